@@ -0,0 +1,412 @@
+#ifndef ASYNC_CLIENT_H
+#define ASYNC_CLIENT_H
+
+#include <chrono>         // For round-trip stamps and drain timeouts
+#include <condition_variable> // For window and send-queue signalling
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()
+#include <functional>     // For the reply callback
+#include <mutex>          // For the state shared by the caller and both threads
+#include <string>         // For the session key
+#include <thread>         // For the sender and receiver threads
+#include <unordered_map>  // For matching replies to requests by sequence number
+#include <vector>         // For staged and outgoing bytes
+#include <arpa/inet.h>    // For sockaddr_in and inet_addr()
+#include <netinet/tcp.h>  // For TCP_NODELAY
+#include <sys/socket.h>   // For socket functions
+#include <unistd.h>       // For close()
+#include "compression.h"  // For the optional compression stage
+#include "framing.h"      // For frames and the receive buffer
+#include "rc4.h"          // For the session cipher
+#include "resumption.h"   // For resuming an earlier session with its ticket
+
+// Pipelined client session: submit() queues a message and returns at once, a sender thread
+// encrypts everything queued so far into one buffer and writes it with a single send, and a
+// receiver thread matches echoes back to their requests by sequence number. Up to `window`
+// messages may be unanswered at a time, so a slow link costs one round trip per window
+// instead of one per message.
+//
+// The send keystream is only touched by the sender thread and the receive keystream only by
+// the receiver thread; a server key rotation is handed from one to the other through the queue.
+// With compression negotiated, the sender compresses messages and room posts that shrink
+// enough just before encrypting them, and the receiver expands compressed frames right after
+// decrypting them, so callers only ever see plaintext.
+//
+// Given a ResumeTicket, connect() first tries to resume the session the ticket came from and
+// only waits for a new key if the server refuses; close() then leaves in the ticket what the
+// next connect() needs to resume this session in turn.
+class AsyncClient {
+public:
+    // Called on the receiver thread for every echo: sequence, decrypted payload, round trip
+    using ReplyHandler = std::function<void(uint32_t, const unsigned char*, size_t, std::chrono::nanoseconds)>;
+    // Called on the receiver thread for room traffic (MSG_JOIN/MSG_LEAVE confirmations, MSG_ROOM
+    // messages, MSG_HISTORY replay ends) and for this session's own messages replayed from the
+    // log (MSG_DATA flagged FLAG_HISTORY): type, flags, sequence, decrypted payload
+    using EventHandler = std::function<void(uint8_t, uint8_t, uint32_t, const unsigned char*, size_t)>;
+
+private:
+    struct Staged {               // A frame waiting for the sender thread
+        uint8_t type;             // MSG_DATA, MSG_REKEY_ACK or a room frame
+        uint32_t sequence;        // Sequence number (0 for the ACK)
+        size_t offset;            // Plaintext position in the staging buffer
+        size_t length;            // Plaintext length
+    };
+
+    int sock;
+    size_t window;                          // Most messages allowed in flight
+    std::string key;                        // Current session key
+    CipherContext cipher;                   // tx used by the sender, rx by the receiver
+    CipherContext rotated;                  // Next keys, adopted by the sender at the staged ACK
+    ReplyHandler handler;
+    EventHandler events;
+    bool compressing;                       // The server accepted compression (set before the threads start)
+    ResumeTicket* resumeState;              // Updated by connect() and close() (nullptr: no resumption)
+    int resumeStatus;                       // ResumeStatus of the last connect (-1: did not try)
+    int64_t resumeSince;                    // Messages from here on may have been missed while away
+
+    mutable std::mutex lock;                // Guards everything below
+    std::condition_variable windowOpen;     // Signalled when a reply frees a slot
+    std::condition_variable sendReady;      // Signalled when frames are staged
+    std::vector<unsigned char> staging;     // Plaintext of staged frames, back to back
+    std::vector<Staged> stagedFrames;
+    std::unordered_map<uint32_t, std::chrono::steady_clock::time_point> inFlight; // Sequence -> submit time
+    uint32_t sequence;                      // Last sequence number handed out
+    bool stopping;                          // close() called
+    bool failed;                            // Connection broke
+    uint64_t sendCalls;                     // Batches written
+    uint64_t framesSent;                    // Frames written
+    uint64_t unmatched;                     // Replies with an unknown sequence number
+    uint64_t rekeys;                        // Key rotations followed
+    uint64_t plainBytes;                    // Payload bytes submitted or posted
+    uint64_t wireBytes;                     // ...and what they took on the wire
+
+    std::thread sender;
+    std::thread receiver;
+
+    static bool sendAll(int fd, const unsigned char* data, size_t length) {
+        while (length > 0) {
+            ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    void fail() {
+        std::lock_guard<std::mutex> guard(lock);
+        failed = true;
+        windowOpen.notify_all();
+        sendReady.notify_all();
+    }
+
+    // Take every staged frame, encrypt them into one buffer and write it with one send
+    void sendLoop() {
+        std::vector<unsigned char> plain, wire;
+        std::vector<Staged> frames;
+        Lz4 lz4;
+        CompressionPolicy policy;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            sendReady.wait(guard, [this] { return stopping || failed || !stagedFrames.empty(); });
+            if (stopping || failed) return;
+            plain.swap(staging);
+            frames.swap(stagedFrames);
+            guard.unlock();
+
+            wire.clear();
+            uint64_t plainTotal = 0;
+            for (const Staged& f : frames) {
+                size_t at = wire.size();
+                wire.resize(at + FRAME_HEADER_SIZE + f.length);
+                unsigned char* out = &wire[at + FRAME_HEADER_SIZE];
+                const unsigned char* payload = plain.data() + f.offset;
+                size_t length = f.length;
+                uint8_t flags = 0;
+                if (compressing && (f.type == MSG_DATA || f.type == MSG_ROOM)) {
+                    size_t packed = policy.apply(lz4, payload, f.length, out); // Straight into the frame
+                    if (packed) {
+                        payload = out; // Encrypted in place below
+                        length = packed;
+                        flags = FLAG_COMPRESSED;
+                        wire.resize(at + FRAME_HEADER_SIZE + packed);
+                    }
+                }
+                encodeHeader(FrameHeader{uint32_t(length), f.type, flags, f.sequence, uint32_t(f.length)}, &wire[at]);
+                if (f.type == MSG_REKEY_ACK) {
+                    cipher.adoptTx(rotated); // Frames staged after the ACK use the new key
+                } else {
+                    cipher.encrypt(payload, out, length);
+                }
+                plainTotal += f.length;
+            }
+            bool ok = sendAll(sock, wire.data(), wire.size());
+
+            guard.lock();
+            ++sendCalls;
+            framesSent += frames.size();
+            plainBytes += plainTotal;
+            wireBytes += wire.size() - frames.size() * FRAME_HEADER_SIZE;
+            plain.clear();
+            frames.clear();
+            if (!ok) {
+                failed = true;
+                windowOpen.notify_all();
+                return;
+            }
+        }
+    }
+
+    // Read frames until the connection ends; decrypt, match and hand replies to the handler
+    void receiveLoop() {
+        BufferPool pool(FRAME_BLOCK_SIZE, 1);
+        FrameReader reader(pool);
+        FrameHeader header;
+        unsigned char* payload;
+        std::vector<unsigned char> inflated(MAX_FRAME_PAYLOAD);
+        while (recvFrame(sock, reader, header, payload)) {
+            cipher.decrypt(payload, header.length);
+            size_t length = header.length;
+            if (header.flags & FLAG_COMPRESSED) {
+                long n = Lz4::decompress(payload, header.length, inflated.data(), header.plainLength);
+                if (n != long(header.plainLength)) break; // Corrupt: the stream cannot be trusted any more
+                length = n;
+            }
+            const unsigned char* plain = (header.flags & FLAG_COMPRESSED) ? inflated.data() : payload;
+            if (header.type == MSG_REKEY) {
+                std::lock_guard<std::mutex> guard(lock);
+                key.assign(reinterpret_cast<char*>(payload), header.length);
+                rotated.init(key, CipherContext::CLIENT);
+                cipher.adoptRx(rotated); // Everything after the REKEY frame uses the new key
+                stagedFrames.push_back({MSG_REKEY_ACK, 0, staging.size(), 0});
+                ++rekeys;
+                sendReady.notify_one();
+            } else if (header.type == MSG_JOIN || header.type == MSG_LEAVE || header.type == MSG_ROOM ||
+                       header.type == MSG_HISTORY || (header.type == MSG_DATA && (header.flags & FLAG_HISTORY))) {
+                if (events) events(header.type, header.flags, header.sequence, plain, length);
+            } else if (header.type == MSG_DATA) {
+                std::chrono::nanoseconds rtt{0};
+                bool matched = false;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    auto it = inFlight.find(header.sequence);
+                    if (it != inFlight.end()) {
+                        rtt = std::chrono::steady_clock::now() - it->second;
+                        inFlight.erase(it);
+                        matched = true;
+                        windowOpen.notify_all();
+                    } else {
+                        ++unmatched;
+                    }
+                }
+                if (matched && handler) handler(header.sequence, plain, length, rtt);
+            }
+            reader.consume(header);
+        }
+        fail();
+    }
+
+public:
+    AsyncClient(size_t windowSize = 32)
+        : sock(-1), window(windowSize ? windowSize : 1), compressing(false), resumeState(nullptr), resumeStatus(-1), resumeSince(0),
+          sequence(0), stopping(false), failed(false),
+          sendCalls(0), framesSent(0), unmatched(0), rekeys(0), plainBytes(0), wireBytes(0) {}
+
+    ~AsyncClient() { close(); }
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    // Connect, receive the session key (or resume the session in `resume`), negotiate compression
+    // and resumption if asked and start both threads; false with errno set on failure
+    bool connect(const std::string& host, int port, ReplyHandler onReply, EventHandler onEvent = nullptr,
+                 bool compress = false, ResumeTicket* resume = nullptr) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return false;
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Batching replaces Nagle's delay
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(port);
+        server.sin_addr.s_addr = inet_addr(host.c_str());
+        if (::connect(sock, (sockaddr*)&server, sizeof(server)) < 0) return false;
+
+        BufferPool pool(FRAME_BLOCK_SIZE, 1);
+        FrameReader reader(pool);
+        FrameHeader header;
+        unsigned char* payload;
+        key.clear();
+        resumeState = resume;
+        resumeStatus = -1;
+        bool resumed = false;
+        if (resume && resume->valid()) {
+            int outcome = resumeSession(reader);
+            if (outcome < 0) return false;
+            resumed = outcome > 0;
+        }
+        if (!resumed) {
+            if (key.empty()) { // Not already sent ahead of a refused resumption
+                if (!recvFrame(sock, reader, header, payload)) return false;
+                if (header.type != MSG_KEY) {
+                    errno = EPROTO;
+                    return false;
+                }
+                key.assign(reinterpret_cast<char*>(payload), header.length);
+                reader.consume(header); // Nothing else can arrive before our first message
+            }
+            cipher.init(key, CipherContext::CLIENT);
+            uint32_t requested = (compress ? FEATURE_COMPRESSION : 0) | (resume ? FEATURE_RESUMPTION : 0);
+            if (requested) {
+                unsigned char request[FRAME_HEADER_SIZE + 4] = {};
+                encodeHeader(FrameHeader{4, MSG_FEATURES, 0, 0}, request);
+                request[FRAME_HEADER_SIZE + 3] = uint8_t(requested);
+                cipher.encrypt(request + FRAME_HEADER_SIZE, 4);
+                if (!sendAll(sock, request, sizeof(request)) || !recvFrame(sock, reader, header, payload)) return false;
+                if (header.type != MSG_FEATURES || header.length != 4) {
+                    errno = EPROTO;
+                    return false;
+                }
+                cipher.decrypt(payload, header.length);
+                compressing = (payload[3] & FEATURE_COMPRESSION) != 0;
+                bool ticketed = (payload[3] & FEATURE_RESUMPTION) != 0;
+                reader.consume(header);
+                if (ticketed && !receiveTicket(reader)) return false; // Sent right behind the answer
+            }
+        }
+
+        handler = std::move(onReply);
+        events = std::move(onEvent);
+        sender = std::thread(&AsyncClient::sendLoop, this);
+        receiver = std::thread(&AsyncClient::receiveLoop, this);
+        return true;
+    }
+
+    // Offer the ticket in `resumeState` and follow the server's answer: 1 if the session resumed
+    // (keys, features and a new ticket in place), 0 if it was refused (the fresh key, if it came
+    // already, is in `key`), -1 if the connection failed
+    int resumeSession(FrameReader& reader) {
+        uint64_t nonce = resumeNonce();
+        std::string request = resumeState->request(nonce);
+        if (!sendAll(sock, reinterpret_cast<const unsigned char*>(request.data()), request.size())) return -1;
+        FrameHeader header;
+        unsigned char* payload;
+        ResumeReply reply;
+        while (true) {
+            if (!recvFrame(sock, reader, header, payload)) return -1;
+            bool answer = header.type == MSG_RESUME;
+            if (answer && !reply.decode(payload, header.length)) break;
+            if (header.type == MSG_KEY) key.assign(reinterpret_cast<char*>(payload), header.length); // Sent before the server saw our request
+            else if (!answer) break;
+            reader.consume(header);
+            if (answer) {
+                resumeStatus = reply.status;
+                resumeSince = reply.since;
+                std::string resumedKey;
+                bool restored = reply.restore(*resumeState, nonce, cipher, resumedKey);
+                if (reply.status != RESUME_CACHED) { // The server skips whatever we sent until this marker
+                    std::string marker = resumeMarker();
+                    if (!sendAll(sock, reinterpret_cast<const unsigned char*>(marker.data()), marker.size())) return -1;
+                }
+                if (!restored) {
+                    resumeState->clear();
+                    if (reply.status == RESUME_REJECTED) return 0;
+                    errno = EPROTO; // Resumed, but the keystream positions do not line up
+                    return -1;
+                }
+                key = resumedKey;
+                compressing = (reply.features & FEATURE_COMPRESSION) != 0;
+                return receiveTicket(reader) ? 1 : -1;
+            }
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Read the MSG_TICKET the server sends after granting resumption
+    bool receiveTicket(FrameReader& reader) {
+        FrameHeader header;
+        unsigned char* payload;
+        if (!recvFrame(sock, reader, header, payload)) return false;
+        cipher.decrypt(payload, header.length);
+        if (header.type != MSG_TICKET || !resumeState->accept(payload, header.length)) {
+            errno = EPROTO;
+            return false;
+        }
+        reader.consume(header);
+        return true;
+    }
+
+    // Queue a message; blocks only while the window is full. Returns its sequence number, or 0
+    // if the connection is gone or the message does not fit in a frame.
+    uint32_t submit(const void* data, size_t length) {
+        if (length > MAX_FRAME_PAYLOAD) return 0;
+        std::unique_lock<std::mutex> guard(lock);
+        windowOpen.wait(guard, [this] { return stopping || failed || inFlight.size() < window; });
+        if (stopping || failed) return 0;
+        uint32_t seq = ++sequence;
+        if (seq == 0) seq = ++sequence; // 0 marks failure; skip it on wrap-around
+        stagedFrames.push_back({MSG_DATA, seq, staging.size(), length});
+        staging.insert(staging.end(), static_cast<const unsigned char*>(data),
+                       static_cast<const unsigned char*>(data) + length);
+        inFlight.emplace(seq, std::chrono::steady_clock::now());
+        sendReady.notify_one();
+        return seq;
+    }
+
+    // Queue a frame that expects no echo (MSG_JOIN, MSG_LEAVE, MSG_ROOM or MSG_HISTORY); it does not count
+    // against the window. Returns its sequence number, or 0 on failure.
+    uint32_t post(uint8_t type, const void* data, size_t length) {
+        if (length > MAX_FRAME_PAYLOAD) return 0;
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping || failed) return 0;
+        uint32_t seq = ++sequence;
+        if (seq == 0) seq = ++sequence;
+        stagedFrames.push_back({type, seq, staging.size(), length});
+        staging.insert(staging.end(), static_cast<const unsigned char*>(data),
+                       static_cast<const unsigned char*>(data) + length);
+        sendReady.notify_one();
+        return seq;
+    }
+
+    // Wait until every submitted message has been answered; false on timeout or failure
+    bool drain(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> guard(lock);
+        return windowOpen.wait_for(guard, timeout, [this] { return failed || inFlight.empty(); }) && !failed;
+    }
+
+    // Stop both threads and close the socket (unanswered messages are abandoned)
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            windowOpen.notify_all();
+            sendReady.notify_all();
+        }
+        if (sock >= 0) shutdown(sock, SHUT_RDWR); // Wakes the receiver out of recv()
+        if (sender.joinable()) sender.join();
+        if (receiver.joinable()) receiver.join();
+        if (sock >= 0) ::close(sock);
+        if (sock >= 0 && resumeState) { // Both threads are gone: the keystreams are where the connection left them
+            resumeState->cipher = cipher;
+            resumeState->key = key;
+        }
+        sock = -1;
+    }
+
+    std::string sessionKey() const { std::lock_guard<std::mutex> guard(lock); return key; }
+    size_t pending() const { std::lock_guard<std::mutex> guard(lock); return inFlight.size(); }
+    uint64_t batches() const { std::lock_guard<std::mutex> guard(lock); return sendCalls; }       // send() calls made
+    uint64_t frames() const { std::lock_guard<std::mutex> guard(lock); return framesSent; }      // Frames written
+    uint64_t rotations() const { std::lock_guard<std::mutex> guard(lock); return rekeys; }       // Key rotations followed
+    uint64_t strayReplies() const { std::lock_guard<std::mutex> guard(lock); return unmatched; } // Replies matching no request
+    bool compressed() const { return compressing; }                                             // Server accepted compression
+    uint64_t payloadBytes() const { std::lock_guard<std::mutex> guard(lock); return plainBytes; } // Payload submitted and posted
+    uint64_t sentPayloadBytes() const { std::lock_guard<std::mutex> guard(lock); return wireBytes; } // ...as sent
+    int resumption() const { return resumeStatus; }                                            // ResumeStatus, or -1 if not tried
+    int64_t missedSince() const { return resumeSince; }                                        // After a resumption: MSG_HISTORY "since"
+};
+
+#endif // ASYNC_CLIENT_H
@@ -0,0 +1,141 @@
+#ifndef AVL_TREE_H
+#define AVL_TREE_H
+
+#include <algorithm>      // For std::max
+#include <string>         // For std::string keys
+
+// Pointer-based AVL tree of keys. The server keeps issued keys in KeyRegistry now; this
+// remains as the reference implementation the registry is measured against.
+
+// AVL Tree Node structure
+struct AVLNode {
+    std::string key;      // Key stored in the node
+    int height;           // Height of the node for balancing
+    AVLNode* left;        // Pointer to left child
+    AVLNode* right;       // Pointer to right child
+
+    AVLNode(const std::string& k) : key(k), height(1), left(nullptr), right(nullptr) {} // Constructor initializes a leaf node
+};
+
+// AVL Tree implementation
+class AVLTree {
+private:
+    AVLNode* root; // Root of the AVL tree
+
+    // Helper function to get the height of a node
+    int height(AVLNode* node) {
+        return node ? node->height : 0;
+    }
+
+    // Calculate balance factor of a node
+    int getBalance(AVLNode* node) {
+        return node ? height(node->left) - height(node->right) : 0;
+    }
+
+    // Right rotation for balancing
+    AVLNode* rightRotate(AVLNode* y) {
+        AVLNode* x = y->left;
+        AVLNode* T2 = x->right;
+
+        // Perform rotation
+        x->right = y;
+        y->left = T2;
+
+        // Update heights
+        y->height = std::max(height(y->left), height(y->right)) + 1;
+        x->height = std::max(height(x->left), height(x->right)) + 1;
+
+        return x;
+    }
+
+    // Left rotation for balancing
+    AVLNode* leftRotate(AVLNode* x) {
+        AVLNode* y = x->right;
+        AVLNode* T2 = y->left;
+
+        // Perform rotation
+        y->left = x;
+        x->right = T2;
+
+        // Update heights
+        x->height = std::max(height(x->left), height(x->right)) + 1;
+        y->height = std::max(height(y->left), height(y->right)) + 1;
+
+        return y;
+    }
+
+    // Insert a key into the AVL tree
+    AVLNode* insertNode(AVLNode* node, const std::string& key) {
+        // Standard BST insertion
+        if (!node) return new AVLNode(key);
+
+        if (key < node->key)
+            node->left = insertNode(node->left, key);
+        else if (key > node->key)
+            node->right = insertNode(node->right, key);
+        else
+            return node; // Duplicate keys are not allowed
+
+        // Update height of the current node
+        node->height = 1 + std::max(height(node->left), height(node->right));
+
+        // Get the balance factor and balance the tree if needed
+        int balance = getBalance(node);
+
+        // Left Left Case
+        if (balance > 1 && key < node->left->key)
+            return rightRotate(node);
+
+        // Right Right Case
+        if (balance < -1 && key > node->right->key)
+            return leftRotate(node);
+
+        // Left Right Case
+        if (balance > 1 && key > node->left->key) {
+            node->left = leftRotate(node->left);
+            return rightRotate(node);
+        }
+
+        // Right Left Case
+        if (balance < -1 && key < node->right->key) {
+            node->right = rightRotate(node->right);
+            return leftRotate(node);
+        }
+
+        return node;
+    }
+
+    // Search for a key in the AVL tree
+    bool searchKey(AVLNode* node, const std::string& key) {
+        if (!node) return false;
+        if (node->key == key) return true;
+        if (key < node->key) return searchKey(node->left, key);
+        return searchKey(node->right, key);
+    }
+
+    // Helper function to destroy the AVL tree
+    void destroyTree(AVLNode* node) {
+        if (node) {
+            destroyTree(node->left);
+            destroyTree(node->right);
+            delete node;
+        }
+    }
+
+public:
+    AVLTree() : root(nullptr) {} // Constructor initializes an empty tree
+
+    ~AVLTree() { // Destructor clears the tree
+        destroyTree(root);
+    }
+
+    void insert(const std::string& key) { // Insert a key into the tree
+        root = insertNode(root, key);
+    }
+
+    bool contains(const std::string& key) { // Check if a key exists in the tree
+        return searchKey(root, key);
+    }
+};
+
+#endif // AVL_TREE_H
@@ -0,0 +1,1249 @@
+#include <iostream>       // For progress output on stderr
+#include <fstream>        // For the JSON report and synthetic images
+#include <sstream>        // For formatting JSON numbers
+#include <string>         // For names and keys
+#include <vector>         // For key sets and results
+#include <chrono>         // For timing
+#include <functional>     // For the benchmark table
+#include <thread>         // For hardware_concurrency()
+#include <cstring>        // For strerror()
+#include <csignal>        // For kill()
+#include <sys/socket.h>   // For the loopback client socket
+#include <arpa/inet.h>    // For inet_addr()
+#include <sys/wait.h>     // For waitpid()
+#include <unistd.h>       // For fork()/exec()
+#include <fcntl.h>        // For open() on /dev/null and non-blocking members
+#include <sys/epoll.h>    // For reading every room member from one thread
+#include <cstdlib>        // For mkdtemp()
+#include <dirent.h>       // For the server's threads in /proc
+#include <limits>         // For tickets that never expire in the setup benchmark
+#include <netinet/tcp.h>  // For TCP_NODELAY on reconnecting clients
+#include "avl_tree.h"
+#include "bulk_cipher.h"
+#include "compression.h"
+#include "entropy_pool.h"
+#include "file_transfer.h"
+#include "frame_queue.h"
+#include "framing.h"
+#include "image_processor.h"
+#include "key_registry.h"
+#include "latency_histogram.h"
+#include "load_generator.h"
+#include "message_log.h"
+#include "rc4.h"
+#include "resumption.h"
+
+#ifndef SERVER_BINARY
+#define SERVER_BINARY "./server2" // Server executable used by the loopback benchmark
+#endif
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// One measured case, written as one JSON object
+struct BenchResult {
+    string name;                          // Benchmark case, e.g. "rc4_prga_stream"
+    vector<pair<string, double>> params;  // Inputs such as payload size
+    uint64_t operations;                  // Operations timed
+    double seconds;                       // Wall time for all operations
+    uint64_t bytes;                       // Bytes processed (0 if not meaningful)
+};
+
+static vector<BenchResult> results;       // Everything measured in this run
+static bool quick = false;                // --quick: smaller inputs for smoke runs
+
+static double secondsSince(Clock::time_point start) {
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void record(const string& name, vector<pair<string, double>> params, uint64_t ops, double seconds, uint64_t bytes = 0) {
+    results.push_back({name, move(params), ops, seconds, bytes});
+    cerr << "  " << name;
+    for (auto& p : results.back().params) cerr << " " << p.first << "=" << p.second;
+    cerr << ": " << seconds * 1e9 / ops << " ns/op";
+    if (bytes) cerr << ", " << bytes / seconds / 1e6 << " MB/s";
+    cerr << endl;
+}
+
+// Fail loudly instead of reporting numbers for wrong output
+static void check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "Benchmark self-check failed: " << what << endl;
+        exit(1);
+    }
+}
+
+static void benchRC4() {
+    const string key = "0123456789abcdef0123456789abcdef";
+    const int ksaRuns = quick ? 20000 : 200000;
+
+    RC4 legacy;
+    auto start = Clock::now();
+    size_t sink = 0;
+    for (int i = 0; i < ksaRuns; ++i) {
+        sink += legacy.encrypt(key, "x")[0]; // One byte: KSA plus a single PRGA step
+    }
+    record("rc4_ksa_legacy", {}, ksaRuns, secondsSince(start));
+
+    RC4Stream stream;
+    start = Clock::now();
+    for (int i = 0; i < ksaRuns; ++i) {
+        stream.init(key);
+    }
+    record("rc4_ksa_stream", {}, ksaRuns, secondsSince(start));
+
+    for (size_t size : {size_t(64), size_t(1024), size_t(16 * 1024), size_t(1 << 20)}) {
+        string data(size, 'a');
+        uint64_t total = quick ? (16ull << 20) : (256ull << 20);
+        uint64_t runs = max<uint64_t>(1, total / size);
+
+        // Byte-for-byte check against the reference implementation, data fed in two pieces
+        string expected = legacy.encrypt(key, data);
+        string actual = data;
+        stream.init(key);
+        stream.apply(reinterpret_cast<unsigned char*>(&actual[0]), size / 3);
+        stream.apply(reinterpret_cast<unsigned char*>(&actual[size / 3]), size - size / 3);
+        check(actual == expected, "RC4Stream output differs from RC4 at size " + to_string(size));
+
+        uint64_t legacyRuns = max<uint64_t>(1, runs / 4);
+        start = Clock::now();
+        for (uint64_t i = 0; i < legacyRuns; ++i) {
+            sink += legacy.encrypt(key, data)[0];
+        }
+        record("rc4_prga_legacy", {{"payload_bytes", double(size)}}, legacyRuns, secondsSince(start), legacyRuns * size);
+
+        start = Clock::now();
+        for (uint64_t i = 0; i < runs; ++i) {
+            stream.apply(reinterpret_cast<unsigned char*>(&data[0]), size);
+        }
+        record("rc4_prga_stream", {{"payload_bytes", double(size)}}, runs, secondsSince(start), runs * size);
+    }
+    if (sink == 42) cerr << ""; // Keep the legacy results alive
+}
+
+static void benchImageHash() {
+    for (size_t megabytes : {size_t(4), size_t(32)}) {
+        if (quick && megabytes > 4) continue;
+        string path = "/tmp/lava_bench_frame_" + to_string(getpid()) + ".png";
+        {
+            vector<char> bytes(megabytes << 20);
+            uint32_t x = 2463534242u;
+            for (char& c : bytes) { // xorshift noise stands in for camera data
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                c = char(x);
+            }
+            ofstream(path, ios::binary).write(bytes.data(), bytes.size());
+        }
+        this_thread::sleep_for(chrono::milliseconds(50)); // Let the mtime settle so the identity cache may keep it
+        ImageProcessor processor;
+        int runs = quick ? 3 : 10;
+        string first = processor.generateKey(path);
+        check(first.size() == 10, "image key generation");
+        auto start = Clock::now();
+        for (int i = 0; i < runs; ++i) {
+            ImageProcessor cold; // Nothing cached: every run maps and hashes the file
+            check(cold.generateKey(path) == first, "image key is deterministic");
+        }
+        record("image_hash", {{"image_mb", double(megabytes)}}, runs, secondsSince(start), uint64_t(runs) * (megabytes << 20));
+
+        int cachedRuns = runs * 1000;
+        start = Clock::now();
+        for (int i = 0; i < cachedRuns; ++i) {
+            check(processor.generateKey(path) == first, "cached image key matches");
+        }
+        record("image_hash_cached", {{"image_mb", double(megabytes)}}, cachedRuns, secondsSince(start));
+        unlink(path.c_str());
+    }
+}
+
+// Camera-like PPM frames rewritten continuously: the whole frame unchanged on disk, rewritten
+// with equal pixels, with a tenth of its tiles changed, and with sensor noise everywhere
+static void benchFrameEntropy() {
+    struct Size { int width, height; };
+    for (Size size : {Size{640, 480}, Size{1920, 1080}}) {
+        if (quick && size.width > 640) continue;
+        string path = "/tmp/lava_bench_stream_" + to_string(getpid()) + ".ppm";
+        string header = "P6\n" + to_string(size.width) + " " + to_string(size.height) + "\n255\n";
+        size_t stride = size_t(size.width) * 3;
+        vector<unsigned char> pixels(stride * size.height);
+        uint32_t x = 2463534242u;
+        auto noise = [&x] { x ^= x << 13; x ^= x >> 17; x ^= x << 5; return x; };
+        for (int row = 0; row < size.height; ++row) { // Smooth gradient plus a little sensor noise
+            for (size_t i = 0; i < stride; ++i) pixels[row * stride + i] = (unsigned char)((row + i / 3) / 8 + noise() % 5);
+        }
+        auto writeFrame = [&] { // Replace the file atomically, the way open.py --stream does
+            string temporary = path + ".tmp";
+            ofstream out(temporary, ios::binary);
+            out << header;
+            out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+            out.close();
+            rename(temporary.c_str(), path.c_str());
+        };
+        int tilesX = (size.width + FrameEntropy::TILE - 1) / FrameEntropy::TILE;
+        int tilesY = (size.height + FrameEntropy::TILE - 1) / FrameEntropy::TILE;
+        auto changeTile = [&](int tile) { // New noise over one tile, as a moving blob would bring
+            int tx = tile % tilesX, ty = tile / tilesX;
+            for (int row = ty * FrameEntropy::TILE; row < min(size.height, (ty + 1) * FrameEntropy::TILE); ++row) {
+                for (int col = tx * FrameEntropy::TILE; col < min(size.width, (tx + 1) * FrameEntropy::TILE); ++col) {
+                    for (int c = 0; c < 3; ++c) pixels[row * stride + col * 3 + c] += (unsigned char)(noise() % 5) - 2;
+                }
+            }
+        };
+
+        FrameEntropy extractor;
+        FrameSample sample;
+        writeFrame();
+        this_thread::sleep_for(chrono::milliseconds(50)); // Settled, so an unchanged identity is trusted
+        check(extractor.extract(path, sample) && sample.changed && sample.pixels, "first frame is extracted");
+        int runs = quick ? 20 : 100;
+        auto start = Clock::now();
+        for (int i = 0; i < runs * 100; ++i) {
+            check(extractor.extract(path, sample) && !sample.changed && sample.bytesRead == 0, "unchanged frame is skipped");
+        }
+        record("frame_entropy_unchanged", {{"width", double(size.width)}, {"height", double(size.height)}},
+               runs * 100, secondsSince(start));
+
+        for (int percent : {0, 10, 100}) {
+            double seconds = 0, bits = 0;
+            uint64_t changed = 0;
+            for (int i = 0; i < runs; ++i) {
+                int tiles = tilesX * tilesY;
+                for (int t = 0; t < tiles * percent / 100; ++t) changeTile(percent == 100 ? t : int(noise() % tiles));
+                writeFrame();
+                auto begin = Clock::now();
+                check(extractor.extract(path, sample), "rewritten frame is readable");
+                seconds += secondsSince(begin);
+                bits += sample.bits;
+                changed += sample.tilesChanged;
+            }
+            check(percent > 0 || changed == 0, "equal pixels credit nothing");
+            record("frame_entropy_rewritten", {{"width", double(size.width)}, {"height", double(size.height)},
+                   {"changed_pct", double(percent)}, {"bits_per_frame", bits / runs},
+                   {"tiles_changed_per_frame", double(changed) / runs}},
+                   runs, seconds, uint64_t(runs) * (header.size() + pixels.size()));
+        }
+        unlink(path.c_str());
+    }
+}
+
+static void benchFrameQueue() {
+    const int runs = quick ? 200000 : 2000000;
+    FrameQueue queue;
+    Frame frame("opencv_frame_0.png");
+    auto start = Clock::now();
+    for (int i = 0; i < runs; ++i) {
+        queue.push(move(frame));
+        queue.tryPop(frame);
+    }
+    record("frame_queue_push_pop", {}, runs, secondsSince(start));
+
+    start = Clock::now();
+    for (int i = 0; i < runs; ++i) {
+        queue.push(Frame(frame.path)); // Queue stays full: every push drops the oldest frame
+    }
+    record("frame_queue_push_full", {}, runs, secondsSince(start));
+}
+
+static void benchKeyStores() {
+    const size_t count = quick ? 100000 : 1000000;
+    EntropyPool entropy;
+    vector<string> keys(count), absent(count);
+    for (string& k : keys) k = entropy.sessionKey();
+    for (string& k : absent) k = entropy.sessionKey();
+
+    {
+        AVLTree tree;
+        auto start = Clock::now();
+        for (const string& k : keys) tree.insert(k);
+        record("avl_insert", {{"keys", double(count)}}, count, secondsSince(start));
+
+        size_t hits = 0;
+        start = Clock::now();
+        for (const string& k : keys) hits += tree.contains(k);
+        record("avl_contains_hit", {{"keys", double(count)}}, count, secondsSince(start));
+        start = Clock::now();
+        for (const string& k : absent) hits += tree.contains(k);
+        record("avl_contains_miss", {{"keys", double(count)}}, count, secondsSince(start));
+        check(hits == count, "AVLTree lookups");
+    }
+    {
+        KeyRegistry registry;
+        auto start = Clock::now();
+        for (const string& k : keys) registry.insert(k);
+        record("registry_insert", {{"keys", double(count)}}, count, secondsSince(start));
+
+        size_t hits = 0;
+        start = Clock::now();
+        for (const string& k : keys) hits += registry.contains(k);
+        record("registry_contains_hit", {{"keys", double(count)}}, count, secondsSince(start));
+        start = Clock::now();
+        for (const string& k : absent) hits += registry.contains(k);
+        record("registry_contains_miss", {{"keys", double(count)}}, count, secondsSince(start));
+        check(hits == count, "KeyRegistry lookups");
+    }
+}
+
+// Start server2 on `port` with extra arguments (output discarded, no stats endpoint)
+static pid_t startServer(int port, vector<string> args = {}) {
+    args.insert(args.begin(), {SERVER_BINARY, "--port", to_string(port), "--stats-port", "0"});
+    pid_t server = fork();
+    if (server == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        vector<char*> argv;
+        for (string& a : args) argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+        execv(SERVER_BINARY, argv.data());
+        _exit(127);
+    }
+    return server;
+}
+
+static void stopServer(pid_t server) {
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+}
+
+// Connect to a freshly started server, retrying until it listens; -1 if it never does
+static int connectWhenReady(int port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (sockaddr*)&address, sizeof(address)) == 0) return sock;
+        close(sock);
+        usleep(20000);
+    }
+    return -1;
+}
+
+// Round trips through a real server process over loopback
+static void benchLoopback() {
+    const int port = 18000 + getpid() % 1000;
+    pid_t server = startServer(port);
+    int sock = connectWhenReady(port);
+    if (sock < 0) {
+        cerr << "  loopback: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+        stopServer(server);
+        return;
+    }
+
+    BufferPool pool(FRAME_BLOCK_SIZE, 1);
+    FrameReader reader(pool);
+    FrameHeader header;
+    unsigned char* payload;
+    check(recvFrame(sock, reader, header, payload) && header.type == MSG_KEY, "loopback key frame");
+    string key(reinterpret_cast<char*>(payload), header.length);
+    reader.consume(header);
+    CipherContext cipher;
+    cipher.init(key, CipherContext::CLIENT);
+
+    for (size_t size : {size_t(64), size_t(4096)}) {
+        int runs = quick ? 2000 : 20000;
+        vector<unsigned char> plain(size, 'm'), wire(size);
+        uint32_t sequence = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < runs; ++i) {
+            cipher.encrypt(plain.data(), wire.data(), size);
+            check(sendFrame(sock, MSG_DATA, ++sequence, wire.data(), size), "loopback send");
+            while (true) {
+                check(recvFrame(sock, reader, header, payload), "loopback receive");
+                if (header.type != MSG_REKEY) break;
+                cipher.decrypt(payload, header.length); // Follow a key rotation
+                string next(reinterpret_cast<char*>(payload), header.length);
+                reader.consume(header);
+                CipherContext rotated;
+                rotated.init(next, CipherContext::CLIENT);
+                cipher.adoptRx(rotated);
+                check(sendFrame(sock, MSG_REKEY_ACK, 0, nullptr, 0), "loopback rekey ack");
+                cipher.adoptTx(rotated);
+            }
+            cipher.decrypt(payload, header.length);
+            check(header.sequence == sequence && memcmp(payload, plain.data(), size) == 0, "loopback echo");
+            reader.consume(header);
+        }
+        record("loopback_echo_rtt", {{"payload_bytes", double(size)}}, runs, secondsSince(start), uint64_t(runs) * size * 2);
+    }
+
+    close(sock);
+    stopServer(server);
+}
+
+// Aggregate echo throughput of a sharded server as workers go from 1 to every core
+static void benchScaling() {
+    int cpus = max(1u, thread::hardware_concurrency());
+    for (int workers = 1; ; workers = min(workers * 2, cpus)) {
+        const int port = 19000 + getpid() % 1000 + workers;
+        pid_t server = startServer(port, {"--workers", to_string(workers), "--pin"});
+        int probe = connectWhenReady(port);
+        if (probe < 0) {
+            cerr << "  scaling: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+            stopServer(server);
+            return;
+        }
+        close(probe);
+
+        LoadGenerator::Options options;
+        options.port = port;
+        options.connections = 8 * cpus; // Enough sessions to land on every shard
+        options.window = 8;
+        options.seconds = quick ? 1 : 3;
+        LoadGenerator::Report report = LoadGenerator(options).run();
+        stopServer(server);
+        check(report.errors == 0, "scaling run without errors");
+        record("sharded_echo", {{"workers", double(workers)}, {"cpus", double(cpus)}}, report.received,
+               report.seconds, report.received * options.messageBytes * 2);
+        if (workers == cpus) break;
+    }
+}
+
+// The same load against each event-loop backend: closed loop (throughput) and a fixed open-loop
+// rate (latency at equal offered load). A kernel without io_uring falls back to epoll, so both
+// rows then measure epoll.
+static void benchBackends() {
+    for (const char* io : {"epoll", "uring"}) {
+        const int port = 19100 + getpid() % 800 + (io[0] == 'u');
+        pid_t server = startServer(port, {"--io", io});
+        int probe = connectWhenReady(port);
+        if (probe < 0) {
+            cerr << "  backends: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+            stopServer(server);
+            return;
+        }
+        close(probe);
+
+        for (bool openLoop : {false, true}) {
+            LoadGenerator::Options options;
+            options.port = port;
+            options.connections = 32;
+            options.window = openLoop ? 1 : 8;
+            options.openLoop = openLoop;
+            options.rate = openLoop ? 20000 : 0; // Well below either backend's capacity
+            options.seconds = quick ? 1 : 3;
+            LoadGenerator::Report report = LoadGenerator(options).run();
+            check(report.errors == 0, "backend run without errors");
+            record(openLoop ? "backend_echo_open_loop" : "backend_echo_closed_loop",
+                   {{"uring", double(io[0] == 'u')}, {"connections", double(options.connections)},
+                    {"rate", double(options.rate)}, {"p50_us", report.latency.percentile(0.5) / 1e3},
+                    {"p99_us", report.latency.percentile(0.99) / 1e3}},
+                   report.received, report.seconds, report.received * options.messageBytes * 2);
+        }
+        stopServer(server);
+    }
+}
+
+// The same load over raw TCP and over the WebSocket gateway of one server: closed loop at two
+// message sizes (what framing and masking cost) and a fixed open-loop rate (latency)
+static void benchWebSocket() {
+    const int port = 19300 + getpid() % 800 * 2;
+    pid_t server = startServer(port, {"--ws-port", to_string(port + 1)});
+    int probe = connectWhenReady(port);
+    if (probe < 0) {
+        cerr << "  websocket: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+        stopServer(server);
+        return;
+    }
+    close(probe);
+
+    for (bool webSocket : {false, true}) {
+        for (size_t size : {size_t(64), size_t(16384)}) {
+            for (bool openLoop : {false, true}) {
+                if (openLoop && size != 64) continue;
+                LoadGenerator::Options options;
+                options.port = webSocket ? port + 1 : port;
+                options.webSocket = webSocket;
+                options.connections = 32;
+                options.messageBytes = size;
+                options.window = openLoop ? 1 : 8;
+                options.openLoop = openLoop;
+                options.rate = openLoop ? 20000 : 0;
+                options.seconds = quick ? 1 : 3;
+                LoadGenerator::Report report = LoadGenerator(options).run();
+                check(report.errors == 0, "websocket run without errors");
+                record(openLoop ? "transport_echo_open_loop" : "transport_echo_closed_loop",
+                       {{"websocket", double(webSocket)}, {"payload_bytes", double(size)},
+                        {"rate", double(options.rate)}, {"p50_us", report.latency.percentile(0.5) / 1e3},
+                        {"p99_us", report.latency.percentile(0.99) / 1e3}},
+                       report.received, report.seconds, report.received * size * 2);
+            }
+        }
+    }
+    stopServer(server);
+}
+
+// The compression stage on its own (ratio, and CPU per message next to what RC4 costs for the
+// same message) for chat text and random bytes, then the echo load with and without it
+static void benchCompression() {
+    Lz4 lz4;
+    vector<unsigned char> packed(Lz4::bound(MAX_FRAME_PAYLOAD)), plain(MAX_FRAME_PAYLOAD), cipherText(MAX_FRAME_PAYLOAD);
+    CipherContext cipher;
+    cipher.init("bench-key", CipherContext::SERVER);
+    for (bool random : {false, true}) {
+        for (size_t size : {size_t(128), size_t(512), size_t(4096), size_t(16384), size_t(65536)}) {
+            vector<string> messages; // Distinct messages so nothing is compressed twice in a row
+            mt19937 bytes(size);
+            for (uint32_t i = 0; i < 16; ++i) {
+                string m = LoadGenerator::chatPayload(size, i + 1);
+                if (random) for (char& c : m) c = char(bytes());
+                messages.push_back(m);
+            }
+            const size_t runs = max<size_t>(200, (quick ? 4 : 32) * (size_t(1) << 20) / size);
+
+            uint64_t plainTotal = 0, packedTotal = 0;
+            auto start = Clock::now();
+            for (size_t i = 0; i < runs; ++i) {
+                const string& m = messages[i % messages.size()];
+                size_t n = lz4.compress(reinterpret_cast<const unsigned char*>(m.data()), m.size(), packed.data(), packed.size());
+                plainTotal += m.size();
+                packedTotal += n;
+            }
+            double compressSeconds = secondsSince(start);
+
+            start = Clock::now();
+            for (size_t i = 0; i < runs; ++i) {
+                const string& m = messages[i % messages.size()];
+                cipher.encrypt(reinterpret_cast<const unsigned char*>(m.data()), cipherText.data(), m.size());
+            }
+            double rc4Seconds = secondsSince(start);
+            record("lz4_compress", {{"random", double(random)}, {"payload_bytes", double(size)},
+                                    {"ratio", double(plainTotal) / packedTotal}, {"rc4_ns", rc4Seconds * 1e9 / runs}},
+                   runs, compressSeconds, plainTotal);
+
+            const string& m = messages[0];
+            size_t n = lz4.compress(reinterpret_cast<const unsigned char*>(m.data()), m.size(), packed.data(), packed.size());
+            check(Lz4::decompress(packed.data(), n, plain.data(), plain.size()) == long(size) &&
+                  memcmp(plain.data(), m.data(), size) == 0, "lz4 round trip");
+            start = Clock::now();
+            for (size_t i = 0; i < runs; ++i) Lz4::decompress(packed.data(), n, plain.data(), plain.size());
+            record("lz4_decompress", {{"random", double(random)}, {"payload_bytes", double(size)}}, runs,
+                   secondsSince(start), uint64_t(runs) * size);
+
+            // What the adaptive policy costs per message once it has given up on a stream
+            CompressionPolicy policy;
+            start = Clock::now();
+            for (size_t i = 0; i < runs; ++i) {
+                const string& next = messages[i % messages.size()];
+                policy.apply(lz4, reinterpret_cast<const unsigned char*>(next.data()), next.size(), packed.data());
+            }
+            record("lz4_policy", {{"random", double(random)}, {"payload_bytes", double(size)}}, runs,
+                   secondsSince(start), uint64_t(runs) * size);
+        }
+    }
+
+    const int port = 19700 + getpid() % 190;
+    pid_t server = startServer(port, {"--ws-port", "0"});
+    int probe = connectWhenReady(port);
+    if (probe < 0) {
+        cerr << "  compression: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+        stopServer(server);
+        return;
+    }
+    close(probe);
+    for (size_t size : {size_t(256), size_t(1024), size_t(16384)}) {
+        for (bool compress : {false, true}) {
+            LoadGenerator::Options options;
+            options.port = port;
+            options.connections = 32;
+            options.messageBytes = size;
+            options.window = 8;
+            options.payload = LoadGenerator::PAYLOAD_CHAT;
+            options.compress = compress;
+            options.seconds = quick ? 1 : 3;
+            LoadGenerator::Report report = LoadGenerator(options).run();
+            check(report.errors == 0 && report.compressed == (compress ? report.connected : 0),
+                  "compressed echo run without errors");
+            uint64_t plainBytes = (report.sent + report.received) * size;
+            record("compressed_echo_closed_loop",
+                   {{"compress", double(compress)}, {"payload_bytes", double(size)},
+                    {"wire_ratio", double(plainBytes) / report.wireBytes}, {"p50_us", report.latency.percentile(0.5) / 1e3},
+                    {"p99_us", report.latency.percentile(0.99) / 1e3}},
+                   report.received, report.seconds, report.received * size * 2);
+        }
+    }
+    stopServer(server);
+}
+
+// CPU time a process has used so far, all threads, from the scheduler's per-task accounting
+static uint64_t processCpuNanos(pid_t pid) {
+    string dir = "/proc/" + to_string(pid) + "/task";
+    uint64_t total = 0;
+    if (DIR* tasks = opendir(dir.c_str())) {
+        while (dirent* task = readdir(tasks)) {
+            if (task->d_name[0] == '.') continue;
+            ifstream stat(dir + "/" + task->d_name + "/schedstat");
+            uint64_t running = 0;
+            if (stat >> running) total += running;
+        }
+        closedir(tasks);
+    }
+    return total;
+}
+
+// One connection of the reconnect benchmark: get keys (a fresh MSG_KEY, or by resuming with
+// `ticket`), echo `message` once, then hang up and wait for the server to close its end.
+// Resuming sends the message in the same write as MSG_RESUME, under the old keystream; if the
+// server could not continue that keystream it is sent again once the new keys are in place.
+// Returns the server's ResumeStatus, or -1 for a fresh connection.
+static int reconnectOnce(int port, bool resume, ResumeTicket& ticket, BufferPool& pool, const string& message,
+                         LatencyHistogram& latency) {
+    auto start = Clock::now();
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    check(connect(fd, (sockaddr*)&address, sizeof(address)) == 0, "reconnect");
+
+    FrameReader reader(pool);
+    FrameHeader header;
+    unsigned char* payload;
+    CipherContext cipher;
+    string key, wire(FRAME_HEADER_SIZE + message.size(), '\0');
+    auto dataFrame = [&](CipherContext& c) { // The message, encrypted under `c`
+        unsigned char* p = reinterpret_cast<unsigned char*>(&wire[0]);
+        encodeHeader(FrameHeader{uint32_t(message.size()), MSG_DATA, 0, 1}, p);
+        c.encrypt(reinterpret_cast<const unsigned char*>(message.data()), p + FRAME_HEADER_SIZE, message.size());
+        return wire;
+    };
+    auto sendBytes = [&](const string& bytes) { check(send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL) == ssize_t(bytes.size()), "reconnect send"); };
+
+    int status = -1;
+    bool needTicket = resume;
+    if (resume && ticket.valid()) {
+        uint64_t nonce = resumeNonce();
+        CipherContext early = ticket.cipher;
+        sendBytes(ticket.request(nonce) + dataFrame(early)); // 0-RTT
+        ResumeReply reply;
+        while (true) {
+            check(recvFrame(fd, reader, header, payload), "resume answer");
+            if (header.type == MSG_KEY) key.assign(reinterpret_cast<char*>(payload), header.length);
+            bool answer = header.type == MSG_RESUME;
+            check(!answer || reply.decode(payload, header.length), "resume answer format");
+            reader.consume(header);
+            if (answer) break;
+        }
+        status = reply.status;
+        needTicket = false;
+        if (reply.restore(ticket, nonce, cipher, key)) {
+            if (status == RESUME_CACHED) cipher.adoptTx(early); // The early message continued the old keystream
+            else sendBytes(resumeMarker() + dataFrame(cipher));
+            check(recvFrame(fd, reader, header, payload) && header.type == MSG_TICKET, "resumed ticket");
+            cipher.decrypt(payload, header.length);
+            check(ticket.accept(payload, header.length), "resumed ticket format");
+            reader.consume(header);
+        } else {
+            check(status == RESUME_REJECTED, "resume positions");
+            if (key.empty()) {
+                check(recvFrame(fd, reader, header, payload) && header.type == MSG_KEY, "key after refusal");
+                key.assign(reinterpret_cast<char*>(payload), header.length);
+                reader.consume(header);
+            }
+            cipher.init(key, CipherContext::CLIENT);
+            sendBytes(resumeMarker());
+            needTicket = true;
+        }
+    } else {
+        check(recvFrame(fd, reader, header, payload) && header.type == MSG_KEY, "reconnect key");
+        key.assign(reinterpret_cast<char*>(payload), header.length);
+        reader.consume(header);
+        cipher.init(key, CipherContext::CLIENT);
+    }
+    if (needTicket) { // Fresh keys: ask for a ticket (answered before the echo)
+        unsigned char request[4] = {0, 0, 0, FEATURE_RESUMPTION};
+        cipher.encrypt(request, 4);
+        check(sendFrame(fd, MSG_FEATURES, 0, request, 4), "features");
+        check(recvFrame(fd, reader, header, payload) && header.type == MSG_FEATURES, "features answer");
+        cipher.decrypt(payload, header.length);
+        reader.consume(header);
+        check(recvFrame(fd, reader, header, payload) && header.type == MSG_TICKET, "ticket");
+        cipher.decrypt(payload, header.length);
+        check(ticket.accept(payload, header.length), "ticket format");
+        reader.consume(header);
+    }
+    if (status < 0 || status == RESUME_REJECTED) sendBytes(dataFrame(cipher));
+
+    check(recvFrame(fd, reader, header, payload) && header.type == MSG_DATA, "reconnect echo");
+    cipher.decrypt(payload, header.length);
+    check(header.length == message.size() && memcmp(payload, message.data(), message.size()) == 0, "reconnect echo contents");
+    reader.consume(header);
+    latency.record(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+
+    shutdown(fd, SHUT_WR); // The server closes (and caches the session) before we reconnect
+    char drain[64];
+    while (recv(fd, drain, sizeof(drain), 0) > 0) {}
+    close(fd);
+    ticket.cipher = cipher;
+    ticket.key = key;
+    return status;
+}
+
+// Reconnecting clients: what setting up a session costs the server (a fresh key against a
+// cached or ticket-only resumption), then connections churning through a real server, each
+// one connecting, echoing one message and hanging up, reporting connect-to-echo latency and
+// server CPU per connection for fresh keys, cached resumption and ticket-only resumption
+static void benchResumption() {
+    EntropyPool entropy;
+    KeyRegistry registry;
+    Resumption resumption(entropy, 4096, 3600);
+    const int runs = quick ? 20000 : 200000;
+
+    auto start = Clock::now();
+    for (int i = 0; i < runs; ++i) { // What openSession() does for a new client
+        string key = entropy.sessionKey();
+        registry.insert(key, chrono::hours(1));
+        CipherContext cipher;
+        cipher.init(key, CipherContext::SERVER);
+    }
+    record("session_setup_fresh", {}, runs, secondsSince(start));
+
+    // Closed sessions and their tickets, prepared up front
+    vector<string> sealed;
+    CipherContext closed;
+    closed.init("closed-session", CipherContext::SERVER);
+    for (int i = 0; i < 4096; ++i) {
+        TicketBody body{uint64_t(i) * 2 + 1, 0, numeric_limits<int64_t>::max(), 7, 0, string(TICKET_SECRET_BYTES, '\0')};
+        entropy.generate(reinterpret_cast<unsigned char*>(&body.secret[0]), body.secret.size());
+        sealed.push_back(resumption.tickets.seal(body, entropy));
+    }
+    for (bool cached : {true, false}) {
+        start = Clock::now();
+        for (int i = 0; i < runs; ++i) { // What handleResume() and eraseSession() do
+            const string& t = sealed[i % sealed.size()];
+            TicketBody body;
+            check(resumption.tickets.open(reinterpret_cast<const unsigned char*>(t.data()), t.size(), body), "ticket opens");
+            CipherContext cipher;
+            ResumptionCache::Entry entry;
+            if (cached) {
+                if (!resumption.cache.take(body.id, entry)) entry.cipher = closed; // First lap: nothing cached yet
+                cipher = entry.cipher;
+            } else {
+                unsigned char serverNonce[RESUME_NONCE_BYTES];
+                entropy.generate(serverNonce, sizeof(serverNonce));
+                cipher.init(ticketSessionKey(body.secret, uint64_t(i), serverNonce), CipherContext::SERVER);
+            }
+            TicketBody next{body.id, 0, body.expires, 7, 0, string(TICKET_SECRET_BYTES, '\0')};
+            entropy.generate(reinterpret_cast<unsigned char*>(&next.secret[0]), next.secret.size());
+            string issued = resumption.tickets.seal(next, entropy);
+            if (cached) {
+                entry.expiresAt = body.expires;
+                resumption.cache.put(body.id, move(entry)); // Closing again
+            }
+        }
+        record(cached ? "session_setup_cached" : "session_setup_ticket", {}, runs, secondsSince(start));
+    }
+
+    // One server per mode, reconnecting to each in turn so drift on the machine hits all three alike
+    const string message(64, 'r');
+    const char* names[3] = {"reconnect_fresh", "reconnect_resume_cached", "reconnect_resume_ticket"};
+    const int expected[3] = {-1, RESUME_CACHED, RESUME_TICKET};
+    int ports[3];
+    pid_t servers[3];
+    for (int mode = 0; mode < 3; ++mode) { // Fresh keys, cached resumption, ticket-only resumption
+        ports[mode] = 20000 + getpid() % 900 * 3 + mode;
+        vector<string> args = {"--ws-port", "0"};
+        if (mode == 2) args.insert(args.end(), {"--resume-cache", "0"});
+        servers[mode] = startServer(ports[mode], args);
+    }
+    for (int mode = 0; mode < 3; ++mode) {
+        int probe = connectWhenReady(ports[mode]);
+        if (probe < 0) {
+            cerr << "  resumption: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+            for (pid_t server : servers) stopServer(server);
+            return;
+        }
+        close(probe);
+    }
+
+    BufferPool pool(FRAME_BLOCK_SIZE, 1);
+    ResumeTicket tickets[3];
+    LatencyHistogram latency[3];
+    uint64_t cpu[3];
+    double seconds[3] = {0, 0, 0};
+    int matched[3] = {0, 0, 0};
+    for (int mode = 0; mode < 3; ++mode) {
+        reconnectOnce(ports[mode], mode > 0, tickets[mode], pool, message, latency[mode]); // Warm-up (and the first ticket)
+        latency[mode].reset();
+        cpu[mode] = processCpuNanos(servers[mode]);
+    }
+    const int connections = quick ? 500 : 5000;
+    for (int i = 0; i < connections; ++i) {
+        for (int mode = 0; mode < 3; ++mode) {
+            start = Clock::now();
+            matched[mode] += reconnectOnce(ports[mode], mode > 0, tickets[mode], pool, message, latency[mode]) == expected[mode];
+            seconds[mode] += secondsSince(start);
+        }
+    }
+    for (int mode = 0; mode < 3; ++mode) {
+        cpu[mode] = processCpuNanos(servers[mode]) - cpu[mode];
+        check(matched[mode] > connections * 9 / 10, "reconnects took the expected path");
+        record(names[mode],
+               {{"expected_path", double(matched[mode]) / connections}, {"p50_us", latency[mode].percentile(0.5) / 1e3},
+                {"p99_us", latency[mode].percentile(0.99) / 1e3}, {"server_cpu_us", cpu[mode] / 1e3 / connections}},
+               connections, seconds[mode]);
+        stopServer(servers[mode]);
+    }
+}
+
+static bool sameFile(const string& a, const string& b) {
+    ifstream x(a, ios::binary), y(b, ios::binary);
+    vector<char> bx(1 << 20), by(1 << 20);
+    while (x && y) {
+        x.read(bx.data(), bx.size());
+        y.read(by.data(), by.size());
+        if (x.gcount() != y.gcount() || memcmp(bx.data(), by.data(), x.gcount()) != 0) return false;
+    }
+    return x.eof() && y.eof();
+}
+
+// Offline encryption of a large file to a file: the line-by-line getline loop against the
+// BulkCipher blocking loop and its io_uring pipeline at two block sizes (headerless, so the
+// outputs compare byte for byte), then an archive with a nonce header and its decryption
+static void benchBulkCipher() {
+    char directory[] = "/tmp/lava-bench-bulk-XXXXXX";
+    check(mkdtemp(directory) != nullptr, "scratch directory created");
+    const uint64_t total = quick ? (128ull << 20) : (1ull << 30);
+    const string source = string(directory) + "/archive.log", reference = string(directory) + "/getline.enc";
+    {
+        ofstream out(source, ios::binary);
+        string line;
+        uint32_t x = 2463534242u;
+        for (uint64_t written = 0; written < total; written += line.size()) { // Log-like lines of random text
+            line.assign(40 + x % 160, ' ');
+            for (char& c : line) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                c = char('a' + x % 26);
+            }
+            line.back() = '\n';
+            out << line;
+        }
+        check(out.good(), "archive written");
+    }
+    const string key = "bench archive key";
+
+    {
+        auto start = Clock::now();
+        ifstream in(source, ios::binary);
+        ofstream out(reference, ios::binary);
+        RC4Stream cipher;
+        cipher.init(key);
+        string line;
+        uint64_t bytes = 0;
+        while (getline(in, line)) {
+            line += '\n';
+            cipher.apply(reinterpret_cast<unsigned char*>(&line[0]), line.size());
+            out.write(line.data(), line.size());
+            bytes += line.size();
+        }
+        out.flush();
+        record("bulk_getline", {{"file_mb", double(total >> 20)}}, 1, secondsSince(start), bytes);
+    }
+
+    struct Mode { const char* name; bool uring; size_t blockKb; };
+    for (Mode mode : {Mode{"bulk_blocking", false, 1024}, Mode{"bulk_uring", true, 256}, Mode{"bulk_uring", true, 1024}}) {
+        BulkCipher::Options options;
+        options.input = source;
+        options.output = string(directory) + "/out.enc";
+        options.key = key;
+        options.blockBytes = mode.blockKb << 10;
+        options.useUring = mode.uring;
+        options.raw = true; // One keystream under the key alone, as in the getline loop
+        BulkCipher::Result r = BulkCipher(options).run();
+        check(r.complete, string(mode.name) + " complete: " + r.error);
+        check(r.uring == mode.uring || !mode.uring, "io_uring available for " + string(mode.name));
+        check(sameFile(options.output, reference), string(mode.name) + " output matches the line-by-line output");
+        record(mode.name, {{"file_mb", double(total >> 20)}, {"block_kb", double(mode.blockKb)}, {"depth", double(options.depth)}},
+               1, r.seconds, r.bytes);
+    }
+
+    BulkCipher::Options options;
+    options.key = key;
+    options.input = source;
+    options.output = string(directory) + "/archive.enc";
+    BulkCipher::Result r = BulkCipher(options).run();
+    check(r.complete, "archive complete: " + r.error);
+    record("bulk_uring_archive", {{"file_mb", double(total >> 20)}, {"block_kb", double(options.blockBytes >> 10)}},
+           1, r.seconds, r.bytes);
+    options.output = string(directory) + "/again.enc";
+    check(BulkCipher(options).run().complete, "second archive complete");
+    check(!sameFile(options.output, string(directory) + "/archive.enc"), "two archives under one key differ");
+    options.input = string(directory) + "/archive.enc";
+    options.output = string(directory) + "/decrypted.log";
+    options.decrypt = true;
+    check(BulkCipher(options).run().complete, "archive decrypts");
+    check(sameFile(options.output, source), "decrypted archive matches the input");
+    check(system(("rm -rf " + string(directory)).c_str()) == 0, "scratch directory removed");
+}
+
+// Streaming file transfer through a real server over loopback: a multi-GB upload, the same
+// file downloaded again, and an upload cut off halfway and resumed
+static void benchFiles() {
+    char directory[] = "/tmp/lava-bench-files-XXXXXX";
+    check(mkdtemp(directory) != nullptr, "scratch directory created");
+    const uint64_t total = quick ? (256ull << 20) : (4ull << 30);
+    const string source = string(directory) + "/source.bin", copy = string(directory) + "/copy.bin";
+    {
+        ofstream out(source, ios::binary);
+        vector<uint64_t> block(1 << 17); // 1 MB of xorshift output per write: incompressible, cheap to make
+        uint64_t x = 88172645463325252ull;
+        for (uint64_t written = 0; written < total; written += block.size() * 8) {
+            for (uint64_t& word : block) {
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                word = x;
+            }
+            out.write(reinterpret_cast<const char*>(block.data()), block.size() * 8);
+        }
+        check(out.good(), "source file written");
+    }
+
+    const int port = 19500 + getpid() % 400;
+    pid_t server = startServer(port, {"--ws-port", "0", "--file-dir", string(directory) + "/server"});
+    int probe = connectWhenReady(port);
+    if (probe < 0) {
+        cerr << "  files: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+        stopServer(server);
+        check(system(("rm -rf " + string(directory)).c_str()) == 0, "scratch directory removed");
+        return;
+    }
+    close(probe);
+
+    FileTransferClient::Options options;
+    options.port = port;
+    auto report = [&](const char* name, const FileTransferClient::Result& r) {
+        check(r.complete, string(name) + " complete: " + r.error);
+        record(name, {{"file_mb", double(total >> 20)}, {"chunk", double(FILE_CHUNK_BYTES)},
+                      {"window_kb", double(options.window >> 10)}, {"resumed_at_mb", double(r.resumedAt >> 20)}},
+               (r.bytes + FILE_CHUNK_BYTES - 1) / FILE_CHUNK_BYTES, r.seconds, r.bytes);
+    };
+    report("file_upload", FileTransferClient(options).upload(source, "whole.bin"));
+    report("file_download", FileTransferClient(options).download("whole.bin", copy));
+    check(system(("cmp -s " + source + " " + copy).c_str()) == 0, "downloaded copy matches");
+    check(FileTransferClient(options).upload(source, "whole.bin").error == fileStatusText(FILE_EXISTS),
+          "an upload does not replace an existing file unasked");
+
+    FileTransferClient::Options interrupted = options;
+    interrupted.stopAfter = total / 2;
+    FileTransferClient::Result first = FileTransferClient(interrupted).upload(source, "resumed.bin");
+    check(!first.complete, "first half interrupted");
+    FileTransferClient::Result rest = FileTransferClient(options).upload(source, "resumed.bin");
+    check(rest.resumedAt > 0 && rest.resumedAt < total, "upload resumed from the stored part");
+    report("file_upload_resumed", rest);
+    stopServer(server);
+    check(system(("cmp -s " + source + " " + string(directory) + "/server/resumed.bin").c_str()) == 0, "resumed upload matches");
+    check(system(("rm -rf " + string(directory)).c_str()) == 0, "scratch directory removed");
+}
+
+// One session of the fan-out benchmark's room
+struct RoomMember {
+    int fd = -1;
+    CipherContext cipher;
+    FrameReader reader;
+    explicit RoomMember(BufferPool& pool) : reader(pool) {}
+    ~RoomMember() { if (fd >= 0) close(fd); }
+};
+
+// Connect, take the session key and join `room`; false if any step fails
+static bool joinBenchRoom(int port, const string& room, RoomMember& m) {
+    m.fd = connectWhenReady(port);
+    FrameHeader header;
+    unsigned char* payload;
+    if (m.fd < 0 || !recvFrame(m.fd, m.reader, header, payload) || header.type != MSG_KEY) return false;
+    m.cipher.init(string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+    m.reader.consume(header);
+    string name = room;
+    m.cipher.encrypt(reinterpret_cast<unsigned char*>(&name[0]), name.size());
+    if (!sendFrame(m.fd, MSG_JOIN, 1, name.data(), name.size())) return false;
+    if (!recvFrame(m.fd, m.reader, header, payload) || header.type != MSG_JOIN) return false;
+    m.cipher.decrypt(payload, header.length);
+    m.reader.consume(header);
+    return true;
+}
+
+// Read room deliveries from every member until `expected` arrived or the deadline passed;
+// latency is measured against the send time stamped into each message
+static uint64_t receiveRoomMessages(vector<unique_ptr<RoomMember>>& members, size_t nameLength, uint64_t expected,
+                                    LatencyHistogram& latency, Clock::time_point deadline) {
+    int epollFd = epoll_create1(0);
+    for (size_t i = 0; i < members.size(); ++i) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, members[i]->fd, &ev);
+    }
+    uint64_t received = 0;
+    epoll_event events[256];
+    while (received < expected && Clock::now() < deadline) {
+        int n = epoll_wait(epollFd, events, 256, 50);
+        for (int e = 0; e < n; ++e) {
+            RoomMember& m = *members[events[e].data.u64];
+            size_t available;
+            unsigned char* space = m.reader.writeSpace(available);
+            ssize_t got = recv(m.fd, space, available, MSG_DONTWAIT);
+            if (got <= 0) continue;
+            m.reader.commit(got);
+            FrameHeader header;
+            unsigned char* payload;
+            while (m.reader.peek(header, payload) > 0) {
+                m.cipher.decrypt(payload, header.length);
+                if (header.type == MSG_ROOM && header.length >= 1 + nameLength + sizeof(int64_t)) {
+                    int64_t sentAt;
+                    memcpy(&sentAt, payload + 1 + nameLength, sizeof(sentAt));
+                    latency.record(Clock::now().time_since_epoch().count() - sentAt);
+                    ++received;
+                } else if (header.type == MSG_REKEY) { // Follow the rotation like a real client
+                    CipherContext next;
+                    next.init(string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+                    m.cipher.adoptRx(next);
+                    sendFrame(m.fd, MSG_REKEY_ACK, 0, nullptr, 0);
+                    m.cipher.adoptTx(next);
+                }
+                m.reader.consume(header);
+            }
+        }
+    }
+    close(epollFd);
+    return received;
+}
+
+// Broadcast fan-out through a real server: `members` sessions join one room and one more
+// session posts to it. "paced" posts at a fixed rate and reports post-to-delivery latency;
+// "burst" posts back to back and reports how fast the server drains the fan-out.
+static void benchRooms() {
+    const int port = 19900 + getpid() % 90;
+    pid_t server = startServer(port, {"--log-level", "warn"});
+    int probe = connectWhenReady(port);
+    if (probe < 0) {
+        cerr << "  rooms: could not reach " << SERVER_BINARY << " (skipped)" << endl;
+        stopServer(server);
+        return;
+    }
+    close(probe);
+
+    const string room = "bench";
+    const size_t messageBytes = 64;
+    BufferPool pool(FRAME_BLOCK_SIZE, 1);
+    vector<unique_ptr<RoomMember>> members;
+    RoomMember sender(pool);
+    bool joined = joinBenchRoom(port, room, sender);
+    size_t roomSizes[] = {1000, 4000};
+    for (size_t size : roomSizes) {
+        if (quick && size > 1000) break;
+        while (joined && members.size() < size) {
+            members.emplace_back(new RoomMember(pool));
+            joined = joinBenchRoom(port, room, *members.back());
+        }
+        check(joined, "room members joined");
+
+        for (bool paced : {true, false}) {
+            const uint64_t posts = paced ? (quick ? 100 : 300) : (quick ? 200 : 500);
+            const double rate = 200000.0 / size; // Paced: 200k deliveries/s whatever the room size
+            vector<unsigned char> text(messageBytes - 1 - room.size());
+            LatencyHistogram latency;
+            uint64_t received = 0;
+            auto start = Clock::now();
+            thread reader([&] {
+                received = receiveRoomMessages(members, room.size(), posts * size, latency, start + chrono::seconds(30));
+            });
+            for (uint64_t i = 0; i < posts; ++i) {
+                if (paced) this_thread::sleep_until(start + chrono::nanoseconds(int64_t(i * 1e9 / rate)));
+                int64_t now = Clock::now().time_since_epoch().count();
+                memcpy(text.data(), &now, sizeof(now));
+                string payload = roomPayload(room, text.data(), text.size());
+                sender.cipher.encrypt(reinterpret_cast<unsigned char*>(&payload[0]), payload.size());
+                check(sendFrame(sender.fd, MSG_ROOM, uint32_t(i + 1), payload.data(), payload.size()), "room post sent");
+            }
+            reader.join();
+            double seconds = secondsSince(start);
+            check(received == posts * size, "every member got every room message");
+            record(paced ? "room_fanout_paced" : "room_fanout_burst",
+                   {{"members", double(size)}, {"posts", double(posts)}, {"rate", paced ? rate : 0},
+                    {"p50_us", latency.percentile(0.5) / 1e3}, {"p99_us", latency.percentile(0.99) / 1e3}},
+                   received, seconds, received * messageBytes);
+        }
+    }
+    members.clear();
+    stopServer(server);
+}
+
+// Message log: group-committed appends, stream and time-range replays, reopening and compaction,
+// on a log several segments long (4 GB; 256 MB with --quick) in a scratch directory
+static void benchLog() {
+    char directory[] = "/tmp/lava-bench-log-XXXXXX";
+    check(mkdtemp(directory) != nullptr, "scratch directory created");
+    const uint64_t total = quick ? (256ull << 20) : (4ull << 30);
+    const size_t payloadBytes = 200, sessions = 1000, rareEvery = 10000, batchRecords = 1000;
+    const uint8_t sessionType = MSG_DATA;
+    MessageLog::Options options;
+    options.directory = directory;
+    options.segmentBytes = quick ? (64 << 20) : (256 << 20);
+    options.sessionType = sessionType;
+    options.newKey = "bench";
+    const uint64_t rare = logStreamId("room:rare");
+    const int64_t spacing = 1000; // Synthetic timestamps, 1 us apart
+    const uint64_t records = total / (sizeof(LogRecordHeader) + payloadBytes);
+    const int64_t first = MessageLog::wallNow() - int64_t(records) * spacing;
+
+    uint64_t rareWritten = 0;
+    {
+        MessageLog log;
+        string error;
+        check(log.open(options, error), "log opened: " + error);
+        vector<unsigned char> payload(payloadBytes, 'x');
+        LogBatch batch;
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < records; ++i) {
+            bool isRare = i % rareEvery == 0;
+            uint64_t stream = isRare ? rare : logStreamId("session-" + to_string(i % sessions));
+            memcpy(payload.data(), &i, sizeof(i));
+            batch.add(stream, first + int64_t(i) * spacing, isRare ? uint8_t(MSG_ROOM) : sessionType, 0, uint32_t(i), payload.data(), payload.size());
+            rareWritten += isRare;
+            if ((i + 1) % batchRecords == 0) log.submit(batch, true);
+        }
+        log.submit(batch, true);
+        log.flush();
+        double seconds = secondsSince(start);
+        MessageLog::Stats st = log.stats();
+        check(st.records == records && st.dropped == 0, "every record written");
+        record("log_append_sync", {{"payload", double(payloadBytes)}, {"batch", double(batchRecords)},
+                                   {"segments", double(st.segments)}, {"commits", double(st.commits)}},
+               records, seconds, st.bytes);
+
+        // One session among a thousand: its records are spread thinly over the whole log, so the
+        // block filters skip most blocks but the replay still touches about one in seven
+        uint64_t checksum = 0;
+        start = Clock::now();
+        size_t dense = log.replay(logStreamId("session-7"), INT64_MIN, INT64_MAX, SIZE_MAX, [&](const MessageLog::Entry& e) {
+            uint64_t i;
+            memcpy(&i, e.data, sizeof(i));
+            checksum += i;
+            return true;
+        });
+        seconds = secondsSince(start);
+        check(dense == (records + sessions - 1 - 7) / sessions && checksum % sessions == 7 * dense % sessions, "session replay");
+        record("log_replay_session", {{"records", double(dense)}}, dense, seconds, st.bytes);
+
+        // A room posting once per 10000 records: the block filters skip nearly everything
+        start = Clock::now();
+        size_t sparse = log.replay(rare, INT64_MIN, INT64_MAX, SIZE_MAX, [](const MessageLog::Entry&) { return true; });
+        seconds = secondsSince(start);
+        check(sparse == rareWritten, "rare stream replay");
+        record("log_replay_rare", {{"records", double(sparse)}}, sparse, seconds);
+
+        // The last 1% of the time range, as a reconnecting client would ask for
+        start = Clock::now();
+        int64_t from = first + int64_t(records - records / 100) * spacing;
+        size_t recent = log.replay(logStreamId("session-7"), from, INT64_MAX, SIZE_MAX,
+                                   [](const MessageLog::Entry&) { return true; });
+        seconds = secondsSince(start);
+        check(recent > 0 && recent <= dense / 100 + 1, "time range replay");
+        record("log_replay_recent", {{"records", double(recent)}}, recent, seconds);
+    }
+
+    {
+        MessageLog log;
+        string error;
+        auto start = Clock::now();
+        check(log.open(options, error), "log reopened: " + error);
+        double seconds = secondsSince(start);
+        MessageLog::Stats st = log.stats();
+        record("log_reopen", {{"segments", double(st.segments)}}, 1, seconds);
+
+        // Session records older than the middle of the log go; room records stay
+        int64_t middle = first + int64_t(records / 2) * spacing;
+        start = Clock::now();
+        size_t changed = log.compact(middle + options.sessionRetentionSeconds * 1000000000LL);
+        seconds = secondsSince(start);
+        size_t kept = log.replay(rare, INT64_MIN, INT64_MAX, SIZE_MAX, [](const MessageLog::Entry&) { return true; });
+        size_t early = log.replay(logStreamId("session-7"), INT64_MIN, middle - int64_t(sessions) * spacing, SIZE_MAX,
+                                  [](const MessageLog::Entry&) { return true; });
+        check(changed > 0 && kept == rareWritten && early == 0, "compaction dropped old session records only");
+        record("log_compact", {{"segments", double(changed)}}, changed, seconds, uint64_t(changed) * options.segmentBytes);
+    }
+    check(system(("rm -rf " + string(directory)).c_str()) == 0, "scratch directory removed");
+}
+
+static string jsonString(const string& s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Machine-readable report: one object per case, stable field names for regression tracking
+static void writeJson(ostream& out) {
+    out << "{\n  \"suite\": \"lava-bench\",\n  \"timestamp\": " << time(nullptr) << ",\n  \"quick\": "
+        << (quick ? "true" : "false") << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        ostringstream line;
+        line.precision(10);
+        line << "    {\"name\": " << jsonString(r.name) << ", \"params\": {";
+        for (size_t p = 0; p < r.params.size(); ++p) {
+            line << (p ? ", " : "") << jsonString(r.params[p].first) << ": " << r.params[p].second;
+        }
+        line << "}, \"operations\": " << r.operations << ", \"seconds\": " << r.seconds
+             << ", \"ns_per_op\": " << r.seconds * 1e9 / r.operations
+             << ", \"ops_per_sec\": " << r.operations / r.seconds;
+        if (r.bytes) line << ", \"mb_per_sec\": " << r.bytes / r.seconds / 1e6;
+        line << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        out << line.str();
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+    cerr.precision(8); // Whole-number params such as 1048576 print without exponents
+    string outputPath; // Empty: JSON goes to stdout
+    string filter;     // Only run cases whose group name contains this
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--out" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--quick] [--filter NAME] [--out FILE.json]" << endl;
+            return 1;
+        }
+    }
+
+    const vector<pair<string, function<void()>>> groups = {
+        {"rc4", benchRC4},
+        {"image", benchImageHash},
+        {"frames", benchFrameEntropy},
+        {"frame_queue", benchFrameQueue},
+        {"keys", benchKeyStores},
+        {"loopback", benchLoopback},
+        {"scaling", benchScaling},
+        {"backends", benchBackends},
+        {"websocket", benchWebSocket},
+        {"compression", benchCompression},
+        {"resumption", benchResumption},
+        {"rooms", benchRooms},
+        {"log", benchLog},
+        {"files", benchFiles},
+        {"bulk", benchBulkCipher},
+    };
+    for (auto& group : groups) {
+        if (!filter.empty() && group.first.find(filter) == string::npos) continue;
+        cerr << group.first << ":" << endl;
+        group.second();
+    }
+
+    if (outputPath.empty()) {
+        writeJson(cout);
+    } else {
+        ofstream file(outputPath);
+        writeJson(file);
+        cerr << "Wrote " << outputPath << endl;
+    }
+    return 0;
+}
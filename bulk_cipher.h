@@ -0,0 +1,378 @@
+#ifndef BULK_CIPHER_H
+#define BULK_CIPHER_H
+
+#include <algorithm>      // For std::min
+#include <cerrno>         // For EINTR/EAGAIN
+#include <chrono>         // For timing the run
+#include <cstdint>        // For fixed-width integer types
+#include <cstdio>         // For rename()
+#include <cstdlib>        // For posix_memalign()/free()
+#include <cstring>        // For strerror()
+#include <string>         // For paths, keys and errors
+#include <vector>         // For the pipeline slots
+#include <fcntl.h>        // For open() and posix_fadvise()
+#include <sys/random.h>   // For getrandom() (per-file nonces)
+#include <sys/stat.h>     // For fstat() to tell files from pipes
+#include <unistd.h>       // For read()/write()/close()
+#include "file_transfer.h" // For WriteBehind (bounded page cache on the output)
+#include "rc4.h"          // For the RC4 keystream
+#include "uring.h"        // For asynchronous reads and writes
+
+// Offline RC4 over files and pipes (client2 --encrypt/--decrypt), for log archives and the
+// like. Encrypting writes a header with a random nonce, then the whole input as one keystream
+// under nonce + key with the first DISCARD_BYTES of output dropped, so no two archives under
+// one key share keystream; decrypting reads the nonce back from the header. Options::raw
+// keeps the old headerless format, exactly RC4::encrypt(key, input), where every archive
+// under a key reuses the same keystream (XOR of two archives gives XOR of the plaintexts).
+//
+// Memory is `depth` aligned blocks, whatever the input size. With io_uring, reads of the
+// next blocks and writes of the previous ones are in flight while the current block is
+// encrypted in place: each block is read, encrypted, written and then reused for a later
+// read. The blocks are registered as fixed buffers when the memlock limit allows. Files are
+// read and written at explicit offsets with several blocks in flight; a pipe or terminal is
+// read and written one block at a time, in order. Every block but the last is full, so
+// block k always starts at k * blockBytes. Input pages are dropped from the page cache once
+// read, and the output goes through WriteBehind, so a multi-GB run does not fill the cache.
+// Without io_uring the same blocks go through a blocking read/encrypt/write loop.
+class BulkCipher {
+public:
+    static const size_t BLOCK_ALIGN = 4096;   // Block size and buffer alignment (page, and O_DIRECT-safe)
+    static const size_t NONCE_BYTES = 16;     // Random per archive, prepended to the key
+    static const size_t HEADER_BYTES = 8 + NONCE_BYTES; // | "lavarc4" 1 (8) | nonce (16) |
+    static const size_t DISCARD_BYTES = 3072; // Initial keystream dropped (RC4's first bytes are biased)
+
+    struct Options {
+        std::string input;                    // File to read; empty = stdin
+        std::string output;                   // File to write (via OUTPUT.part, renamed when complete); empty = stdout
+        std::string key;                      // RC4 key (with the archive's nonce in front)
+        bool decrypt = false;                 // Read the header's nonce instead of writing a new one
+        bool raw = false;                     // Headerless legacy format: RC4 under the key alone, no discard
+        size_t blockBytes = 1 << 20;          // I/O size, rounded up to a multiple of BLOCK_ALIGN
+        unsigned depth = 4;                   // Blocks in the pipeline
+        bool useUring = true;                 // False: blocking loop even if io_uring is available
+    };
+
+    struct Result {
+        bool complete = false;
+        bool uring = false;                   // Ran the io_uring pipeline (else the blocking loop)
+        bool fixedBuffers = false;            // ...with the blocks registered (memlock limit permitting)
+        uint64_t bytes = 0;                   // Bytes encrypted and written
+        double seconds = 0;
+        std::string error;
+    };
+
+private:
+    enum SlotState { FREE, READING, READ, SEALED, WRITING };
+
+    struct Slot {
+        SlotState state = FREE;
+        uint64_t block = 0;                   // Block of the stream the slot holds
+        size_t length = 0;                    // Bytes read into it
+        size_t written = 0;                   // ...and written out so far
+    };
+
+    static const uint64_t NO_END = ~uint64_t(0);
+
+    Options options;
+    Result result;
+    RC4Stream cipher;
+    int in, out;
+    bool seekIn, seekOut;                     // Regular files: explicit offsets, several blocks in flight
+    uint64_t inBase, outBase;                 // Where the stream starts in each (stdin/stdout may be mid-file)
+    unsigned char* memory;                    // depth * blockBytes, aligned
+    std::vector<Slot> slots;
+    IoUring ring;
+    bool fixed;                               // Blocks are registered buffers
+    uint64_t nextRead, nextCipher, nextWrite; // Next block to read, encrypt and write
+    uint64_t endBlock;                        // Blocks in the stream, once EOF was seen
+    uint64_t flushedBlock;                    // Blocks before this one are all written
+    unsigned readsInFlight, writesInFlight;
+    WriteBehind behind;
+
+    unsigned char* data(size_t slot) { return memory + slot * options.blockBytes; }
+
+    void fail(const std::string& what, int error) {
+        if (result.error.empty()) result.error = what + ": " + strerror(error);
+    }
+
+    // Queue a read of the rest of `slot`'s block (all of it, or after a short read)
+    void startRead(size_t index) {
+        Slot& slot = slots[index];
+        io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = in;
+        sqe->addr = reinterpret_cast<uint64_t>(data(index) + slot.length);
+        sqe->len = uint32_t(options.blockBytes - slot.length);
+        sqe->off = seekIn ? inBase + slot.block * options.blockBytes + slot.length : ~uint64_t(0); // -1: file position
+        sqe->buf_index = uint16_t(index);
+        sqe->user_data = index;
+        slot.state = READING;
+        ++readsInFlight;
+    }
+
+    // Queue a write of the rest of `slot`'s block
+    void startWrite(size_t index) {
+        Slot& slot = slots[index];
+        io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = out;
+        sqe->addr = reinterpret_cast<uint64_t>(data(index) + slot.written);
+        sqe->len = uint32_t(slot.length - slot.written);
+        sqe->off = seekOut ? outBase + slot.block * options.blockBytes + slot.written : ~uint64_t(0);
+        sqe->buf_index = uint16_t(index);
+        sqe->user_data = uint64_t(1) << 32 | index;
+        slot.state = WRITING;
+        ++writesInFlight;
+    }
+
+    void readDone(size_t index, int res) {
+        Slot& slot = slots[index];
+        --readsInFlight;
+        if (res == -EINTR || res == -EAGAIN) return startRead(index);
+        if (res < 0) {
+            slot.state = FREE;
+            return fail("read", -res);
+        }
+        if (slot.block >= endBlock) { // Past an end already seen (the file grew meanwhile): ignore
+            slot.state = FREE;
+            return;
+        }
+        slot.length += res;
+        if (res > 0 && slot.length < options.blockBytes) return startRead(index); // Fill the block first
+        if (res == 0) endBlock = std::min(endBlock, slot.length ? slot.block + 1 : slot.block);
+        slot.state = slot.length ? READ : FREE;
+        if (seekIn && slot.length) { // Our copy is all we need; keep the input out of the page cache
+            posix_fadvise(in, inBase + slot.block * options.blockBytes, slot.length, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    void writeDone(size_t index, int res) {
+        Slot& slot = slots[index];
+        --writesInFlight;
+        if (res == -EINTR || res == -EAGAIN) return startWrite(index);
+        if (res <= 0) {
+            slot.state = FREE;
+            return fail("write", res < 0 ? -res : EIO);
+        }
+        slot.written += res;
+        if (slot.written < slot.length) return startWrite(index);
+        result.bytes += slot.length;
+        slot.state = FREE;
+        if (!seekOut) return;
+        // Writes finish out of order; writeback follows the prefix that is complete
+        while (flushedBlock < nextWrite) {
+            const Slot& next = slots[flushedBlock % slots.size()];
+            if (next.block == flushedBlock && next.state != FREE) break;
+            ++flushedBlock;
+        }
+        behind.wrote(out, outBase + flushedBlock * options.blockBytes);
+    }
+
+    bool finished() const {
+        if (readsInFlight || writesInFlight) return false;
+        return !result.error.empty() || (endBlock != NO_END && nextWrite == endBlock);
+    }
+
+    void runUring() {
+        while (true) {
+            ring.drain([this](const io_uring_cqe& cqe) {
+                size_t index = uint32_t(cqe.user_data);
+                if (cqe.user_data >> 32) writeDone(index, cqe.res);
+                else readDone(index, cqe.res);
+            });
+            if (result.error.empty()) {
+                while (nextRead < endBlock && slots[nextRead % slots.size()].state == FREE && (seekIn || !readsInFlight)) {
+                    Slot& slot = slots[nextRead % slots.size()];
+                    slot.block = nextRead++;
+                    slot.length = slot.written = 0;
+                    startRead(slot.block % slots.size());
+                }
+                while (nextWrite < nextCipher && (seekOut || !writesInFlight)) {
+                    startWrite(nextWrite++ % slots.size()); // Encrypted blocks are SEALED in order
+                }
+            }
+            ring.submit();
+
+            // Encrypt the next block while the kernel reads ahead and writes behind
+            Slot& next = slots[nextCipher % slots.size()];
+            if (result.error.empty() && next.block == nextCipher && next.state == READ) {
+                cipher.apply(data(nextCipher % slots.size()), next.length);
+                next.state = SEALED;
+                ++nextCipher;
+                continue;
+            }
+            if (finished()) return;
+            if (ring.submit(true) < 0 && errno != EINTR) return fail("io_uring", errno);
+        }
+    }
+
+    void runBlocking() {
+        unsigned char* block = data(0);
+        for (uint64_t offset = 0;; offset += options.blockBytes) {
+            size_t length = 0;
+            while (length < options.blockBytes) {
+                ssize_t n = read(in, block + length, options.blockBytes - length);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return fail("read", errno);
+                if (n == 0) break;
+                length += n;
+            }
+            if (length == 0) return;
+            if (seekIn) posix_fadvise(in, inBase + offset, length, POSIX_FADV_DONTNEED);
+            cipher.apply(block, length);
+            for (size_t done = 0; done < length;) {
+                ssize_t n = write(out, block + done, length - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return fail("write", n < 0 ? errno : EIO);
+                done += n;
+            }
+            result.bytes += length;
+            if (seekOut) behind.wrote(out, outBase + offset + length);
+            if (length < options.blockBytes) return;
+        }
+    }
+
+    // Key the cipher for this archive: write a header with a new nonce, or read one back. Done
+    // with plain read()/write() before either loop, so a pipe's header is consumed in order.
+    bool startArchive() {
+        static const unsigned char MAGIC[8] = {'l', 'a', 'v', 'a', 'r', 'c', '4', 1};
+        if (options.raw) {
+            cipher.init(options.key);
+            return true;
+        }
+        unsigned char header[HEADER_BYTES];
+        if (options.decrypt) {
+            size_t length = 0;
+            while (length < HEADER_BYTES) {
+                ssize_t n = read(in, header + length, HEADER_BYTES - length);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    fail("read", errno);
+                    return false;
+                }
+                if (n == 0) break;
+                length += n;
+            }
+            if (length < HEADER_BYTES || memcmp(header, MAGIC, sizeof(MAGIC)) != 0) {
+                result.error = "input is not an encrypted archive (--raw reads headerless ones)";
+                return false;
+            }
+            if (seekIn) inBase += HEADER_BYTES;
+        } else {
+            memcpy(header, MAGIC, sizeof(MAGIC));
+            for (size_t done = 0; done < NONCE_BYTES;) {
+                ssize_t n = getrandom(header + sizeof(MAGIC) + done, NONCE_BYTES - done, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    fail("getrandom", errno);
+                    return false;
+                }
+                done += n;
+            }
+            for (size_t done = 0; done < HEADER_BYTES;) {
+                ssize_t n = write(out, header + done, HEADER_BYTES - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    fail("write", n < 0 ? errno : EIO);
+                    return false;
+                }
+                done += n;
+            }
+            if (seekOut) outBase += HEADER_BYTES;
+        }
+        std::string key(reinterpret_cast<const char*>(header + sizeof(MAGIC)), NONCE_BYTES);
+        key += options.key; // Nonce first, so a long key cannot push it past the 256 bytes the KSA reads
+        cipher.init(key);
+        cipher.skip(DISCARD_BYTES);
+        return true;
+    }
+
+    // A regular file can take positioned I/O from `base` (its current offset); an append-only
+    // one cannot, since every write lands at the end whatever its offset
+    static bool positioned(int fd, uint64_t& base) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (fcntl(fd, F_GETFL) & O_APPEND)) return false;
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        if (position < 0) return false;
+        base = uint64_t(position);
+        return true;
+    }
+
+public:
+    explicit BulkCipher(const Options& opts)
+        : options(opts), in(-1), out(-1), seekIn(false), seekOut(false), inBase(0), outBase(0), memory(nullptr), fixed(false),
+          nextRead(0), nextCipher(0), nextWrite(0), endBlock(NO_END), flushedBlock(0),
+          readsInFlight(0), writesInFlight(0) {
+        options.blockBytes = std::max(BLOCK_ALIGN, (options.blockBytes + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN);
+        options.blockBytes = std::min<size_t>(options.blockBytes, 1u << 30); // An SQE length is 32 bits
+        options.depth = std::max(2u, std::min(options.depth, 64u));
+    }
+
+    ~BulkCipher() {
+        if (memory) free(memory);
+    }
+
+    BulkCipher(const BulkCipher&) = delete;
+    BulkCipher& operator=(const BulkCipher&) = delete;
+
+    // Encrypt (or decrypt) the whole input to the output
+    Result run() {
+        auto start = std::chrono::steady_clock::now();
+        result = Result();
+        if (options.key.empty()) {
+            result.error = "empty key";
+            return result;
+        }
+
+        std::string part = options.output + ".part";
+        in = options.input.empty() ? STDIN_FILENO : open(options.input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            fail("open " + options.input, errno);
+            return result;
+        }
+        out = options.output.empty() ? STDOUT_FILENO : open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (out < 0) {
+            fail("open " + part, errno);
+        } else if (posix_memalign(reinterpret_cast<void**>(&memory), BLOCK_ALIGN, options.blockBytes * options.depth) != 0) {
+            memory = nullptr;
+            result.error = "out of memory";
+        } else {
+            seekIn = positioned(in, inBase);
+            seekOut = positioned(out, outBase);
+            if (seekIn) posix_fadvise(in, inBase, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        if (result.error.empty() && startArchive()) {
+            behind.resume(outBase);
+            slots.assign(options.depth, Slot());
+            result.uring = options.useUring && ring.init(options.depth * 2, options.depth * 4) &&
+                           ring.supports({IORING_OP_READ, IORING_OP_WRITE});
+            if (result.uring) {
+                fixed = ring.supports({IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED}) &&
+                        ring.registerSparseBuffers(options.depth);
+                for (unsigned s = 0; fixed && s < options.depth; ++s) {
+                    fixed = ring.updateBuffer(s, data(s), options.blockBytes); // Fails under a small memlock limit
+                }
+                result.fixedBuffers = fixed;
+                runUring();
+                if (seekIn) lseek(in, inBase + result.bytes, SEEK_SET); // Leave shared descriptors where a plain copy would
+                if (seekOut) lseek(out, outBase + result.bytes, SEEK_SET);
+            } else {
+                runBlocking();
+            }
+        }
+
+        if (!options.input.empty() && in >= 0) close(in);
+        if (!options.output.empty() && out >= 0) {
+            if (result.error.empty() && (fdatasync(out) < 0 || rename(part.c_str(), options.output.c_str()) < 0)) {
+                fail("finish " + options.output, errno);
+            }
+            close(out);
+            if (!result.error.empty()) unlink(part.c_str());
+        }
+        result.complete = result.error.empty();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+};
+
+#endif // BULK_CIPHER_H
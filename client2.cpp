@@ -5,254 +5,378 @@
 #include <string.h>       // For string manipulation functions
 #include <fstream>        // For file input/output operations
 #include <ctime>          // For generating timestamps
+#include <mutex>          // For serializing console output between threads
+#include <memory>         // For replacing the session on /reconnect
+#include <unordered_map>  // For where each room's next history page starts
+#include <vector>         // For the reusable send buffer
+#include "async_client.h" // For the pipelined session used by the interactive mode
+#include "bulk_cipher.h"  // For the offline encrypt/decrypt mode
+#include "file_transfer.h" // For the streaming file transfer modes
+#include "image_processor.h" // For image-derived keys
+#include "framing.h"      // For length-prefixed frames and pooled I/O buffers
+#include "load_generator.h" // For the headless load-test mode
+#include "rc4.h"          // For the RC4 stream cipher
 
 using namespace std;
 
-// Frame structure to represent a data frame
-struct Frame {
-    string path;          // Path of the image file
-    string timestamp;     // Timestamp of the frame's creation
-    Frame(const string& p) : path(p), timestamp(to_string(time(nullptr))) {} // Constructor initializes with current time
-};
-
-// Node structure for the queue implementation
-struct QueueNode {
-    Frame data;           // Frame data stored in the node
-    QueueNode* next;      // Pointer to the next node
-    QueueNode(const Frame& frame) : data(frame), next(nullptr) {} // Constructor initializes the node with data
-};
-
-// A custom Queue implemented using a linked list
-class FrameQueue {
-private:
-    QueueNode *front, *rear;  // Pointers to the front and rear of the queue
-    size_t currentSize;       // Current size of the queue
-    const size_t MAX_SIZE = 10; // Maximum allowed size of the queue
-
-public:
-    FrameQueue() : front(nullptr), rear(nullptr), currentSize(0) {} // Constructor initializes an empty queue
-    
-    ~FrameQueue() {             // Destructor clears the queue
-        while (!empty()) {
-            pop();              // Remove elements until empty
-        }
+// Headless mode: hammer the server with many sessions and report throughput and latency
+static int runLoadTest(const LoadGenerator::Options& options) {
+    cout << "Load test: " << options.connections << (options.webSocket ? " WebSocket" : "") << " connections, " << options.messageBytes << " byte messages, "
+         << (options.openLoop ? "open loop at " + to_string(int64_t(options.rate)) + " msg/s" : string("closed loop"))
+         << ", " << options.seconds << " s" << endl;
+
+    LoadGenerator generator(options);
+    LoadGenerator::Report report = generator.run();
+
+    const LatencyHistogram& latency = report.latency;
+    cout << "Connected:  " << report.connected << "/" << options.connections << endl;
+    cout << "Sent:       " << report.sent << " (" << report.sent / report.seconds << " msg/s)" << endl;
+    cout << "Received:   " << report.received << " (" << report.received / report.seconds << " msg/s, "
+         << report.received * options.messageBytes / report.seconds / 1e6 << " MB/s payload)" << endl;
+    cout << "Errors:     " << report.errors << ", unanswered: " << report.sent - report.received
+         << ", key rotations: " << report.rekeys << endl;
+    if (options.compress) { // Payload bytes both ways, against what they would have been uncompressed
+        uint64_t plain = (report.sent + report.received) * options.messageBytes;
+        cout << "Compressed: " << report.compressed << "/" << report.connected << " sessions, wire "
+             << report.wireBytes << " of " << plain << " payload bytes ("
+             << (report.wireBytes ? double(plain) / report.wireBytes : 0) << "x)" << endl;
     }
+    cout << "Latency us: min " << latency.min() / 1e3 << "  mean " << latency.mean() / 1e3
+         << "  p50 " << latency.percentile(0.50) / 1e3 << "  p99 " << latency.percentile(0.99) / 1e3
+         << "  p999 " << latency.percentile(0.999) / 1e3 << "  max " << latency.max() / 1e3 << endl;
+    return report.errors == 0 && report.received > 0 ? 0 : 1;
+}
 
-    void push(const Frame& frame) { // Adds a new frame to the queue
-        QueueNode* newNode = new QueueNode(frame); // Create a new node
-        
-        if (currentSize >= MAX_SIZE) { // Remove the oldest element if queue is full
-            pop();
-        }
-
-        if (rear == nullptr) { // If the queue is empty, update both front and rear
-            front = rear = newNode;
-        } else {               // Otherwise, link the new node to the rear
-            rear->next = newNode;
-            rear = newNode;
-        }
-        
-        currentSize++; // Increment the queue size
-    }
-
-    Frame pop() {       // Removes and returns the front frame
-        if (empty()) {
-            throw runtime_error("Queue is empty"); // Error if queue is empty
-        }
-
-        QueueNode* temp = front;      // Store the current front node
-        Frame frame = temp->data;     // Extract the frame data
-        front = front->next;          // Update the front pointer
-
-        if (front == nullptr) {       // If queue becomes empty, set rear to nullptr
-            rear = nullptr;
-        }
-
-        delete temp;       // Free memory of the removed node
-        currentSize--;     // Decrement the queue size
-        return frame;
+// Headless mode: upload (--send) or download (--get) one file, resuming a partial transfer
+static int runTransfer(const LoadGenerator::Options& options, bool upload, const string& local, const string& remote,
+                       bool replace) {
+    FileTransferClient::Options transferOptions;
+    transferOptions.host = options.host;
+    transferOptions.port = options.port;
+    transferOptions.replace = replace;
+    FileTransferClient client(transferOptions);
+    FileTransferClient::Result result = upload ? client.upload(local, remote) : client.download(remote, local);
+    if (result.resumedAt > 0) cout << "Resumed at byte " << result.resumedAt << " of " << result.size << endl;
+    cout << (upload ? "Sent " : "Received ") << result.bytes << " bytes in " << result.seconds << " s ("
+         << (result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0) << " MB/s)";
+    if (result.rekeys) cout << ", server rotated the key " << result.rekeys << " time(s)";
+    cout << endl;
+    if (!result.complete) {
+        const char* hint = result.resumedAt + result.bytes > 0 ? " (run again to resume)"
+                           : result.error == fileStatusText(FILE_EXISTS) ? " (--replace overwrites it)" : "";
+        cerr << "Transfer incomplete: " << result.error << hint << endl;
+        return 1;
     }
+    cout << (upload ? "Stored on the server as " + remote : "Saved to " + local) << endl;
+    return 0;
+}
 
-    bool empty() const { return front == nullptr; } // Checks if the queue is empty
-    size_t size() const { return currentSize; }     // Returns the current size of the queue
-};
-
-// RC4 encryption/decryption implementation
-class RC4 {
-private:
-    unsigned char S[256]; // Permutation array for RC4 algorithm
-
-    void KSA(const string& key) { // Key-scheduling algorithm to initialize S
-        for (int i = 0; i < 256; ++i) {
-            S[i] = i;
-        }
-
-        int j = 0;
-        for (int i = 0; i < 256; ++i) {
-            j = (j + S[i] + key[i % key.size()]) % 256; // Key-dependent swapping
-            swap(S[i], S[j]);
-        }
+// Headless mode: encrypt or decrypt a file or pipe offline (no server involved). Progress goes
+// to stderr, since the output may be stdout.
+static int runBulkCipher(const BulkCipher::Options& options) {
+    BulkCipher cipher(options);
+    BulkCipher::Result result = cipher.run();
+    cerr << (result.complete ? "Processed " : "Stopped after ") << result.bytes << " bytes in " << result.seconds << " s ("
+         << (result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0) << " MB/s, "
+         << (result.uring ? (result.fixedBuffers ? "io_uring, fixed buffers" : "io_uring") : "blocking I/O") << ")" << endl;
+    if (!result.complete) {
+        cerr << "Failed: " << result.error << endl;
+        return 1;
     }
+    return 0;
+}
 
-    string PRGA(const string& data) { // Pseudo-random generation algorithm for encryption/decryption
-        string result(data.size(), 0); // Initialize result string with the same size as input
-        int i = 0, j = 0;
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--host IP] [--port N] [--window N] [--compress]\n"
+         << "       " << program << " --load [--host IP] [--port N] [--connections N] [--size BYTES]\n"
+         << "           [--rate MSG_PER_SEC (open loop; default closed loop)] [--duration SEC] [--threads N]\n"
+         << "           [--window N (closed loop: messages in flight per connection)]\n"
+         << "           [--websocket (through server2's WebSocket port; --port defaults to 8081)]\n"
+         << "           [--compress] [--payload alphabet|chat|random]\n"
+         << "       " << program << " --send PATH [--as NAME] [--replace] | --get NAME [--to PATH] [--host IP] [--port N]\n"
+         << "       " << program << " --encrypt|--decrypt --key KEY|--key-file PATH [--in PATH (stdin)] [--out PATH (stdout)]\n"
+         << "           [--block-kb N (1024)] [--no-uring] [--raw (headerless: every file under KEY reuses one keystream)]" << endl;
+}
 
-        for (size_t k = 0; k < data.size(); ++k) {
-            i = (i + 1) % 256;
-            j = (j + S[i]) % 256;
-            swap(S[i], S[j]); // Swap values in S array
-            unsigned char rnd = S[(S[i] + S[j]) % 256]; // Generate a pseudo-random byte
-            result[k] = data[k] ^ rnd; // XOR the data with the pseudo-random byte
+int main(int argc, char* argv[]) {
+    LoadGenerator::Options options; // Server address, plus load-test parameters
+    bool loadTest = false;
+    bool portGiven = false;
+    string sendPath, getName, remoteName, localPath; // File transfer modes
+    bool replace = false;           // --send: overwrite the server's copy of NAME
+    size_t window = 32;             // Interactive mode: lines sent ahead of their replies
+    bool bulk = false;              // --encrypt/--decrypt: offline, no server
+    string keyFile;                 // ...key read from this file instead of --key
+    BulkCipher::Options bulkOptions;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--load") {
+            loadTest = true;
+        } else if (arg == "--host" && hasValue) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && hasValue) {
+            options.port = atoi(argv[++i]);
+            portGiven = true;
+        } else if (arg == "--connections" && hasValue) {
+            options.connections = max(1, atoi(argv[++i]));
+        } else if (arg == "--size" && hasValue) {
+            options.messageBytes = min<size_t>(MAX_FRAME_PAYLOAD, strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--rate" && hasValue) {
+            options.rate = atof(argv[++i]);
+            options.openLoop = options.rate > 0;
+        } else if (arg == "--duration" && hasValue) {
+            options.seconds = atof(argv[++i]);
+        } else if (arg == "--window" && hasValue) {
+            window = max(1, atoi(argv[++i]));
+            options.window = window;
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "--websocket") {
+            options.webSocket = true;
+        } else if (arg == "--compress") {
+            options.compress = true;
+        } else if (arg == "--payload" && hasValue) {
+            string payload = argv[++i];
+            if (payload == "chat") options.payload = LoadGenerator::PAYLOAD_CHAT;
+            else if (payload == "random") options.payload = LoadGenerator::PAYLOAD_RANDOM;
+            else if (payload == "alphabet") options.payload = LoadGenerator::PAYLOAD_ALPHABET;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--send" && hasValue) {
+            sendPath = argv[++i];
+        } else if (arg == "--get" && hasValue) {
+            getName = argv[++i];
+        } else if (arg == "--replace") {
+            replace = true;
+        } else if (arg == "--as" && hasValue) {
+            remoteName = argv[++i];
+        } else if (arg == "--to" && hasValue) {
+            localPath = argv[++i];
+        } else if (arg == "--encrypt" || arg == "--decrypt") { // The same RC4, but only --encrypt writes a nonce header
+            bulk = true;
+            bulkOptions.decrypt = arg == "--decrypt";
+        } else if (arg == "--key" && hasValue) {
+            bulkOptions.key = argv[++i];
+        } else if (arg == "--key-file" && hasValue) {
+            keyFile = argv[++i];
+        } else if (arg == "--in" && hasValue) {
+            bulkOptions.input = argv[++i];
+        } else if (arg == "--out" && hasValue) {
+            bulkOptions.output = argv[++i];
+        } else if (arg == "--block-kb" && hasValue) {
+            bulkOptions.blockBytes = size_t(max(4L, atol(argv[++i]))) << 10;
+        } else if (arg == "--no-uring") {
+            bulkOptions.useUring = false;
+        } else if (arg == "--raw") {
+            bulkOptions.raw = true;
+        } else {
+            usage(argv[0]);
+            return 1;
         }
-
-        return result; // Return the encrypted/decrypted result
-    }
-
-public:
-    string encrypt(const string& key, const string& data) { // Encrypts the data using the given key
-        KSA(key); // Initialize S array using the key
-        return PRGA(data); // Encrypt the data using PRGA
     }
-
-    string decrypt(const string& key, const string& data) { // Decrypts the data (same as encryption for RC4)
-        return encrypt(key, data);
+    if (options.webSocket && !portGiven) options.port = 8081;
+    if (options.port <= 0 || options.port > 65535 || options.seconds <= 0 || (options.webSocket && !loadTest)) {
+        usage(argv[0]);
+        return 1;
     }
-};
-
-class ImageProcessor {
-private:
-    FrameQueue frameQueue; // Queue to manage frames generated from image files
-    
-    // Function to generate a numeric string based on image content
-    string GenerateNumberFromImage(const string& imagePath) {
-        ifstream imageFile(imagePath, ios::binary); // Open image file in binary mode
-        if (!imageFile) { // Check if file could not be opened
-            cerr << "Error: Unable to open image file: " << imagePath << endl;
-            return "";
-        }
-
-        unsigned long hash = 5381; // Initialize hash with a large prime number
-        char c;
-        while (imageFile.get(c)) { // Read each byte from the file
-            hash = ((hash << 5) + hash) + static_cast<unsigned char>(c); // Update hash using a variation of DJB2 algorithm
+    if (bulk) {
+        if (!keyFile.empty()) { // First line of the file; keeps the key out of the process list
+            ifstream file(keyFile);
+            if (!getline(file, bulkOptions.key)) {
+                cerr << "Cannot read key from " << keyFile << endl;
+                return 1;
+            }
         }
-        imageFile.close(); // Close the file
-
-        string number;
-        unsigned long tempHash = hash;
-
-        // Convert the hash to a 10-digit numeric string
-        for (int i = 0; i < 10; ++i) {
-            number = to_string(tempHash % 10) + number;
-            tempHash /= 10;
+        if (bulkOptions.key.empty() || (!bulkOptions.output.empty() && bulkOptions.output == bulkOptions.input)) {
+            usage(argv[0]);
+            return 1;
         }
-
-        frameQueue.push(Frame(imagePath)); // Add a new frame to the queue
-        return number; // Return the generated numeric string
+        return runBulkCipher(bulkOptions);
     }
-
-public:
-    // Public method to generate a key from an image file
-    string generateKey(const string& imagePath) {
-        return GenerateNumberFromImage(imagePath);
-    }
-
-    // Check if there are frames in the queue
-    bool hasFrames() const {
-        return !frameQueue.empty();
+    if (loadTest) {
+        return runLoadTest(options);
     }
-
-    // Retrieve the next frame from the queue
-    Frame getNextFrame() {
-        return frameQueue.pop();
+    if (!sendPath.empty() || !getName.empty()) {
+        if (!sendPath.empty() && !getName.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (!sendPath.empty()) { // Stored under the file's own name unless --as says otherwise
+            return runTransfer(options, true, sendPath, remoteName.empty() ? sendPath.substr(sendPath.rfind('/') + 1) : remoteName,
+                               replace);
+        }
+        return runTransfer(options, false, localPath.empty() ? getName : localPath, getName, false);
     }
-};
 
-int main() {
-    RC4 rc4;                     // RC4 encryption/decryption object
     ImageProcessor imageProcessor; // Image processor object for key generation
-    string encryption_key;       // Variable to store the encryption key
-    
-    // Create a client socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) { // Check for socket creation failure
-        cerr << "Could not create socket" << endl;
-        return 1;
-    }
-    cout << "Client socket created" << endl;
-
-    // Configure server address
-    struct sockaddr_in server;
-    server.sin_family = AF_INET; // IPv4 address family
-    server.sin_port = htons(8080); // Set server port to 8080
-    server.sin_addr.s_addr = inet_addr("127.0.0.1"); // Server IP address (localhost)
+    unique_ptr<AsyncClient> client; // Pipelined session: lines go out without waiting for replies
+    ResumeTicket ticket;           // Lets /reconnect resume the session instead of starting a new one
+    mutex console;                 // Replies are printed from the receiver thread
+    bool interactive = isatty(STDIN_FILENO); // Prompt only when a person is typing
 
-    // Connect to the server
+    // Connect to the server and receive the session key
     cout << "Attempting to connect to server..." << endl;
-    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) { // Check for connection failure
+    unordered_map<string, uint64_t> historyNext; // Per room ("": our own messages): where the next /history page starts (console lock)
+    AsyncClient::ReplyHandler onReply =
+        [&](uint32_t sequence, const unsigned char* reply, size_t length, chrono::nanoseconds rtt) {
+            lock_guard<mutex> guard(console);
+            cout << "Server reply #" << sequence << " (" << rtt.count() / 1000 << " us): ";
+            cout.write(reinterpret_cast<const char*>(reply), length) << '\n'; // Piped runs let stdout buffer replies
+            if (interactive) cout << flush; // A person at a terminal sees each reply at once
+        };
+    AsyncClient::EventHandler onEvent =
+        [&](uint8_t type, uint8_t flags, uint32_t sequence, const unsigned char* payload, size_t length) {
+            lock_guard<mutex> guard(console);
+            const char* text = reinterpret_cast<const char*>(payload);
+            size_t nameLength;
+            if (type == MSG_ROOM && roomNameLength(payload, length, nameLength)) {
+                cout << "[" << string(text + 1, nameLength) << " #" << sequence << ((flags & FLAG_HISTORY) ? ", history] " : "] ");
+                cout.write(text + 1 + nameLength, length - 1 - nameLength) << '\n';
+            } else if (type == MSG_DATA) { // One of our own messages, replayed after a reconnect
+                cout << "[sent #" << sequence << ", history] ";
+                cout.write(text, length) << '\n';
+            } else if (type == MSG_HISTORY && length >= 12) { // | count (4) | next since (8) | name ("": our own) |
+                string room(text + 12, length - 12);
+                historyNext[room] = historyField(payload + 4, 8);
+                string command = room.empty() ? "/history" : "/history " + room;
+                cout << "End of " << (room.empty() ? "this session's" : room) << " history: " << historyField(payload, 4)
+                     << " message(s) (" << command << " again for the next page)\n";
+            } else if (type != MSG_ROOM) {
+                cout << (type == MSG_JOIN ? "Joined room " : "Left room ") << string(text, length) << '\n';
+            }
+            if (interactive) cout << flush;
+        };
+    client.reset(new AsyncClient(window));
+    if (!client->connect(options.host, options.port, onReply, onEvent, options.compress, &ticket)) { // Check for connection failure
         cerr << "Connection failed: " << strerror(errno) << endl;
         return 1;
     }
-    cout << "Connected to server" << endl;
-
-    // Receive encryption key from server
-    char key_buffer[1024] = {0}; // Buffer to store the received key
-    int key_size = recv(sock, key_buffer, sizeof(key_buffer) - 1, 0); // Receive key from server
-    if (key_size < 0) { // Check for receive failure
-        cerr << "Failed to receive key: " << strerror(errno) << endl;
-        close(sock);
-        return 1;
-    }
-    key_buffer[key_size] = '\0'; // Null-terminate the received key
-    encryption_key = string(key_buffer); // Store the key in a string variable
-    cout << "Received encryption key from server: " << encryption_key << endl;
+    cout << "Connected to server" << (client->compressed() ? " (compression on)" : "") << endl;
+    cout << "Received encryption key from server: " << client->sessionKey() << endl;
 
-    // Generate local encryption key from an image
+    // Generate local encryption key from the captured frames
     try {
-        string localKey = imageProcessor.generateKey("opencv_frame_0.png"); // Generate key from image
-        cout << "Generated local key from image: " << localKey << endl;
+        string localKey = imageProcessor.generateKey({"opencv_frame_0.png", "opencv_frame_1.png",
+                                                      "opencv_frame_2.png", "opencv_frame_3.png"});
+        cout << "Generated local key from images: " << localKey << endl;
+        for (const FrameTiming& t : imageProcessor.frameTimings()) { // Report ingestion throughput
+            cout << "  " << t.path << ": " << t.bytes << " bytes in " << t.milliseconds << " ms ("
+                 << (t.milliseconds > 0 ? t.bytes / 1000.0 / t.milliseconds : 0) << " MB/s)" << endl;
+        }
     } catch (const exception& e) {
         cout << "Warning: Could not generate local key from image" << endl;
     }
 
+    string message;
     while (true) {
-        // Get a message from the user
-        string message;
-        cout << "\nEnter message (or 'exit' to quit): ";
-        getline(cin, message);
-
-        if (message == "exit") { // Check if the user wants to exit
+        // Get a message from the user (or the next line of piped input)
+        if (interactive) {
+            lock_guard<mutex> guard(console);
+            cout << "\nEnter message, /join ROOM, /leave ROOM, /say ROOM TEXT, /history [ROOM [N]], /reconnect (or 'exit' to quit): " << flush;
+        }
+        if (!getline(cin, message) || message == "exit") { // Check if the user wants to exit
             break;
         }
+        if (message.size() > MAX_FRAME_PAYLOAD) { // Check the message fits in one frame
+            cerr << "Message too long (limit " << MAX_FRAME_PAYLOAD << " bytes)" << endl;
+            continue;
+        }
 
-        // Encrypt the message and send it to the server
-        string encrypted_message = rc4.encrypt(encryption_key, message); // Encrypt using RC4
-        if (send(sock, encrypted_message.c_str(), encrypted_message.length(), 0) < 0) { // Send encrypted message
-            cerr << "Send failed: " << strerror(errno) << endl;
-            break;
+        // Drop the connection and resume the session on a new one (rooms and keys carry over if the server still has them)
+        if (message == "/reconnect") {
+            client->drain(chrono::seconds(1));
+            client->close(); // Leaves the keystreams in the ticket
+            auto start = chrono::steady_clock::now();
+            client.reset(new AsyncClient(window));
+            if (!client->connect(options.host, options.port, onReply, onEvent, options.compress, &ticket)) {
+                cerr << "Reconnect failed: " << strerror(errno) << endl;
+                return 1;
+            }
+            long micros = long(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+            lock_guard<mutex> guard(console);
+            int how = client->resumption();
+            cout << (how == RESUME_CACHED ? "Resumed the session (keys and rooms kept)"
+                     : how == RESUME_TICKET ? "Resumed the session with new keys (rooms must be joined again)"
+                     : "New session (the server refused the ticket)")
+                 << " in " << micros << " us" << endl;
+            if (how == RESUME_CACHED || how == RESUME_TICKET) {
+                historyNext[""]; // /history alone: what the server logged of ours since then
+                for (auto& room : historyNext) room.second = uint64_t(client->missedSince()); // /history shows what was missed
+            }
+            continue;
+        }
+
+        // The messages this session sent, replayed from the server's log (after a /reconnect: since the drop)
+        if (message == "/history") {
+            uint64_t since;
+            {
+                lock_guard<mutex> guard(console);
+                since = historyNext[""];
+            }
+            string request = historyRequest("", since, 20);
+            if (client->post(MSG_HISTORY, request.data(), request.size()) == 0) {
+                cerr << "Send failed: connection closed" << endl;
+                break;
+            }
+            continue;
         }
-        cout << "Sent encrypted message: " << encrypted_message << endl;
 
-        // Receive the server's encrypted response
-        char buffer[2000] = {0}; // Buffer for the response
-        int recv_size = recv(sock, buffer, sizeof(buffer) - 1, 0); // Receive response
-        if (recv_size < 0) { // Check for receive failure
-            cerr << "Receive failed: " << strerror(errno) << endl;
+        // Room commands: /join ROOM, /leave ROOM, /say ROOM TEXT, /history ROOM [N]
+        if (message.compare(0, 6, "/join ") == 0 || message.compare(0, 7, "/leave ") == 0 ||
+            message.compare(0, 5, "/say ") == 0 || message.compare(0, 9, "/history ") == 0) {
+            size_t nameStart = message.find(' ') + 1;
+            size_t nameEnd = message.find(' ', nameStart);
+            string room = message.substr(nameStart, nameEnd == string::npos ? string::npos : nameEnd - nameStart);
+            if (room.empty() || room.size() > MAX_ROOM_NAME) {
+                cerr << "Room names are 1-" << MAX_ROOM_NAME << " bytes without spaces" << endl;
+                continue;
+            }
+            uint32_t sent;
+            if (message[1] == 's') {
+                string text = nameEnd == string::npos ? "" : message.substr(nameEnd + 1);
+                string payload = roomPayload(room, text.data(), text.size());
+                if (payload.size() > MAX_FRAME_PAYLOAD) {
+                    cerr << "Message too long for a room frame" << endl;
+                    continue;
+                }
+                sent = client->post(MSG_ROOM, payload.data(), payload.size());
+            } else if (message[1] == 'h') { // Replays the room's log from where the previous page ended
+                uint32_t limit = nameEnd == string::npos ? 20 : uint32_t(atoi(message.c_str() + nameEnd + 1));
+                uint64_t since;
+                {
+                    lock_guard<mutex> guard(console);
+                    since = historyNext[room];
+                }
+                string request = historyRequest(room, since, limit);
+                sent = client->post(MSG_HISTORY, request.data(), request.size());
+            } else {
+                sent = client->post(message[1] == 'j' ? MSG_JOIN : MSG_LEAVE, room.data(), room.size());
+            }
+            if (sent == 0) {
+                cerr << "Send failed: connection closed" << endl;
+                break;
+            }
+            continue;
+        }
+
+        // Queue the message; it is encrypted and sent by the client's sender thread
+        if (client->submit(message.data(), message.size()) == 0) {
+            cerr << "Send failed: connection closed" << endl;
             break;
         }
-        buffer[recv_size] = '\0'; // Null-terminate the received response
-        
-        // Decrypt the server's response
-        string encrypted_response(buffer); // Store encrypted response
-        string decrypted_response = rc4.decrypt(encryption_key, encrypted_response); // Decrypt the response
-        
-        // Display the server's response
-        cout << "Server reply:" << endl;
-        cout << "Encrypted: " << encrypted_response << endl;
-        cout << "Decrypted: " << decrypted_response << endl;
     }
 
-    close(sock); // Close the socket
+    // Wait for the replies still in flight before hanging up
+    if (!client->drain(chrono::seconds(5))) {
+        cerr << client->pending() << " message(s) left unanswered" << endl;
+    }
+    cout << "Sent " << client->frames() << " frame(s) in " << client->batches() << " write(s)";
+    if (client->rotations()) cout << ", server rotated the key " << client->rotations() << " time(s)";
+    if (client->compressed()) cout << ", " << client->payloadBytes() << " payload bytes sent as " << client->sentPayloadBytes();
+    cout << endl;
+    client->close(); // Close the socket
     return 0;
 }
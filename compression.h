@@ -0,0 +1,232 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()
+#include <vector>         // For the match table
+
+// Fast compression stage applied to a message before it is encrypted. The encoder writes the
+// LZ4 block format (token, literals, 2-byte offset, match length; 64 KB window), so any LZ4
+// block decoder can read its output, but it is self-contained and needs no library.
+//
+// Each message is compressed on its own: nothing carries over from one frame to the next,
+// so a lost or reordered frame cannot corrupt another one and the cipher sees one payload
+// per frame exactly as before. The match table is reused between calls and never cleared;
+// stale entries are harmless because every candidate is verified against the input.
+const size_t COMPRESS_MIN_BYTES = 128;    // Smaller payloads go out as they are
+const uint32_t FEATURE_COMPRESSION = 1;   // MSG_FEATURES bit: the peer reads FLAG_COMPRESSED frames
+
+class Lz4 {
+private:
+    static const int HASH_BITS = 12;      // 4096 table slots, 16 KB
+    static const size_t MIN_MATCH = 4;
+    static const size_t LAST_LITERALS = 5; // The block format ends with at least this many literals
+    static const size_t MATCH_LIMIT = 12;  // ...and the last match starts at least this far from the end
+    static const size_t MAX_OFFSET = 65535;
+
+    std::vector<uint32_t> table;          // Hash of 4 input bytes -> last position seen
+
+    static uint32_t read32(const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    static uint64_t read64(const unsigned char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    static uint32_t hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+    // Bytes two positions have in common, stopping at `end`
+    static size_t common(const unsigned char* a, const unsigned char* b, const unsigned char* end) {
+        const unsigned char* start = a;
+        while (a + 8 <= end) {
+            uint64_t diff = read64(a) ^ read64(b);
+            if (diff) return a - start + (__builtin_ctzll(diff) >> 3); // Little-endian: first differing byte
+            a += 8;
+            b += 8;
+        }
+        while (a < end && *a == *b) ++a, ++b;
+        return a - start;
+    }
+
+    // Token nibble overflow: 255-valued bytes followed by the remainder
+    static bool putLength(size_t value, unsigned char*& op, const unsigned char* end) {
+        while (value >= 255) {
+            if (op >= end) return false;
+            *op++ = 255;
+            value -= 255;
+        }
+        if (op >= end) return false;
+        *op++ = (unsigned char)value;
+        return true;
+    }
+
+    // One sequence: `literals` bytes from `anchor`, then a match (matchLength 0 = final literals only)
+    static bool putSequence(const unsigned char* anchor, size_t literals, size_t offset, size_t matchLength,
+                            unsigned char*& op, const unsigned char* end) {
+        if (op >= end) return false;
+        unsigned char* token = op++;
+        *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+        if (literals >= 15 && !putLength(literals - 15, op, end)) return false;
+        if (size_t(end - op) < literals) return false;
+        memcpy(op, anchor, literals);
+        op += literals;
+        if (!matchLength) return true;
+        if (end - op < 2) return false;
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        size_t extra = matchLength - MIN_MATCH;
+        *token |= (unsigned char)(extra >= 15 ? 15 : extra);
+        return extra < 15 || putLength(extra - 15, op, end);
+    }
+
+    // Copy 8 bytes at a time; may write up to 7 bytes past `length` (callers check there is room)
+    static void wildCopy(unsigned char* out, const unsigned char* in, size_t length) {
+        unsigned char* end = out + length;
+        do {
+            memcpy(out, in, 8);
+            out += 8;
+            in += 8;
+        } while (out < end);
+    }
+
+public:
+    Lz4() : table(size_t(1) << HASH_BITS, 0) {}
+
+    // Largest compressed size of `length` bytes (incompressible input grows slightly)
+    static size_t bound(size_t length) { return length + length / 255 + 16; }
+
+    // Compress `length` bytes into at most `capacity` bytes; 0 if the result would not fit.
+    // Passing a capacity below `length` turns an incompressible payload into an early exit.
+    size_t compress(const unsigned char* in, size_t length, unsigned char* out, size_t capacity) {
+        unsigned char* op = out;
+        const unsigned char* end = out + capacity;
+        const unsigned char* anchor = in;
+        if (length > MATCH_LIMIT) {
+            const unsigned char* ip = in;
+            const unsigned char* last = in + length - MATCH_LIMIT;       // No match may start after this
+            const unsigned char* matchEnd = in + length - LAST_LITERALS; // ...or run past this
+            table[hash(read32(ip))] = 0;
+            ++ip;
+            while (true) {
+                // Look for a match, stepping faster the longer nothing turns up (random data exits quickly)
+                const unsigned char* match;
+                unsigned attempts = 1 << 6;
+                while (true) {
+                    if (ip > last) goto finish;
+                    uint32_t& slot = table[hash(read32(ip))];
+                    match = in + slot;
+                    slot = uint32_t(ip - in);
+                    if (match < ip && size_t(ip - match) <= MAX_OFFSET && read32(match) == read32(ip)) break;
+                    ip += attempts++ >> 6;
+                }
+                while (ip > anchor && match > in && ip[-1] == match[-1]) --ip, --match; // Extend backwards
+
+                while (true) {
+                    size_t matched = MIN_MATCH + common(ip + MIN_MATCH, match + MIN_MATCH, matchEnd);
+                    if (!putSequence(anchor, ip - anchor, ip - match, matched, op, end)) return 0;
+                    ip += matched;
+                    anchor = ip;
+                    if (ip > last) goto finish;
+                    table[hash(read32(ip - 2))] = uint32_t(ip - 2 - in);
+                    // Another match straight away costs no literals
+                    uint32_t& slot = table[hash(read32(ip))];
+                    match = in + slot;
+                    slot = uint32_t(ip - in);
+                    if (!(match < ip && size_t(ip - match) <= MAX_OFFSET && read32(match) == read32(ip))) break;
+                }
+                ++ip;
+            }
+        }
+    finish:
+        if (!putSequence(anchor, in + length - anchor, 0, 0, op, end)) return 0;
+        return op - out;
+    }
+
+    // Expand an LZ4 block into at most `capacity` bytes; the decoded length, or -1 if the block
+    // is malformed or does not fit. Every offset and length is checked, so hostile input is safe.
+    static long decompress(const unsigned char* in, size_t length, unsigned char* out, size_t capacity) {
+        const unsigned char* ip = in;
+        const unsigned char* inEnd = in + length;
+        unsigned char* op = out;
+        unsigned char* outEnd = out + capacity;
+        while (ip < inEnd) {
+            unsigned token = *ip++;
+            size_t literals = token >> 4;
+            if (literals == 15) {
+                unsigned char b;
+                do {
+                    if (ip >= inEnd) return -1;
+                    b = *ip++;
+                    literals += b;
+                } while (b == 255);
+            }
+            if (size_t(inEnd - ip) < literals || size_t(outEnd - op) < literals) return -1;
+            if (size_t(inEnd - ip) >= literals + 8 && size_t(outEnd - op) >= literals + 8) wildCopy(op, ip, literals);
+            else memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+            if (ip == inEnd) break; // The final sequence has no match
+
+            if (inEnd - ip < 2) return -1;
+            size_t offset = ip[0] | size_t(ip[1]) << 8;
+            ip += 2;
+            if (offset == 0 || offset > size_t(op - out)) return -1;
+            size_t matchLength = token & 15;
+            if (matchLength == 15) {
+                unsigned char b;
+                do {
+                    if (ip >= inEnd) return -1;
+                    b = *ip++;
+                    matchLength += b;
+                } while (b == 255);
+            }
+            matchLength += MIN_MATCH;
+            if (size_t(outEnd - op) < matchLength) return -1;
+            const unsigned char* from = op - offset;
+            if (offset >= 8 && size_t(outEnd - op) >= matchLength + 8) {
+                wildCopy(op, from, matchLength);
+                op += matchLength;
+            } else if (offset >= matchLength) {
+                memcpy(op, from, matchLength);
+                op += matchLength;
+            } else {
+                while (matchLength--) *op++ = *from++; // Overlapping copy repeats the pattern
+            }
+        }
+        return op - out;
+    }
+};
+
+// Per-direction policy deciding whether a payload is worth compressing. Small payloads never
+// are; a payload must save at least an eighth of its size to go out compressed. After several
+// misses in a row (already-compressed files, random bytes) attempts are suspended for a
+// doubling number of messages, so a session carrying incompressible data stops paying for it.
+class CompressionPolicy {
+private:
+    uint32_t misses;     // Consecutive payloads that did not shrink enough
+    uint32_t skip;       // Payloads left to send without trying
+    uint32_t backoff;    // Length of the next suspension
+
+public:
+    static const uint32_t MISS_LIMIT = 8;
+    static const uint32_t MAX_BACKOFF = 1024;
+
+    CompressionPolicy() : misses(0), skip(0), backoff(16) {}
+
+    // Compress `length` bytes into `out` (at least `length` bytes) if it pays; the compressed
+    // length, or 0 to send the payload as it is
+    size_t apply(Lz4& lz4, const unsigned char* in, size_t length, unsigned char* out) {
+        if (length < COMPRESS_MIN_BYTES) return 0;
+        if (skip) {
+            --skip;
+            return 0;
+        }
+        size_t packed = lz4.compress(in, length, out, length - length / 8);
+        if (packed) {
+            misses = 0;
+            backoff = 16;
+        } else if (++misses >= MISS_LIMIT) {
+            misses = 0;
+            skip = backoff;
+            if (backoff < MAX_BACKOFF) backoff *= 2;
+        }
+        return packed;
+    }
+};
+
+#endif // COMPRESSION_H
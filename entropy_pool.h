@@ -0,0 +1,342 @@
+#ifndef ENTROPY_POOL_H
+#define ENTROPY_POOL_H
+
+#include <atomic>             // For counters shared with the background threads
+#include <chrono>             // For the capture interval and timing jitter
+#include <condition_variable> // For waking and stopping the background threads
+#include <cstdint>            // For fixed-width integer types
+#include <cstring>            // For memcpy()
+#include <mutex>              // For the pool lock
+#include <random>             // For std::random_device (initial seed)
+#include <string>             // For frame paths and hex keys
+#include <thread>             // For the capture and hashing threads
+#include <vector>             // For the list of frame sources
+#include <unistd.h>           // For access()
+#include "frame_queue.h"      // For the capture -> hashing hand-off
+#include "image_processor.h"  // For extracting entropy from captured frames
+#include "logger.h"           // For warning when frame entropy runs low
+
+// ChaCha20 block function (RFC 8439): 64 bytes of keystream for (key, counter, nonce)
+inline void chacha20Block(const uint32_t key[8], uint64_t counter, uint32_t nonce, uint32_t out[16]) {
+    uint32_t x[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                      key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+                      uint32_t(counter), uint32_t(counter >> 32), nonce, 0};
+    uint32_t input[16];
+    memcpy(input, x, sizeof(x));
+
+    auto rotl = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    auto quarter = [&](int a, int b, int c, int d) {
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+    };
+    for (int round = 0; round < 10; ++round) { // 20 rounds: 10 column + 10 diagonal
+        quarter(0, 4, 8, 12); quarter(1, 5, 9, 13); quarter(2, 6, 10, 14); quarter(3, 7, 11, 15);
+        quarter(0, 5, 10, 15); quarter(1, 6, 11, 12); quarter(2, 7, 8, 13); quarter(3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; ++i) {
+        out[i] = x[i] + input[i];
+    }
+}
+
+// Snapshot of the pool's counters
+struct EntropyStats {
+    uint64_t framesQueued;     // Frames handed to the hashing thread
+    uint64_t framesFolded;     // Frames hashed and mixed into the pool
+    uint64_t framesUnchanged;  // Frames skipped because nothing in them had changed
+    uint64_t tilesSeen;        // Pixel tiles compared with the previous frame
+    uint64_t tilesChanged;     // ...of which changed and were folded in
+    uint64_t entropyBits;      // Estimated entropy credited by all folded frames
+    uint64_t recentBits;       // ...over the last complete LOW_WINDOW
+    bool entropyLow;           // The last window credited less than LOW_BITS
+    uint64_t framesDropped;    // Frames lost because the hashing thread fell behind
+    uint64_t framesUnreadable; // Frames that vanished before they could be hashed
+    uint64_t reseeds;          // Times new entropy changed the pool key
+    uint64_t threadRekeys;     // Times a thread's DRBG pulled a fresh key from the pool
+    uint64_t keysIssued;       // Session keys handed out
+    uint64_t bytesGenerated;   // DRBG output produced by all threads
+};
+
+// Background entropy service. A capture thread queues the configured frames (lava lamp
+// captures from open.py) on a FrameQueue; a hashing thread folds each frame's hash and
+// timing jitter into a 256-bit pool key. Frames go through FrameEntropy, so a file that has
+// not been rewritten is not read and only changed tiles of a raw frame are folded; each
+// window's estimated entropy is checked so a stalled or static camera gets noticed. Key
+// material comes from per-thread ChaCha20 DRBGs that are keyed from the pool, so serving a
+// session key never touches the disk or takes a lock. Every reseed bumps a generation
+// counter that makes each thread rekey on its next request.
+class EntropyPool {
+private:
+    static const size_t DRBG_BUFFER = 1024;          // Output buffered per thread (16 ChaCha20 blocks)
+    static const uint64_t REKEY_BYTES = 1 << 20;     // Thread output allowed between pool rekeys
+
+public:
+    static constexpr std::chrono::seconds LOW_WINDOW{10}; // Period over which fresh entropy is judged
+    static const uint64_t LOW_BITS = 256;             // Less than a pool key's worth per window is "low"
+    static const uint64_t FOLD_BITS = 64;             // Most one frame credits (its digest is 64 bits)
+
+private:
+
+    // Per-thread generator: ChaCha20 with fast key erasure (the first 32 bytes of every
+    // refill become the next key and are never output)
+    struct ThreadDrbg {
+        const EntropyPool* owner = nullptr;   // Pool that keyed this generator
+        uint64_t generation = 0;              // Pool generation the key was derived from
+        uint32_t key[8];                      // Current ChaCha20 key
+        uint64_t bytesSinceRekey = 0;         // Output since the key came from the pool
+        uint64_t counter = 0;                 // Block counter under the current key
+        unsigned char buffer[DRBG_BUFFER];    // Unused output
+        size_t available = 0;                 // Bytes left at the end of buffer
+    };
+
+    mutable std::mutex poolMutex;             // Guards poolKey, mixCounter and forkCounter
+    uint32_t poolKey[8];                      // Accumulated entropy; only derived from, never output
+    uint64_t mixCounter;                      // Blocks used to stir new input into the pool
+    uint64_t forkCounter;                     // Child keys handed to threads
+    std::atomic<uint64_t> generation;         // Incremented on every reseed
+
+    FrameQueue frames;                        // Capture -> hashing hand-off
+    FrameEntropy extractor;                   // Used by the hashing thread only
+    std::vector<std::string> framePaths;      // Frame files re-captured every interval
+    std::chrono::milliseconds interval;       // Capture period
+    bool running;                             // Guarded by wakeMutex
+    std::mutex wakeMutex;                     // Protects running for the condition variable
+    std::condition_variable wake;             // Signals new frames or shutdown
+    std::thread captureThread;                // Queues frames every interval
+    std::thread hashThread;                   // Hashes queued frames into the pool
+
+    std::atomic<uint64_t> framesQueued, framesFolded, framesUnreadable, framesUnchanged;
+    std::atomic<uint64_t> tilesSeen, tilesChanged, entropyBits, recentBits;
+    std::atomic<bool> entropyLow;
+    std::atomic<uint64_t> threadRekeys, keysIssued, bytesGenerated;
+
+    static ThreadDrbg& localDrbg() {
+        static thread_local ThreadDrbg drbg;
+        return drbg;
+    }
+
+    // Stir input into the pool key (caller holds poolMutex)
+    void mix(const void* data, size_t length) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        uint32_t block[16];
+        size_t offset = 0;
+        do { // Absorb 32 bytes at a time (at least once, so empty input still stirs)
+            uint32_t words[8] = {0};
+            memcpy(words, bytes + offset, std::min<size_t>(32, length - offset));
+            for (int i = 0; i < 8; ++i) {
+                poolKey[i] ^= words[i];
+            }
+            chacha20Block(poolKey, ++mixCounter, 0x6d6978 /* "mix" */, block);
+            memcpy(poolKey, block, sizeof(poolKey)); // One-way step: the old key can't be recovered
+            offset += 32;
+        } while (offset < length);
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Refill the calling thread's buffer, rekeying from the pool when it has changed
+    void refill(ThreadDrbg& drbg) {
+        uint64_t current = generation.load(std::memory_order_acquire);
+        if (drbg.owner != this || drbg.generation != current || drbg.bytesSinceRekey >= REKEY_BYTES) {
+            uint32_t block[16];
+            {
+                std::lock_guard<std::mutex> lock(poolMutex);
+                chacha20Block(poolKey, ++forkCounter, 0x666f726b /* "fork" */, block);
+                current = generation.load(std::memory_order_relaxed);
+            }
+            memcpy(drbg.key, block, sizeof(drbg.key));
+            drbg.owner = this;
+            drbg.generation = current;
+            drbg.bytesSinceRekey = 0;
+            drbg.counter = 0;
+            threadRekeys.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint32_t block[16];
+        for (size_t offset = 0; offset < DRBG_BUFFER; offset += 64) {
+            chacha20Block(drbg.key, drbg.counter++, 0, block);
+            memcpy(drbg.buffer + offset, block, 64);
+        }
+        memcpy(drbg.key, drbg.buffer, sizeof(drbg.key)); // Fast key erasure
+        drbg.counter = 0;
+        drbg.available = DRBG_BUFFER - sizeof(drbg.key);
+        drbg.bytesSinceRekey += drbg.available;
+        bytesGenerated.fetch_add(drbg.available, std::memory_order_relaxed);
+    }
+
+    void captureLoop() { // Queue every readable frame source once per interval
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        while (running) {
+            lock.unlock();
+            for (const std::string& path : framePaths) {
+                if (access(path.c_str(), R_OK) == 0) { // Skip sources open.py hasn't written yet
+                    frames.push(Frame(path));
+                    framesQueued.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            wake.notify_all();
+            lock.lock();
+            wake.wait_for(lock, interval, [this] { return !running; });
+        }
+    }
+
+    // Close a window of LOW_WINDOW: warn when it credited too little, and again on recovery
+    void judgeWindow(uint64_t bits) {
+        recentBits.store(bits, std::memory_order_relaxed);
+        bool low = bits < LOW_BITS;
+        if (low == entropyLow.exchange(low, std::memory_order_relaxed)) return;
+        if (low) {
+            LOG_WARN("Entropy running low: ", bits, " bits from frames in the last ", LOW_WINDOW.count(),
+                     " s (sources missing or unchanged)");
+        } else {
+            LOG_INFO("Entropy recovered: ", bits, " bits from frames in the last ", LOW_WINDOW.count(), " s");
+        }
+    }
+
+    void hashLoop() { // Fold changed frames into the pool
+        auto windowStart = std::chrono::steady_clock::now();
+        double windowBits = 0;
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        while (running) {
+            lock.unlock();
+            Frame frame;
+            while (frames.tryPop(frame)) {
+                auto start = std::chrono::steady_clock::now();
+                FrameSample sample;
+                if (!extractor.extract(frame.path, sample)) {
+                    framesUnreadable.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                tilesSeen.fetch_add(sample.tiles, std::memory_order_relaxed);
+                if (!sample.changed) {
+                    framesUnchanged.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                auto finish = std::chrono::steady_clock::now();
+                tilesChanged.fetch_add(sample.tilesChanged, std::memory_order_relaxed);
+                double credit = std::min(sample.bits, double(FOLD_BITS)); // Never more than the digest holds
+                entropyBits.fetch_add(uint64_t(credit), std::memory_order_relaxed);
+                windowBits += credit;
+                uint64_t material[5] = { // Frame content plus capture/hash timing jitter
+                    sample.digest,
+                    uint64_t(start.time_since_epoch().count()),
+                    uint64_t((finish - start).count()),
+                    framesFolded.fetch_add(1, std::memory_order_relaxed),
+                    uint64_t(sample.bits),
+                };
+                std::lock_guard<std::mutex> poolLock(poolMutex);
+                mix(material, sizeof(material));
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - windowStart >= LOW_WINDOW) {
+                judgeWindow(uint64_t(windowBits));
+                windowStart = now;
+                windowBits = 0;
+            }
+            lock.lock();
+            wake.wait_for(lock, interval, [this] { return !running || !frames.empty(); });
+        }
+    }
+
+public:
+    EntropyPool() : mixCounter(0), forkCounter(0), generation(0), interval(1000), running(false),
+                    framesQueued(0), framesFolded(0), framesUnreadable(0), framesUnchanged(0),
+                    tilesSeen(0), tilesChanged(0), entropyBits(0), recentBits(0), entropyLow(false),
+                    threadRekeys(0), keysIssued(0), bytesGenerated(0) {
+        // Start from OS randomness so keys are unpredictable before the first frame arrives
+        std::random_device device;
+        uint32_t seed[10];
+        for (int i = 0; i < 8; ++i) {
+            seed[i] = device();
+        }
+        uint64_t now = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        memcpy(seed + 8, &now, sizeof(now));
+        memset(poolKey, 0, sizeof(poolKey));
+        mix(seed, sizeof(seed));
+    }
+
+    ~EntropyPool() { stop(); }
+
+    EntropyPool(const EntropyPool&) = delete;
+    EntropyPool& operator=(const EntropyPool&) = delete;
+
+    // Start capturing `paths` every `every` and folding them into the pool
+    void start(const std::vector<std::string>& paths, std::chrono::milliseconds every) {
+        stop();
+        framePaths = paths;
+        interval = every;
+        running = true;
+        captureThread = std::thread(&EntropyPool::captureLoop, this);
+        hashThread = std::thread(&EntropyPool::hashLoop, this);
+    }
+
+    void stop() { // Stop and join the background threads
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            running = false;
+        }
+        wake.notify_all();
+        if (captureThread.joinable()) captureThread.join();
+        if (hashThread.joinable()) hashThread.join();
+    }
+
+    // Mix caller-supplied entropy into the pool and reseed every thread
+    void addEntropy(const void* data, size_t length) {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        mix(data, length);
+    }
+
+    // Fill `out` with random bytes from the calling thread's DRBG
+    void generate(unsigned char* out, size_t length) {
+        ThreadDrbg& drbg = localDrbg();
+        while (length > 0) {
+            if (drbg.available == 0 || drbg.owner != this ||
+                drbg.generation != generation.load(std::memory_order_acquire)) {
+                refill(drbg);
+            }
+            size_t n = std::min(length, drbg.available);
+            unsigned char* source = drbg.buffer + DRBG_BUFFER - drbg.available;
+            memcpy(out, source, n);
+            memset(source, 0, n); // Served bytes don't linger in memory
+            drbg.available -= n;
+            out += n;
+            length -= n;
+        }
+    }
+
+    // A fresh session key: `bytes` random bytes as lowercase hex
+    std::string sessionKey(size_t bytes = 16) {
+        static const char HEX[] = "0123456789abcdef";
+        unsigned char raw[64];
+        bytes = std::min(bytes, sizeof(raw));
+        generate(raw, bytes);
+        std::string key(bytes * 2, '0');
+        for (size_t i = 0; i < bytes; ++i) {
+            key[2 * i] = HEX[raw[i] >> 4];
+            key[2 * i + 1] = HEX[raw[i] & 15];
+        }
+        keysIssued.fetch_add(1, std::memory_order_relaxed);
+        return key;
+    }
+
+    EntropyStats stats() const { // Counters since construction
+        EntropyStats s;
+        s.framesQueued = framesQueued.load(std::memory_order_relaxed);
+        s.framesFolded = framesFolded.load(std::memory_order_relaxed);
+        s.framesDropped = frames.dropped();
+        s.framesUnreadable = framesUnreadable.load(std::memory_order_relaxed);
+        s.framesUnchanged = framesUnchanged.load(std::memory_order_relaxed);
+        s.tilesSeen = tilesSeen.load(std::memory_order_relaxed);
+        s.tilesChanged = tilesChanged.load(std::memory_order_relaxed);
+        s.entropyBits = entropyBits.load(std::memory_order_relaxed);
+        s.recentBits = recentBits.load(std::memory_order_relaxed);
+        s.entropyLow = entropyLow.load(std::memory_order_relaxed);
+        s.reseeds = generation.load(std::memory_order_relaxed);
+        s.threadRekeys = threadRekeys.load(std::memory_order_relaxed);
+        s.keysIssued = keysIssued.load(std::memory_order_relaxed);
+        s.bytesGenerated = bytesGenerated.load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+#endif // ENTROPY_POOL_H
@@ -0,0 +1,507 @@
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <algorithm>      // For std::min
+#include <chrono>         // For transfer timing
+#include <cerrno>         // For EAGAIN/EINTR
+#include <cstdint>        // For fixed-width integer types
+#include <cstdio>         // For rename()
+#include <cstring>        // For strerror()
+#include <string>         // For names, paths and errors
+#include <arpa/inet.h>    // For sockaddr_in and inet_addr()
+#include <fcntl.h>        // For open(), posix_fadvise() and sync_file_range()
+#include <netinet/tcp.h>  // For TCP_NODELAY
+#include <poll.h>         // For waiting on the socket
+#include <sys/mman.h>     // For mapping the file being sent
+#include <sys/socket.h>   // For socket functions
+#include <sys/stat.h>     // For fstat()
+#include <unistd.h>       // For pread()/pwrite()/close()
+#include "framing.h"      // For frames and pooled I/O buffers
+#include "rc4.h"          // For the session cipher
+
+// Streaming file transfer. A file of any size moves as MSG_FILE_CHUNK frames of at most
+// FILE_CHUNK_BYTES, encrypted with the session cipher like every other payload. The receiver
+// acknowledges with MSG_FILE_ACK as it stores bytes, and the sender keeps at most `window`
+// unacknowledged bytes in flight, so neither end ever holds more than a window regardless of
+// the file's size. The frames' sequence number is the transfer id the client chose.
+//
+// Uploads are written to NAME.part and renamed to NAME once complete; a download is written
+// to PATH.part on the client the same way. Opening a transfer again picks up where the .part
+// file ends, so an interrupted transfer resumes from the last chunk that was stored. The server
+// answers a resumed upload with an offset one chunk short of the end of its .part and compares
+// those resent bytes with what it stored, so a .part only ever grows with the file it started
+// with. An upload never replaces an existing NAME unless its mode is FILE_UPLOAD_REPLACE.
+//
+// MSG_FILE_OPEN request: | mode (1) | size (8) | offset (8) | window (4) | name |
+//   upload: size is the file's; download: offset is where the client's copy ends and window
+//   how far ahead of its acknowledgements the server may send
+// MSG_FILE_OPEN reply:   | status (1) | size (8) | offset (8) | window (4) |
+//   the offset the transfer starts from, and for an upload the window the server allows
+
+const size_t FILE_CHUNK_BYTES = 32 * 1024 - 64;    // File bytes per chunk (two chunk frames fit in one pool block)
+const uint32_t FILE_WINDOW = 4 << 20;              // Default bytes in flight ahead of acknowledgements
+const uint32_t FILE_MAX_WINDOW = 64 << 20;         // Largest window a downloading client may ask for
+const uint64_t FILE_FLUSH_BYTES = 8 << 20;         // Writeback granularity of a receiving end (see WriteBehind)
+const size_t FILE_OPEN_HEADER = 21;                // Fixed part of a MSG_FILE_OPEN request
+const size_t FILE_REPLY_BYTES = 21;                // MSG_FILE_OPEN reply
+const size_t FILE_OFFSET_BYTES = 8;                // Offset in front of a chunk's bytes; a MSG_FILE_ACK payload
+const size_t MAX_FILE_NAME = 255;
+
+enum FileMode : uint8_t { FILE_UPLOAD = 0, FILE_DOWNLOAD = 1, FILE_UPLOAD_REPLACE = 2 };
+
+enum FileStatus : uint8_t {
+    FILE_OK = 0,
+    FILE_DISABLED = 1,   // The server keeps no files (no --file-dir)
+    FILE_BAD_NAME = 2,   // Not a plain file name
+    FILE_NOT_FOUND = 3,  // Download of a file the server does not have
+    FILE_BUSY = 4,       // Same name being uploaded elsewhere, transfer id in use, or too many transfers
+    FILE_IO_ERROR = 5,   // The server could not open, read or write the file
+    FILE_EXISTS = 6,     // Upload of a name the server already has (FILE_UPLOAD_REPLACE overwrites it)
+};
+
+inline const char* fileStatusText(uint8_t status) {
+    switch (status) {
+        case FILE_OK: return "ok";
+        case FILE_DISABLED: return "file transfers are disabled on the server";
+        case FILE_BAD_NAME: return "invalid file name";
+        case FILE_NOT_FOUND: return "no such file on the server";
+        case FILE_BUSY: return "file is busy";
+        case FILE_EXISTS: return "file already exists on the server";
+        default: return "server I/O error";
+    }
+}
+
+// File names are single path components: no separators, nothing hidden, no ".part" suffix
+inline bool validFileName(const std::string& name) {
+    if (name.empty() || name.size() > MAX_FILE_NAME || name[0] == '.') return false;
+    if (name.size() >= 5 && name.compare(name.size() - 5, 5, ".part") == 0) return false;
+    for (char c : name) {
+        if (c == '/' || c == '\0') return false;
+    }
+    return true;
+}
+
+// Big-endian fields of the file frames
+inline void putFileField(unsigned char* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) p[i] = uint8_t(value >> (8 * (bytes - 1 - i)));
+}
+
+inline uint64_t fileField(const unsigned char* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value = value << 8 | p[i];
+    return value;
+}
+
+// Both MSG_FILE_OPEN layouts: | mode or status (1) | size (8) | offset (8) | window (4) | name (request only) |
+struct FileOpen {
+    uint8_t code = 0;     // FileMode in a request, FileStatus in a reply
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    uint32_t window = 0;
+    std::string name;
+
+    std::string encode() const {
+        std::string payload(FILE_OPEN_HEADER, '\0');
+        unsigned char* p = reinterpret_cast<unsigned char*>(&payload[0]);
+        p[0] = code;
+        putFileField(p + 1, size, 8);
+        putFileField(p + 9, offset, 8);
+        putFileField(p + 17, window, 4);
+        return payload + name;
+    }
+
+    bool decode(const unsigned char* p, size_t length) {
+        if (length < FILE_OPEN_HEADER) return false;
+        code = p[0];
+        size = fileField(p + 1, 8);
+        offset = fileField(p + 9, 8);
+        window = uint32_t(fileField(p + 17, 4));
+        name.assign(reinterpret_cast<const char*>(p + FILE_OPEN_HEADER), length - FILE_OPEN_HEADER);
+        return true;
+    }
+};
+
+// Keeps what a sequential writer leaves in the page cache bounded. Every FILE_FLUSH_BYTES
+// written starts writeback of that range; the range before it, whose writeback has had a
+// whole range's time to finish, is waited for and dropped from the cache. A disk slower than
+// the network therefore stalls the writer here, and the sender in turn through the window.
+struct WriteBehind {
+    uint64_t started = 0; // Writeback started for the bytes before this offset
+
+    void resume(uint64_t offset) { started = offset - offset % FILE_FLUSH_BYTES; }
+
+    void wrote(int fd, uint64_t end) {
+        while (end - started >= FILE_FLUSH_BYTES) {
+            sync_file_range(fd, started, FILE_FLUSH_BYTES, SYNC_FILE_RANGE_WRITE);
+            if (started >= FILE_FLUSH_BYTES) {
+                uint64_t previous = started - FILE_FLUSH_BYTES;
+                sync_file_range(fd, previous, FILE_FLUSH_BYTES,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd, previous, FILE_FLUSH_BYTES, POSIX_FADV_DONTNEED);
+            }
+            started += FILE_FLUSH_BYTES;
+        }
+    }
+};
+
+// Write all of `length` bytes at `offset`; false on an error
+inline bool pwriteAll(int fd, const unsigned char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Read exactly `length` bytes at `offset`; false on an error or a file that shrank
+inline bool preadAll(int fd, unsigned char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, data, length, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// One file transfer over its own session with the server (client2 --send/--get, bench).
+// The file being sent is mapped and encrypted from the mapping straight into the outbox; a
+// file being received is decrypted where the chunk landed in the receive block and written
+// from there with pwrite().
+class FileTransferClient {
+public:
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 8080;
+        uint32_t window = FILE_WINDOW; // Download: bytes the server may send ahead of our acknowledgements
+        uint64_t stopAfter = 0;        // Hang up after moving this many bytes, as if interrupted (0 = never)
+        bool replace = false;          // Upload: overwrite the server's copy of the name if it has one
+        int timeoutMs = 10000;         // Give up when the server is silent this long
+    };
+
+    struct Result {
+        bool complete = false;         // The whole file is stored at the receiving end
+        std::string error;             // Why not, if not
+        uint64_t size = 0;             // File size
+        uint64_t resumedAt = 0;        // Offset this run started from
+        uint64_t bytes = 0;            // File bytes moved by this run
+        double seconds = 0;            // Time from the server's reply to the end
+        uint64_t rekeys = 0;           // Server key rotations followed
+    };
+
+private:
+    static const uint32_t TRANSFER_ID = 1; // One transfer per session
+
+    Options options;
+    BufferPool pool;
+    FrameReader reader;
+    OutputBuffer outbox;
+    CipherContext cipher;          // Current keystreams
+    CipherContext nextCipher;      // Keystreams waiting for the REKEY_ACK to be queued
+    bool ackPending = false;       // Rotation accepted on receive, send side not switched yet
+    int fd = -1;
+    uint64_t rekeys = 0;
+
+    bool fail(Result& result, const std::string& error) {
+        result.error = error;
+        return false;
+    }
+
+    // Blocking connect and key exchange, then non-blocking for the transfer itself
+    bool connectServer(Result& result) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return fail(result, strerror(errno));
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        server.sin_addr.s_addr = inet_addr(options.host.c_str());
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Acknowledgements must not wait for Nagle
+        FrameHeader header;
+        unsigned char* payload;
+        if (connect(fd, (sockaddr*)&server, sizeof(server)) < 0 || !recvFrame(fd, reader, header, payload) ||
+            header.type != MSG_KEY) {
+            return fail(result, std::string("could not connect: ") + strerror(errno));
+        }
+        cipher.init(std::string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+        reader.consume(header);
+        return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0 || fail(result, strerror(errno));
+    }
+
+    // Queue the REKEY_ACK; later frames are encrypted under the new key
+    bool queueAck() {
+        if (!outbox.beginFrame(MSG_REKEY_ACK, 0, 0)) return false; // Outbox full: retried before the next frame
+        outbox.commitFrame(0);
+        cipher.adoptTx(nextCipher);
+        ackPending = false;
+        return true;
+    }
+
+    // Encrypt a small control payload into the outbox; false if the outbox is full
+    bool queue(uint8_t type, const void* plain, size_t length) {
+        if (ackPending && !queueAck()) return false;
+        unsigned char* out = outbox.beginFrame(type, TRANSFER_ID, length);
+        if (!out) return false;
+        cipher.encrypt(static_cast<const unsigned char*>(plain), out, length);
+        outbox.commitFrame(length);
+        return true;
+    }
+
+    // Write as much of the outbox as the socket takes; false on a dead connection
+    bool flush() {
+        while (!outbox.empty()) {
+            ssize_t sent = send(fd, outbox.data(), outbox.size(), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            outbox.consume(sent);
+        }
+        return true;
+    }
+
+    // Wait until the socket is readable (or writable while bytes are queued), then send and
+    // read what it allows; false on a dead connection or a silent server. With `block` false
+    // only what is already there is taken.
+    bool wait(Result& result, bool block = true) {
+        pollfd p = {fd, short(POLLIN | (outbox.empty() ? 0 : POLLOUT)), 0};
+        int ready = poll(&p, 1, block ? options.timeoutMs : 0);
+        if (ready == 0 && block) return fail(result, "timed out");
+        if (ready < 0 && errno != EINTR) return fail(result, strerror(errno));
+        if (!flush()) return fail(result, "connection lost");
+        while (true) {
+            size_t available;
+            unsigned char* space = reader.writeSpace(available);
+            if (available == 0) return true; // A whole block is buffered; handle it first
+            ssize_t received = recv(fd, space, available, 0);
+            if (received > 0) {
+                reader.commit(received);
+                continue;
+            }
+            if (received < 0 && errno == EINTR) continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            return fail(result, "connection closed by the server");
+        }
+    }
+
+    // Next buffered frame other than a key rotation (followed here); 0 if none is complete yet
+    int next(FrameHeader& header, unsigned char*& payload, Result& result) {
+        while (true) {
+            int status = reader.peek(header, payload);
+            if (status <= 0) {
+                if (status < 0) fail(result, "malformed frame from the server");
+                return status;
+            }
+            if (header.type != MSG_REKEY) return 1;
+            cipher.decrypt(payload, header.length);
+            nextCipher.init(std::string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+            cipher.adoptRx(nextCipher);
+            ackPending = true;
+            queueAck();
+            ++rekeys;
+            reader.consume(header);
+        }
+    }
+
+    // Send the MSG_FILE_OPEN request and wait for the reply
+    bool open(const FileOpen& request, FileOpen& reply, Result& result) {
+        std::string payload = request.encode();
+        if (!queue(MSG_FILE_OPEN, payload.data(), payload.size())) return fail(result, "request too large");
+        while (true) {
+            FrameHeader header;
+            unsigned char* data;
+            int status;
+            while ((status = next(header, data, result)) > 0) {
+                bool isReply = header.type == MSG_FILE_OPEN;
+                cipher.decrypt(data, header.length); // Every payload advances the keystream
+                if (isReply && !reply.decode(data, header.length)) return fail(result, "malformed reply");
+                reader.consume(header);
+                if (!isReply) continue;
+                if (reply.code != FILE_OK) return fail(result, fileStatusText(reply.code));
+                return true;
+            }
+            if (status < 0 || !wait(result)) return false;
+        }
+    }
+
+    void hangUp() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    static double secondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+public:
+    explicit FileTransferClient(const Options& o) : options(o), pool(FRAME_BLOCK_SIZE, 2), reader(pool), outbox(pool) {}
+    ~FileTransferClient() { hangUp(); }
+
+    FileTransferClient(const FileTransferClient&) = delete;
+    FileTransferClient& operator=(const FileTransferClient&) = delete;
+
+    // Send the file at `path` to the server as `name`, resuming a partial upload
+    Result upload(const std::string& path, const std::string& name) {
+        Result result;
+        int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (file < 0 || fstat(file, &st) < 0) {
+            fail(result, path + ": " + strerror(errno));
+            if (file >= 0) close(file);
+            return result;
+        }
+        result.size = st.st_size;
+        const unsigned char* map = nullptr;
+        if (result.size > 0) {
+            void* m = mmap(nullptr, result.size, PROT_READ, MAP_SHARED, file, 0);
+            if (m == MAP_FAILED) {
+                fail(result, path + ": " + strerror(errno));
+                close(file);
+                return result;
+            }
+            madvise(m, result.size, MADV_SEQUENTIAL); // Read ahead aggressively, drop behind
+            map = static_cast<const unsigned char*>(m);
+        }
+        close(file); // The mapping keeps the file
+
+        FileOpen request, reply;
+        request.code = options.replace ? FILE_UPLOAD_REPLACE : FILE_UPLOAD;
+        request.size = result.size;
+        request.name = name;
+        if (connectServer(result) && open(request, reply, result)) {
+            result.resumedAt = std::min(reply.offset, result.size);
+            uint64_t sent = result.resumedAt, acked = sent;
+            uint64_t window = std::max<uint64_t>(reply.window, FILE_CHUNK_BYTES);
+            auto start = std::chrono::steady_clock::now();
+            while (acked < result.size) {
+                // Fill the window: encrypted from the mapping straight into the outbox
+                while (sent < result.size && sent - acked < window && (!ackPending || queueAck())) {
+                    if (options.stopAfter && sent - result.resumedAt >= options.stopAfter) break;
+                    size_t n = size_t(std::min<uint64_t>(FILE_CHUNK_BYTES, result.size - sent));
+                    unsigned char* out = outbox.beginFrame(MSG_FILE_CHUNK, TRANSFER_ID, FILE_OFFSET_BYTES + n);
+                    if (!out) break;
+                    unsigned char offset[FILE_OFFSET_BYTES];
+                    putFileField(offset, sent, 8);
+                    cipher.encrypt(offset, out, FILE_OFFSET_BYTES);
+                    cipher.encrypt(map + sent, out + FILE_OFFSET_BYTES, n);
+                    outbox.commitFrame(FILE_OFFSET_BYTES + n);
+                    sent += n;
+                }
+                if (options.stopAfter && sent - result.resumedAt >= options.stopAfter) {
+                    flush();
+                    fail(result, "interrupted");
+                    break;
+                }
+                if (!flush()) {
+                    fail(result, "connection lost");
+                    break;
+                }
+                bool windowOpen = outbox.empty() && sent < result.size && sent - acked < window;
+                if (!wait(result, !windowOpen)) break; // Keep sending while the window allows
+                FrameHeader header;
+                unsigned char* data;
+                int status;
+                while ((status = next(header, data, result)) > 0) {
+                    cipher.decrypt(data, header.length);
+                    if (header.type == MSG_FILE_ACK && header.length == FILE_OFFSET_BYTES) {
+                        if (header.flags & FLAG_FILE_ABORT) fail(result, "aborted by the server");
+                        acked = std::max(acked, fileField(data, 8));
+                    }
+                    reader.consume(header);
+                }
+                if (status < 0 || !result.error.empty()) break;
+            }
+            result.bytes = acked - result.resumedAt;
+            result.complete = acked == result.size && result.error.empty();
+            result.seconds = secondsSince(start);
+        }
+        result.rekeys = rekeys;
+        if (map) munmap(const_cast<unsigned char*>(map), result.size);
+        hangUp();
+        return result;
+    }
+
+    // Fetch `name` from the server into `path` (via path + ".part"), resuming a partial download
+    Result download(const std::string& name, const std::string& path) {
+        Result result;
+        std::string part = path + ".part";
+        int file = ::open(part.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (file < 0 || fstat(file, &st) < 0) {
+            fail(result, part + ": " + strerror(errno));
+            if (file >= 0) close(file);
+            return result;
+        }
+
+        FileOpen request, reply;
+        request.code = FILE_DOWNLOAD;
+        request.offset = st.st_size;
+        request.window = options.window;
+        request.name = name;
+        if (connectServer(result) && open(request, reply, result)) {
+            result.size = reply.size;
+            result.resumedAt = reply.offset;
+            uint64_t stored = reply.offset, acked = stored;
+            WriteBehind writeBehind;
+            writeBehind.resume(stored);
+            if (ftruncate(file, stored) < 0) fail(result, part + ": " + strerror(errno)); // Server may restart from 0
+            uint64_t ackEvery = std::max<uint64_t>(options.window / 4, FILE_CHUNK_BYTES);
+            auto start = std::chrono::steady_clock::now();
+            while (result.error.empty()) {
+                FrameHeader header;
+                unsigned char* data;
+                int status;
+                while ((status = next(header, data, result)) > 0) {
+                    cipher.decrypt(data, header.length); // In the receive block
+                    if (header.type == MSG_FILE_ACK && (header.flags & FLAG_FILE_ABORT)) {
+                        fail(result, "aborted by the server");
+                    } else if (header.type == MSG_FILE_CHUNK && header.sequence == TRANSFER_ID && result.error.empty()) {
+                        size_t n = header.length - std::min<size_t>(header.length, FILE_OFFSET_BYTES);
+                        if (header.length < FILE_OFFSET_BYTES || fileField(data, 8) != stored || n > result.size - stored) {
+                            fail(result, "chunk out of order");
+                        } else if (!pwriteAll(file, data + FILE_OFFSET_BYTES, n, stored)) {
+                            fail(result, part + ": " + strerror(errno));
+                        } else {
+                            stored += n;
+                            writeBehind.wrote(file, stored);
+                        }
+                    }
+                    reader.consume(header);
+                }
+                if (status < 0) break;
+                if (options.stopAfter && stored - result.resumedAt >= options.stopAfter && stored < result.size) {
+                    fail(result, "interrupted");
+                }
+                if (result.error.empty() && (stored - acked >= ackEvery || stored == result.size)) {
+                    unsigned char offset[FILE_OFFSET_BYTES];
+                    putFileField(offset, stored, 8);
+                    if (queue(MSG_FILE_ACK, offset, sizeof(offset))) acked = stored;
+                }
+                if (stored == result.size || !result.error.empty() || !wait(result)) break;
+            }
+            if (result.error.empty() && stored == result.size) { // Also a file that was already complete
+                if (fdatasync(file) < 0 || rename(part.c_str(), path.c_str()) < 0) {
+                    fail(result, path + ": " + strerror(errno));
+                } else {
+                    result.complete = true;
+                }
+                flush(); // The final acknowledgement lets the server close its side
+            }
+            result.bytes = stored - result.resumedAt;
+            result.seconds = secondsSince(start);
+        }
+        result.rekeys = rekeys;
+        if (!result.complete && st.st_size == 0 && result.bytes == 0) unlink(part.c_str()); // Nothing to resume
+        close(file);
+        hangUp();
+        return result;
+    }
+};
+
+#endif // FILE_TRANSFER_H
@@ -0,0 +1,50 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <ctime>          // For generating timestamps
+#include <stdexcept>      // For runtime_error on an empty queue
+#include <string>         // For the frame path and timestamp
+#include "ring_buffer.h"  // For the lock-free slot storage
+
+// Frame structure to represent a data frame
+struct Frame {
+    std::string path;      // Path of the image file
+    std::string timestamp; // Timestamp of the frame's creation
+    Frame() {}             // Empty frame for preallocated queue slots
+    Frame(const std::string& p) : path(p), timestamp(std::to_string(time(nullptr))) {} // Constructor initializes with current time
+};
+
+// Bounded frame queue shared between a capture/ingest thread and a hashing thread.
+// Lock-free and allocation-free; when full, the oldest frame is dropped to make room.
+class FrameQueue {
+private:
+    static const size_t MAX_SIZE = 16;   // Maximum number of queued frames (power of two)
+    RingBuffer<Frame, MAX_SIZE> ring;    // Frames are moved in and out of fixed slots
+
+public:
+    void push(Frame&& frame) { // Adds a frame, removing the oldest one if the queue is full
+        ring.pushOverwrite(std::move(frame));
+    }
+
+    void push(const Frame& frame) { // Adds a copy of a frame
+        push(Frame(frame));
+    }
+
+    bool tryPop(Frame& frame) { // Removes the front frame into `frame`; false if the queue is empty
+        return ring.tryPop(frame);
+    }
+
+    Frame pop() { // Removes and returns the front frame
+        Frame frame;
+        if (!ring.tryPop(frame)) {
+            throw std::runtime_error("Queue is empty"); // Error if queue is empty
+        }
+        return frame;
+    }
+
+    bool empty() const { return ring.empty(); }                 // Checks if the queue is empty
+    size_t size() const { return ring.size(); }                 // Returns the current size of the queue
+    size_t dropped() const { return ring.droppedCount(); }      // Frames discarded because the queue was full
+};
+
+#endif // FRAME_QUEUE_H
@@ -0,0 +1,377 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()/memmove()
+#include <cerrno>         // For errno values (EINTR)
+#include <memory>         // For unique_ptr owning the slabs
+#include <string>         // For room payloads
+#include <utility>        // For std::swap
+#include <vector>         // For the list of allocated slabs
+#include <sys/socket.h>   // For send()/recv()/sendmsg()
+#include <sys/uio.h>      // For iovec scatter/gather writes
+#include "websocket.h"    // For wrapping frames for WebSocket clients
+
+// Wire format: every message is a fixed header followed by `length` payload bytes.
+//
+//   | length (4) | type (1) | flags (1) | reserved (2) | sequence (4) |   (big-endian)
+//
+// The header travels in the clear; only the payload is encrypted. A FLAG_COMPRESSED frame
+// uses the reserved field for its decompressed length minus one.
+const size_t FRAME_HEADER_SIZE = 12;                                  // Bytes in an encoded header
+const size_t MAX_FRAME_PAYLOAD = 64 * 1024;                           // Largest payload a peer may send
+const size_t TRANSPORT_HEADROOM = 16;                                 // Room for a WebSocket header in front of a frame
+const size_t FRAME_BLOCK_SIZE = FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD + TRANSPORT_HEADROOM; // Pool block that always fits one frame
+
+// Message types carried in the header
+enum MessageType : uint8_t {
+    MSG_KEY = 1,   // Server -> client: session key (payload in the clear)
+    MSG_DATA = 2,  // Encrypted chat message
+    MSG_REKEY = 3, // Server -> client: next session key; later server frames use it
+    MSG_REKEY_ACK = 4, // Client -> server: later client frames use the next key (empty payload)
+    MSG_JOIN = 5,  // Client -> server: join the room named by the payload; echoed back once joined
+    MSG_LEAVE = 6, // Client -> server: leave the room named by the payload; echoed back
+    MSG_ROOM = 7,  // Room message (see roomPayload()); the server relays it to every other member
+    MSG_HISTORY = 8, // Client -> server: replay a room's logged messages, or the session's own (see historyRequest());
+                     // server -> client: end of a replay, | count (4) | next since (8) | name |
+    MSG_FILE_OPEN = 9,   // Start or resume a file transfer; answered with the same type (see file_transfer.h)
+    MSG_FILE_CHUNK = 10, // | offset (8) | file bytes |, either direction; the sequence is the transfer id
+    MSG_FILE_ACK = 11,   // | offset (8) |: the receiver has stored every byte of the file before offset
+    MSG_FEATURES = 12,   // Client -> server: | feature bits (4) | requested; answered with the bits accepted
+    MSG_RESUME = 13,     // Resume an earlier session with its ticket, and the answer (in the clear; see resumption.h)
+    MSG_TICKET = 14,     // Server -> client: a ticket for resuming this session later (see resumption.h)
+};
+
+// Frame flag bits
+const uint8_t FLAG_HISTORY = 1; // MSG_ROOM or MSG_DATA replayed from the message log rather than relayed live
+const uint8_t FLAG_FILE_ABORT = 2; // MSG_FILE_ACK: the transfer failed and is closed
+const uint8_t FLAG_COMPRESSED = 4; // MSG_DATA/MSG_ROOM: the payload is an LZ4 block (see compression.h)
+
+// A MSG_ROOM payload names its room: | name length (1) | name | text |
+const size_t MAX_ROOM_NAME = 255;
+
+inline std::string roomPayload(const std::string& room, const void* text, size_t length) {
+    std::string payload(1, char(room.size()));
+    payload += room;
+    payload.append(static_cast<const char*>(text), length);
+    return payload;
+}
+
+// Length of the room name in a MSG_ROOM payload; false if the payload is too short to hold it
+inline bool roomNameLength(const unsigned char* payload, size_t length, size_t& nameLength) {
+    if (length == 0 || payload[0] == 0 || length < 1 + size_t(payload[0])) return false;
+    nameLength = payload[0];
+    return true;
+}
+
+// A MSG_HISTORY request: | since (8, nanoseconds since the epoch) | limit (4) | room name |. Without
+// a room name it replays the messages this session sent (kept across resumption), as MSG_DATA.
+const size_t HISTORY_HEADER = 12;
+
+inline std::string historyRequest(const std::string& room, uint64_t since, uint32_t limit) {
+    std::string payload(HISTORY_HEADER, '\0');
+    for (int i = 0; i < 8; ++i) payload[i] = char(since >> (56 - 8 * i));
+    for (int i = 0; i < 4; ++i) payload[8 + i] = char(limit >> (24 - 8 * i));
+    return payload + room;
+}
+
+// Big-endian field of a MSG_HISTORY payload
+inline uint64_t historyField(const unsigned char* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value = value << 8 | p[i];
+    return value;
+}
+
+// Decoded frame header
+struct FrameHeader {
+    uint32_t length;    // Payload length in bytes
+    uint8_t type;       // One of MessageType
+    uint8_t flags;      // Per-message option bits
+    uint32_t sequence;  // Sender-assigned message number
+    uint32_t plainLength = 0; // Payload length once decompressed (decodeHeader() sets it; only read for FLAG_COMPRESSED)
+};
+
+// Serialize a header into FRAME_HEADER_SIZE bytes
+inline void encodeHeader(const FrameHeader& h, unsigned char* out) {
+    out[0] = h.length >> 24; out[1] = h.length >> 16; out[2] = h.length >> 8; out[3] = h.length;
+    out[4] = h.type;
+    out[5] = h.flags;
+    uint32_t plain = (h.flags & FLAG_COMPRESSED) ? h.plainLength - 1 : 0;
+    out[6] = plain >> 8; out[7] = plain;
+    out[8] = h.sequence >> 24; out[9] = h.sequence >> 16; out[10] = h.sequence >> 8; out[11] = h.sequence;
+}
+
+// Parse FRAME_HEADER_SIZE bytes into a header
+inline FrameHeader decodeHeader(const unsigned char* in) {
+    FrameHeader h;
+    h.length = (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+    h.type = in[4];
+    h.flags = in[5];
+    h.sequence = (uint32_t(in[8]) << 24) | (uint32_t(in[9]) << 16) | (uint32_t(in[10]) << 8) | in[11];
+    h.plainLength = (h.flags & FLAG_COMPRESSED) ? ((uint32_t(in[6]) << 8) | in[7]) + 1 : h.length;
+    return h;
+}
+
+// A fixed-size block handed out by BufferPool; [begin, end) holds the buffered bytes
+struct PoolBuffer {
+    unsigned char* data;  // Start of the block inside its slab
+    size_t begin;         // Offset of the first unconsumed byte
+    size_t end;           // Offset one past the last written byte
+    PoolBuffer* next;     // Free-list link while the block is unused
+    unsigned slab;        // Index of the slab the block was carved from
+};
+
+// Slab allocator of equally sized, reusable I/O blocks (single-threaded; one per event loop)
+class BufferPool {
+private:
+    size_t blockSize;                                       // Bytes per block
+    size_t blocksPerSlab;                                   // Blocks carved out of each slab
+    std::vector<std::unique_ptr<unsigned char[]>> slabs;    // Backing memory, never returned to the OS
+    std::vector<std::unique_ptr<PoolBuffer[]>> descriptors; // Block descriptors, one array per slab
+    PoolBuffer* freeList;                                   // Blocks ready to be handed out
+    size_t inUse;                                           // Blocks currently acquired
+
+    void grow() { // Allocate one more slab and thread its blocks onto the free list
+        slabs.emplace_back(new unsigned char[blockSize * blocksPerSlab]); // Left uninitialized on purpose
+        descriptors.emplace_back(new PoolBuffer[blocksPerSlab]);
+        unsigned char* base = slabs.back().get();
+        PoolBuffer* descs = descriptors.back().get();
+        for (size_t i = 0; i < blocksPerSlab; ++i) {
+            descs[i].data = base + i * blockSize;
+            descs[i].slab = slabs.size() - 1;
+            descs[i].next = freeList;
+            freeList = &descs[i];
+        }
+    }
+
+public:
+    BufferPool(size_t blockBytes = FRAME_BLOCK_SIZE, size_t perSlab = 16)
+        : blockSize(blockBytes), blocksPerSlab(perSlab), freeList(nullptr), inUse(0) {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    PoolBuffer* acquire() { // Take an empty block from the pool
+        if (!freeList) grow();
+        PoolBuffer* buf = freeList;
+        freeList = buf->next;
+        buf->begin = buf->end = 0;
+        buf->next = nullptr;
+        ++inUse;
+        return buf;
+    }
+
+    void release(PoolBuffer* buf) { // Return a block to the pool
+        buf->next = freeList;
+        freeList = buf;
+        --inUse;
+    }
+
+    size_t capacity() const { return blockSize; }                             // Bytes per block
+    size_t buffersInUse() const { return inUse; }                            // Blocks held by connections
+    size_t buffersAllocated() const { return slabs.size() * blocksPerSlab; } // Blocks ever carved out
+
+    // Slabs never move or shrink, so their memory can be registered with the kernel once
+    size_t slabCount() const { return slabs.size(); }
+    size_t slabBytes() const { return blockSize * blocksPerSlab; }
+    unsigned char* slabData(size_t i) const { return slabs[i].get(); }
+};
+
+// Reassembles frames from a byte stream. Handles frames split across reads and several
+// frames arriving in one read; payloads are returned in place, without copying.
+class FrameReader {
+private:
+    BufferPool& pool;  // Pool the receive block comes from
+    PoolBuffer* buf;   // Receive block, held only while bytes are buffered
+
+public:
+    FrameReader(BufferPool& p) : pool(p), buf(nullptr) {}
+    ~FrameReader() { if (buf) pool.release(buf); }
+
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+
+    // Space for the next read; acquires a block lazily and compacts a trailing partial frame
+    unsigned char* writeSpace(size_t& available) {
+        if (!buf) buf = pool.acquire();
+        if (buf->end == pool.capacity() && buf->begin > 0) {
+            memmove(buf->data, buf->data + buf->begin, buf->end - buf->begin);
+            buf->end -= buf->begin;
+            buf->begin = 0;
+        }
+        available = pool.capacity() - buf->end;
+        return buf->data + buf->end;
+    }
+
+    void commit(size_t n) { buf->end += n; } // Record bytes written into writeSpace()
+
+    // Look at the next frame: 1 if complete, 0 if more bytes are needed, -1 if the header is invalid
+    int peek(FrameHeader& header, unsigned char*& payload) {
+        if (!buf || buf->end - buf->begin < FRAME_HEADER_SIZE) return 0;
+        header = decodeHeader(buf->data + buf->begin);
+        if (header.length > MAX_FRAME_PAYLOAD) return -1;
+        if (buf->end - buf->begin < FRAME_HEADER_SIZE + header.length) return 0;
+        payload = buf->data + buf->begin + FRAME_HEADER_SIZE;
+        return 1;
+    }
+
+    // Drop the frame returned by peek(); gives the block back once nothing is buffered
+    void consume(const FrameHeader& header) {
+        buf->begin += FRAME_HEADER_SIZE + header.length;
+        if (buf->begin == buf->end) {
+            pool.release(buf);
+            buf = nullptr;
+        }
+    }
+
+    // Bytes still needed to complete the buffered frame (0 if none is buffered, or it is complete or invalid)
+    size_t missing() const {
+        if (!buf || buf->begin == buf->end) return 0;
+        size_t have = buf->end - buf->begin;
+        if (have < FRAME_HEADER_SIZE) return FRAME_HEADER_SIZE - have;
+        FrameHeader header = decodeHeader(buf->data + buf->begin);
+        if (header.length > MAX_FRAME_PAYLOAD) return 0; // peek() reports it
+        return have < FRAME_HEADER_SIZE + header.length ? FRAME_HEADER_SIZE + header.length - have : 0;
+    }
+
+    void recycle() { // Give the block back if a read turned up nothing
+        if (buf && buf->begin == buf->end) {
+            pool.release(buf);
+            buf = nullptr;
+        }
+    }
+};
+
+// Pending outgoing bytes for one connection, stored in a single pool block
+class OutputBuffer {
+private:
+    BufferPool& pool;  // Pool the send block comes from
+    PoolBuffer* buf;   // Send block, held only while bytes are pending
+    bool webSocket;    // Each frame goes out as one binary WebSocket message
+    bool masked;       // ...masked, as a client sends them
+    uint32_t maskState; // xorshift state for per-frame masks
+    size_t prefix;     // WebSocket header bytes in front of the frame being written
+
+    bool reserve(size_t need) { // Make `need` contiguous bytes available at the end
+        if (!buf) buf = pool.acquire();
+        if (pool.capacity() - buf->end < need) {
+            if (pool.capacity() - (buf->end - buf->begin) < need) return false;
+            memmove(buf->data, buf->data + buf->begin, buf->end - buf->begin); // Compact unsent bytes
+            buf->end -= buf->begin;
+            buf->begin = 0;
+        }
+        return true;
+    }
+
+public:
+    OutputBuffer(BufferPool& p) : pool(p), buf(nullptr), webSocket(false), masked(false), maskState(0), prefix(0) {}
+    ~OutputBuffer() { if (buf) pool.release(buf); }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    // Reserve room for a whole frame and write its header; returns the payload area or nullptr if full.
+    // `plainLength` is the decompressed length of a FLAG_COMPRESSED payload.
+    unsigned char* beginFrame(uint8_t type, uint32_t sequence, uint32_t length, uint8_t flags = 0,
+                              uint32_t plainLength = 0) {
+        prefix = webSocket ? webSocketHeaderSize(FRAME_HEADER_SIZE + length, masked) : 0;
+        if (!reserve(prefix + FRAME_HEADER_SIZE + length)) return nullptr;
+        unsigned char* at = buf->data + buf->end;
+        if (prefix) {
+            uint32_t mask = 0;
+            if (masked) {
+                maskState ^= maskState << 13;
+                maskState ^= maskState >> 17;
+                maskState ^= maskState << 5;
+                mask = maskState;
+            }
+            encodeWebSocketHeader(WS_BINARY, FRAME_HEADER_SIZE + length, at, masked ? reinterpret_cast<unsigned char*>(&mask) : nullptr);
+        }
+        FrameHeader header = {length, type, flags, sequence, plainLength};
+        encodeHeader(header, at + prefix);
+        return at + prefix + FRAME_HEADER_SIZE;
+    }
+
+    // Publish a frame from beginFrame() (a client's frame is masked now that its payload is written)
+    void commitFrame(uint32_t length) {
+        unsigned char* frame = buf->data + buf->end + prefix;
+        if (masked && prefix) applyWebSocketMask(frame, frame, FRAME_HEADER_SIZE + length, frame - 4);
+        buf->end += prefix + FRAME_HEADER_SIZE + length;
+    }
+
+    // Queue bytes as they are (handshake responses, WebSocket control frames); false if full
+    bool append(const void* data, size_t length) {
+        if (!reserve(length)) return false;
+        memcpy(buf->data + buf->end, data, length);
+        buf->end += length;
+        return true;
+    }
+
+    // Wrap frames begun from now on; `client` masks each one under a fresh key seeded from `seed`
+    void setWebSocket(bool on, bool client = false, uint32_t seed = 0x9e3779b9) {
+        webSocket = on;
+        masked = on && client;
+        maskState = seed ? seed : 1;
+    }
+
+    const unsigned char* data() const { return buf ? buf->data + buf->begin : nullptr; } // First unsent byte
+    size_t size() const { return buf ? buf->end - buf->begin : 0; }                      // Unsent byte count
+    bool empty() const { return size() == 0; }
+    unsigned slab() const { return buf->slab; }                                          // Pool slab holding the bytes
+
+    void swap(OutputBuffer& other) { std::swap(buf, other.buf); } // Exchange blocks (same pool)
+
+    void consume(size_t n) { // Drop bytes the socket accepted; gives the block back once empty
+        buf->begin += n;
+        if (buf->begin == buf->end) {
+            pool.release(buf);
+            buf = nullptr;
+        }
+    }
+};
+
+// Blocking helper: send a complete frame (header and payload gathered in one call)
+inline bool sendFrame(int sock, uint8_t type, uint32_t sequence, const void* payload, size_t length, uint8_t flags = 0) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    encodeHeader(FrameHeader{uint32_t(length), type, flags, sequence}, header);
+
+    iovec iov[2] = {{header, FRAME_HEADER_SIZE}, {const_cast<void*>(payload), length}};
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (msg.msg_iovlen > 0 && size_t(sent) >= msg.msg_iov->iov_len) { // Skip fully sent parts
+            sent -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+// Blocking helper: wait for the next complete frame. The payload stays valid until reader.consume(header).
+inline bool recvFrame(int sock, FrameReader& reader, FrameHeader& header, unsigned char*& payload) {
+    while (true) {
+        int status = reader.peek(header, payload);
+        if (status != 0) return status > 0;
+
+        size_t available;
+        unsigned char* space = reader.writeSpace(available);
+        ssize_t received = recv(sock, space, available, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received == 0) errno = ECONNRESET; // Peer closed the connection
+        if (received <= 0) return false;
+        reader.commit(received);
+    }
+}
+
+#endif // FRAMING_H
@@ -0,0 +1,481 @@
+#ifndef IMAGE_PROCESSOR_H
+#define IMAGE_PROCESSOR_H
+
+#include <algorithm>      // For std::min/std::max
+#include <chrono>         // For per-frame ingestion timing
+#include <cmath>          // For log2() in entropy estimates
+#include <cstdint>        // For fixed-width integer types
+#include <cctype>         // For isdigit()/isspace() in frame headers
+#include <cstring>        // For memcpy()
+#include <string>         // For paths and numeric keys
+#include <thread>         // For hashing large images on several cores
+#include <unordered_map>  // For results cached by path
+#include <vector>         // For chunk hashes and timings
+#include <fcntl.h>        // For open()
+#include <sys/mman.h>     // For mmap() of image files
+#include <sys/stat.h>     // For fstat() to size the mapping
+#include <time.h>         // For clock_gettime() (file timestamps are wall-clock)
+#include <unistd.h>       // For read()/close()
+#include "frame_queue.h"  // For the lock-free frame queue
+#include "logger.h"       // For reporting unreadable frames
+
+// Ingestion statistics for one hashed image
+struct FrameTiming {
+    std::string path;          // Image file that was hashed
+    size_t bytes;         // Size of the file
+    double milliseconds;  // Wall time spent mapping and hashing it
+};
+
+// What the filesystem says about a file's contents without reading them. A file whose
+// device, inode, size and modification time are unchanged is taken to hold the same bytes;
+// writing a frame to a temporary name and renaming it over the old one changes the inode.
+struct FileIdentity {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = -1;
+    int64_t mtimeNanos = 0;
+
+    static FileIdentity of(const struct stat& info) {
+        FileIdentity id;
+        id.device = info.st_dev;
+        id.inode = info.st_ino;
+        id.size = info.st_size;
+        id.mtimeNanos = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        return id;
+    }
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && size == other.size && mtimeNanos == other.mtimeNanos;
+    }
+
+    // Filesystem timestamps advance in coarse ticks, so a file read within a tick of its last
+    // write could be rewritten without its mtime changing. Such a result is not reused.
+    bool settledBy(int64_t readNanos) const {
+        return mtimeNanos + SETTLE_NANOS < readNanos;
+    }
+
+    static int64_t wallNanos() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    static constexpr int64_t SETTLE_NANOS = 20000000; // Longer than a timestamp tick (one jiffy at HZ=100)
+};
+
+class ImageProcessor {
+private:
+    // A file's DJB2 hash from 0; continuing any hash over the file is hash * 33^length + this
+    struct CachedHash {
+        FileIdentity identity;
+        unsigned long hash;
+        size_t length;
+    };
+
+    FrameQueue frameQueue;         // Queue to manage frames generated from image files
+    std::vector<FrameTiming> timings;   // Timing of the most recently hashed images
+    std::unordered_map<std::string, CachedHash> hashCache; // Settled files by path
+    static const size_t MAX_TIMINGS = 64;     // Timings kept for continuous ingestion
+    static const size_t CHUNK_SIZE = 4 << 20; // Bytes hashed per worker thread at a time
+
+    // DJB2 (hash * 33 + byte) over a block, continuing from `hash`.
+    // Eight bytes are folded per step so the multiplies don't form one long dependency chain.
+    static unsigned long djb2(unsigned long hash, const unsigned char* data, size_t length) {
+        const unsigned long P1 = 33, P2 = P1 * 33, P3 = P2 * 33, P4 = P3 * 33,
+                            P5 = P4 * 33, P6 = P5 * 33, P7 = P6 * 33, P8 = P7 * 33;
+        size_t k = 0;
+        for (; k + 8 <= length; k += 8) {
+            const unsigned char* d = data + k;
+            hash = hash * P8 + d[0] * P7 + d[1] * P6 + d[2] * P5 + d[3] * P4
+                             + d[4] * P3 + d[5] * P2 + d[6] * P1 + d[7];
+        }
+        for (; k < length; ++k) {
+            hash = ((hash << 5) + hash) + data[k]; // Update hash using a variation of DJB2 algorithm
+        }
+        return hash;
+    }
+
+    // 33^n modulo 2^64, the factor that shifts a hash past n more bytes
+    static unsigned long pow33(size_t n) {
+        unsigned long result = 1, base = 33;
+        while (n) {
+            if (n & 1) result *= base;
+            base *= base;
+            n >>= 1;
+        }
+        return result;
+    }
+
+    // DJB2 of a buffer, split across threads. DJB2 is a polynomial hash, so
+    // hash(seed, A + B) = hash(seed, A) * 33^|B| + hash(0, B): chunks are hashed from 0
+    // independently and folded together, giving exactly the sequential result.
+    static unsigned long hashBytes(unsigned long seed, const unsigned char* data, size_t length) {
+        size_t chunks = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), chunks);
+        if (workers <= 1) {
+            return djb2(seed, data, length);
+        }
+
+        std::vector<unsigned long> partial(chunks);
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < workers; ++w) {
+            threads.emplace_back([&, w] {
+                for (size_t c = w; c < chunks; c += workers) { // Chunks are dealt round-robin
+                    size_t begin = c * CHUNK_SIZE;
+                    partial[c] = djb2(0, data + begin, std::min(CHUNK_SIZE, length - begin));
+                }
+            });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+
+        unsigned long hash = seed;
+        const unsigned long fullShift = pow33(CHUNK_SIZE);
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t chunkLength = std::min(CHUNK_SIZE, length - c * CHUNK_SIZE);
+            hash = hash * (chunkLength == CHUNK_SIZE ? fullShift : pow33(chunkLength)) + partial[c];
+        }
+        return hash;
+    }
+
+    void recordTiming(const std::string& imagePath, size_t length, std::chrono::steady_clock::time_point start) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (timings.size() >= MAX_TIMINGS) {
+            timings.erase(timings.begin()); // Keep only the most recent entries
+        }
+        timings.push_back({imagePath, length, ms});
+    }
+
+    // Continue `hash` over the contents of a file; the file is memory-mapped rather than read byte by byte.
+    // A file whose identity is unchanged since it was last hashed is not read again.
+    bool hashFile(const std::string& imagePath, unsigned long& hash) {
+        auto start = std::chrono::steady_clock::now();
+        struct stat info;
+        auto cached = hashCache.find(imagePath);
+        if (cached != hashCache.end() && stat(imagePath.c_str(), &info) == 0 &&
+            FileIdentity::of(info) == cached->second.identity) {
+            hash = hash * pow33(cached->second.length) + cached->second.hash;
+            recordTiming(imagePath, cached->second.length, start);
+            return true;
+        }
+
+        int64_t readNanos = FileIdentity::wallNanos();
+        int fd = open(imagePath.c_str(), O_RDONLY);
+        if (fd < 0) { // Check if file could not be opened
+            LOG_WARN("Unable to open image file: ", imagePath);
+            return false;
+        }
+
+        if (fstat(fd, &info) < 0) {
+            LOG_WARN("Unable to stat image file: ", imagePath);
+            close(fd);
+            return false;
+        }
+        size_t length = info.st_size;
+
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, length, MADV_SEQUENTIAL);
+                unsigned long fileHash = hashBytes(0, static_cast<unsigned char*>(mapped), length);
+                munmap(mapped, length);
+                hash = hash * pow33(length) + fileHash;
+                FileIdentity identity = FileIdentity::of(info);
+                if (S_ISREG(info.st_mode) && identity.settledBy(readNanos)) {
+                    hashCache[imagePath] = {identity, fileHash, length};
+                } else {
+                    hashCache.erase(imagePath);
+                }
+            } else { // Not mappable (e.g. a pipe): stream it in large blocks instead
+                std::vector<unsigned char> block(CHUNK_SIZE);
+                length = 0;
+                ssize_t n;
+                while ((n = read(fd, block.data(), block.size())) > 0) {
+                    hash = djb2(hash, block.data(), n);
+                    length += n;
+                }
+            }
+        }
+        close(fd); // Close the file
+        recordTiming(imagePath, length, start);
+        return true;
+    }
+
+    // Convert a hash to a 10-digit numeric string
+    static std::string toDigits(unsigned long hash) {
+        std::string number(10, '0');
+        for (int i = 9; i >= 0; --i) {
+            number[i] = '0' + hash % 10;
+            hash /= 10;
+        }
+        return number;
+    }
+
+    // Function to generate a numeric std::string based on image content
+    std::string GenerateNumberFromImage(const std::string& imagePath) {
+        unsigned long hash = 5381; // Initialize hash with a large prime number
+        if (!hashFile(imagePath, hash)) {
+            return "";
+        }
+        frameQueue.push(Frame(imagePath)); // Add a new frame to the queue
+        return toDigits(hash); // Return the generated numeric string
+    }
+
+public:
+    // Public method to generate a key from an image file
+    std::string generateKey(const std::string& imagePath) {
+        return GenerateNumberFromImage(imagePath);
+    }
+
+    // Generate a key from several frames; equal to hashing the frames concatenated in order.
+    // Unreadable frames are skipped; returns "" if none could be read.
+    std::string generateKey(const std::vector<std::string>& imagePaths) {
+        unsigned long hash = 5381;
+        bool any = false;
+        for (const std::string& path : imagePaths) {
+            if (hashFile(path, hash)) {
+                frameQueue.push(Frame(path));
+                any = true;
+            }
+        }
+        return any ? toDigits(hash) : "";
+    }
+
+    // Hash one image without deriving a key or queueing it; false if it could not be read
+    bool hashImage(const std::string& imagePath, unsigned long& hash) {
+        hash = 5381;
+        return hashFile(imagePath, hash);
+    }
+
+    // Per-frame ingestion timings collected so far
+    const std::vector<FrameTiming>& frameTimings() const {
+        return timings;
+    }
+
+    // Check if there are frames in the queue
+    bool hasFrames() const {
+        return !frameQueue.empty();
+    }
+
+    // Retrieve the next frame from the queue
+    Frame getNextFrame() {
+        return frameQueue.pop();
+    }
+};
+
+// What one look at a frame source contributed to the entropy pool
+struct FrameSample {
+    bool changed = false;    // False if the file, or every tile of it, is as it was last time
+    bool pixels = false;     // Raw pixel frame compared tile by tile (else an opaque container)
+    uint64_t digest = 0;     // Hash of the changed content, for mixing into the pool
+    double bits = 0;         // Conservative estimate of the entropy the change carried
+    size_t tiles = 0;        // Tiles in the frame (pixel frames only)
+    size_t tilesChanged = 0; // ...of which differed from the previous frame
+    size_t bytesRead = 0;    // Bytes read from disk (0 when the identity cache answered)
+};
+
+// Incremental entropy extraction for frames that are rewritten continuously. Each source path
+// remembers the identity of the file it last read, so an unchanged file costs one stat().
+// Binary PPM/PGM frames (raw pixels, as open.py --stream writes them) are split into 32x32
+// tiles; a cheap hash per tile finds the ones that changed, and only those are estimated,
+// copied and folded into the digest. Other formats (PNG) are hashed whole: their pixels are
+// compressed, so only a changed container hash can be told apart.
+//
+// The estimate is the min-entropy of a changed tile's pixel differences from the previous
+// frame (-log2 of the most common difference, over every 4th row), counted once per 8x8
+// block on the assumption that neighbouring pixels and colour channels are correlated. A
+// frame seen for the first time uses differences between horizontally adjacent pixels
+// instead. Containers are credited one bit per 8 bytes, at most MAX_CONTAINER_BITS per frame.
+class FrameEntropy {
+public:
+    static constexpr int TILE = 32;                 // Tile edge in pixels
+    static constexpr int BLOCK = 8;                 // Edge of the block credited as one sample
+    static constexpr int SAMPLE_ROWS = 4;           // Every 4th row of a changed tile is histogrammed
+    static constexpr double MAX_CONTAINER_BITS = 1024;
+
+private:
+    struct Source {
+        FileIdentity identity;            // File as last read
+        bool settled = false;             // ...and old enough that an equal identity means equal bytes
+        uint64_t containerHash = 0;       // Whole-file hash of a non-pixel frame
+        int width = 0, height = 0, channels = 0;
+        std::vector<uint64_t> tileHashes; // Row-major tile hashes of the previous pixel frame
+        std::vector<unsigned char> previous; // Previous pixel frame, for temporal differences
+    };
+
+    std::unordered_map<std::string, Source> sources; // By path
+    std::vector<unsigned char> buffer;                // Reused for every read
+
+    static uint64_t mix64(uint64_t hash, uint64_t value) {
+        hash = (hash ^ value) * 0x9e3779b97f4a7c15ull;
+        return hash ^ (hash >> 29);
+    }
+
+    static uint64_t hash64(uint64_t hash, const unsigned char* data, size_t length) {
+        size_t k = 0;
+        for (; k + 8 <= length; k += 8) {
+            uint64_t word;
+            memcpy(&word, data + k, 8);
+            hash = mix64(hash, word);
+        }
+        if (k < length) {
+            uint64_t word = 0;
+            memcpy(&word, data + k, length - k);
+            hash = mix64(hash, word ^ (uint64_t(length - k) << 56));
+        }
+        return hash;
+    }
+
+    // Read the whole file into `buffer`; false if it could not be opened
+    bool readFile(const std::string& path, FileIdentity& identity, int64_t& readNanos) {
+        readNanos = FileIdentity::wallNanos();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+            close(fd);
+            return false;
+        }
+        identity = FileIdentity::of(info);
+        buffer.resize(info.st_size);
+        size_t length = 0;
+        ssize_t n;
+        while (length < buffer.size() && (n = pread(fd, buffer.data() + length, buffer.size() - length, length)) > 0) {
+            length += n;
+        }
+        buffer.resize(length); // Truncated underneath us: use what was there
+        close(fd);
+        return true;
+    }
+
+    // Parse a binary netpbm header (P5 grey, P6 RGB, 8-bit); the offset of the pixels or 0
+    static size_t parsePnm(const std::vector<unsigned char>& data, int& width, int& height, int& channels) {
+        if (data.size() < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) return 0;
+        channels = data[1] == '6' ? 3 : 1;
+        size_t p = 2;
+        long fields[3];
+        for (long& field : fields) {
+            while (p < data.size() && (isspace(data[p]) || data[p] == '#')) {
+                if (data[p] == '#') while (p < data.size() && data[p] != '\n') ++p; // Comment to end of line
+                else ++p;
+            }
+            if (p >= data.size() || !isdigit(data[p])) return 0;
+            field = 0;
+            while (p < data.size() && isdigit(data[p]) && field < 1000000) field = field * 10 + (data[p++] - '0');
+        }
+        if (p >= data.size() || !isspace(data[p]) || fields[0] < 1 || fields[1] < 1 ||
+            fields[0] > 65535 || fields[1] > 65535 || fields[2] < 1 || fields[2] > 255) return 0;
+        ++p; // Exactly one whitespace byte precedes the raster
+        width = int(fields[0]);
+        height = int(fields[1]);
+        if (data.size() - p < size_t(width) * height * channels) return 0;
+        return p;
+    }
+
+    // Min-entropy estimate for one changed tile; `prev` is null for a source's first frame
+    static double tileBits(const unsigned char* pixels, const unsigned char* prev, size_t stride,
+                           size_t rowBytes, int rows, int channels) {
+        // Four interleaved histograms: runs of equal differences would otherwise serialise on one counter
+        uint32_t histogram[4][256] = {{0}};
+        uint32_t samples = 0;
+        for (int y = 0; y < rows; y += SAMPLE_ROWS) {
+            const unsigned char* row = pixels + y * stride;
+            const unsigned char* before = prev ? prev + y * stride : row;
+            size_t first = prev ? 0 : channels, lag = prev ? 0 : channels; // Else the pixel to the left
+            if (rowBytes <= first) continue;
+            size_t i = first;
+            for (; i + 4 <= rowBytes; i += 4) {
+                ++histogram[0][uint8_t(row[i] - before[i - lag])];
+                ++histogram[1][uint8_t(row[i + 1] - before[i + 1 - lag])];
+                ++histogram[2][uint8_t(row[i + 2] - before[i + 2 - lag])];
+                ++histogram[3][uint8_t(row[i + 3] - before[i + 3 - lag])];
+            }
+            for (; i < rowBytes; ++i) ++histogram[0][uint8_t(row[i] - before[i - lag])];
+            samples += uint32_t(rowBytes - first);
+        }
+        if (!samples) return 0;
+        uint32_t common = 0;
+        for (int v = 0; v < 256; ++v) {
+            common = std::max(common, histogram[0][v] + histogram[1][v] + histogram[2][v] + histogram[3][v]);
+        }
+        double perSample = -std::log2(double(common) / samples);
+        double blocks = std::max(1.0, double(rowBytes / channels) * rows / (BLOCK * BLOCK));
+        return perSample * blocks;
+    }
+
+    void extractPixels(Source& source, size_t offset, int width, int height, int channels, FrameSample& sample) {
+        size_t stride = size_t(width) * channels;
+        int tilesX = (width + TILE - 1) / TILE, tilesY = (height + TILE - 1) / TILE;
+        bool continuing = source.width == width && source.height == height && source.channels == channels;
+        if (!continuing) { // New source or new resolution: every tile is new
+            source.width = width;
+            source.height = height;
+            source.channels = channels;
+            source.tileHashes.assign(size_t(tilesX) * tilesY, 0);
+            source.previous.assign(stride * height, 0);
+        }
+        const unsigned char* pixels = buffer.data() + offset;
+        uint64_t digest = 0x6672616d65ull; // "frame"
+        sample.pixels = true;
+        sample.tiles = source.tileHashes.size();
+        for (int ty = 0; ty < tilesY; ++ty) {
+            int rows = std::min(TILE, height - ty * TILE);
+            for (int tx = 0; tx < tilesX; ++tx) {
+                size_t index = size_t(ty) * tilesX + tx;
+                size_t start = size_t(ty) * TILE * stride + size_t(tx) * TILE * channels;
+                size_t rowBytes = size_t(std::min(TILE, width - tx * TILE)) * channels;
+                uint64_t hash = index + 1;
+                for (int y = 0; y < rows; ++y) hash = hash64(hash, pixels + start + y * stride, rowBytes);
+                if (continuing && hash == source.tileHashes[index]) continue;
+
+                sample.bits += tileBits(pixels + start, continuing ? source.previous.data() + start : nullptr,
+                                        stride, rowBytes, rows, channels);
+                for (int y = 0; y < rows; ++y) {
+                    memcpy(source.previous.data() + start + y * stride, pixels + start + y * stride, rowBytes);
+                }
+                source.tileHashes[index] = hash;
+                digest = mix64(digest, hash);
+                ++sample.tilesChanged;
+            }
+        }
+        sample.changed = sample.tilesChanged > 0;
+        sample.digest = digest;
+    }
+
+public:
+    // Look at the frame at `path`; false if it could not be read. An unchanged frame yields
+    // sample.changed == false and nothing to mix.
+    bool extract(const std::string& path, FrameSample& sample) {
+        sample = FrameSample();
+        Source& source = sources[path];
+        struct stat info;
+        if (stat(path.c_str(), &info) < 0) return false;
+        if (source.settled && FileIdentity::of(info) == source.identity) return true; // Not rewritten
+
+        FileIdentity identity;
+        int64_t readNanos;
+        if (!readFile(path, identity, readNanos)) return false;
+        source.identity = identity;
+        source.settled = identity.settledBy(readNanos);
+        sample.bytesRead = buffer.size();
+
+        int width, height, channels;
+        size_t offset = parsePnm(buffer, width, height, channels);
+        if (offset) {
+            extractPixels(source, offset, width, height, channels, sample);
+        } else {
+            uint64_t hash = hash64(0x636f6e74ull /* "cont" */, buffer.data(), buffer.size());
+            sample.changed = hash != source.containerHash;
+            if (sample.changed) {
+                source.containerHash = hash;
+                sample.digest = hash;
+                sample.bits = std::min(double(buffer.size()) / 8, MAX_CONTAINER_BITS);
+            }
+            source.width = 0; // A later pixel frame starts afresh
+        }
+        return true;
+    }
+};
+
+#endif // IMAGE_PROCESSOR_H
@@ -0,0 +1,207 @@
+#ifndef KEY_REGISTRY_H
+#define KEY_REGISTRY_H
+
+#include <chrono>         // For TTL expiry
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()/memcmp()
+#include <memory>         // For unique_ptr owning the slot arrays
+#include <mutex>          // For exclusive shard locks
+#include <shared_mutex>   // For concurrent readers per shard
+#include <stdexcept>      // For length_error on oversized keys
+#include <string>         // For std::string keys
+
+// Registry of issued session keys: answers "has this key been handed out (recently)?" so
+// the server never reuses a key. Keys are stored inline in flat open-addressing tables
+// (no per-key allocation, no pointer chasing) split into independently locked shards, so
+// many connection threads can look up concurrently. Entries may carry a time-to-live.
+class KeyRegistry {
+public:
+    static const size_t MAX_KEY_BYTES = 32; // Longest key that can be stored inline
+
+private:
+    static const size_t SHARD_COUNT = 64;      // Independent tables (power of two)
+    static const size_t INITIAL_CAPACITY = 64; // Slots per shard before the first growth
+
+    // Control byte per slot, scanned before touching the slot itself
+    static const uint8_t EMPTY = 0x00;     // Never used: ends a probe sequence
+    static const uint8_t DELETED = 0x01;   // Removed or expired: probing continues past it
+    static const uint8_t FULL = 0x80;      // High bit set: low 7 bits hold a hash tag
+
+    struct Slot {
+        int64_t expiresAt;                 // steady_clock nanoseconds; 0 = never
+        uint8_t length;                    // Key length in bytes
+        unsigned char key[MAX_KEY_BYTES];  // Key bytes (inline)
+    };
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex lock;    // Readers share, writers exclusive
+        std::unique_ptr<uint8_t[]> control; // One control byte per slot
+        std::unique_ptr<Slot[]> slots;     // Slot arena
+        size_t capacity = 0;               // Slots allocated (power of two)
+        size_t live = 0;                   // FULL slots
+        size_t used = 0;                   // FULL + DELETED slots (drives growth)
+    };
+
+    Shard shards[SHARD_COUNT];
+
+    static uint64_t hashKey(const unsigned char* key, size_t length) { // 64-bit word-at-a-time mix
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ length;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t w;
+            memcpy(&w, key + i, 8);
+            h = (h ^ w) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 32;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, key + i, length - i);
+        h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 29;
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+    }
+
+    static int64_t nowNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool expired(const Slot& slot, int64_t now) { return slot.expiresAt != 0 && slot.expiresAt <= now; }
+
+    Shard& shardFor(uint64_t hash) { return shards[hash & (SHARD_COUNT - 1)]; }
+
+    // Find the slot holding `key`, or capacity if absent (caller holds the shard lock)
+    static size_t find(const Shard& shard, const unsigned char* key, size_t length, uint64_t hash) {
+        if (shard.capacity == 0) return 0;
+        uint8_t tag = FULL | ((hash >> 57) & 0x7f);
+        size_t mask = shard.capacity - 1;
+        for (size_t i = (hash >> 6) & mask, probes = 0; probes < shard.capacity; i = (i + 1) & mask, ++probes) {
+            uint8_t c = shard.control[i];
+            if (c == EMPTY) break;
+            if (c == tag && shard.slots[i].length == length && memcmp(shard.slots[i].key, key, length) == 0) {
+                return i;
+            }
+        }
+        return shard.capacity;
+    }
+
+    // Re-insert every live entry into a table of `newCapacity` slots (caller holds the lock exclusively)
+    static void rehash(Shard& shard, size_t newCapacity, int64_t now) {
+        std::unique_ptr<uint8_t[]> control(new uint8_t[newCapacity]());
+        std::unique_ptr<Slot[]> slots(new Slot[newCapacity]);
+        size_t live = 0;
+        for (size_t i = 0; i < shard.capacity; ++i) {
+            if (!(shard.control[i] & FULL) || expired(shard.slots[i], now)) continue; // Drop dead entries
+            const Slot& slot = shard.slots[i];
+            uint64_t hash = hashKey(slot.key, slot.length);
+            size_t j = (hash >> 6) & (newCapacity - 1);
+            while (control[j] != EMPTY) j = (j + 1) & (newCapacity - 1);
+            control[j] = shard.control[i];
+            slots[j] = slot;
+            ++live;
+        }
+        shard.control = std::move(control);
+        shard.slots = std::move(slots);
+        shard.capacity = newCapacity;
+        shard.live = shard.used = live;
+    }
+
+    static const unsigned char* bytesOf(const std::string& key) {
+        if (key.size() > MAX_KEY_BYTES) {
+            throw std::length_error("Key longer than KeyRegistry::MAX_KEY_BYTES");
+        }
+        return reinterpret_cast<const unsigned char*>(key.data());
+    }
+
+public:
+    // Register a key; returns false if it is already present (and not expired).
+    // A ttl of zero keeps the entry until it is removed.
+    bool insert(const std::string& keyString, std::chrono::nanoseconds ttl = std::chrono::nanoseconds::zero()) {
+        const unsigned char* key = bytesOf(keyString);
+        size_t length = keyString.size();
+        uint64_t hash = hashKey(key, length);
+        Shard& shard = shardFor(hash);
+        int64_t now = nowNanos();
+
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        size_t existing = find(shard, key, length, hash);
+        if (existing < shard.capacity) {
+            Slot& slot = shard.slots[existing];
+            if (!expired(slot, now)) return false; // Duplicate
+            slot.expiresAt = ttl.count() ? now + ttl.count() : 0; // Revive an expired entry in place
+            return true;
+        }
+
+        if ((shard.used + 1) * 4 > shard.capacity * 3) { // Keep load (including tombstones) under 75%
+            size_t grown = shard.capacity ? shard.capacity : INITIAL_CAPACITY;
+            while ((shard.live + 1) * 2 > grown) grown *= 2; // Rehashed table ends up at most half full
+            rehash(shard, grown, now);
+        }
+
+        size_t mask = shard.capacity - 1;
+        size_t i = (hash >> 6) & mask;
+        while (shard.control[i] & FULL) i = (i + 1) & mask; // First empty or deleted slot
+        if (shard.control[i] == EMPTY) ++shard.used;
+        shard.control[i] = FULL | ((hash >> 57) & 0x7f);
+        Slot& slot = shard.slots[i];
+        slot.expiresAt = ttl.count() ? now + ttl.count() : 0;
+        slot.length = length;
+        memcpy(slot.key, key, length);
+        ++shard.live;
+        return true;
+    }
+
+    // Check whether a key is registered and not expired (shared lock: lookups run concurrently)
+    bool contains(const std::string& keyString) const {
+        const unsigned char* key = bytesOf(keyString);
+        uint64_t hash = hashKey(key, keyString.size());
+        const Shard& shard = shards[hash & (SHARD_COUNT - 1)];
+        std::shared_lock<std::shared_mutex> guard(shard.lock);
+        size_t i = find(shard, key, keyString.size(), hash);
+        return i < shard.capacity && !expired(shard.slots[i], nowNanos());
+    }
+
+    // Remove a key; returns false if it was not registered
+    bool remove(const std::string& keyString) {
+        const unsigned char* key = bytesOf(keyString);
+        uint64_t hash = hashKey(key, keyString.size());
+        Shard& shard = shardFor(hash);
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        size_t i = find(shard, key, keyString.size(), hash);
+        if (i >= shard.capacity) return false;
+        shard.control[i] = DELETED;
+        --shard.live;
+        return true;
+    }
+
+    // Drop every expired entry; returns how many were removed. Call periodically.
+    size_t expire() {
+        int64_t now = nowNanos();
+        size_t removed = 0;
+        for (Shard& shard : shards) {
+            std::unique_lock<std::shared_mutex> guard(shard.lock);
+            for (size_t i = 0; i < shard.capacity; ++i) {
+                if ((shard.control[i] & FULL) && expired(shard.slots[i], now)) {
+                    shard.control[i] = DELETED;
+                    --shard.live;
+                    ++removed;
+                }
+            }
+            if (shard.used > shard.live * 2 && shard.used > INITIAL_CAPACITY / 2) { // Mostly tombstones: clean up
+                rehash(shard, shard.capacity, now);
+            }
+        }
+        return removed;
+    }
+
+    size_t size() const { // Registered keys, including expired ones not yet swept
+        size_t total = 0;
+        for (const Shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> guard(shard.lock);
+            total += shard.live;
+        }
+        return total;
+    }
+};
+
+#endif // KEY_REGISTRY_H
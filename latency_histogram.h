@@ -0,0 +1,85 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <algorithm>      // For std::min/std::max
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memset()
+
+// Log-linear histogram of nanosecond durations (HdrHistogram-style): each power of two is
+// split into SUB_BUCKETS linear buckets, so any recorded value is reported within ~1.6%.
+// Recording is a couple of shifts and an increment with no allocation; not thread-safe, so
+// keep one per thread and merge() them when reporting.
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 6;                    // 64 buckets per power of two
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 42;               // Values up to ~73 minutes; larger ones are clamped
+    static const size_t BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+private:
+    uint64_t counts[BUCKETS];
+    uint64_t total;     // Values recorded
+    uint64_t sum;       // Sum of recorded values (for the mean)
+    uint64_t minimum;   // Smallest value recorded
+    uint64_t maximum;   // Largest value recorded
+
+public:
+    static size_t bucketOf(uint64_t value) { // Bucket a value is counted in
+        if (value < SUB_BUCKETS) return value; // Exact below 64 ns
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+        uint64_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t valueOf(size_t bucket) { // Upper edge of a bucket
+        if (bucket < SUB_BUCKETS) return bucket;
+        int exponent = int(bucket / SUB_BUCKETS) + SUB_BITS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = sum = maximum = 0;
+        minimum = UINT64_MAX;
+    }
+
+    void record(uint64_t nanos, uint64_t times = 1) { // Count `nanos` once, or `times` times
+        if (times == 0) return;
+        counts[bucketOf(nanos)] += times;
+        total += times;
+        sum += nanos * times;
+        minimum = std::min(minimum, nanos);
+        maximum = std::max(maximum, nanos);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    // Value at quantile q (0..1), e.g. 0.99 for p99; 0 if nothing was recorded
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, uint64_t(q * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(valueOf(i), maximum);
+        }
+        return maximum;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? minimum : 0; }
+    uint64_t max() const { return maximum; }
+    double mean() const { return total ? double(sum) / total : 0; }
+};
+
+#endif // LATENCY_HISTOGRAM_H
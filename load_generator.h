@@ -0,0 +1,472 @@
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include <algorithm>      // For std::min
+#include <chrono>         // For send schedules and latency stamps
+#include <condition_variable> // For the start line shared by the workers
+#include <cerrno>         // For EAGAIN/EINTR
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcmp()
+#include <deque>          // For the per-connection list of unanswered messages
+#include <memory>         // For unique_ptr owning connections
+#include <mutex>          // For the start line shared by the workers
+#include <random>         // For WebSocket handshake keys and mask seeds
+#include <string>         // For the server address
+#include <thread>         // For one event loop per worker thread
+#include <vector>         // For connections, workers and reports
+#include <arpa/inet.h>    // For sockaddr_in and inet_addr()
+#include <fcntl.h>        // For fcntl() to set non-blocking mode
+#include <netinet/tcp.h>  // For TCP_NODELAY
+#include <sys/epoll.h>    // For the per-worker event loop
+#include <sys/socket.h>   // For socket functions
+#include <unistd.h>       // For close()
+#include "compression.h"  // For the optional compression stage
+#include "framing.h"      // For frames and pooled I/O buffers
+#include "latency_histogram.h" // For round-trip percentiles
+#include "rc4.h"          // For per-connection cipher state
+#include "websocket.h"    // For the WebSocket transport option
+
+// Headless load generator: opens many encrypted sessions against the echo server and drives
+// them from a few epoll worker threads, measuring the round trip of every message.
+//
+// Closed loop: each connection keeps `window` messages outstanding and sends the next as soon
+// as an echo arrives (measures capacity). Open loop: messages are sent on a fixed schedule whether or
+// not replies have come back, and latency is taken from the scheduled send time, so a stalled
+// server shows up as latency instead of silently lowering the offered load.
+class LoadGenerator {
+public:
+    enum Payload {
+        PAYLOAD_ALPHABET,            // "abc...z" repeated: checks every byte, compresses to almost nothing
+        PAYLOAD_CHAT,                // JSON chat records (see chatPayload()): typical compressible traffic
+        PAYLOAD_RANDOM,              // Random bytes: incompressible
+    };
+
+    struct Options {
+        std::string host = "127.0.0.1";
+        int port = 8080;
+        size_t connections = 1;      // Concurrent sessions
+        size_t threads = 0;          // Worker event loops; 0 = one per core (at most one per connection)
+        size_t messageBytes = 64;    // Payload size of every message
+        double rate = 0;             // Total messages/s across all connections (open loop only)
+        bool openLoop = false;       // Send on a schedule instead of after each reply
+        size_t window = 1;           // Closed loop: messages kept in flight per connection
+        double seconds = 10;         // Sending time; unanswered messages get a short grace period after
+        bool webSocket = false;      // Speak WebSocket (server2 --ws-port) instead of raw TCP
+        bool compress = false;       // Negotiate compression (messages and echoes may go out compressed)
+        Payload payload = PAYLOAD_ALPHABET; // What every message contains
+    };
+
+    struct Report {
+        uint64_t connected = 0;      // Sessions that completed the key exchange
+        uint64_t sent = 0;           // Messages sent
+        uint64_t received = 0;       // Echoes received and verified
+        uint64_t errors = 0;         // Connection failures and mismatched echoes
+        uint64_t rekeys = 0;         // Server-initiated key rotations followed
+        uint64_t compressed = 0;     // Sessions whose server accepted compression
+        uint64_t wireBytes = 0;      // Message and echo payload bytes as they crossed the wire
+        double seconds = 0;          // Measured sending time
+        LatencyHistogram latency;    // Round trip per message, nanoseconds
+    };
+
+private:
+    struct Pending {
+        uint32_t sequence;           // Sequence number of the message
+        int64_t sentAt;              // Send (or scheduled send) time, steady_clock nanoseconds
+    };
+
+    // One session with its own cipher state, buffers and queue of unanswered messages
+    struct Connection {
+        int fd = -1;
+        CipherContext cipher;        // Current keystreams
+        CipherContext nextCipher;    // Keystreams waiting for the REKEY_ACK to be queued
+        bool ackPending = false;     // Rotation accepted on receive, send side not switched yet
+        FrameReader reader;
+        OutputBuffer outbox;
+        std::deque<Pending> pending; // Unanswered messages, oldest first (the server echoes in order)
+        uint32_t sequence = 0;       // Last sequence number used
+        int64_t nextSend = 0;        // Open loop: scheduled time of the next message
+        WebSocketDecoder decoder{false}; // WebSocket mode: strips the server's message headers
+        bool compress = false;       // The server accepted compression
+
+        Connection(BufferPool& pool) : reader(pool), outbox(pool) {}
+    };
+
+    Options options;
+    std::vector<unsigned char> message; // Plaintext payload sent on every connection
+    std::vector<unsigned char> packed;  // ...compressed once up front (empty: not worth it)
+
+    std::mutex startLock;               // Guards the fields below
+    std::condition_variable startSignal;
+    size_t workersReady = 0;            // Workers done connecting
+    int64_t startTime = 0;              // When sending begins; 0 until every worker is ready
+    int64_t endTime = 0;                // When sending stops
+
+    static int64_t nowNanos() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // One recv() into the reader, unwrapping WebSocket messages; returns what recv() returned
+    ssize_t pull(Connection& c) {
+        size_t available;
+        unsigned char* space = c.reader.writeSpace(available);
+        ssize_t received = recv(c.fd, space, available, 0);
+        if (received <= 0 || !options.webSocket) {
+            if (received > 0) c.reader.commit(received);
+            return received;
+        }
+        std::string replies; // Pongs, if the server ever pings
+        long stream = c.decoder.decode(space, received, replies);
+        if (stream < 0 || (!replies.empty() && !c.outbox.append(replies.data(), replies.size()))) {
+            errno = ECONNRESET; // Server closed the WebSocket
+            return -1;
+        }
+        c.reader.commit(stream);
+        return received;
+    }
+
+    // WebSocket mode: send the upgrade request and take exactly the response off the socket
+    bool upgrade(Connection& c, std::mt19937& random) {
+        unsigned char key[16];
+        for (unsigned char& b : key) b = uint8_t(random());
+        std::string keyText, request = webSocketUpgradeRequest(options.host, key, keyText);
+        if (send(c.fd, request.data(), request.size(), MSG_NOSIGNAL) != ssize_t(request.size())) return false;
+        char response[1024];
+        while (true) { // Peek so frames sent right after the response stay queued
+            ssize_t n = recv(c.fd, response, sizeof(response) - 1, MSG_PEEK);
+            if (n <= 0) return false;
+            std::string text(response, n);
+            size_t end = text.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (size_t(n) == sizeof(response) - 1) return false; // Far larger than our server's response
+                usleep(1000);
+                continue;
+            }
+            if (recv(c.fd, response, end + 4, 0) != ssize_t(end + 4)) return false;
+            c.outbox.setWebSocket(true, true, uint32_t(random()));
+            return webSocketUpgradeAccepted(text.substr(0, end + 4), keyText);
+        }
+    }
+
+    // Blocking connect plus key exchange, then switch the socket to non-blocking mode
+    bool open(Connection& c, std::mt19937& random) {
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c.fd < 0) return false;
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        server.sin_addr.s_addr = inet_addr(options.host.c_str());
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Small messages must not wait for Nagle
+        if (connect(c.fd, (sockaddr*)&server, sizeof(server)) < 0 || (options.webSocket && !upgrade(c, random))) {
+            return false;
+        }
+        FrameHeader header;
+        unsigned char* payload;
+        int status;
+        while ((status = c.reader.peek(header, payload)) == 0) {
+            ssize_t received = pull(c);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+        }
+        if (status < 0 || header.type != MSG_KEY) return false;
+        c.cipher.init(std::string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+        c.reader.consume(header);
+        if (options.compress && !negotiate(c)) return false;
+        return fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK) == 0;
+    }
+
+    // Ask for compression and wait for the answer (still blocking, before any message)
+    bool negotiate(Connection& c) {
+        unsigned char request[4] = {0, 0, 0, FEATURE_COMPRESSION};
+        unsigned char* out = c.outbox.beginFrame(MSG_FEATURES, 0, sizeof(request));
+        c.cipher.encrypt(request, out, sizeof(request));
+        c.outbox.commitFrame(sizeof(request));
+        if (!flush(c)) return false;
+        FrameHeader header;
+        unsigned char* payload;
+        int status;
+        while ((status = c.reader.peek(header, payload)) == 0) {
+            ssize_t received = pull(c);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+        }
+        if (status < 0 || header.type != MSG_FEATURES || header.length != 4) return false;
+        c.cipher.decrypt(payload, header.length);
+        c.compress = (payload[3] & FEATURE_COMPRESSION) != 0;
+        c.reader.consume(header);
+        return true;
+    }
+
+    // Queue the REKEY_ACK; later frames are encrypted under the new key
+    static bool queueAck(Connection& c) {
+        if (!c.outbox.beginFrame(MSG_REKEY_ACK, 0, 0)) return false; // Outbox full: retried on the next fill
+        c.outbox.commitFrame(0);
+        c.cipher.adoptTx(c.nextCipher);
+        c.ackPending = false;
+        return true;
+    }
+
+    // Encrypt one message into the outbox; false if the outbox is full
+    bool queueMessage(Connection& c, int64_t sentAt, Report& report) {
+        if (c.ackPending && !queueAck(c)) return false;
+        uint32_t sequence = c.sequence + 1;
+        bool pack = c.compress && !packed.empty();
+        const std::vector<unsigned char>& payload = pack ? packed : message;
+        unsigned char* out = c.outbox.beginFrame(MSG_DATA, sequence, payload.size(), pack ? FLAG_COMPRESSED : 0,
+                                                 message.size());
+        if (!out) return false;
+        c.cipher.encrypt(payload.data(), out, payload.size());
+        c.outbox.commitFrame(payload.size());
+        report.wireBytes += payload.size();
+        c.sequence = sequence;
+        c.pending.push_back({sequence, sentAt});
+        ++report.sent;
+        return true;
+    }
+
+    // Write as much of the outbox as the socket takes; false on a dead connection
+    static bool flush(Connection& c) {
+        while (!c.outbox.empty()) {
+            ssize_t sent = send(c.fd, c.outbox.data(), c.outbox.size(), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            c.outbox.consume(sent);
+        }
+        return true;
+    }
+
+    // Queue whatever is due on this connection, then flush (several frames go out in one send)
+    bool fill(Connection& c, int64_t now, int64_t interval, Report& report) {
+        if (options.openLoop) {
+            while (c.nextSend <= now && queueMessage(c, c.nextSend, report)) {
+                c.nextSend += interval;
+            }
+        } else {
+            bool queued = true;
+            while (queued && c.pending.size() < options.window) queued = queueMessage(c, now, report);
+            if (c.ackPending) queueAck(c); // Window full: the ACK cannot wait for the next message
+        }
+        return flush(c);
+    }
+
+    // Handle one complete frame from the server (`inflated` holds a compressed echo's plaintext)
+    void handleFrame(Connection& c, const FrameHeader& header, unsigned char* payload, int64_t now, Report& report,
+                     std::vector<unsigned char>& inflated) {
+        if (header.type == MSG_REKEY) {
+            c.cipher.decrypt(payload, header.length);
+            c.nextCipher.init(std::string(reinterpret_cast<char*>(payload), header.length), CipherContext::CLIENT);
+            c.cipher.adoptRx(c.nextCipher);
+            c.ackPending = true;
+            queueAck(c);
+            ++report.rekeys;
+            return;
+        }
+        if (header.type != MSG_DATA) return;
+        c.cipher.decrypt(payload, header.length);
+        report.wireBytes += header.length;
+        long length = header.length;
+        if (header.flags & FLAG_COMPRESSED) {
+            length = Lz4::decompress(payload, header.length, inflated.data(), inflated.size());
+            payload = inflated.data();
+        }
+        if (c.pending.empty() || c.pending.front().sequence != header.sequence ||
+            length != long(message.size()) || memcmp(payload, message.data(), length) != 0) {
+            ++report.errors; // Echo does not match what we sent
+        } else {
+            ++report.received;
+            report.latency.record(now - c.pending.front().sentAt);
+        }
+        if (!c.pending.empty()) c.pending.pop_front();
+    }
+
+    // Drain the socket (edge-triggered); false once the connection is closed or broken
+    bool readAll(Connection& c, Report& report, std::vector<unsigned char>& inflated) {
+        while (true) {
+            FrameHeader header;
+            unsigned char* payload;
+            int status;
+            int64_t now = nowNanos();
+            while ((status = c.reader.peek(header, payload)) > 0) {
+                handleFrame(c, header, payload, now, report, inflated);
+                c.reader.consume(header);
+            }
+            if (status < 0) return false;
+
+            ssize_t received = pull(c);
+            if (received > 0) continue;
+            if (received < 0 && errno == EINTR) continue;
+            c.reader.recycle();
+            return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    // Event loop for one worker's share of the connections
+    void work(size_t first, size_t count, Report& report) {
+        BufferPool pool(FRAME_BLOCK_SIZE, 4);
+        std::vector<std::unique_ptr<Connection>> connections;
+        int epollFd = epoll_create1(0);
+        int64_t interval = options.openLoop ? int64_t(1e9 * options.connections / options.rate) : 0;
+        std::mt19937 random(std::random_device{}());
+        std::vector<unsigned char> inflated(MAX_FRAME_PAYLOAD); // Compressed echoes expand here
+
+        for (size_t i = 0; i < count; ++i) {
+            std::unique_ptr<Connection> c(new Connection(pool));
+            if (!open(*c, random)) {
+                ++report.errors;
+                if (c->fd >= 0) close(c->fd);
+                continue;
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = c.get();
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, c->fd, &ev);
+            report.compressed += c->compress;
+            connections.push_back(std::move(c));
+        }
+        report.connected = connections.size();
+
+        // Wait until every worker has connected so the measurement covers only steady traffic
+        int64_t start, end;
+        {
+            std::unique_lock<std::mutex> guard(startLock);
+            ++workersReady;
+            startSignal.notify_all();
+            startSignal.wait(guard, [this] { return startTime != 0; });
+            start = startTime;
+            end = endTime;
+        }
+        for (size_t i = 0; i < connections.size(); ++i) { // Stagger schedules across the interval
+            connections[i]->nextSend = start + interval * int64_t(first + i) / int64_t(options.connections);
+        }
+
+        const int64_t grace = 2000000000; // Wait up to 2 s for echoes of the last messages
+        epoll_event events[256];
+        while (true) {
+            int64_t now = nowNanos();
+            bool sending = now < end;
+            size_t outstanding = 0;
+            int64_t wake = sending ? end : end + grace;
+            for (auto& c : connections) {
+                if (c->fd < 0) continue;
+                if (sending && !fill(*c, now, interval, report)) {
+                    close(c->fd);
+                    c->fd = -1;
+                    ++report.errors;
+                    continue;
+                }
+                outstanding += c->pending.size();
+                if (options.openLoop && sending) wake = std::min(wake, c->nextSend);
+            }
+            if (!sending && (outstanding == 0 || now >= end + grace)) break;
+
+            int timeout = int(std::min<int64_t>(100, std::max<int64_t>(0, (wake - now) / 1000000)));
+            int n = epoll_wait(epollFd, events, 256, timeout);
+            for (int i = 0; i < n; ++i) {
+                Connection& c = *static_cast<Connection*>(events[i].data.ptr);
+                if (c.fd < 0) continue;
+                bool alive = true;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) alive = readAll(c, report, inflated);
+                if (alive && (events[i].events & EPOLLOUT)) alive = flush(c);
+                if (!alive) {
+                    close(c.fd);
+                    c.fd = -1;
+                    ++report.errors;
+                }
+            }
+        }
+
+        for (auto& c : connections) {
+            if (c->fd >= 0) close(c->fd);
+        }
+        close(epollFd);
+    }
+
+public:
+    LoadGenerator(const Options& o) : options(o), message(o.messageBytes) {
+        if (options.payload == PAYLOAD_CHAT) {
+            std::string text = chatPayload(message.size());
+            message.assign(text.begin(), text.end());
+        } else {
+            std::mt19937 random(1);
+            for (size_t i = 0; i < message.size(); ++i) { // Checked on every echo
+                message[i] = options.payload == PAYLOAD_RANDOM ? uint8_t(random()) : 'a' + i % 26;
+            }
+        }
+        if (options.compress) { // Every message is the same, so it is compressed once here
+            Lz4 lz4;
+            CompressionPolicy policy;
+            packed.resize(message.size());
+            packed.resize(policy.apply(lz4, message.data(), message.size(), packed.data()));
+        }
+    }
+
+    // `bytes` of chat traffic as JSON records, one per line, with the repetition real traffic has:
+    // the same keys, a handful of users and rooms, words from a small vocabulary
+    static std::string chatPayload(size_t bytes, uint32_t seed = 1) {
+        static const char* const users[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+        static const char* const rooms[] = {"general", "random", "lava-lamps", "ops"};
+        static const char* const words[] = {
+            "the", "lamp", "is", "warming", "up", "again", "did", "you", "see", "new", "frame", "entropy",
+            "looks", "good", "server", "restart", "at", "noon", "key", "rotated", "ok", "thanks", "lol", "ship",
+            "it", "tomorrow", "meeting", "moved", "to", "three", "can", "someone", "review", "my", "patch"};
+        std::mt19937 random(seed);
+        std::string out;
+        uint64_t timestamp = 1700000000000ull;
+        while (out.size() < bytes) {
+            timestamp += random() % 5000;
+            out += "{\"type\":\"message\",\"user\":\"";
+            out += users[random() % 8];
+            out += "\",\"room\":\"";
+            out += rooms[random() % 4];
+            out += "\",\"ts\":" + std::to_string(timestamp) + ",\"text\":\"";
+            for (unsigned n = 3 + random() % 10; n; --n) {
+                out += words[random() % (sizeof(words) / sizeof(words[0]))];
+                if (n > 1) out += ' ';
+            }
+            out += "\"}\n";
+        }
+        out.resize(bytes);
+        return out;
+    }
+
+    // Run the whole test and return the combined results of all workers
+    Report run() {
+        size_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        threads = std::max<size_t>(1, std::min(threads, options.connections));
+        std::vector<Report> reports(threads);
+        std::vector<std::thread> workers;
+
+        for (size_t t = 0, first = 0; t < threads; ++t) {
+            size_t count = options.connections / threads + (t < options.connections % threads);
+            workers.emplace_back(&LoadGenerator::work, this, first, count, std::ref(reports[t]));
+            first += count;
+        }
+        {
+            std::unique_lock<std::mutex> guard(startLock);
+            startSignal.wait(guard, [&] { return workersReady == threads; });
+            startTime = nowNanos();
+            endTime = startTime + int64_t(options.seconds * 1e9);
+            startSignal.notify_all();
+        }
+        for (std::thread& w : workers) w.join();
+
+        Report total;
+        total.seconds = options.seconds;
+        for (const Report& r : reports) {
+            total.connected += r.connected;
+            total.sent += r.sent;
+            total.received += r.received;
+            total.errors += r.errors;
+            total.rekeys += r.rekeys;
+            total.compressed += r.compressed;
+            total.wireBytes += r.wireBytes;
+            total.latency.merge(r.latency);
+        }
+        return total;
+    }
+};
+
+#endif // LOAD_GENERATOR_H
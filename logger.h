@@ -0,0 +1,238 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <algorithm>      // For std::stable_sort/std::min
+#include <atomic>         // For the level, drop counter and shutdown flag
+#include <charconv>       // For std::to_chars (no locale, no allocation)
+#include <chrono>         // For record timestamps and the flush interval
+#include <cstdint>        // For fixed-width integer types
+#include <cstdio>         // For snprintf() on floating-point values
+#include <cstring>        // For memcpy()/strlen()
+#include <ctime>          // For localtime_r() in the line prefix
+#include <memory>         // For shared_ptr owning per-thread buffers
+#include <mutex>          // For the buffer list (taken once per thread, never per message)
+#include <string>         // For std::string arguments and output batches
+#include <thread>         // For the writer thread
+#include <type_traits>    // For dispatching integer/floating arguments
+#include <vector>         // For the buffer list and batch sorting
+#include <unistd.h>       // For write()
+#include "ring_buffer.h"  // For the lock-free per-thread record queues
+
+// Severity of a log line; lines below the configured level are skipped before any formatting
+enum class LogLevel : uint8_t { DEBUG, INFO, WARN, ERROR };
+
+// Raw bytes to log (e.g. a ciphertext); non-printable bytes are escaped by the writer thread
+struct LogBytes {
+    const void* data;
+    size_t length;
+    LogBytes(const void* d, size_t n) : data(d), length(n) {}
+};
+
+// Asynchronous logger. A call on the hot path copies its arguments into a fixed-size record and
+// pushes it onto the calling thread's own lock-free ring; no lock, allocation or system call.
+// A background thread drains every ring each few milliseconds, orders the records by time,
+// formats the line prefixes and writes each batch with one write() per stream (INFO/DEBUG to
+// stdout, WARN/ERROR to stderr). When a ring is full the record is dropped and counted.
+class Logger {
+public:
+    static const size_t MAX_TEXT = 232;       // Longer lines are truncated (marked with "...")
+    static const size_t RING_RECORDS = 1024;  // Records buffered per thread before dropping
+
+private:
+    struct Record {
+        int64_t timestamp;      // system_clock nanoseconds
+        LogLevel level;
+        uint8_t escape;         // Text holds raw bytes that need escaping
+        uint16_t length;        // Bytes used in text
+        char text[MAX_TEXT];
+    };
+
+    using Ring = RingBuffer<Record, RING_RECORDS>;
+
+    std::atomic<LogLevel> minimum{LogLevel::INFO};
+    std::atomic<uint64_t> dropped{0};           // Records lost to full rings
+    std::atomic<bool> running{true};
+    std::mutex lock;                            // Guards rings
+    std::vector<std::shared_ptr<Ring>> rings;   // One per thread that ever logged; outlive their threads
+    std::thread writer;
+
+    Logger() : writer(&Logger::writeLoop, this) {}
+
+    ~Logger() {
+        running = false;
+        writer.join(); // The writer drains everything left before it exits
+    }
+
+    Ring& threadRing() {
+        thread_local std::shared_ptr<Ring> ring;
+        if (!ring) {
+            ring = std::make_shared<Ring>();
+            std::lock_guard<std::mutex> guard(lock);
+            rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    // Argument appenders: each copies as much as fits into the record
+    static void append(Record& r, const char* data, size_t length) {
+        if (r.length >= MAX_TEXT) return; // Already full
+        size_t room = MAX_TEXT - r.length;
+        if (length <= room) {
+            memcpy(r.text + r.length, data, length);
+            r.length += length;
+            return;
+        }
+        size_t keep = std::min(room >= 3 ? room - 3 : 0, length); // Too long: keep what fits and end with "..."
+        memcpy(r.text + r.length, data, keep);
+        memcpy(r.text + r.length + keep, "...", room - keep);
+        r.length = MAX_TEXT;
+    }
+    static void appendArg(Record& r, const char* s) { append(r, s, strlen(s)); }
+    static void appendArg(Record& r, const std::string& s) { append(r, s.data(), s.size()); }
+    static void appendArg(Record& r, char c) { append(r, &c, 1); }
+    static void appendArg(Record& r, const LogBytes& b) {
+        r.escape = 1;
+        append(r, static_cast<const char*>(b.data), b.length);
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value>::type appendArg(Record& r, T value) {
+        std::to_chars_result done = std::to_chars(r.text + r.length, r.text + MAX_TEXT, value); // Formats in place
+        if (done.ec == std::errc()) r.length = done.ptr - r.text;
+        else append(r, "...", 3);
+    }
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value>::type appendArg(Record& r, T value) {
+        char digits[32];
+        int n = snprintf(digits, sizeof(digits), "%g", double(value));
+        append(r, digits, std::min<size_t>(n, sizeof(digits) - 1));
+    }
+
+    static const char* levelName(LogLevel level) {
+        switch (level) {
+        case LogLevel::DEBUG: return "DEBUG";
+        case LogLevel::INFO: return "INFO ";
+        case LogLevel::WARN: return "WARN ";
+        default: return "ERROR";
+        }
+    }
+
+    // Append one formatted line: "HH:MM:SS.mmm LEVEL text"
+    static void format(std::string& out, const Record& r) {
+        time_t seconds = r.timestamp / 1000000000;
+        tm local;
+        localtime_r(&seconds, &local);
+        char prefix[32];
+        int n = snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %s ", local.tm_hour, local.tm_min,
+                         local.tm_sec, int(r.timestamp / 1000000 % 1000), levelName(r.level));
+        out.append(prefix, n);
+        for (size_t i = 0; i < r.length; ++i) {
+            unsigned char c = r.text[i];
+            if (!r.escape || (c >= 0x20 && c < 0x7f)) {
+                out += char(c);
+            } else { // Ciphertext and other binary data: keep the output one line per record
+                static const char hex[] = "0123456789abcdef";
+                out += "\\x";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            }
+        }
+        out += '\n';
+    }
+
+    static void writeAll(int fd, const std::string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n <= 0) return; // Nowhere to report a failing log stream
+            done += n;
+        }
+    }
+
+    // Drain all rings into one time-ordered batch and write it
+    bool drainOnce(std::vector<Record>& batch, std::string& out, std::string& err, uint64_t& reportedDrops) {
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto& ring : rings) {
+                Record r;
+                while (ring->tryPop(r)) batch.push_back(r);
+            }
+        }
+        uint64_t drops = dropped.load(std::memory_order_relaxed);
+        if (batch.empty() && drops == reportedDrops) return false;
+
+        std::stable_sort(batch.begin(), batch.end(),
+                  [](const Record& a, const Record& b) { return a.timestamp < b.timestamp; });
+        out.clear();
+        err.clear();
+        for (const Record& r : batch) format(r.level >= LogLevel::WARN ? err : out, r);
+        if (drops != reportedDrops) {
+            err += "Logger: " + std::to_string(drops - reportedDrops) + " message(s) dropped (buffer full)\n";
+            reportedDrops = drops;
+        }
+        writeAll(STDOUT_FILENO, out);
+        writeAll(STDERR_FILENO, err);
+        return true;
+    }
+
+    void writeLoop() {
+        std::vector<Record> batch;
+        std::string out, err;
+        uint64_t reportedDrops = 0;
+        while (running.load(std::memory_order_relaxed)) {
+            if (!drainOnce(batch, out, err, reportedDrops)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        drainOnce(batch, out, err, reportedDrops); // Shutting down: write whatever is left
+    }
+
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    static bool enabled(LogLevel level) {
+        return level >= instance().minimum.load(std::memory_order_relaxed);
+    }
+
+    void setLevel(LogLevel level) { minimum.store(level, std::memory_order_relaxed); }
+    uint64_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+    // Parse "debug", "info", "warn" or "error"; false if the name is unknown
+    static bool parseLevel(const std::string& name, LogLevel& level) {
+        static const char* names[] = {"debug", "info", "warn", "error"};
+        for (int i = 0; i < 4; ++i) {
+            if (name == names[i]) {
+                level = LogLevel(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename... Args>
+    void log(LogLevel level, const Args&... args) {
+        Record r;
+        r.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        r.level = level;
+        r.escape = 0;
+        r.length = 0;
+        (appendArg(r, args), ...);
+        if (!threadRing().tryPush(std::move(r))) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Level check happens before the arguments are evaluated or copied
+#define LOG_AT(level, ...) \
+    do { if (Logger::enabled(level)) Logger::instance().log(level, __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::ERROR, __VA_ARGS__)
+
+#endif // LOGGER_H
@@ -0,0 +1,805 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <algorithm>      // For std::sort/std::lower_bound/std::max
+#include <atomic>         // For counters read by other threads
+#include <chrono>         // For the compaction interval
+#include <cerrno>         // For errno
+#include <condition_variable> // For waking the writer and waiting producers
+#include <cstddef>        // For offsetof()
+#include <cstdint>        // For fixed-width integer types
+#include <cstdio>         // For snprintf()/rename()
+#include <cstring>        // For memcpy()/memset()
+#include <deque>          // For jobs waiting for the reader thread
+#include <functional>     // For replay visitors
+#include <memory>         // For shared_ptr keeping segments mapped while they are read
+#include <mutex>          // For the queue, the segment list and each segment's index
+#include <string>         // For paths and keys
+#include <thread>         // For the writer, compactor and reader threads
+#include <vector>         // For batches, segments and block indexes
+#include <dirent.h>       // For listing segment files
+#include <fcntl.h>        // For open()/fallocate()
+#include <sys/mman.h>     // For mapping segments
+#include <sys/stat.h>     // For fstat()/mkdir()
+#include <unistd.h>       // For read()/write()/ftruncate()/unlink()
+#include "rc4.h"          // For encrypting payloads at rest
+
+// Every record starts with this header (host byte order: the log is not meant to move between
+// machines). The header stays in the clear so the log can be indexed and compacted without
+// decrypting; the payload is encrypted.
+struct LogRecordHeader {
+    uint32_t length;      // Payload bytes
+    uint8_t type;         // Frame type the payload arrived in (0 marks the end of a segment's data)
+    uint8_t flags;        // Frame flags
+    uint16_t blockStart;  // 1 if the keystream restarts at this record
+    uint32_t sequence;    // Sender's sequence number
+    uint32_t checksum;    // Over this header (checksum zeroed) and the encrypted payload
+    uint64_t stream;      // Session (a random id) or room (see logStreamId()) the record belongs to
+    int64_t timestamp;    // Wall-clock nanoseconds; increases with every record of a log
+};
+static_assert(sizeof(LogRecordHeader) == 32, "log records start with a 32-byte header");
+
+// Stream id for a room name (FNV-1a, 64 bit)
+inline uint64_t logStreamId(const std::string& name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : name) h = (h ^ c) * 1099511628211ULL;
+    return h;
+}
+
+// Records gathered by one event loop during a batch and handed to the log in one piece.
+// Adding a record is one copy of its plaintext; encryption happens on the log's writer thread.
+class LogBatch {
+private:
+    friend class MessageLog;
+    std::vector<unsigned char> bytes;  // Headers (checksum unset) and plaintext payloads, back to back
+
+public:
+    void add(uint64_t stream, int64_t timestamp, uint8_t type, uint8_t flags, uint32_t sequence,
+             const unsigned char* data, size_t length) {
+        LogRecordHeader h{uint32_t(length), type, flags, 0, sequence, 0, stream, timestamp};
+        size_t at = bytes.size();
+        bytes.resize(at + sizeof(h) + length);
+        memcpy(&bytes[at], &h, sizeof(h));
+        memcpy(&bytes[at + sizeof(h)], data, length);
+    }
+
+    bool empty() const { return bytes.empty(); }
+    size_t size() const { return bytes.size(); }
+};
+
+// Durable message history: an append-only log of fixed-size, memory-mapped segment files.
+//
+// Producers hand over LogBatches without blocking; a writer thread encrypts each record into the
+// active segment's mapping and then commits everything it took with one msync (group commit),
+// so a burst of batches costs one disk flush. Replays see committed records only.
+//
+// A segment is split into blocks of about BLOCK_BYTES. The keystream restarts at every block,
+// so a reader can start decrypting at any block, and the sparse index holds one entry per
+// block: its offset, the time range it covers and a bloom filter of its streams. A replay
+// binary-searches the time range and decrypts only the blocks whose filter matches.
+//
+// Full segments are sealed (their index is saved next to them) and a new one is started. A
+// compactor thread deletes segments past the retention time and rewrites segments holding
+// echo (per-session) records past the shorter session retention. A reader thread runs jobs
+// (replays for clients) handed to it with schedule(), so callers never wait on the disk.
+class MessageLog {
+public:
+    static const size_t BLOCK_BYTES = 32 * 1024;  // Keystream restart interval (and index granularity)
+    static const size_t SEGMENT_HEADER = 32;      // | magic (8) | id (8) | epoch (8) | reserved (8) |
+    static const int BLOOM_WORDS = 32;            // 2048-bit stream filter per block (~0.7% false positives
+    static const int BLOOM_PROBES = 3;            // at the ~140 records a block holds)
+
+    struct Options {
+        std::string directory;                      // Created if missing
+        size_t segmentBytes = size_t(1) << 30;      // Segment file size before rolling
+        bool sync = true;                           // msync each group commit (false: leave it to the kernel)
+        int64_t retentionSeconds = 7 * 24 * 3600;   // Segments older than this are deleted (0 = forever)
+        int64_t sessionRetentionSeconds = 24 * 3600; // Session records (echo type) older than this are compacted away (0 = forever)
+        uint8_t sessionType = 0;                    // Record type compaction treats as session traffic (0 = none)
+        size_t maxPendingBytes = 64 << 20;          // Queued bytes beyond which submit() drops a batch
+        std::chrono::seconds compactInterval{60};   // Time between compaction passes
+        std::string newKey;                         // Key for a new log (random if empty); an existing log keeps its key
+    };
+
+    struct Entry {                                  // A record handed to a replay visitor
+        uint64_t stream;
+        int64_t timestamp;
+        uint32_t sequence;
+        uint8_t type;
+        uint8_t flags;
+        const unsigned char* data;                  // Decrypted payload, valid during the call
+        size_t length;
+    };
+
+    struct Stats {
+        uint64_t records;                           // Records written
+        uint64_t bytes;                             // Bytes written (headers and padding included)
+        uint64_t commits;                           // Group commits
+        uint64_t dropped;                           // Records dropped because the queue was full
+        uint64_t segments;                          // Segments on disk
+        uint64_t compacted;                         // Segments rewritten or deleted by compaction
+    };
+
+private:
+    struct Block {                                  // One sparse index entry
+        uint64_t offset;                            // First record (keystream start)
+        int64_t firstTimestamp;
+        int64_t lastTimestamp;
+        uint32_t records;
+        uint32_t sessionRecords;                    // Records of Options::sessionType
+        uint64_t bloom[BLOOM_WORDS];                // Streams present
+
+        bool mayHold(uint64_t stream) const {
+            uint64_t h = mix(stream);
+            for (int k = 0; k < BLOOM_PROBES; ++k, h >>= 11) {
+                if (!(bloom[(h & (BLOOM_WORDS * 64 - 1)) >> 6] >> (h & 63) & 1)) return false;
+            }
+            return true;
+        }
+        void add(uint64_t stream) {
+            uint64_t h = mix(stream);
+            for (int k = 0; k < BLOOM_PROBES; ++k, h >>= 11) {
+                bloom[(h & (BLOOM_WORDS * 64 - 1)) >> 6] |= uint64_t(1) << (h & 63);
+            }
+        }
+        static uint64_t mix(uint64_t x) { // Full-avalanche finalizer: every probe gets independent bits
+            x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+            x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+            return x ^ (x >> 33);
+        }
+    };
+
+    struct Segment {
+        uint64_t id;
+        uint64_t epoch;                             // Bumped by each compaction rewrite (part of the block keys)
+        std::string path;
+        int fd = -1;
+        unsigned char* map = nullptr;
+        size_t mapped = 0;
+        std::mutex lock;                            // Guards index and committed
+        std::vector<Block> index;
+        size_t committed = SEGMENT_HEADER;          // End of the records readers may see
+        bool sealed = false;
+
+        ~Segment() {
+            if (map) munmap(map, mapped);
+            if (fd >= 0) ::close(fd);
+        }
+    };
+    using SegmentPtr = std::shared_ptr<Segment>;
+
+    // Writes records into a segment's mapping: keystream blocks, checksums and the block index
+    struct Appender {
+        Segment* segment = nullptr;
+        size_t offset = 0;                          // Next write position
+        std::vector<Block> blocks;                  // Index so far (published to the segment on commit)
+        RC4Stream keystream;
+        bool restart = true;                        // Next record starts a block (keystream not yet set up)
+        int64_t lastTimestamp = 0;
+    };
+
+    Options options;
+    unsigned char key[32];                          // Log key; block keys extend it
+    std::mutex segmentsLock;                        // Guards segments (not their contents)
+    std::vector<SegmentPtr> segments;               // Oldest first; the last one is active
+    Appender appender;                              // Writer thread only (after open())
+    uint64_t nextSegmentId = 1;
+
+    std::mutex queueLock;                           // Guards the queue below
+    std::condition_variable queueReady;             // Writer: batches waiting
+    std::condition_variable queueDone;              // Producers and flush(): room freed / batches committed
+    std::vector<std::vector<unsigned char>> queue;  // Submitted batches
+    std::vector<std::vector<unsigned char>> spare;  // Emptied batch buffers, handed back to producers
+    size_t queuedBytes = 0;
+    uint64_t submitted = 0;                         // Batches submitted
+    uint64_t written = 0;                           // Batches committed
+    bool stopping = false;
+    std::thread writer;
+    std::thread compactor;
+    std::mutex compactLock;                         // One compaction at a time; also wakes the compactor on close
+    std::condition_variable compactWake;
+    std::mutex jobsLock;                            // Guards jobs and readerStopping
+    std::condition_variable jobsReady;
+    std::deque<std::function<void()>> jobs;         // Waiting for the reader thread, oldest first
+    bool readerStopping = false;
+    std::thread reader;
+
+    std::atomic<uint64_t> recordsWritten{0}, bytesWritten{0}, commits{0}, droppedRecords{0}, compactedSegments{0};
+
+    static size_t padded(size_t length) { return (sizeof(LogRecordHeader) + length + 7) & ~size_t(7); }
+
+    // Word-at-a-time FNV-1a variant over header and ciphertext
+    static uint32_t checksum(const unsigned char* data, size_t length) {
+        uint64_t h = 14695981039346656037ULL;
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            h = (h ^ word) * 1099511628211ULL;
+        }
+        for (; i < length; ++i) h = (h ^ data[i]) * 1099511628211ULL;
+        return uint32_t(h ^ (h >> 32));
+    }
+
+    static uint32_t recordChecksum(const unsigned char* record, size_t length) {
+        LogRecordHeader h;
+        memcpy(&h, record, sizeof(h));
+        h.checksum = 0;
+        uint32_t head = checksum(reinterpret_cast<const unsigned char*>(&h), sizeof(h));
+        return head ^ checksum(record + sizeof(h), length);
+    }
+
+    // Keystream for the block starting at `offset`: the log key extended with the block's position,
+    // with the first 1 KB of output discarded (its bias is what makes related RC4 keys attackable)
+    void startKeystream(RC4Stream& stream, const Segment& segment, uint64_t offset) const {
+        unsigned char blockKey[sizeof(key) + 24];
+        memcpy(blockKey, key, sizeof(key));
+        memcpy(blockKey + sizeof(key), &segment.id, 8);
+        memcpy(blockKey + sizeof(key) + 8, &segment.epoch, 8);
+        memcpy(blockKey + sizeof(key) + 16, &offset, 8);
+        stream.init(blockKey, sizeof(blockKey));
+        unsigned char discard[1024] = {};
+        stream.apply(discard, sizeof(discard));
+    }
+
+    std::string segmentPath(uint64_t id) const {
+        char name[40];
+        snprintf(name, sizeof(name), "/segment-%010llu.log", static_cast<unsigned long long>(id));
+        return options.directory + name;
+    }
+
+    static std::string indexPath(const std::string& segmentFile) {
+        return segmentFile.substr(0, segmentFile.size() - 4) + ".idx";
+    }
+
+    // Create a segment file of `size` bytes mapped read-write
+    SegmentPtr createSegment(const std::string& path, uint64_t id, uint64_t epoch, size_t size) {
+        SegmentPtr s = std::make_shared<Segment>();
+        s->id = id;
+        s->epoch = epoch;
+        s->path = path;
+        s->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (s->fd < 0 || ftruncate(s->fd, size) < 0) return nullptr;
+        if (fallocate(s->fd, 0, 0, size) < 0 && errno != EOPNOTSUPP) return nullptr; // Reserve the space up front
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        if (map == MAP_FAILED) return nullptr;
+        s->map = static_cast<unsigned char*>(map);
+        s->mapped = size;
+        memcpy(s->map, "LAVALOG1", 8);
+        memcpy(s->map + 8, &id, 8);
+        memcpy(s->map + 16, &epoch, 8);
+        return s;
+    }
+
+    void beginAppend(Appender& a, Segment* segment, size_t offset) {
+        a.segment = segment;
+        a.offset = offset;
+        a.blocks.clear();
+        a.restart = true;
+    }
+
+    // Encrypt one record into the appender's segment; the caller checks that it fits
+    void appendRecord(Appender& a, LogRecordHeader h, const unsigned char* plain) {
+        bool newBlock = a.restart || a.offset - a.blocks.back().offset >= BLOCK_BYTES;
+        if (newBlock) {
+            a.restart = false;
+            Block b{};
+            b.offset = a.offset;
+            a.blocks.push_back(b);
+            startKeystream(a.keystream, *a.segment, a.offset);
+        }
+        h.timestamp = std::max(h.timestamp, a.lastTimestamp + 1); // Keeps the time index sorted, and a record's time names it alone
+        h.blockStart = newBlock;
+        h.checksum = 0;
+        unsigned char* at = a.segment->map + a.offset;
+        a.keystream.apply(plain, at + sizeof(h), h.length);
+        memcpy(at, &h, sizeof(h));
+        size_t size = padded(h.length);
+        memset(at + sizeof(h) + h.length, 0, size - sizeof(h) - h.length);
+        uint32_t sum = recordChecksum(at, h.length);
+        memcpy(at + offsetof(LogRecordHeader, checksum), &sum, sizeof(sum));
+
+        Block& b = a.blocks.back();
+        if (b.records++ == 0) b.firstTimestamp = h.timestamp;
+        b.lastTimestamp = h.timestamp;
+        if (options.sessionType && h.type == options.sessionType) ++b.sessionRecords;
+        b.add(h.stream);
+        a.lastTimestamp = h.timestamp;
+        a.offset += size;
+    }
+
+    // Make the appended records durable (if syncing) and visible to replays
+    void publish(Appender& a, size_t syncedFrom) {
+        Segment& s = *a.segment;
+        memset(s.map + a.offset, 0, sizeof(LogRecordHeader)); // End marker, so a recovery scan never runs into stale bytes
+        if (options.sync && a.offset > syncedFrom) {
+            size_t page = size_t(sysconf(_SC_PAGESIZE));
+            size_t from = syncedFrom & ~(page - 1);
+            msync(s.map + from, a.offset - from, MS_SYNC);
+        }
+        std::lock_guard<std::mutex> guard(s.lock);
+        size_t from = s.index.empty() ? 0 : s.index.size() - 1; // Earlier blocks are complete and already published
+        s.index.resize(a.blocks.size());
+        std::copy(a.blocks.begin() + from, a.blocks.end(), s.index.begin() + from);
+        s.committed = a.offset;
+    }
+
+    // Seal a segment: trim the file, save its index beside it
+    void seal(Segment& s) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (s.sealed) return;
+        s.sealed = true;
+        msync(s.map, s.committed, options.sync ? MS_SYNC : MS_ASYNC);
+        if (ftruncate(s.fd, s.committed) < 0) return; // Still readable; only the spare space stays reserved
+        std::string path = indexPath(s.path);
+        int fd = ::open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return; // Rebuilt by scanning on the next open
+        uint64_t header[4] = {0x3158444947564c41ULL /* "ALVGIDX1" */, s.epoch, s.committed, s.index.size()};
+        bool ok = ::write(fd, header, sizeof(header)) == ssize_t(sizeof(header)) &&
+                  ::write(fd, s.index.data(), s.index.size() * sizeof(Block)) == ssize_t(s.index.size() * sizeof(Block));
+        if (options.sync) fsync(fd);
+        ::close(fd);
+        if (ok) rename((path + ".tmp").c_str(), path.c_str());
+    }
+
+    // Start a new active segment after the current one
+    bool roll() {
+        if (appender.segment) seal(*appender.segment);
+        SegmentPtr next = createSegment(segmentPath(nextSegmentId), nextSegmentId, 0, options.segmentBytes);
+        if (!next) return false;
+        ++nextSegmentId;
+        beginAppend(appender, next.get(), SEGMENT_HEADER);
+        std::lock_guard<std::mutex> guard(segmentsLock);
+        segments.push_back(next);
+        return true;
+    }
+
+    // Walk a segment's records from the start, checking each; returns where valid data ends
+    size_t scan(Segment& s, size_t limit, std::vector<Block>& blocks) {
+        blocks.clear();
+        size_t offset = SEGMENT_HEADER;
+        while (offset + sizeof(LogRecordHeader) <= limit) {
+            LogRecordHeader h;
+            memcpy(&h, s.map + offset, sizeof(h));
+            if (h.type == 0 || offset + padded(h.length) > limit) break;
+            if (recordChecksum(s.map + offset, h.length) != h.checksum) break; // Torn write: the log ends here
+            if (h.blockStart || blocks.empty()) {
+                Block b{};
+                b.offset = offset;
+                b.firstTimestamp = h.timestamp;
+                blocks.push_back(b);
+            }
+            Block& b = blocks.back();
+            ++b.records;
+            b.lastTimestamp = h.timestamp;
+            if (options.sessionType && h.type == options.sessionType) ++b.sessionRecords;
+            b.add(h.stream);
+            offset += padded(h.length);
+        }
+        return offset;
+    }
+
+    // Load a sealed segment's saved index; false if it is missing or stale
+    static bool loadIndex(Segment& s) {
+        int fd = ::open(indexPath(s.path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        uint64_t header[4];
+        bool ok = ::read(fd, header, sizeof(header)) == ssize_t(sizeof(header)) && header[1] == s.epoch &&
+                  header[2] == s.mapped && header[3] < s.mapped / sizeof(LogRecordHeader);
+        if (ok) {
+            s.index.resize(header[3]);
+            ok = ::read(fd, s.index.data(), header[3] * sizeof(Block)) == ssize_t(header[3] * sizeof(Block));
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    // Map an existing segment file; the newest one is reopened for appending unless it was sealed
+    SegmentPtr openSegment(const std::string& path, bool newest) {
+        SegmentPtr s = std::make_shared<Segment>();
+        s->path = path;
+        bool sealedBefore = access(indexPath(path).c_str(), F_OK) == 0;
+        bool writable = newest && !sealedBefore;
+        s->fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        struct stat st;
+        if (s->fd < 0 || fstat(s->fd, &st) < 0 || size_t(st.st_size) < SEGMENT_HEADER) return nullptr;
+        size_t size = writable ? std::max(size_t(st.st_size), options.segmentBytes) : size_t(st.st_size);
+        if (writable && size_t(st.st_size) < size && ftruncate(s->fd, size) < 0) return nullptr;
+        void* map = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, s->fd, 0);
+        if (map == MAP_FAILED) return nullptr;
+        s->map = static_cast<unsigned char*>(map);
+        s->mapped = size;
+        if (memcmp(s->map, "LAVALOG1", 8) != 0) return nullptr;
+        memcpy(&s->id, s->map + 8, 8);
+        memcpy(&s->epoch, s->map + 16, 8);
+
+        if (!writable) {
+            s->sealed = true;
+            s->committed = size;
+            if (!loadIndex(*s)) s->committed = scan(*s, size, s->index);
+            return s;
+        }
+        // Recovering the active segment: keep every intact record, drop a torn tail
+        s->committed = scan(*s, size, s->index);
+        if (s->committed + sizeof(LogRecordHeader) <= size) memset(s->map + s->committed, 0, sizeof(LogRecordHeader));
+        return s;
+    }
+
+    void writeLoop() {
+        std::vector<std::vector<unsigned char>> work;
+        std::unique_lock<std::mutex> guard(queueLock);
+        while (true) {
+            queueReady.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return; // Stopping with nothing left
+            work.swap(queue);
+            queuedBytes = 0;
+            guard.unlock();
+            queueDone.notify_all();
+
+            size_t syncedFrom = appender.offset;
+            for (const std::vector<unsigned char>& batch : work) {
+                size_t at = 0;
+                while (at + sizeof(LogRecordHeader) <= batch.size()) {
+                    LogRecordHeader h;
+                    memcpy(&h, &batch[at], sizeof(h));
+                    size_t size = padded(h.length);
+                    if (appender.offset + size + sizeof(LogRecordHeader) > appender.segment->mapped) {
+                        publish(appender, syncedFrom);
+                        if (!roll()) { // Out of disk or file handles: keep what was written, drop the rest
+                            droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                            at += sizeof(h) + h.length;
+                            continue;
+                        }
+                        syncedFrom = appender.offset;
+                    }
+                    appendRecord(appender, h, &batch[at + sizeof(h)]);
+                    recordsWritten.fetch_add(1, std::memory_order_relaxed);
+                    bytesWritten.fetch_add(size, std::memory_order_relaxed);
+                    at += sizeof(h) + h.length;
+                }
+            }
+            publish(appender, syncedFrom);
+            commits.fetch_add(1, std::memory_order_relaxed);
+
+            guard.lock();
+            written += work.size();
+            for (std::vector<unsigned char>& batch : work) {
+                batch.clear();
+                spare.push_back(std::move(batch));
+            }
+            work.clear();
+            queueDone.notify_all();
+        }
+    }
+
+    void readLoop() {
+        std::unique_lock<std::mutex> guard(jobsLock);
+        while (true) {
+            jobsReady.wait(guard, [this] { return readerStopping || !jobs.empty(); });
+            if (readerStopping) return; // Jobs still waiting are dropped
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            guard.unlock();
+            job();
+            guard.lock();
+        }
+    }
+
+    void compactLoop() {
+        std::unique_lock<std::mutex> guard(compactLock);
+        while (!stopping) {
+            compactWake.wait_for(guard, options.compactInterval);
+            if (stopping) return;
+            guard.unlock();
+            compact(wallNow());
+            guard.lock();
+        }
+    }
+
+    // Copy the records of a sealed segment that `keep` accepts into a new epoch of that segment
+    SegmentPtr rewrite(const SegmentPtr& old, const std::function<bool(const LogRecordHeader&)>& keep) {
+        std::string tmp = old->path + ".compact";
+        SegmentPtr fresh = createSegment(tmp, old->id, old->epoch + 1, std::max(old->mapped, SEGMENT_HEADER + BLOCK_BYTES));
+        if (!fresh) {
+            unlink(tmp.c_str());
+            return nullptr;
+        }
+        fresh->path = old->path;
+        Appender out;
+        beginAppend(out, fresh.get(), SEGMENT_HEADER);
+        std::vector<unsigned char> plain;
+        RC4Stream in;
+        for (size_t b = 0; b < old->index.size(); ++b) {
+            size_t end = b + 1 < old->index.size() ? old->index[b + 1].offset : old->committed;
+            startKeystream(in, *old, old->index[b].offset);
+            for (size_t offset = old->index[b].offset; offset < end;) {
+                LogRecordHeader h;
+                memcpy(&h, old->map + offset, sizeof(h));
+                plain.resize(h.length);
+                in.apply(old->map + offset + sizeof(h), plain.data(), h.length); // Keeps the keystream in step
+                if (keep(h)) appendRecord(out, h, plain.data());
+                offset += padded(h.length);
+            }
+        }
+        fresh->index = out.blocks;
+        fresh->committed = out.offset;
+        seal(*fresh);
+        if (rename(tmp.c_str(), old->path.c_str()) < 0) { // The saved index already names the new epoch
+            unlink(tmp.c_str());
+            return nullptr;
+        }
+        return fresh;
+    }
+
+public:
+    MessageLog() = default;
+    ~MessageLog() { close(); }
+
+    MessageLog(const MessageLog&) = delete;
+    MessageLog& operator=(const MessageLog&) = delete;
+
+    static int64_t wallNow() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Open (or create) the log in options.directory and start its threads
+    bool open(const Options& opts, std::string& error) {
+        options = opts;
+        options.segmentBytes = std::max(options.segmentBytes, size_t(1) << 20); // Room for the largest frame many times over
+        if (mkdir(options.directory.c_str(), 0700) < 0 && errno != EEXIST) {
+            error = "cannot create " + options.directory + ": " + strerror(errno);
+            return false;
+        }
+
+        std::string keyPath = options.directory + "/log.key";
+        int fd = ::open(keyPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            bool ok = ::read(fd, key, sizeof(key)) == ssize_t(sizeof(key));
+            ::close(fd);
+            if (!ok) {
+                error = "cannot read " + keyPath;
+                return false;
+            }
+        } else {
+            std::string material = options.newKey;
+            if (material.empty()) {
+                int random = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+                material.resize(sizeof(key));
+                if (random < 0 || ::read(random, &material[0], sizeof(key)) != ssize_t(sizeof(key))) {
+                    error = "cannot read /dev/urandom";
+                    if (random >= 0) ::close(random);
+                    return false;
+                }
+                ::close(random);
+            }
+            RC4Stream expand; // Stretch whatever key material we got to 32 bytes
+            expand.init(reinterpret_cast<const unsigned char*>(material.data()), material.size());
+            unsigned char discard[1024] = {};
+            expand.apply(discard, sizeof(discard));
+            memset(key, 0, sizeof(key));
+            expand.apply(key, sizeof(key));
+            fd = ::open(keyPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0 || ::write(fd, key, sizeof(key)) != ssize_t(sizeof(key))) {
+                error = "cannot write " + keyPath + ": " + strerror(errno);
+                if (fd >= 0) ::close(fd);
+                return false;
+            }
+            fsync(fd);
+            ::close(fd);
+        }
+
+        std::vector<std::string> files;
+        if (DIR* dir = opendir(options.directory.c_str())) {
+            while (dirent* e = readdir(dir)) {
+                std::string name = e->d_name;
+                if (name.size() == 22 && name.compare(0, 8, "segment-") == 0 && name.compare(18, 4, ".log") == 0) {
+                    files.push_back(options.directory + "/" + name);
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(files.begin(), files.end()); // Zero-padded ids sort by age
+        for (size_t i = 0; i < files.size(); ++i) {
+            SegmentPtr s = openSegment(files[i], i + 1 == files.size());
+            if (!s) {
+                error = "cannot open " + files[i] + ": " + strerror(errno);
+                return false;
+            }
+            nextSegmentId = s->id + 1;
+            segments.push_back(s);
+        }
+
+        if (!segments.empty() && !segments.back()->sealed) { // Carry on where the last run stopped
+            Segment& active = *segments.back();
+            beginAppend(appender, &active, active.committed);
+            appender.blocks = active.index; // The next record starts a fresh keystream block
+        } else if (!roll()) {
+            error = "cannot create a segment in " + options.directory + ": " + strerror(errno);
+            return false;
+        }
+        for (const SegmentPtr& s : segments) {
+            if (!s->index.empty()) appender.lastTimestamp = std::max(appender.lastTimestamp, s->index.back().lastTimestamp);
+        }
+
+        writer = std::thread(&MessageLog::writeLoop, this);
+        compactor = std::thread(&MessageLog::compactLoop, this);
+        reader = std::thread(&MessageLog::readLoop, this);
+        return true;
+    }
+
+    // Write out everything submitted and stop the threads (jobs not started yet are dropped)
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(jobsLock);
+            readerStopping = true;
+        }
+        jobsReady.notify_all();
+        if (reader.joinable()) reader.join();
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            std::lock_guard<std::mutex> compacting(compactLock);
+            if (stopping) return;
+            stopping = true;
+        }
+        queueReady.notify_all();
+        compactWake.notify_all();
+        if (writer.joinable()) writer.join();
+        if (compactor.joinable()) compactor.join();
+        if (appender.segment) {
+            std::lock_guard<std::mutex> guard(appender.segment->lock);
+            msync(appender.segment->map, appender.segment->committed, options.sync ? MS_SYNC : MS_ASYNC);
+        }
+    }
+
+    // Hand a batch to the writer (the batch comes back empty, with a recycled buffer). Never
+    // blocks unless `wait` is set; without it a batch that would overfill the queue is dropped.
+    bool submit(LogBatch& batch, bool wait = false) {
+        if (batch.empty()) return true;
+        std::unique_lock<std::mutex> guard(queueLock);
+        if (wait) {
+            queueDone.wait(guard, [&] { return stopping || queuedBytes + batch.size() <= options.maxPendingBytes; });
+        }
+        if (stopping || queuedBytes + batch.size() > options.maxPendingBytes) {
+            size_t records = 0;
+            for (size_t at = 0; at + sizeof(LogRecordHeader) <= batch.bytes.size(); ++records) {
+                LogRecordHeader h;
+                memcpy(&h, &batch.bytes[at], sizeof(h));
+                at += sizeof(h) + h.length;
+            }
+            droppedRecords.fetch_add(records, std::memory_order_relaxed);
+            batch.bytes.clear();
+            return false;
+        }
+        queuedBytes += batch.size();
+        queue.push_back(std::move(batch.bytes));
+        if (!spare.empty()) {
+            batch.bytes = std::move(spare.back());
+            spare.pop_back();
+        } else {
+            batch.bytes = std::vector<unsigned char>();
+        }
+        ++submitted;
+        guard.unlock();
+        queueReady.notify_one();
+        return true;
+    }
+
+    // Wait until every batch submitted so far is committed
+    void flush() {
+        std::unique_lock<std::mutex> guard(queueLock);
+        uint64_t target = submitted;
+        queueDone.wait(guard, [&] { return stopping || written >= target; });
+    }
+
+    // Run `job` on the reader thread, after the jobs scheduled before it. False (and not run)
+    // once the log is closed.
+    bool schedule(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(jobsLock);
+            if (readerStopping) return false;
+            jobs.push_back(std::move(job));
+        }
+        jobsReady.notify_one();
+        return true;
+    }
+
+    // Visit committed records of `stream` with timestamps in [from, to], oldest first, until
+    // `limit` records were visited or the visitor returns false. Returns the number visited.
+    size_t replay(uint64_t stream, int64_t from, int64_t to, size_t limit, const std::function<bool(const Entry&)>& visit) {
+        std::vector<SegmentPtr> snapshot;
+        {
+            std::lock_guard<std::mutex> guard(segmentsLock);
+            snapshot = segments; // Keeps them mapped even if compaction replaces them meanwhile
+        }
+        size_t visited = 0;
+        std::vector<std::pair<size_t, size_t>> ranges; // Candidate blocks [begin, end)
+        std::vector<unsigned char> plain;
+        RC4Stream keystream;
+        for (const SegmentPtr& s : snapshot) {
+            ranges.clear();
+            {
+                std::lock_guard<std::mutex> guard(s->lock);
+                auto first = std::lower_bound(s->index.begin(), s->index.end(), from,
+                                              [](const Block& b, int64_t t) { return b.lastTimestamp < t; });
+                for (auto b = first; b != s->index.end() && b->firstTimestamp <= to; ++b) {
+                    if (!b->mayHold(stream)) continue;
+                    size_t end = b + 1 != s->index.end() ? (b + 1)->offset : s->committed;
+                    ranges.push_back({b->offset, end});
+                }
+            }
+            for (const auto& range : ranges) {
+                startKeystream(keystream, *s, range.first);
+                for (size_t offset = range.first; offset < range.second;) {
+                    LogRecordHeader h;
+                    memcpy(&h, s->map + offset, sizeof(h));
+                    plain.resize(h.length);
+                    keystream.apply(s->map + offset + sizeof(h), plain.data(), h.length);
+                    offset += padded(h.length);
+                    if (h.timestamp > to) return visited; // Timestamps never decrease
+                    if (h.stream != stream || h.timestamp < from) continue;
+                    Entry e{h.stream, h.timestamp, h.sequence, h.type, h.flags, plain.data(), h.length};
+                    ++visited;
+                    if (!visit(e) || visited >= limit) return visited;
+                }
+            }
+        }
+        return visited;
+    }
+
+    // One compaction pass over the sealed segments: delete those past retention, rewrite those
+    // holding session records past session retention. Returns the segments changed.
+    size_t compact(int64_t now) {
+        std::lock_guard<std::mutex> compacting(compactLock);
+        const int64_t second = 1000000000;
+        int64_t cutoff = options.retentionSeconds ? now - options.retentionSeconds * second : INT64_MIN;
+        int64_t sessionCutoff = options.sessionRetentionSeconds && options.sessionType
+                                    ? now - options.sessionRetentionSeconds * second : INT64_MIN;
+        std::vector<SegmentPtr> snapshot;
+        {
+            std::lock_guard<std::mutex> guard(segmentsLock);
+            snapshot = segments;
+        }
+        size_t changed = 0;
+        for (const SegmentPtr& s : snapshot) {
+            {
+                std::lock_guard<std::mutex> guard(s->lock); // A sealed segment's index no longer changes
+                if (!s->sealed || s->index.empty()) continue; // The active segment is never touched
+            }
+            if (s->index.back().lastTimestamp < cutoff) {
+                {
+                    std::lock_guard<std::mutex> guard(segmentsLock);
+                    segments.erase(std::find(segments.begin(), segments.end(), s));
+                }
+                unlink(s->path.c_str()); // Readers holding it keep their mapping
+                unlink(indexPath(s->path).c_str());
+                ++changed;
+                continue;
+            }
+            bool stale = false;
+            for (const Block& b : s->index) {
+                if (b.firstTimestamp >= sessionCutoff) break;
+                if (b.sessionRecords) stale = true;
+            }
+            if (!stale) continue;
+            uint8_t sessionType = options.sessionType;
+            SegmentPtr fresh = rewrite(s, [&](const LogRecordHeader& h) {
+                return h.type != sessionType || h.timestamp >= sessionCutoff;
+            });
+            if (!fresh) continue;
+            std::lock_guard<std::mutex> guard(segmentsLock);
+            *std::find(segments.begin(), segments.end(), s) = fresh;
+            ++changed;
+        }
+        compactedSegments.fetch_add(changed, std::memory_order_relaxed);
+        return changed;
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> guard(segmentsLock);
+        return {recordsWritten.load(), bytesWritten.load(), commits.load(), droppedRecords.load(),
+                segments.size(), compactedSegments.load()};
+    }
+};
+
+#endif // MESSAGE_LOG_H
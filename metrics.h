@@ -0,0 +1,331 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>      // For std::min
+#include <atomic>         // For single-writer counters readable from the stats thread
+#include <chrono>         // For timestamps and uptime
+#include <cerrno>         // For EINTR
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For strncpy()
+#include <functional>     // For gauges read at report time
+#include <memory>         // For unique_ptr owning per-thread blocks
+#include <mutex>          // For the thread list and rate sampling
+#include <sstream>        // For rendering the text report
+#include <string>         // For thread names and the report
+#include <thread>         // For the endpoint thread
+#include <utility>        // For std::pair
+#include <vector>         // For the thread list
+#include <netinet/in.h>   // For sockaddr_in
+#include <sys/socket.h>   // For the endpoint socket
+#include <sys/un.h>       // For sockaddr_un
+#include <unistd.h>       // For close()/unlink()
+#include "latency_histogram.h" // For bucket layout and percentiles
+
+// Build with -DMETRICS_ENABLED=0 to compile the instrumentation out (for measuring its cost)
+#ifndef METRICS_ENABLED
+#define METRICS_ENABLED 1
+#endif
+
+// Nanosecond timestamp for hot-path timers; 0 when metrics are compiled out
+inline uint64_t metricsNow() {
+#if METRICS_ENABLED
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return 0;
+#endif
+}
+
+// Counter written by exactly one thread and read by any. A relaxed load+store instead of an
+// atomic add compiles to a plain increment: no lock prefix, no contended cache line.
+class StatCounter {
+private:
+    std::atomic<uint64_t> value{0};
+
+public:
+    void add(uint64_t n = 1) {
+#if METRICS_ENABLED
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#else
+        (void)n;
+#endif
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Single-writer latency histogram with LatencyHistogram's bucket layout, readable while it is written
+class StatHistogram {
+private:
+    std::atomic<uint64_t> counts[LatencyHistogram::BUCKETS];
+    std::atomic<uint64_t> maximum{0};
+
+public:
+    StatHistogram() {
+        for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t nanos, uint64_t times = 1) {
+#if METRICS_ENABLED
+        std::atomic<uint64_t>& c = counts[LatencyHistogram::bucketOf(nanos)];
+        c.store(c.load(std::memory_order_relaxed) + times, std::memory_order_relaxed);
+        if (nanos > maximum.load(std::memory_order_relaxed)) maximum.store(nanos, std::memory_order_relaxed);
+#else
+        (void)nanos;
+        (void)times;
+#endif
+    }
+
+    void addTo(LatencyHistogram& out) const { // Merge a snapshot (values rounded to bucket edges)
+        uint64_t top = maximum.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+            uint64_t n = counts[i].load(std::memory_order_relaxed);
+            if (n) out.record(std::min(LatencyHistogram::valueOf(i), top), n);
+        }
+    }
+};
+
+// Everything one server thread measures; each thread owns one and is its only writer
+struct alignas(64) ThreadMetrics {
+    char name[32];                   // Shown as the thread label in the report
+
+    StatCounter connectionsAccepted; // Sessions opened
+    StatCounter connectionsClosed;   // Sessions closed
+    StatCounter bytesIn;             // Frame bytes read from clients (headers included)
+    StatCounter bytesOut;            // Bytes written to clients
+    StatCounter messagesIn;          // DATA frames decrypted
+    StatCounter messagesOut;         // DATA frames encrypted and queued
+    StatCounter rotations;           // Key rotations started
+    StatCounter readCalls;           // read() system calls
+    StatCounter sendCalls;           // send() system calls
+    StatCounter roomMessages;        // Room messages received for fan-out
+    StatCounter roomDeliveries;      // Room messages encrypted for a member
+    StatCounter roomDropped;         // Room messages dropped for members that fell too far behind
+    StatCounter historyReplayed;     // Logged messages replayed (room history, and sessions' own after resuming)
+    StatCounter fileBytesIn;         // File transfer bytes stored from uploads
+    StatCounter fileBytesOut;        // File transfer bytes read for downloads
+    StatCounter filesCompleted;      // Uploads and downloads finished
+    StatCounter packedPlainBytes;    // Plaintext bytes of compressed frames, both directions
+    StatCounter packedWireBytes;     // ...and what they took on the wire
+    StatCounter ticketsIssued;       // Resumption tickets handed out
+    StatCounter resumedCached;       // Sessions resumed from the cache (old keystreams continued)
+    StatCounter resumedTicket;       // Sessions resumed from a ticket alone (new keystreams)
+    StatCounter resumeRejected;      // Resumptions refused (bad or expired ticket): fresh key instead
+
+    StatCounter ksaNanos;            // Time in RC4 key schedules
+    StatCounter prgaNanos;           // Time generating keystream (decrypt + encrypt)
+    StatCounter readNanos;           // Time inside read()
+    StatCounter sendNanos;           // Time inside send()
+    StatCounter compressNanos;       // Time compressing and decompressing payloads
+    StatCounter resumeNanos;          // Time handling MSG_RESUME (ticket check, state restore, new ticket)
+
+    StatHistogram cryptoLatency;     // Per message: decrypt -> encrypt into the outbox
+    StatHistogram sendLatency;       // Per message: decrypt -> handed to the kernel (upper bound per batch)
+};
+
+// Registry of per-thread metrics, summed only when someone asks for a report
+class Metrics {
+private:
+    std::mutex lock;                                      // Guards the thread list and rate sample
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;  // Never shrinks: references stay valid
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point lastReport;     // For messages/second between scrapes
+    uint64_t lastMessages;
+    std::vector<std::pair<const char*, std::function<double()>>> gauges; // Values owned by other components
+
+    static void line(std::ostringstream& out, const char* metric, const char* label, double value) {
+        out << metric;
+        if (label && *label) out << "{thread=\"" << label << "\"}";
+        out << " " << value << "\n";
+    }
+
+public:
+    Metrics() : started(std::chrono::steady_clock::now()), lastReport(started), lastMessages(0) {}
+
+    // Give the calling thread its own block to write to
+    ThreadMetrics& registerThread(const std::string& name) {
+        std::lock_guard<std::mutex> guard(lock);
+        threads.emplace_back(new ThreadMetrics());
+        strncpy(threads.back()->name, name.c_str(), sizeof(threads.back()->name) - 1);
+        return *threads.back();
+    }
+
+    // Report a value read from elsewhere (e.g. a component with its own thread) on every scrape
+    void addGauge(const char* metric, std::function<double()> read) {
+        std::lock_guard<std::mutex> guard(lock);
+        gauges.emplace_back(metric, std::move(read));
+    }
+
+    // Plain-text report (Prometheus exposition format): per-thread counters, totals and percentiles
+    std::string render() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::ostringstream out;
+        out.precision(10);
+        auto now = std::chrono::steady_clock::now();
+
+        struct Field { const char* metric; StatCounter ThreadMetrics::*counter; double scale; };
+        static const Field fields[] = {
+            {"lava_connections_accepted_total", &ThreadMetrics::connectionsAccepted, 1},
+            {"lava_connections_closed_total", &ThreadMetrics::connectionsClosed, 1},
+            {"lava_bytes_in_total", &ThreadMetrics::bytesIn, 1},
+            {"lava_bytes_out_total", &ThreadMetrics::bytesOut, 1},
+            {"lava_messages_in_total", &ThreadMetrics::messagesIn, 1},
+            {"lava_messages_out_total", &ThreadMetrics::messagesOut, 1},
+            {"lava_key_rotations_total", &ThreadMetrics::rotations, 1},
+            {"lava_read_calls_total", &ThreadMetrics::readCalls, 1},
+            {"lava_send_calls_total", &ThreadMetrics::sendCalls, 1},
+            {"lava_room_messages_total", &ThreadMetrics::roomMessages, 1},
+            {"lava_room_deliveries_total", &ThreadMetrics::roomDeliveries, 1},
+            {"lava_room_dropped_total", &ThreadMetrics::roomDropped, 1},
+            {"lava_history_replayed_total", &ThreadMetrics::historyReplayed, 1},
+            {"lava_file_bytes_received_total", &ThreadMetrics::fileBytesIn, 1},
+            {"lava_file_bytes_sent_total", &ThreadMetrics::fileBytesOut, 1},
+            {"lava_files_completed_total", &ThreadMetrics::filesCompleted, 1},
+            {"lava_compressed_plain_bytes_total", &ThreadMetrics::packedPlainBytes, 1},
+            {"lava_compressed_wire_bytes_total", &ThreadMetrics::packedWireBytes, 1},
+            {"lava_tickets_issued_total", &ThreadMetrics::ticketsIssued, 1},
+            {"lava_resumed_cached_total", &ThreadMetrics::resumedCached, 1},
+            {"lava_resumed_ticket_total", &ThreadMetrics::resumedTicket, 1},
+            {"lava_resume_rejected_total", &ThreadMetrics::resumeRejected, 1},
+            {"lava_ksa_seconds_total", &ThreadMetrics::ksaNanos, 1e-9},
+            {"lava_prga_seconds_total", &ThreadMetrics::prgaNanos, 1e-9},
+            {"lava_read_seconds_total", &ThreadMetrics::readNanos, 1e-9},
+            {"lava_send_seconds_total", &ThreadMetrics::sendNanos, 1e-9},
+            {"lava_compress_seconds_total", &ThreadMetrics::compressNanos, 1e-9},
+            {"lava_resume_seconds_total", &ThreadMetrics::resumeNanos, 1e-9},
+        };
+
+        line(out, "lava_metrics_enabled", nullptr, METRICS_ENABLED);
+        line(out, "lava_uptime_seconds", nullptr, std::chrono::duration<double>(now - started).count());
+        uint64_t accepted = 0, closed = 0, messages = 0;
+        for (const Field& f : fields) {
+            uint64_t total = 0;
+            for (auto& t : threads) {
+                uint64_t v = ((*t).*f.counter).get();
+                line(out, f.metric, t->name, v * f.scale);
+                total += v;
+            }
+            line(out, f.metric, nullptr, total * f.scale);
+            if (f.counter == &ThreadMetrics::connectionsAccepted) accepted = total;
+            if (f.counter == &ThreadMetrics::connectionsClosed) closed = total;
+            if (f.counter == &ThreadMetrics::messagesIn) messages = total;
+        }
+        line(out, "lava_sessions_active", nullptr, double(accepted - closed));
+
+        double elapsed = std::chrono::duration<double>(now - lastReport).count();
+        line(out, "lava_messages_per_second", nullptr, elapsed > 0 ? (messages - lastMessages) / elapsed : 0); // Since the previous report
+        lastReport = now;
+        lastMessages = messages;
+        for (auto& g : gauges) line(out, g.first, nullptr, g.second());
+
+        struct Histogram { const char* metric; StatHistogram ThreadMetrics::*histogram; };
+        static const Histogram histograms[] = {
+            {"lava_crypto_latency_seconds", &ThreadMetrics::cryptoLatency},
+            {"lava_send_latency_seconds", &ThreadMetrics::sendLatency},
+        };
+        for (const Histogram& h : histograms) {
+            LatencyHistogram merged;
+            for (auto& t : threads) ((*t).*h.histogram).addTo(merged);
+            for (double q : {0.5, 0.9, 0.99, 0.999}) {
+                out << h.metric << "{quantile=\"" << q << "\"} " << merged.percentile(q) * 1e-9 << "\n";
+            }
+            out << h.metric << "_max " << merged.max() * 1e-9 << "\n";
+            out << h.metric << "_count " << merged.count() << "\n";
+        }
+        return out.str();
+    }
+};
+
+// Serves Metrics::render() over HTTP/1.0 on localhost TCP or a Unix socket, from its own thread,
+// so scraping never touches the event loops. Try: curl localhost:9100/metrics
+//                                            or: curl --unix-socket /tmp/lava.sock http://x/metrics
+class StatsEndpoint {
+private:
+    Metrics& metrics;
+    int listenFd;
+    std::string unixPath;      // Removed again on stop()
+    std::atomic<bool> running;
+    std::thread worker;
+
+    void serve() {
+        while (running.load()) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return; // Listening socket shut down
+            }
+            timeval timeout{1, 0}; // Don't let a silent client stall the endpoint
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char request[1024];
+            ssize_t n = recv(fd, request, sizeof(request), 0); // Any request gets the report
+            if (n > 0) {
+                std::string body = metrics.render();
+                std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                size_t sent = 0;
+                while (sent < response.size()) {
+                    ssize_t w = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                    if (w <= 0) break;
+                    sent += w;
+                }
+            }
+            close(fd);
+        }
+    }
+
+    bool launch(int fd) {
+        if (listen(fd, 16) < 0) {
+            close(fd);
+            return false;
+        }
+        listenFd = fd;
+        running = true;
+        worker = std::thread(&StatsEndpoint::serve, this);
+        return true;
+    }
+
+public:
+    StatsEndpoint(Metrics& m) : metrics(m), listenFd(-1), running(false) {}
+    ~StatsEndpoint() { stop(); }
+
+    bool listenTcp(int port) { // Loopback only: the report is for local scrapers
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+            close(fd);
+            return false;
+        }
+        return launch(fd);
+    }
+
+    bool listenUnix(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) return false;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(path.c_str()); // Stale socket from an earlier run
+        if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+            close(fd);
+            return false;
+        }
+        unixPath = path;
+        return launch(fd);
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        shutdown(listenFd, SHUT_RDWR); // Wakes accept()
+        if (worker.joinable()) worker.join();
+        close(listenFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+    }
+};
+
+#endif // METRICS_H
@@ -1,6 +1,12 @@
 import cv2
+import os
+import sys
 import time
 
+# --stream: keep rewriting lava_frame.ppm (raw pixels) at the camera's frame rate for
+# server2's entropy pool; each frame is written under a temporary name and renamed into place
+STREAM = "--stream" in sys.argv
+
 # Initialize the webcam
 cam = cv2.VideoCapture(0)
 cv2.namedWindow("Python Webcam Screenshot App")
@@ -16,6 +22,10 @@ while True:
     
     # Display the webcam feed
     cv2.imshow("Python Webcam Screenshot App", frame)
+
+    if STREAM:
+        cv2.imwrite("lava_frame.tmp.ppm", frame)
+        os.replace("lava_frame.tmp.ppm", "lava_frame.ppm")
     
     k = cv2.waitKey(1)
     
@@ -0,0 +1,152 @@
+#ifndef RC4_H
+#define RC4_H
+
+#include <cstddef>        // For size_t
+#include <cstdint>        // For uint32_t state words
+#include <string>         // For std::string keys and one-shot results
+#include <utility>        // For std::swap
+
+// RC4 Encryption/Decryption class (one-shot: every call re-keys and restarts the keystream)
+class RC4 {
+private:
+    unsigned char S[256]; // Permutation array for RC4
+
+    // Key Scheduling Algorithm (KSA) initializes the permutation array
+    void KSA(const std::string& key) {
+        for (int i = 0; i < 256; ++i) {
+            S[i] = i;
+        }
+
+        int j = 0;
+        for (int i = 0; i < 256; ++i) {
+            j = (j + S[i] + static_cast<unsigned char>(key[i % key.size()])) % 256; // Key-dependent swapping
+            std::swap(S[i], S[j]);
+        }
+    }
+
+    // Pseudo-Random Generation Algorithm (PRGA) generates the keystream
+    std::string PRGA(const std::string& data) {
+        std::string result(data.size(), 0); // Result will have the same size as the input
+        int i = 0, j = 0;
+
+        for (size_t k = 0; k < data.size(); ++k) {
+            i = (i + 1) % 256;
+            j = (j + S[i]) % 256;
+            std::swap(S[i], S[j]);
+            unsigned char rnd = S[(S[i] + S[j]) % 256]; // Generate pseudo-random byte
+            result[k] = data[k] ^ rnd; // XOR input data with the generated byte
+        }
+
+        return result; // Return encrypted/decrypted data
+    }
+
+public:
+    // Encrypt data using the given key
+    std::string encrypt(const std::string& key, const std::string& data) {
+        KSA(key); // Initialize the permutation array
+        return PRGA(data); // Generate encrypted data
+    }
+
+    // Decrypt data (same as encrypt for RC4)
+    std::string decrypt(const std::string& key, const std::string& data) {
+        return encrypt(key, data);
+    }
+};
+
+// RC4 keystream that is keyed once and then continues across calls.
+// Feeding a message through apply() in pieces gives the same bytes as RC4::encrypt on the whole.
+// The permutation is held as 32-bit words (1 KB, stays in L1) so swaps avoid byte-store stalls.
+class RC4Stream {
+private:
+    uint32_t S[256]; // Permutation array (values 0-255)
+    uint32_t i, j;   // PRGA indices carried over between calls
+    uint64_t offset; // Keystream bytes produced since the key schedule
+
+public:
+    RC4Stream() : i(0), j(0), offset(0) {}
+
+    // Run the key schedule and rewind the keystream
+    void init(const unsigned char* key, size_t length) {
+        for (uint32_t k = 0; k < 256; ++k) {
+            S[k] = k;
+        }
+        uint32_t jj = 0;
+        for (uint32_t k = 0; k < 256; ++k) {
+            jj = (jj + S[k] + key[k % length]) & 0xff;
+            std::swap(S[k], S[jj]);
+        }
+        i = j = 0;
+        offset = 0;
+    }
+
+    void init(const std::string& key) {
+        init(reinterpret_cast<const unsigned char*>(key.data()), key.size());
+    }
+
+    // XOR the next `length` keystream bytes over `in`, writing to `out` (may be the same buffer)
+    void apply(const unsigned char* in, unsigned char* out, size_t length) {
+        uint32_t* state = S;
+        uint32_t x = i, y = j; // Indices live in registers for the whole call
+        for (size_t k = 0; k < length; ++k) {
+            x = (x + 1) & 0xff;
+            uint32_t a = state[x];
+            y = (y + a) & 0xff;
+            uint32_t b = state[y];
+            state[x] = b;
+            state[y] = a;
+            out[k] = in[k] ^ static_cast<unsigned char>(state[(a + b) & 0xff]);
+        }
+        i = x;
+        j = y;
+        offset += length;
+    }
+
+    void apply(unsigned char* data, size_t length) { apply(data, data, length); } // Encrypt/decrypt in place
+
+    // Discard the next `length` keystream bytes (bytes the peer produced that never reached us)
+    void skip(uint64_t length) {
+        unsigned char scratch[256] = {};
+        while (length > 0) {
+            size_t n = length < sizeof(scratch) ? size_t(length) : sizeof(scratch);
+            apply(scratch, n); // Contents don't matter; only the state advances
+            length -= n;
+        }
+    }
+
+    uint64_t position() const { return offset; } // Keystream bytes used so far
+};
+
+// Cipher state of one connection: independent keystreams for each direction.
+// Both ends derive the two streams from the shared session key, so client->server and
+// server->client traffic never reuse keystream bytes, and neither restarts between messages.
+class CipherContext {
+private:
+    RC4Stream tx; // Keystream for bytes we send
+    RC4Stream rx; // Keystream for bytes we receive
+
+public:
+    enum Role { CLIENT, SERVER }; // Which end of the connection owns this context
+
+    void init(const std::string& key, Role role) { // Key both directions (runs the KSA twice per session)
+        std::string clientToServer = key + ":c2s";
+        std::string serverToClient = key + ":s2c";
+        tx.init(role == CLIENT ? clientToServer : serverToClient);
+        rx.init(role == CLIENT ? serverToClient : clientToServer);
+    }
+
+    // Key rotation happens one direction at a time, each at a frame boundary the peer can see
+    void adoptTx(const CipherContext& next) { tx = next.tx; } // Switch our sending keystream to `next`'s
+    void adoptRx(const CipherContext& next) { rx = next.rx; } // Switch our receiving keystream to `next`'s
+
+    void encrypt(const unsigned char* in, unsigned char* out, size_t length) { tx.apply(in, out, length); }
+    void encrypt(unsigned char* data, size_t length) { tx.apply(data, length); }
+    void decrypt(const unsigned char* in, unsigned char* out, size_t length) { rx.apply(in, out, length); }
+    void decrypt(unsigned char* data, size_t length) { rx.apply(data, length); }
+
+    // Keystream positions, so a resumed connection can line both ends up again
+    uint64_t sent() const { return tx.position(); }     // Bytes encrypted since the send key took effect
+    uint64_t received() const { return rx.position(); } // Bytes decrypted since the receive key took effect
+    void skipReceived(uint64_t length) { rx.skip(length); }
+};
+
+#endif // RC4_H
@@ -0,0 +1,397 @@
+#ifndef RESUMPTION_H
+#define RESUMPTION_H
+
+#include <algorithm>      // For std::min
+#include <cerrno>         // For EINTR
+#include <chrono>         // For ticket lifetimes
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()
+#include <list>           // For the cache's recency order
+#include <mutex>          // For the cache lock shared by the workers
+#include <string>         // For tickets and secrets
+#include <unordered_map>  // For cache lookups by ticket id
+#include <vector>         // For the rooms a cached session had joined
+#include <sys/random.h>   // For getrandom() (client nonces)
+#include "entropy_pool.h" // For chacha20Block() and ticket keys, ids and secrets
+#include "framing.h"      // For frame headers and historyField()
+#include "rc4.h"          // For the cipher state a resumption restores
+
+// Session resumption: a client that reconnects shows the server a ticket from its previous
+// connection instead of waiting for a new key.
+//
+//  - The server hands out a ticket (MSG_TICKET, encrypted) once the client negotiates
+//    FEATURE_RESUMPTION, and a new one after every resumption. The ticket is opaque to the
+//    client: the server seals it with ChaCha20 and authenticates it with SipHash-2-4 under
+//    keys that never leave the process. Next to it the client receives the ticket's secret.
+//  - When the connection closes, the server keeps its cipher state, rooms and log stream in a
+//    ResumptionCache under the ticket id (LRU, bounded, entries expire with the ticket).
+//  - On reconnect the client sends MSG_RESUME in the clear. If the cache still holds the
+//    session, both ends continue their old keystreams from where they stopped (no key
+//    schedule at all); otherwise a valid ticket alone is enough to key a new session from its
+//    secret, a client nonce and a nonce the server draws for its answer. Only a bad or expired
+//    ticket falls back to a fresh MSG_KEY.
+//
+// A cached session is taken out of the cache when it resumes, so its keystreams are never
+// continued twice; replaying a ticket only ever yields the ticket path, which needs the secret
+// and, thanks to the server's nonce, keys a different RC4 stream every time.
+const uint32_t FEATURE_RESUMPTION = 2;    // MSG_FEATURES bit: send MSG_TICKET, accept MSG_RESUME
+const uint64_t RESUME_MAX_SKIP = 16 << 20; // Most keystream a cached resumption discards to line up
+const size_t TICKET_SECRET_BYTES = 16;   // Random bytes (not hex): the sealed body then fits one ChaCha20 block
+
+// MSG_RESUME client -> server, in the clear: | nonce (8) | sent (8) | received (8) | ticket |
+// (sent/received: the client's keystream positions when it lost the connection). An empty
+// MSG_RESUME marks the point after which the client encrypts under the keys it was answered with.
+const size_t RESUME_REQUEST_HEADER = 24;
+
+// MSG_RESUME server -> client, in the clear: | status (1) | features (4) | sent (8) | since (8) | nonce (16) |
+// `sent` is the server's send position (cached resumption only); `since` the wall-clock time in
+// nanoseconds the client may have missed messages from, for MSG_HISTORY; `nonce` the server's
+// half of a ticket resumption's key (random for RESUME_TICKET, zero otherwise).
+const size_t RESUME_NONCE_BYTES = 16;
+const size_t RESUME_REPLY_SIZE = 21 + RESUME_NONCE_BYTES;
+enum ResumeStatus : uint8_t {
+    RESUME_REJECTED = 0, // Ticket unusable: keys come from the MSG_KEY frame
+    RESUME_CACHED = 1,   // Old keystreams continue, rooms rejoined
+    RESUME_TICKET = 2,   // New keystreams from the ticket's secret and both nonces
+};
+
+// MSG_TICKET server -> client, encrypted: | lifetime seconds (4) | secret length (1) | secret | ticket |
+
+inline int64_t resumeWallNow() { // Wall-clock nanoseconds (tickets outlive steady-clock epochs of a client)
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void putField(unsigned char* p, uint64_t value, int bytes) { // Big-endian, like historyField()
+    for (int i = bytes - 1; i >= 0; --i, value >>= 8) p[i] = uint8_t(value);
+}
+
+// A client's MSG_RESUME nonce, from the kernel's random source (the server's nonce keeps keys
+// apart even if this one repeats)
+inline uint64_t resumeNonce() {
+    uint64_t nonce = 0;
+    while (getrandom(&nonce, sizeof(nonce), 0) < 0 && errno == EINTR) {}
+    return nonce;
+}
+
+// SipHash-2-4 of `length` bytes under a 128-bit key (authenticates tickets)
+inline uint64_t sipHash24(const uint64_t key[2], const unsigned char* data, size_t length) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0], v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0], v3 = 0x7465646279746573ULL ^ key[1];
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&] {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t m;
+        memcpy(&m, data + i, 8); // Little-endian words
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    uint64_t last = uint64_t(length) << 56;
+    for (size_t k = 0; i + k < length; ++k) last |= uint64_t(data[i + k]) << (8 * k);
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; ++r) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Key both directions of a ticket resumption: SipHash-2-4 keyed with the ticket's secret, as a
+// PRF over both nonces, makes 16 key bytes (hex, like a fresh session key). The server draws
+// its nonce for every answer, so a replayed MSG_RESUME never keys an RC4 stream used before.
+inline std::string ticketSessionKey(const std::string& secret, uint64_t clientNonce, const unsigned char* serverNonce) {
+    static const char HEX[] = "0123456789abcdef";
+    uint64_t prfKey[2] = {0, 0};
+    memcpy(prfKey, secret.data(), std::min(secret.size(), sizeof(prfKey))); // Secrets are TICKET_SECRET_BYTES long
+    unsigned char input[1 + 8 + RESUME_NONCE_BYTES];
+    putField(input + 1, clientNonce, 8);
+    memcpy(input + 9, serverNonce, RESUME_NONCE_BYTES);
+    std::string key;
+    for (uint8_t half = 0; half < 2; ++half) {
+        input[0] = half; // Each half of the key is its own PRF output
+        uint64_t word = sipHash24(prfKey, input, sizeof(input));
+        for (int shift = 60; shift >= 0; shift -= 4) key += HEX[(word >> shift) & 15];
+    }
+    memset(prfKey, 0, sizeof(prfKey));
+    return key;
+}
+
+// What a ticket carries (only the server can read it)
+struct TicketBody {
+    uint64_t id;          // Cache key of the session it was issued on
+    int64_t issued;       // Wall-clock nanoseconds
+    int64_t expires;      // Wall-clock nanoseconds; refused afterwards
+    uint64_t logStream;   // Message log stream the resumed session keeps writing to
+    uint32_t features;    // Negotiated features the resumed session keeps
+    std::string secret;   // Shared with the client in MSG_TICKET; keys a ticket resumption
+};
+
+// Seals tickets: | version (1) | nonce (12) | ChaCha20(body) | SipHash-2-4 tag (8) |
+// body = | id (8) | issued (8) | expires (8) | log stream (8) | features (4) | secret length (1) | secret |
+// Both keys are drawn when the server starts, so tickets die with the process that issued them.
+class TicketCodec {
+private:
+    static const uint8_t VERSION = 1;
+    static const size_t NONCE_SIZE = 12;
+    static const size_t BODY_HEADER = 37;
+    static const size_t TAG_SIZE = 8;
+
+    uint32_t cipherKey[8]; // ChaCha20 key
+    uint64_t macKey[2];    // SipHash key
+
+    // XOR the ChaCha20 keystream for `nonce` over `length` bytes
+    void crypt(const unsigned char* nonce, unsigned char* data, size_t length) const {
+        uint64_t counter;
+        uint32_t word;
+        memcpy(&counter, nonce, 8);
+        memcpy(&word, nonce + 8, 4);
+        uint32_t block[16];
+        for (size_t at = 0; at < length; at += 64) {
+            chacha20Block(cipherKey, counter++, word, block);
+            const unsigned char* stream = reinterpret_cast<const unsigned char*>(block);
+            for (size_t k = 0; k < 64 && at + k < length; ++k) data[at + k] ^= stream[k];
+        }
+    }
+
+public:
+    static const size_t OVERHEAD = 1 + NONCE_SIZE + TAG_SIZE;
+
+    explicit TicketCodec(EntropyPool& entropy) {
+        entropy.generate(reinterpret_cast<unsigned char*>(cipherKey), sizeof(cipherKey));
+        entropy.generate(reinterpret_cast<unsigned char*>(macKey), sizeof(macKey));
+    }
+
+    ~TicketCodec() {
+        memset(cipherKey, 0, sizeof(cipherKey));
+        memset(macKey, 0, sizeof(macKey));
+    }
+
+    std::string seal(const TicketBody& body, EntropyPool& entropy) const {
+        size_t secret = body.secret.size() < 255 ? body.secret.size() : 255;
+        std::string ticket(1 + NONCE_SIZE + BODY_HEADER + secret + TAG_SIZE, '\0');
+        unsigned char* p = reinterpret_cast<unsigned char*>(&ticket[0]);
+        p[0] = VERSION;
+        entropy.generate(p + 1, NONCE_SIZE);
+        unsigned char* b = p + 1 + NONCE_SIZE;
+        putField(b, body.id, 8);
+        putField(b + 8, uint64_t(body.issued), 8);
+        putField(b + 16, uint64_t(body.expires), 8);
+        putField(b + 24, body.logStream, 8);
+        putField(b + 32, body.features, 4);
+        b[36] = uint8_t(secret);
+        memcpy(b + BODY_HEADER, body.secret.data(), secret);
+        crypt(p + 1, b, BODY_HEADER + secret);
+        size_t signedBytes = ticket.size() - TAG_SIZE;
+        putField(p + signedBytes, sipHash24(macKey, p, signedBytes), 8);
+        return ticket;
+    }
+
+    // Check and decrypt a ticket; false if it was not sealed by this codec or was altered
+    bool open(const unsigned char* ticket, size_t length, TicketBody& body) const {
+        if (length < OVERHEAD + BODY_HEADER || length > OVERHEAD + BODY_HEADER + 255 || ticket[0] != VERSION) return false;
+        size_t signedBytes = length - TAG_SIZE;
+        if (historyField(ticket + signedBytes, 8) != sipHash24(macKey, ticket, signedBytes)) return false;
+        unsigned char b[BODY_HEADER + 255];
+        size_t bodyLength = signedBytes - 1 - NONCE_SIZE;
+        memcpy(b, ticket + 1 + NONCE_SIZE, bodyLength);
+        crypt(ticket + 1, b, bodyLength);
+        if (BODY_HEADER + b[36] != bodyLength) return false;
+        body.id = historyField(b, 8);
+        body.issued = int64_t(historyField(b + 8, 8));
+        body.expires = int64_t(historyField(b + 16, 8));
+        body.logStream = historyField(b + 24, 8);
+        body.features = uint32_t(historyField(b + 32, 4));
+        body.secret.assign(reinterpret_cast<char*>(b + BODY_HEADER), b[36]);
+        memset(b, 0, sizeof(b));
+        return true;
+    }
+};
+
+// State of closed sessions, kept until their ticket comes back, expires, or the cache needs
+// the room for a more recently closed one. Shared by every worker behind one lock, taken once
+// when a session closes and once when a client resumes (never per message). Each entry holds
+// both RC4 states, a little over 2 KB.
+class ResumptionCache {
+public:
+    struct Entry {
+        CipherContext cipher;       // Keystreams where the connection left them
+        std::string key;            // Session key they were derived from
+        uint64_t logStream;         // Message log stream of the session
+        uint32_t features;          // Negotiated features
+        std::vector<std::string> rooms; // Rooms the session had joined
+        int64_t closedAt;           // Wall-clock nanoseconds
+        int64_t expiresAt;          // Wall-clock nanoseconds: the ticket's expiry
+        uint64_t bytesSinceRekey;   // Rotation progress carries over to the resumed session
+        uint64_t messagesSinceRekey;
+        std::chrono::steady_clock::time_point keyStart;
+    };
+
+    struct Stats {
+        uint64_t entries;  // Sessions held now
+        uint64_t stored;   // Sessions put in
+        uint64_t hits;     // Resumptions served from the cache
+        uint64_t misses;   // Tickets whose session was not (or no longer) cached
+        uint64_t evicted;  // Entries pushed out by capacity
+        uint64_t expired;  // Entries dropped because their ticket expired
+    };
+
+private:
+    using Order = std::list<std::pair<uint64_t, Entry>>; // Most recently closed first
+
+    mutable std::mutex lock;
+    size_t limit;
+    Order order;
+    std::unordered_map<uint64_t, Order::iterator> index;
+    Stats counts;
+
+public:
+    explicit ResumptionCache(size_t capacity) : limit(capacity), counts{} {}
+
+    ResumptionCache(const ResumptionCache&) = delete;
+    ResumptionCache& operator=(const ResumptionCache&) = delete;
+
+    // Keep a closed session under its ticket id, evicting expired entries and then the least
+    // recently closed ones to stay within capacity (a capacity of 0 keeps nothing)
+    void put(uint64_t id, Entry&& entry) {
+        if (limit == 0) return;
+        int64_t now = resumeWallNow();
+        std::lock_guard<std::mutex> guard(lock);
+        while (!order.empty() && (order.back().second.expiresAt <= now || order.size() >= limit)) {
+            ++(order.back().second.expiresAt <= now ? counts.expired : counts.evicted);
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+        auto existing = index.find(id);
+        if (existing != index.end()) { // Same ticket closed twice (cannot happen with random ids, but stay consistent)
+            order.erase(existing->second);
+            index.erase(existing);
+        }
+        order.emplace_front(id, std::move(entry));
+        index[id] = order.begin();
+        ++counts.stored;
+    }
+
+    // Remove and return the session cached under `id`; false if absent or expired
+    bool take(uint64_t id, Entry& entry) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(id);
+        if (it == index.end()) {
+            ++counts.misses;
+            return false;
+        }
+        bool fresh = it->second->second.expiresAt > resumeWallNow();
+        if (fresh) entry = std::move(it->second->second);
+        order.erase(it->second);
+        index.erase(it);
+        ++(fresh ? counts.hits : counts.expired);
+        if (!fresh) ++counts.misses;
+        return fresh;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> guard(lock);
+        Stats s = counts;
+        s.entries = order.size();
+        return s;
+    }
+
+    size_t capacity() const { return limit; }
+};
+
+// Everything the server's workers share for resumption
+struct Resumption {
+    TicketCodec tickets;     // Seals and opens tickets
+    ResumptionCache cache;   // Recently closed sessions
+    int64_t lifetimeNanos;   // How long a ticket (and the cache entry behind it) is honoured
+
+    Resumption(EntropyPool& entropy, size_t capacity, int64_t lifetimeSeconds)
+        : tickets(entropy), cache(capacity), lifetimeNanos(lifetimeSeconds * 1000000000LL) {}
+};
+
+// Client side: what a client keeps between connections to resume its session
+struct ResumeTicket {
+    std::string ticket;   // Opaque, returned to the server as it was received
+    std::string secret;   // Keys a ticket resumption
+    std::string key;      // Session key when the connection closed
+    CipherContext cipher; // Keystreams when the connection closed (a cached resumption continues them)
+    int64_t expires = 0;  // Wall-clock nanoseconds (our clock) after which the server will refuse it
+
+    bool valid() const { return !ticket.empty() && resumeWallNow() < expires; }
+    void clear() { ticket.clear(); secret.clear(); key.clear(); expires = 0; }
+
+    // Take a decrypted MSG_TICKET payload; false if it is malformed
+    bool accept(const unsigned char* payload, size_t length) {
+        if (length < 5 || length < 5 + size_t(payload[4])) return false;
+        uint64_t lifetime = historyField(payload, 4);
+        secret.assign(reinterpret_cast<const char*>(payload + 5), payload[4]);
+        ticket.assign(reinterpret_cast<const char*>(payload + 5 + payload[4]), length - 5 - payload[4]);
+        expires = resumeWallNow() + int64_t(lifetime) * 1000000000LL;
+        return !ticket.empty();
+    }
+
+    // The MSG_RESUME frame offering this ticket under `nonce`
+    std::string request(uint64_t nonce) const {
+        std::string frame(FRAME_HEADER_SIZE + RESUME_REQUEST_HEADER, '\0');
+        unsigned char* p = reinterpret_cast<unsigned char*>(&frame[0]);
+        encodeHeader(FrameHeader{uint32_t(RESUME_REQUEST_HEADER + ticket.size()), MSG_RESUME, 0, 0}, p);
+        putField(p + FRAME_HEADER_SIZE, nonce, 8);
+        putField(p + FRAME_HEADER_SIZE + 8, cipher.sent(), 8);
+        putField(p + FRAME_HEADER_SIZE + 16, cipher.received(), 8);
+        return frame + ticket;
+    }
+};
+
+// Decoded MSG_RESUME answer
+struct ResumeReply {
+    uint8_t status = RESUME_REJECTED; // ResumeStatus
+    uint32_t features = 0;  // Features the resumed session has (RESUME_REJECTED: none yet)
+    uint64_t sent = 0;      // Server send position (RESUME_CACHED)
+    int64_t since = 0;      // Messages from here on may have been missed
+    unsigned char nonce[RESUME_NONCE_BYTES] = {}; // Server's half of a ticket resumption's key
+
+    bool decode(const unsigned char* payload, size_t length) {
+        if (length != RESUME_REPLY_SIZE || payload[0] > RESUME_TICKET) return false;
+        status = payload[0];
+        features = uint32_t(historyField(payload + 1, 4));
+        sent = historyField(payload + 5, 8);
+        since = int64_t(historyField(payload + 13, 8));
+        memcpy(nonce, payload + 21, RESUME_NONCE_BYTES);
+        return true;
+    }
+
+    // Set up `cipher` and `key` for the session the server resumed; false if the positions do
+    // not line up (the client must then reconnect without the ticket)
+    bool restore(const ResumeTicket& t, uint64_t clientNonce, CipherContext& cipher, std::string& key) const {
+        if (status == RESUME_CACHED) {
+            if (sent < t.cipher.received() || sent - t.cipher.received() > RESUME_MAX_SKIP) return false;
+            cipher = t.cipher;
+            cipher.skipReceived(sent - t.cipher.received()); // Frames the server sent that never arrived
+            key = t.key;
+            return true;
+        }
+        if (status == RESUME_TICKET) {
+            key = ticketSessionKey(t.secret, clientNonce, nonce);
+            cipher.init(key, CipherContext::CLIENT);
+            return true;
+        }
+        return false;
+    }
+};
+
+// The empty MSG_RESUME a client sends once it uses the keys a non-cached answer gave it
+inline std::string resumeMarker() {
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    encodeHeader(FrameHeader{0, MSG_RESUME, 0, 0}, reinterpret_cast<unsigned char*>(&frame[0]));
+    return frame;
+}
+
+#endif // RESUMPTION_H
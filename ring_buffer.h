@@ -0,0 +1,102 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>         // For the lock-free slot sequence counters
+#include <cstddef>        // For size_t
+#include <cstdint>        // For intptr_t
+#include <utility>        // For std::move
+
+const size_t CACHE_LINE_SIZE = 64; // Alignment that keeps producer and consumer state apart
+
+// Fixed-capacity lock-free ring buffer (bounded MPMC queue with per-slot sequence numbers).
+// Any number of producers and consumers may use it concurrently without locks or allocation;
+// elements are moved in and out of preallocated slots. Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class RingBuffer {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Slot {
+        std::atomic<size_t> sequence; // Position this slot is ready for (push: pos, pop: pos + 1)
+        T value;                      // Stored element
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;    // Next position to pop
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;    // Next position to push
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> dropped; // Elements discarded by pushOverwrite()
+    Slot slots[Capacity];                                 // Preallocated element storage
+
+public:
+    RingBuffer() : head(0), tail(0), dropped(0) {
+        for (size_t i = 0; i < Capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+    // Append an element; returns false (leaving `value` untouched) if the buffer is full
+    bool tryPush(T&& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (Capacity - 1)];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.sequence.store(pos + 1, std::memory_order_release); // Publish to consumers
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // Slot still holds an unconsumed element: full
+            } else {
+                pos = tail.load(std::memory_order_relaxed); // Another producer won the slot
+            }
+        }
+    }
+
+    // Remove the oldest element; returns false if the buffer is empty
+    bool tryPop(T& out) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (Capacity - 1)];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(slot.value);
+                    slot.sequence.store(pos + Capacity, std::memory_order_release); // Hand the slot back to producers
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // Nothing published at this position yet: empty
+            } else {
+                pos = head.load(std::memory_order_relaxed); // Another consumer took it
+            }
+        }
+    }
+
+    // Append an element, discarding the oldest ones while the buffer is full
+    void pushOverwrite(T&& value) {
+        while (!tryPush(std::move(value))) {
+            T oldest;
+            if (tryPop(oldest)) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t size() const { // Approximate element count while other threads are active
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    bool empty() const { return size() == 0; }                                     // Check if the buffer is empty
+    size_t droppedCount() const { return dropped.load(std::memory_order_relaxed); } // Elements lost to overwrites
+    static constexpr size_t capacity() { return Capacity; }                       // Maximum element count
+};
+
+#endif // RING_BUFFER_H
@@ -0,0 +1,221 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <atomic>         // For the reference count and per-room worker mask
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()
+#include <memory>         // For unique_ptr owning rooms and inboxes
+#include <mutex>          // For the room table and the inboxes
+#include <new>            // For placement new into the single allocation
+#include <string>         // For room names
+#include <unordered_map>  // For the room table
+#include <unordered_set>  // For the rooms still alive (checked before removing one)
+#include <utility>        // For std::swap
+#include <vector>         // For inbox batches
+#include <sys/eventfd.h>  // For waking a worker that has posts waiting
+#include <unistd.h>       // For write()/close()
+#include "framing.h"      // For frame types
+#include "message_log.h"  // For room log stream ids
+
+// Plaintext of one room message, decrypted once and shared by every delivery that cannot be
+// encrypted straight away (a recipient's outbox is full, or the recipient lives on another
+// worker). Header and bytes share one allocation; the count is atomic because references
+// cross worker threads. A message worth compressing also carries its compressed form, made
+// once for every member that negotiated compression.
+class SharedMessage {
+private:
+    std::atomic<uint32_t> refs;
+    uint32_t bytes;
+    uint32_t seq;
+    uint32_t packedBytes;
+    uint8_t frameType;
+    uint8_t frameFlags;
+
+    SharedMessage(size_t length, size_t packedLength, uint32_t sequence, uint8_t type, uint8_t flags)
+        : refs(1), bytes(uint32_t(length)), seq(sequence), packedBytes(uint32_t(packedLength)), frameType(type),
+          frameFlags(flags) {}
+
+public:
+    static SharedMessage* create(const unsigned char* data, size_t length, uint32_t sequence,
+                                 uint8_t type = MSG_ROOM, uint8_t flags = 0,
+                                 const unsigned char* packed = nullptr, size_t packedLength = 0) {
+        void* memory = ::operator new(sizeof(SharedMessage) + length + packedLength);
+        SharedMessage* message = new (memory) SharedMessage(length, packedLength, sequence, type, flags);
+        memcpy(message->data(), data, length);
+        if (packedLength) memcpy(message->packed(), packed, packedLength);
+        return message;
+    }
+
+    void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~SharedMessage();
+            ::operator delete(this);
+        }
+    }
+
+    unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+    size_t length() const { return bytes; }
+    unsigned char* packed() { return data() + bytes; }  // Compressed form (FLAG_COMPRESSED), if any
+    size_t packedLength() const { return packedBytes; } // 0: not worth compressing
+    uint32_t sequence() const { return seq; }  // The sender's sequence number, relayed as is
+    uint8_t type() const { return frameType; }  // Frame type it is sent in (MSG_ROOM, or MSG_HISTORY for a replay's end)
+    uint8_t flags() const { return frameFlags; }
+};
+
+// Owning handle to a SharedMessage (copying shares it)
+class MessageRef {
+private:
+    SharedMessage* message;
+
+public:
+    MessageRef() : message(nullptr) {}
+    explicit MessageRef(SharedMessage* m) : message(m) {} // Adopts the creator's reference
+    MessageRef(const MessageRef& other) : message(other.message) { if (message) message->retain(); }
+    MessageRef(MessageRef&& other) noexcept : message(other.message) { other.message = nullptr; }
+    MessageRef& operator=(MessageRef other) {
+        std::swap(message, other.message);
+        return *this;
+    }
+    ~MessageRef() { if (message) message->release(); }
+
+    SharedMessage* operator->() const { return message; }
+    explicit operator bool() const { return message != nullptr; }
+};
+
+// Rooms shared by all workers. Each worker keeps its own member lists; a room only records
+// which workers have members, so a message crosses threads once per worker, not per member.
+// Cross-worker posts are queued per worker and announced through an eventfd the worker's
+// event loop watches. The same inbox carries replies for single sessions from threads that
+// are not event loops (the message log's reader).
+class RoomHub {
+public:
+    static const size_t MAX_WORKERS = 64; // One bit per worker in Room::workers
+
+    struct Room {
+        std::string name;
+        uint64_t logStream = 0;           // Stream id of its messages in the message log
+        std::atomic<uint64_t> workers{0}; // Bit w set while worker w has members
+        std::atomic<uint32_t> packing{0}; // Members that negotiated compression, all workers
+        std::atomic<uint32_t> refs{0};    // Members on all workers, plus posts in flight
+    };
+
+    struct Post {                          // A message for another worker's members of a room
+        Room* room;                        // Holds a reference (retain() before posting)
+        MessageRef message;
+    };
+
+    struct Reply {                         // A message for one session of a worker (history replays)
+        int fd;
+        uint64_t session;                  // The session's serial number (its fd may be reused meanwhile)
+        MessageRef message;
+    };
+
+private:
+    struct Inbox {
+        std::mutex lock;                   // Guards posts and replies
+        std::vector<Post> posts;
+        std::vector<Reply> replies;
+        int wakeFd;                        // eventfd, readable while posts are waiting
+    };
+
+    std::mutex lock;                       // Guards rooms and live (taken on join and when a room empties, never per message)
+    std::unordered_map<std::string, std::unique_ptr<Room>> rooms; // Rooms with members or posts in flight
+    std::unordered_set<Room*> live;        // The same rooms by address
+    std::vector<std::unique_ptr<Inbox>> inboxes;
+
+public:
+    explicit RoomHub(size_t workers) {
+        for (size_t w = 0; w < workers; ++w) {
+            inboxes.emplace_back(new Inbox());
+            inboxes.back()->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+    }
+
+    ~RoomHub() {
+        for (auto& inbox : inboxes) {
+            if (inbox->wakeFd >= 0) close(inbox->wakeFd);
+        }
+    }
+
+    RoomHub(const RoomHub&) = delete;
+    RoomHub& operator=(const RoomHub&) = delete;
+
+    // Find or create a room and take a reference on it; the pointer stays valid until that
+    // reference is released
+    Room* acquire(const std::string& name) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unique_ptr<Room>& slot = rooms[name];
+        if (!slot) {
+            slot.reset(new Room());
+            slot->name = name;
+            slot->logStream = logStreamId("room:" + name);
+            live.insert(slot.get());
+        }
+        slot->refs.fetch_add(1, std::memory_order_relaxed);
+        return slot.get();
+    }
+
+    // Another reference to a room the caller already holds one on
+    static void retain(Room* room) { room->refs.fetch_add(1, std::memory_order_relaxed); }
+
+    // Drop a reference; the last one removes the room. Between the count reaching zero and the
+    // lock being taken, another thread may revive the room and drop it again (and so remove it
+    // first), which is why the address is checked against the live set before it is touched.
+    void release(Room* room) {
+        if (room->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+        std::lock_guard<std::mutex> guard(lock);
+        auto alive = live.find(room);
+        if (alive == live.end() || room->refs.load(std::memory_order_acquire) != 0) return;
+        live.erase(alive);
+        rooms.erase(rooms.find(room->name)); // Frees it
+    }
+
+    int wakeFd(size_t worker) const { return inboxes[worker]->wakeFd; } // -1 if eventfd failed
+
+    // Hand a batch to another worker (the batch is left empty)
+    void post(size_t worker, std::vector<Post>& batch) {
+        Inbox& inbox = *inboxes[worker];
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> guard(inbox.lock);
+            wasEmpty = inbox.posts.empty() && inbox.replies.empty();
+            for (Post& p : batch) inbox.posts.push_back(std::move(p));
+        }
+        batch.clear();
+        if (wasEmpty) wake(inbox); // Otherwise a wakeup is already pending
+    }
+
+    // Hand replies for a worker's sessions to it (the batch is left empty)
+    void reply(size_t worker, std::vector<Reply>& batch) {
+        Inbox& inbox = *inboxes[worker];
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> guard(inbox.lock);
+            wasEmpty = inbox.posts.empty() && inbox.replies.empty();
+            for (Reply& r : batch) inbox.replies.push_back(std::move(r));
+        }
+        batch.clear();
+        if (wasEmpty) wake(inbox);
+    }
+
+    // Take everything posted to a worker (after its wake fd turned readable)
+    void take(size_t worker, std::vector<Post>& out, std::vector<Reply>& replies) {
+        Inbox& inbox = *inboxes[worker];
+        uint64_t count;
+        ssize_t n = read(inbox.wakeFd, &count, sizeof(count)); // Reset the wakeup before looking
+        (void)n;
+        std::lock_guard<std::mutex> guard(inbox.lock);
+        out.swap(inbox.posts);
+        replies.swap(inbox.replies);
+    }
+
+private:
+    static void wake(Inbox& inbox) {
+        uint64_t one = 1;
+        ssize_t n = write(inbox.wakeFd, &one, sizeof(one));
+        (void)n; // Only fails if the counter is saturated, which still leaves it readable
+    }
+};
+
+#endif // ROOM_H
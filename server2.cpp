@@ -5,354 +5,2095 @@
 #include <cstring>        // For string manipulation functions
 #include <fstream>        // For file input/output operations
 #include <ctime>          // For generating timestamps
+#include <cerrno>         // For errno values (EAGAIN, EINTR)
+#include <fcntl.h>        // For fcntl() to make sockets non-blocking
+#include <sys/epoll.h>    // For the epoll event loop
+#include <unordered_map>  // For the session table keyed by file descriptor
+#include <deque>          // For per-recipient room backlogs
+#include <poll.h>         // For POLLIN (io_uring wake-up polling)
+#include <vector>         // For the key preparation queue and worker list
+#include <atomic>         // For the worker failure flag
+#include <thread>         // For sharded worker threads
+#include <pthread.h>      // For pthread_setaffinity_np()
+#include <sched.h>        // For cpu_set_t
+#include <csignal>        // For ignoring SIGPIPE (io_uring writes cannot pass MSG_NOSIGNAL)
+#include <sys/file.h>     // For flock() on partial uploads
+#include <sys/stat.h>     // For fstat() and mkdir()
+#include <cstdio>         // For renameat2() (a finished upload never replaces a file unasked)
+#include "compression.h" // For the optional compression stage before encryption
+#include "entropy_pool.h" // For image-seeded session keys
+#include "file_transfer.h" // For streaming file uploads and downloads
+#include "framing.h"      // For length-prefixed frames and pooled I/O buffers
+#include "key_registry.h" // For the registry of issued keys
+#include "logger.h"       // For asynchronous, levelled logging off the message path
+#include "message_log.h"  // For the durable, encrypted message history
+#include "metrics.h"      // For hot-path counters and the stats endpoint
+#include "rc4.h"          // For the RC4 stream cipher
+#include "resumption.h"   // For session tickets and the resumption cache
+#include "room.h"         // For broadcast rooms shared across workers
+#include "uring.h"        // For the io_uring event loop
+#include "websocket.h"    // For browser clients on the WebSocket port
 
 #define PORT 8080         // Port on which the server will listen
-#define BUFFER_SIZE 1024  // Buffer size for receiving messages
+#define MAX_EVENTS 256    // Maximum epoll events handled per wakeup
+#define STATS_PORT 9100   // Loopback port of the metrics endpoint (0 disables it)
+#define WS_PORT 8081      // Port for WebSocket (browser) clients (0 disables it)
+
+// Session keys are rotated after whichever limit is reached first
+#ifndef REKEY_BYTES
+#define REKEY_BYTES (4 << 20)  // Bytes encrypted under one key (both directions)
+#endif
+#ifndef REKEY_MESSAGES
+#define REKEY_MESSAGES 50000   // Messages handled under one key
+#endif
+#ifndef REKEY_SECONDS
+#define REKEY_SECONDS 600      // Age of a key in seconds
+#endif
+
+// A room member that stops reading gets this much queued before new room messages are dropped for it
+#define ROOM_BACKLOG_MESSAGES 4096
+#define ROOM_BACKLOG_BYTES (4 << 20)
+
+// Rooms one session may be in at a time
+#define MAX_ROOMS_PER_SESSION 64
+
+// Most logged messages one MSG_HISTORY request replays (clients page with the returned "next since")
+#define HISTORY_LIMIT 1000
+
+// File transfers one session may have open at a time
+#define FILE_TRANSFERS 4
+
+// Closed sessions kept for resumption, and how long a ticket is honoured
+#define RESUME_CACHE_ENTRIES 10000
+#define TICKET_LIFETIME_SECONDS 3600
 
 using namespace std;
 
-// Frame structure to represent data frames
-struct Frame {
-    string path;          // Path to the image file
-    string timestamp;     // Timestamp when the frame was created
-    Frame(const string& p) : path(p), timestamp(to_string(time(nullptr))) {} // Constructor initializes with current time
+// Part of a provided receive buffer that has not been parsed yet (io_uring backend)
+struct RecvChunk {
+    uint16_t id;          // Provided buffer id
+    uint32_t offset;      // First unparsed byte
+    uint32_t length;      // Unparsed bytes
 };
 
-// Node structure for the custom queue
-struct QueueNode {
-    Frame data;           // Frame data stored in the node
-    QueueNode* next;      // Pointer to the next node
-    QueueNode(const Frame& frame) : data(frame), next(nullptr) {} // Constructor initializes the node
+// Transport state of a WebSocket client
+struct WebSocketState {
+    bool open = false;        // Handshake done; frames flow
+    string request;           // Upgrade request received so far
+    WebSocketDecoder decoder; // Unwraps client messages into the frame stream
 };
 
-// Custom queue implementation using a linked list
-class FrameQueue {
-private:
-    QueueNode *front, *rear; // Pointers to the front and rear of the queue
-    size_t currentSize;      // Current size of the queue
-    const size_t MAX_SIZE = 10; // Maximum allowed size of the queue
+// A file upload or download in progress (--file-dir)
+struct FileTransfer {
+    uint32_t id;              // Client's transfer id (the sequence number of its frames)
+    bool upload;              // Client -> server; otherwise server -> client
+    int fd;                   // NAME.part being written, or the file being sent
+    uint64_t size;            // File size
+    uint64_t offset;          // Upload: next byte expected; download: next byte to send
+    uint64_t acked;           // Upload: offset last acknowledged; download: offset the client acknowledged
+    uint32_t window;          // Bytes allowed between acked and offset
+    uint64_t stored;          // Upload: end of what an earlier run left in NAME.part (resent bytes before it are compared)
+    bool replace;             // Upload: may overwrite an existing NAME
+    string name;              // File name in the file directory
+    WriteBehind writeBehind;  // Upload: keeps written pages from piling up in the cache
+
+    FileTransfer(uint32_t i, bool up, int f, uint64_t bytes, uint64_t start, uint32_t w, const string& n)
+        : id(i), upload(up), fd(f), size(bytes), offset(start), acked(start), window(w), stored(start), replace(false), name(n) {
+        writeBehind.resume(start);
+    }
+    ~FileTransfer() { close(fd); }
+};
 
-public:
-    FrameQueue() : front(nullptr), rear(nullptr), currentSize(0) {} // Constructor initializes an empty queue
+// Per-client session state owned by the event loop
+struct Session {
+    int fd;               // Client socket
+    uint64_t serial;      // Tells apart sessions that reuse an fd (replies from other threads name it)
+    string key;           // Encryption key issued to this client
+    uint64_t logStream;   // Stream id of this session's messages in the message log (random, kept across resumption)
+    CipherContext cipher; // Send/receive keystreams, keyed once per session
+    FrameReader reader;   // Reassembles incoming frames
+    OutputBuffer outbox;  // Encrypted frames waiting to be sent
+    bool readPaused;      // Reading stopped until the outbox has room
+    unique_ptr<WebSocketState> ws; // Set for clients on the WebSocket port (nullptr: raw TCP)
+    bool compress;        // Negotiated compression: echoes and room messages may go out FLAG_COMPRESSED
+    CompressionPolicy echoPolicy; // Whether this client's echoes are worth compressing
+    CompressionPolicy postPolicy; // Whether its room messages are
+    uint64_t ticketId;    // Id of the last ticket issued on this connection (0: none, not resumable)
+    int64_t ticketExpires; // Its expiry (wall-clock nanoseconds)
+    bool discarding;      // Resumed without the old keystreams: skip frames until the client's marker
+
+    // Key rotation state
+    string nextKey;            // Key prepared for the next rotation ("" until prepared)
+    CipherContext nextCipher;  // nextKey's keystreams, keyed ahead of time
+    bool rekeyPending;         // REKEY sent; receive side switches on the client's ACK
+    bool prepareQueued;        // Waiting for nextKey to be prepared after this event batch
+    uint64_t bytesSinceRekey;  // Bytes encrypted or decrypted under the current key
+    uint64_t messagesSinceRekey; // Messages handled under the current key
+    chrono::steady_clock::time_point keyStart; // When the current key took effect
+    unsigned rotations;        // Completed rotations
+
+    uint64_t unsentSince;      // When the oldest echo still in the outbox was decrypted (metrics)
+    uint32_t unsentMessages;   // Echoes queued since the outbox was last empty (metrics)
+
+    // Rooms
+    vector<RoomHub::Room*> rooms;  // Rooms joined
+    deque<MessageRef> backlog;     // Room messages waiting for outbox space, oldest first
+    size_t backlogBytes;           // Plaintext bytes in backlog
+    bool touched;                  // Room deliveries added to the outbox during this batch
+    bool dropping;                 // Backlog overflowed (warned once until it drains)
+    deque<pair<size_t, size_t>> replays; // Backlog messages and bytes set aside for each history replay in flight
+    size_t replayMessages;         // Their sums
+    size_t replayBytes;
+
+    vector<unique_ptr<FileTransfer>> transfers; // Open file transfers (their .part files outlive the session)
+
+    // io_uring backend only
+    OutputBuffer sending;        // Block the kernel is sending from; the outbox fills the other one meanwhile
+    vector<RecvChunk> received;  // Received buffers not yet fully parsed, oldest first
+    bool recvArmed;              // A multishot receive is active
+    bool sendBusy;               // A send is in flight
+    bool closing;                // Shut down; erased once no operation is in flight
+
+    Session(int f, const string& k, BufferPool& pool) // Constructor initializes an idle session ("" key: keyed later)
+        : fd(f), serial(0), key(k), logStream(0), reader(pool), outbox(pool), readPaused(false), compress(false),
+          ticketId(0), ticketExpires(0), discarding(false), rekeyPending(false), prepareQueued(false),
+          bytesSinceRekey(0), messagesSinceRekey(0), keyStart(chrono::steady_clock::now()), rotations(0),
+          unsentSince(0), unsentMessages(0), backlogBytes(0), touched(false), dropping(false), replayMessages(0), replayBytes(0), sending(pool), recvArmed(false), sendBusy(false), closing(false) {
+        if (!key.empty()) cipher.init(key, CipherContext::SERVER);
+    }
+};
+
+// Set when a worker fails: every event loop returns at its next wakeup and the process exits
+static atomic<bool> shuttingDown(false);
+
+// Switch a socket to non-blocking mode
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// True if a new client's first frame, already waiting on its socket, is MSG_RESUME
+static bool resumeWaiting(int fd) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    ssize_t n = recv(fd, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+    return n == ssize_t(FRAME_HEADER_SIZE) && header[4] == MSG_RESUME;
+}
+
+// Pin the calling thread to one CPU; false if the CPU does not exist or pinning is not allowed
+static bool pinToCpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
 
-    ~FrameQueue() { // Destructor clears the queue
-        while (!empty()) {
-            pop(); // Remove all elements
+// Protocol core shared by the event loops: session keys, frame handling and key rotation. A
+// backend decides when sockets are read and written; everything here runs on its one thread.
+// In sharded mode every worker thread runs its own instance with its own listening socket,
+// pool and session table.
+class SessionServer {
+protected:
+    int listenFd;                          // Non-blocking listening socket
+    int wsListenFd;                        // Non-blocking listening socket for WebSocket clients (-1: none)
+    EntropyPool& entropy;                  // Source of fresh session keys
+    ThreadMetrics& stats;                  // This loop's counters (it is their only writer)
+    KeyRegistry& registry;                 // Every key issued recently, to rule out reuse
+    chrono::steady_clock::time_point lastSweep; // Last time expired registry entries were dropped
+    chrono::steady_clock::time_point lastAgeCheck; // Last pass over every session's key age
+    const chrono::hours KEY_TTL{24};       // How long an issued key stays blocked from reuse
+    BufferPool pool;                       // Receive/send blocks shared by all sessions
+    unordered_map<int, Session> sessions;  // Active sessions keyed by socket
+    chrono::steady_clock::time_point loopTime; // Time of the current event batch
+    vector<int> prepareQueue;              // Sessions whose next key is prepared between batches
+    uint64_t rotations;                    // Key rotations started, all sessions
+    uint64_t slowestRotationNanos;         // Longest time a rotation spent on the message path
+    RoomHub& hub;                          // Rooms and the other workers' inboxes
+    size_t worker;                         // This loop's index (its bit in a room's worker mask)
+    unordered_map<RoomHub::Room*, vector<Session*>> members; // This worker's members of each room
+    unordered_map<string, RoomHub::Room*> roomNames;      // Rooms with members here, by name (skips the hub lock)
+    vector<vector<RoomHub::Post>> outgoing;  // Room messages for other workers, posted after the batch
+    vector<RoomHub::Post> inbound;         // Room messages taken from this worker's inbox
+    vector<RoomHub::Reply> replies;        // Messages for single sessions taken from it (history replays)
+    uint64_t sessionSerial;                // Serial number of the last session opened
+    vector<int> touched;                   // Sessions given room deliveries during this batch
+    vector<int> flushing;                  // touched, while it is being flushed
+    MessageLog* log;                       // Message history (nullptr: not kept)
+    LogBatch logBatch;                     // Messages logged during this batch, submitted after it
+    int64_t wallTime;                      // Wall-clock time of the current event batch (log timestamps)
+    string wsReplies;                      // Control frames a WebSocket read asks us to send
+    string fileDir;                        // Where uploads are stored and downloads read from ("": transfers refused)
+    bool compression;                      // Clients may negotiate compression (--no-compression refuses)
+    Lz4 lz4;                               // Compressor shared by this loop's sessions (one message at a time)
+    vector<unsigned char> inflated;        // Decompressed payload of the frame being handled
+    vector<unsigned char> packed;          // Compressed payload of the frame being sent
+    Resumption* resumption;                // Ticket keys and closed sessions, all workers (nullptr: --no-resumption)
+
+    // Generate an encryption key for a new session from the entropy pool, never reusing a registered key
+    string generateSessionKey() {
+        while (true) {
+            string key = entropy.sessionKey();
+            if (registry.insert(key, KEY_TTL)) return key;
+            LOG_WARN("Entropy pool produced a key that was already issued; drawing another");
         }
     }
 
-    void push(const Frame& frame) { // Adds a frame to the queue
-        QueueNode* newNode = new QueueNode(frame); // Create a new node
+    // Stream id for a new session's records in the message log. Record headers are in the clear,
+    // so the id is random rather than derived from anything about the session.
+    uint64_t newLogStream() {
+        uint64_t stream;
+        entropy.generate(reinterpret_cast<unsigned char*>(&stream), sizeof(stream));
+        return stream;
+    }
+
+    // How close a session is to its rotation limits (1.0 = due)
+    double rekeyProgress(const Session& s) const {
+        double bytes = double(s.bytesSinceRekey) / REKEY_BYTES;
+        double messages = double(s.messagesSinceRekey) / REKEY_MESSAGES;
+        double age = chrono::duration<double>(loopTime - s.keyStart).count() / REKEY_SECONDS;
+        return max(bytes, max(messages, age));
+    }
+
+    // Draw the next key and run its key schedule, off the message path where possible
+    void prepareNextKey(Session& s) {
+        s.nextKey = generateSessionKey();
+        uint64_t start = metricsNow();
+        s.nextCipher.init(s.nextKey, CipherContext::SERVER);
+        stats.ksaNanos.add(metricsNow() - start);
+    }
 
-        if (currentSize >= MAX_SIZE) { // If queue is full, remove the oldest element
-            pop();
+    // Prepare keys for the sessions that asked during the last event batch
+    void prepareQueuedKeys() {
+        for (int fd : prepareQueue) {
+            auto it = sessions.find(fd);
+            if (it == sessions.end()) continue; // Closed in the meantime
+            it->second.prepareQueued = false;
+            if (it->second.nextKey.empty()) prepareNextKey(it->second);
         }
+        prepareQueue.clear();
+    }
 
-        if (rear == nullptr) { // If the queue is empty, update both front and rear
-            front = rear = newNode;
-        } else { // Otherwise, link the new node to the rear
-            rear->next = newNode;
-            rear = newNode;
+    // Called after every message: prepare the next key at 75% of a limit, rotate at 100%
+    void maybeRotate(Session& s) {
+        if (s.rekeyPending) return; // One rotation at a time
+        double progress = rekeyProgress(s);
+        if (progress < 0.75) return;
+        if (s.nextKey.empty()) {
+            if (progress < 1.0) {
+                if (!s.prepareQueued) {
+                    s.prepareQueued = true;
+                    prepareQueue.push_back(s.fd);
+                }
+                return;
+            }
+            prepareNextKey(s); // Limit jumped straight past 75%; prepare now
+        }
+        if (progress >= 1.0) {
+            startRekey(s);
         }
+    }
+
+    // Send the next key (under the current key) and switch the send direction right after it
+    void startRekey(Session& s) {
+        auto start = chrono::steady_clock::now();
+        unsigned char* out = s.outbox.beginFrame(MSG_REKEY, 0, s.nextKey.size());
+        if (!out) return; // Outbox full; try again after the next message
+        s.cipher.encrypt(reinterpret_cast<const unsigned char*>(s.nextKey.data()), out, s.nextKey.size());
+        s.outbox.commitFrame(s.nextKey.size());
+        s.cipher.adoptTx(s.nextCipher);
+        s.rekeyPending = true;
+        s.bytesSinceRekey = 0;
+        s.messagesSinceRekey = 0;
+        s.keyStart = loopTime;
+        ++rotations;
+        stats.rotations.add();
+        uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        slowestRotationNanos = max(slowestRotationNanos, nanos);
+    }
+
+    // The client acknowledged: everything it sends from here on uses the next key
+    void completeRekey(Session& s) {
+        if (!s.rekeyPending) return; // Stray acknowledgement
+        s.cipher.adoptRx(s.nextCipher);
+        registry.remove(s.key);       // Retire the old key: blocked from reuse for a full TTL from now
+        registry.insert(s.key, KEY_TTL);
+        s.key = s.nextKey;
+        s.nextKey.clear();
+        s.rekeyPending = false;
+        ++s.rotations;
+    }
 
-        currentSize++; // Increment the queue size
+    // Start of an event batch: take the time once for everything in it
+    void beginBatch() {
+        loopTime = chrono::steady_clock::now();
+        if (log) wallTime = MessageLog::wallNow();
+        sweep();
+        checkKeyAges();
     }
 
-    Frame pop() { // Removes and returns the front frame
-        if (empty()) {
-            throw runtime_error("Queue is empty"); // Error if queue is empty
+    // Once a second: start rotations that are due by key age alone. maybeRotate otherwise runs
+    // only as frames arrive, so an idle session would keep its key past REKEY_SECONDS and send
+    // its next message under it. A REKEY queued here goes out when the batch is flushed.
+    void checkKeyAges() {
+        if (loopTime - lastAgeCheck < chrono::seconds(1)) return;
+        lastAgeCheck = loopTime;
+        for (auto& entry : sessions) {
+            Session& s = entry.second;
+            if (s.key.empty() || s.discarding || s.closing || (s.ws && !s.ws->open)) continue; // Not keyed yet
+            bool pending = s.rekeyPending;
+            maybeRotate(s);
+            if (s.rekeyPending != pending) markTouched(s);
         }
+    }
 
-        QueueNode* temp = front;      // Store the current front node
-        Frame frame = temp->data;     // Extract the frame data
-        front = front->next;          // Update the front pointer
+    // Periodic housekeeping run from the event loop
+    void sweep() {
+        auto now = chrono::steady_clock::now();
+        if (now - lastSweep < chrono::seconds(10)) return;
+        lastSweep = now;
+        registry.expire();
+    }
 
-        if (front == nullptr) { // If queue becomes empty, set rear to nullptr
-            rear = nullptr;
+    // The room of that name the session is in, or null
+    static RoomHub::Room* joinedRoom(const Session& s, const char* name, size_t length) {
+        for (RoomHub::Room* r : s.rooms) {
+            if (r->name.size() == length && memcmp(r->name.data(), name, length) == 0) return r;
         }
+        return nullptr;
+    }
 
-        delete temp; // Free memory of the removed node
-        currentSize--; // Decrement the queue size
-        return frame;
+    // Join a room by name (taking a reference on it); false if the session is in too many rooms
+    bool joinRoom(Session& s, const string& name) {
+        if (joinedRoom(s, name.data(), name.size())) return true;
+        if (s.rooms.size() >= MAX_ROOMS_PER_SESSION) return false;
+        RoomHub::Room* room;
+        auto cached = roomNames.find(name);
+        if (cached != roomNames.end()) {
+            room = cached->second; // Members here keep it alive
+            RoomHub::retain(room);
+        } else {
+            room = hub.acquire(name);
+            roomNames.emplace(name, room);
+        }
+        s.rooms.push_back(room);
+        if (s.compress) room->packing.fetch_add(1, memory_order_relaxed);
+        vector<Session*>& list = members[room];
+        list.push_back(&s);
+        if (list.size() == 1) room->workers.fetch_or(uint64_t(1) << worker); // Other workers start posting to us
+        return true;
     }
 
-    bool empty() const { return front == nullptr; } // Check if the queue is empty
-    size_t size() const { return currentSize; }     // Return the current size of the queue
-};
+    // Leave a room the session is in; the last member anywhere leaving removes it
+    void leaveRoom(Session& s, RoomHub::Room* room) {
+        auto joined = find(s.rooms.begin(), s.rooms.end(), room);
+        if (joined == s.rooms.end()) return;
+        s.rooms.erase(joined);
+        if (s.compress) room->packing.fetch_sub(1, memory_order_relaxed);
+        auto it = members.find(room);
+        vector<Session*>& list = it->second;
+        auto member = find(list.begin(), list.end(), &s);
+        *member = list.back(); // Member order does not matter
+        list.pop_back();
+        if (list.empty()) {
+            room->workers.fetch_and(~(uint64_t(1) << worker));
+            members.erase(it);
+            roomNames.erase(room->name);
+        }
+        hub.release(room);
+    }
 
-// AVL Tree Node structure
-struct AVLNode {
-    string key;           // Key stored in the node
-    int height;           // Height of the node for balancing
-    AVLNode* left;        // Pointer to left child
-    AVLNode* right;       // Pointer to right child
+    // Join or leave the room named by the payload and confirm by echoing the frame;
+    // false if the outbox has no room for the confirmation yet. Leaving a room the
+    // session is not in is confirmed without touching the hub.
+    bool handleMembership(Session& s, const FrameHeader& header, unsigned char* payload) {
+        unsigned char* out = s.outbox.beginFrame(header.type, header.sequence, header.length);
+        if (!out) return false;
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += 2 * header.length;
+        if (header.length == 0 || header.length > MAX_ROOM_NAME) {
+            LOG_WARN("Client ", s.fd, " sent an invalid room name");
+            maybeRotate(s);
+            return true; // Not confirmed
+        }
+        const char* name = reinterpret_cast<char*>(payload);
+        if (header.type == MSG_JOIN) {
+            if (!joinRoom(s, string(name, header.length))) {
+                LOG_WARN("Client ", s.fd, " is already in ", MAX_ROOMS_PER_SESSION, " rooms");
+                maybeRotate(s);
+                return true; // Not confirmed
+            }
+        } else if (RoomHub::Room* room = joinedRoom(s, name, header.length)) {
+            leaveRoom(s, room);
+        }
+        LOG_DEBUG("Client ", s.fd, header.type == MSG_JOIN ? " joined room " : " left room ",
+                  string(name, header.length));
+        s.cipher.encrypt(payload, out, header.length);
+        s.outbox.commitFrame(header.length);
+        maybeRotate(s);
+        return true;
+    }
 
-    AVLNode(const string& k) : key(k), height(1), left(nullptr), right(nullptr) {} // Constructor initializes a leaf node
-};
+    void markTouched(Session& r) {
+        if (r.touched) return;
+        r.touched = true;
+        touched.push_back(r.fd);
+    }
 
-// AVL Tree implementation
-class AVLTree {
-private:
-    AVLNode* root; // Root of the AVL tree
+    // Encrypt a room message (or the end of a history replay) into a member's outbox, compressed
+    // if the member negotiated it and a compressed form was made; false if it has no space
+    bool encryptRoomFrame(Session& r, const unsigned char* plain, size_t length, uint32_t sequence,
+                          uint8_t type = MSG_ROOM, uint8_t flags = 0,
+                          const unsigned char* packedData = nullptr, size_t packedLength = 0) {
+        bool pack = packedLength && r.compress;
+        size_t wire = pack ? packedLength : length;
+        unsigned char* out = r.outbox.beginFrame(type, sequence, wire, pack ? flags | FLAG_COMPRESSED : flags, length);
+        if (!out) return false;
+        r.cipher.encrypt(pack ? packedData : plain, out, wire);
+        r.outbox.commitFrame(wire);
+        r.bytesSinceRekey += wire;
+        if (pack) {
+            stats.packedPlainBytes.add(length);
+            stats.packedWireBytes.add(wire);
+        }
+        ++r.messagesSinceRekey;
+        stats.roomDeliveries.add();
+        markTouched(r);
+        maybeRotate(r);
+        return true;
+    }
 
-    // Helper function to get the height of a node
-    int height(AVLNode* node) {
-        return node ? node->height : 0;
+    // Deliver a room message to one member: straight into its outbox when it is keeping up,
+    // otherwise as a reference to the shared plaintext (share() makes it on first use)
+    template <typename Share>
+    void deliver(Session& r, const unsigned char* plain, size_t length, uint32_t sequence,
+                 const unsigned char* packedData, size_t packedLength, Share&& share) {
+        if (r.closing) return;
+        if (r.backlog.empty() && encryptRoomFrame(r, plain, length, sequence, MSG_ROOM, 0, packedData, packedLength)) return;
+        if (r.backlog.size() >= ROOM_BACKLOG_MESSAGES || r.backlogBytes + length > ROOM_BACKLOG_BYTES) {
+            stats.roomDropped.add(); // A slow member loses messages; the room never waits for it
+            if (!r.dropping) {
+                r.dropping = true;
+                LOG_WARN("Client ", r.fd, " is not keeping up with its rooms; dropping room messages");
+            }
+            return;
+        }
+        r.backlog.push_back(share());
+        r.backlogBytes += length;
     }
 
-    // Calculate balance factor of a node
-    int getBalance(AVLNode* node) {
-        return node ? height(node->left) - height(node->right) : 0;
+    // Move queued room messages into the outbox while it has space
+    void drainBacklog(Session& r) {
+        while (!r.backlog.empty()) {
+            const MessageRef& message = r.backlog.front();
+            if (!encryptRoomFrame(r, message->data(), message->length(), message->sequence(), message->type(),
+                                  message->flags(), message->packed(), message->packedLength())) return;
+            r.backlogBytes -= message->length();
+            r.backlog.pop_front();
+        }
+        r.dropping = false;
     }
 
-    // Right rotation for balancing
-    AVLNode* rightRotate(AVLNode* y) {
-        AVLNode* x = y->left;
-        AVLNode* T2 = x->right;
+    // Decrypt a room message once and fan it out: members on this worker get it encrypted
+    // under their own keys, other workers with members get one shared reference each. It is
+    // compressed at most once, and only if some member negotiated compression.
+    void handleRoomMessage(Session& s, const FrameHeader& header, unsigned char* payload) {
+        uint64_t start = metricsNow();
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += header.length;
+        ++s.messagesSinceRekey;
+        size_t length;
+        const unsigned char* plain = unpack(s, header, payload, length);
+        size_t nameLength;
+        RoomHub::Room* room = nullptr; // Only members may post
+        if (plain && roomNameLength(plain, length, nameLength)) room = joinedRoom(s, reinterpret_cast<const char*>(plain + 1), nameLength);
+        if (!room) {
+            LOG_DEBUG("Client ", s.fd, " posted to a room it has not joined");
+            maybeRotate(s);
+            return;
+        }
+        stats.roomMessages.add();
+        if (log) logBatch.add(room->logStream, wallTime, MSG_ROOM, 0, header.sequence, plain, length);
+
+        size_t packedLength = 0;
+        if (room->packing.load(memory_order_relaxed)) {
+            uint64_t packStart = metricsNow();
+            packedLength = s.postPolicy.apply(lz4, plain, length, packed.data());
+            stats.compressNanos.add(metricsNow() - packStart);
+        }
+        MessageRef shared;
+        auto share = [&]() -> const MessageRef& {
+            if (!shared) {
+                shared = MessageRef(SharedMessage::create(plain, length, header.sequence, MSG_ROOM, 0, packed.data(),
+                                                          packedLength));
+            }
+            return shared;
+        };
+        for (Session* member : members[room]) {
+            if (member != &s) deliver(*member, plain, length, header.sequence, packed.data(), packedLength, share);
+        }
+        uint64_t others = room->workers.load(memory_order_relaxed) & ~(uint64_t(1) << worker);
+        for (; others; others &= others - 1) {
+            RoomHub::retain(room); // Released by the worker that delivers it
+            outgoing[__builtin_ctzll(others)].push_back({room, share()});
+        }
+        stats.prgaNanos.add(metricsNow() - start);
+        maybeRotate(s);
+    }
 
-        // Perform rotation
-        x->right = y;
-        y->left = T2;
+    // The MSG_HISTORY frame that ends a replay: how many records it sent and where the next page starts
+    static MessageRef historyEnd(uint32_t count, int64_t next, const string& room, uint32_t sequence) {
+        unsigned char end[12 + MAX_ROOM_NAME];
+        for (int i = 0; i < 4; ++i) end[i] = uint8_t(count >> (24 - 8 * i));
+        for (int i = 0; i < 8; ++i) end[4 + i] = uint8_t(uint64_t(next) >> (56 - 8 * i));
+        memcpy(end + 12, room.data(), room.size());
+        return MessageRef(SharedMessage::create(end, 12 + room.size(), sequence, MSG_HISTORY));
+    }
 
-        // Update heights
-        y->height = max(height(y->left), height(y->right)) + 1;
-        x->height = max(height(x->left), height(x->right)) + 1;
+    // Replay a room's logged messages to a member, or (no room named) the messages a session sent,
+    // which a resumed session keeps under the same stream. The replay runs on the message log's reader
+    // thread, never on this event loop; its records come back through this worker's inbox into
+    // the session's backlog (flagged FLAG_HISTORY), followed by a MSG_HISTORY frame saying how
+    // many there were and where the next page starts. A page is cut short to the backlog space
+    // left once earlier replays still in flight are accounted for. Messages from the current
+    // batch are not committed yet, so a replay may end just short of the live stream.
+    void handleHistory(Session& s, const FrameHeader& header, unsigned char* payload) {
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += header.length;
+        ++s.messagesSinceRekey;
+        RoomHub::Room* room = nullptr; // Only members may read a room's history
+        if (header.length > HISTORY_HEADER) {
+            room = joinedRoom(s, reinterpret_cast<char*>(payload + HISTORY_HEADER), header.length - HISTORY_HEADER);
+            if (!room) {
+                LOG_DEBUG("Client ", s.fd, " asked for the history of a room it has not joined");
+                maybeRotate(s);
+                return;
+            }
+        } else if (header.length < HISTORY_HEADER) {
+            LOG_WARN("Client ", s.fd, " sent a malformed history request");
+            maybeRotate(s);
+            return;
+        }
+        uint64_t stream = room ? room->logStream : s.logStream; // No room name: the session's own messages
+        string name = room ? room->name : string();
+        uint8_t type = room ? MSG_ROOM : MSG_DATA;
+        uint64_t since = historyField(payload, 8);
+        int64_t from = int64_t(min<uint64_t>(since, INT64_MAX));
+        size_t queued = s.backlog.size() + s.replayMessages + 1; // The end frame always goes out
+        size_t limit = min<uint64_t>(historyField(payload + 8, 4), HISTORY_LIMIT);
+        limit = min(limit, ROOM_BACKLOG_MESSAGES - min<size_t>(queued, ROOM_BACKLOG_MESSAGES));
+        size_t bytes = ROOM_BACKLOG_BYTES - min<size_t>(s.backlogBytes + s.replayBytes, ROOM_BACKLOG_BYTES);
+        if (!log || limit == 0 || bytes == 0) { // Nothing to look up: answer straight away
+            MessageRef end = historyEnd(0, from, name, header.sequence);
+            s.backlogBytes += end->length();
+            s.backlog.push_back(move(end));
+            markTouched(s); // Sent by the end-of-batch flush
+            maybeRotate(s);
+            return;
+        }
+        s.replays.push_back({limit + 1, bytes});
+        s.replayMessages += limit + 1;
+        s.replayBytes += bytes;
+        MessageLog* messages = log;
+        RoomHub* rooms = &hub;
+        log->schedule([messages, rooms, w = worker, fd = s.fd, serial = s.serial, stream, name = move(name), type,
+                       sequence = header.sequence, from, limit, bytes]() {
+            vector<RoomHub::Reply> out;
+            int64_t next = from;
+            uint32_t count = 0;
+            size_t used = 0;
+            messages->replay(stream, from, INT64_MAX, limit, [&](const MessageLog::Entry& e) {
+                if (used + e.length > bytes) return false; // Rest on the next page
+                out.push_back({fd, serial, MessageRef(SharedMessage::create(e.data, e.length, e.sequence, type, FLAG_HISTORY))});
+                used += e.length;
+                next = e.timestamp + 1;
+                ++count;
+                return true;
+            });
+            out.push_back({fd, serial, historyEnd(count, next, name, sequence)});
+            rooms->reply(w, out);
+        });
+        maybeRotate(s);
+    }
 
-        return x;
+    FileTransfer* findTransfer(Session& s, uint32_t id) {
+        for (auto& t : s.transfers) {
+            if (t->id == id) return t.get();
+        }
+        return nullptr;
     }
 
-    // Left rotation for balancing
-    AVLNode* leftRotate(AVLNode* x) {
-        AVLNode* y = x->right;
-        AVLNode* T2 = y->left;
+    void closeTransfer(Session& s, FileTransfer* t) {
+        for (auto& entry : s.transfers) {
+            if (entry.get() == t) {
+                entry = move(s.transfers.back());
+                s.transfers.pop_back();
+                return;
+            }
+        }
+    }
 
-        // Perform rotation
-        y->left = x;
-        x->right = T2;
+    // Queue a MSG_FILE_ACK (into `out` if the frame was already begun); false if the outbox is full
+    bool queueFileAck(Session& s, uint32_t id, uint64_t offset, uint8_t flags = 0, unsigned char* out = nullptr) {
+        if (!out) out = s.outbox.beginFrame(MSG_FILE_ACK, id, FILE_OFFSET_BYTES, flags);
+        if (!out) return false;
+        putFileField(out, offset, 8);
+        s.cipher.encrypt(out, FILE_OFFSET_BYTES);
+        s.outbox.commitFrame(FILE_OFFSET_BYTES);
+        s.bytesSinceRekey += FILE_OFFSET_BYTES;
+        return true;
+    }
 
-        // Update heights
-        x->height = max(height(x->left), height(x->right)) + 1;
-        y->height = max(height(y->left), height(y->right)) + 1;
+    // Give up on a transfer and tell the client (if the outbox has room; otherwise its window stalls)
+    void abortTransfer(Session& s, FileTransfer* t, const char* why) {
+        LOG_WARN("File transfer ", t->name, " with client ", s.fd, " aborted: ", why, " (", strerror(errno), ")");
+        queueFileAck(s, t->id, t->acked, FLAG_FILE_ABORT);
+        closeTransfer(s, t);
+    }
 
-        return y;
+    // Open (or resume) an upload into NAME.part, or a download of NAME; answers with the offset
+    // the transfer starts from. Uploads of one name are serialized across sessions and workers
+    // by a lock on the .part file. A resumed upload starts one chunk before the end of the .part,
+    // and those bytes are compared rather than written (see storeChunk()).
+    uint8_t openTransfer(Session& s, uint32_t id, FileOpen& request) {
+        if (fileDir.empty()) return FILE_DISABLED;
+        if (!validFileName(request.name)) return FILE_BAD_NAME;
+        if (s.transfers.size() >= FILE_TRANSFERS || findTransfer(s, id)) return FILE_BUSY;
+        string path = fileDir + "/" + request.name;
+        struct stat st;
+        if (request.code != FILE_DOWNLOAD) {
+            bool replace = request.code == FILE_UPLOAD_REPLACE;
+            if (!replace && lstat(path.c_str(), &st) == 0) return FILE_EXISTS;
+            int fd = open((path + ".part").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) return FILE_IO_ERROR;
+            if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+                close(fd);
+                return FILE_BUSY;
+            }
+            if (fstat(fd, &st) < 0 || (uint64_t(st.st_size) > request.size && ftruncate(fd, 0) < 0)) { // A different, smaller file: start over
+                close(fd);
+                return FILE_IO_ERROR;
+            }
+            uint64_t stored = uint64_t(st.st_size) > request.size ? 0 : st.st_size;
+            request.offset = stored - min<uint64_t>(stored, FILE_CHUNK_BYTES); // The client proves it holds the same bytes
+            request.window = FILE_WINDOW;
+            s.transfers.emplace_back(new FileTransfer(id, true, fd, request.size, request.offset, FILE_WINDOW, request.name));
+            s.transfers.back()->stored = stored;
+            s.transfers.back()->replace = replace;
+            if (request.offset == request.size && !finishUpload(s, s.transfers.back().get())) return FILE_IO_ERROR;
+            return FILE_OK;
+        }
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return errno == ENOENT ? FILE_NOT_FOUND : FILE_IO_ERROR;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return FILE_NOT_FOUND;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // Larger readahead for the preads
+        request.size = st.st_size;
+        if (request.offset > request.size) request.offset = 0; // Client holds more than there is: start over
+        request.window = max<uint32_t>(FILE_CHUNK_BYTES, min(request.window, FILE_MAX_WINDOW));
+        if (request.offset == request.size) {
+            close(fd); // Client already has it all
+            return FILE_OK;
+        }
+        s.transfers.emplace_back(new FileTransfer(id, false, fd, request.size, request.offset, request.window, request.name));
+        markTouched(s); // The first chunks go out with the end-of-batch flush
+        return FILE_OK;
     }
 
-    // Insert a key into the AVL tree
-    AVLNode* insertNode(AVLNode* node, const string& key) {
-        // Standard BST insertion
-        if (!node) return new AVLNode(key);
+    // Every byte of an upload is stored: sync it, move it into place and close the transfer. Without
+    // leave to replace, a NAME that appeared since the upload was opened is left alone.
+    bool finishUpload(Session& s, FileTransfer* t) {
+        string path = fileDir + "/" + t->name;
+        if (fdatasync(t->fd) < 0 ||
+            renameat2(AT_FDCWD, (path + ".part").c_str(), AT_FDCWD, path.c_str(), t->replace ? 0 : RENAME_NOREPLACE) < 0) {
+            LOG_ERROR("Could not store upload ", t->name, ": ", strerror(errno));
+            closeTransfer(s, t);
+            return false;
+        }
+        LOG_INFO("Client ", s.fd, " uploaded ", t->name, " (", t->size, " bytes)");
+        stats.filesCompleted.add();
+        closeTransfer(s, t);
+        return true;
+    }
 
-        if (key < node->key)
-            node->left = insertNode(node->left, key);
-        else if (key > node->key)
-            node->right = insertNode(node->right, key);
-        else
-            return node; // Duplicate keys are not allowed
+    // MSG_FILE_OPEN: start or resume a transfer; false if the outbox has no room for the reply yet
+    bool handleFileOpen(Session& s, const FrameHeader& header, unsigned char* payload) {
+        unsigned char* out = s.outbox.beginFrame(MSG_FILE_OPEN, header.sequence, FILE_REPLY_BYTES);
+        if (!out) return false;
+        s.cipher.decrypt(payload, header.length);
+        FileOpen request;
+        uint8_t status = FILE_BAD_NAME;
+        if (request.decode(payload, header.length) && request.code <= FILE_UPLOAD_REPLACE) {
+            status = openTransfer(s, header.sequence, request);
+        }
+        if (status != FILE_OK) LOG_DEBUG("Client ", s.fd, " file transfer refused: ", fileStatusText(status));
+        FileOpen reply = request;
+        reply.code = status;
+        reply.name.clear();
+        string encoded = reply.encode();
+        s.cipher.encrypt(reinterpret_cast<const unsigned char*>(encoded.data()), out, FILE_REPLY_BYTES);
+        s.outbox.commitFrame(FILE_REPLY_BYTES);
+        s.bytesSinceRekey += header.length + FILE_REPLY_BYTES;
+        ++s.messagesSinceRekey;
+        maybeRotate(s);
+        return true;
+    }
 
-        // Update height of the current node
-        node->height = 1 + max(height(node->left), height(node->right));
+    // MSG_FILE_CHUNK of an upload: decrypted where it was received and written from there.
+    // Acknowledged every quarter window (and at the end), so the client can keep sending.
+    bool handleFileChunk(Session& s, const FrameHeader& header, unsigned char* payload) {
+        FileTransfer* t = findTransfer(s, header.sequence);
+        size_t n = header.length - min<size_t>(header.length, FILE_OFFSET_BYTES);
+        unsigned char* ack = nullptr;
+        if (t && t->upload) { // Reserve the acknowledgement first, so nothing is decrypted twice
+            uint64_t end = t->offset + n;
+            if (end - t->acked >= t->window / 4 || end >= t->size) {
+                ack = s.outbox.beginFrame(MSG_FILE_ACK, t->id, FILE_OFFSET_BYTES);
+                if (!ack) return false;
+            }
+        }
+        s.cipher.decrypt(payload, header.length); // Keeps the keystream in step even for a stale transfer
+        s.bytesSinceRekey += header.length;
+        if (t && t->upload) storeChunk(s, t, payload, header.length, ack);
+        maybeRotate(s); // Only after the reserved acknowledgement is written
+        return true;
+    }
 
-        // Get the balance factor and balance the tree if needed
-        int balance = getBalance(node);
+    // Write a decrypted chunk at its offset and fill in the acknowledgement reserved for it
+    void storeChunk(Session& s, FileTransfer* t, const unsigned char* payload, size_t length, unsigned char* ack) {
+        size_t n = length - min<size_t>(length, FILE_OFFSET_BYTES);
+        if (length < FILE_OFFSET_BYTES || fileField(payload, 8) != t->offset || n > t->size - t->offset) {
+            errno = EPROTO;
+            abortTransfer(s, t, "chunk out of order");
+            return;
+        }
+        size_t resent = size_t(min<uint64_t>(n, t->stored - min(t->stored, t->offset))); // Already in NAME.part
+        if (resent) {
+            unsigned char* stored = packed.data(); // Free outside of sending a frame
+            if (!preadAll(t->fd, stored, resent, t->offset) || memcmp(stored, payload + FILE_OFFSET_BYTES, resent) != 0) {
+                if (ftruncate(t->fd, 0) < 0) LOG_WARN("Could not clear ", t->name, ".part: ", strerror(errno)); // Another file's bytes: the next run starts over
+                errno = EPERM;
+                abortTransfer(s, t, "resumed with different bytes than the stored part");
+                return;
+            }
+        }
+        if (n > resent && !pwriteAll(t->fd, payload + FILE_OFFSET_BYTES + resent, n - resent, t->offset + resent)) {
+            abortTransfer(s, t, "write failed");
+            return;
+        }
+        t->offset += n;
+        t->writeBehind.wrote(t->fd, t->offset);
+        stats.fileBytesIn.add(n);
+        if (!ack) return;
+        uint32_t id = t->id;
+        if (t->offset < t->size) {
+            queueFileAck(s, id, t->offset, 0, ack);
+            t->acked = t->offset;
+        } else {
+            uint64_t size = t->size;
+            bool stored = finishUpload(s, t); // Closes the transfer
+            queueFileAck(s, id, stored ? size : 0, stored ? 0 : FLAG_FILE_ABORT, ack);
+        }
+    }
+
+    // MSG_FILE_ACK of a download: the window moves on (the chunks go out with the next flush)
+    void handleFileAck(Session& s, const FrameHeader& header, unsigned char* payload) {
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += header.length;
+        FileTransfer* t = findTransfer(s, header.sequence);
+        if (!t || t->upload || header.length != FILE_OFFSET_BYTES) return;
+        t->acked = max(t->acked, min(fileField(payload, 8), t->offset));
+        if (header.flags & FLAG_FILE_ABORT) {
+            closeTransfer(s, t);
+        } else if (t->acked == t->size) {
+            LOG_INFO("Client ", s.fd, " downloaded ", t->name, " (", t->size, " bytes)");
+            stats.filesCompleted.add();
+            closeTransfer(s, t);
+        } else {
+            markTouched(s);
+        }
+    }
 
-        // Left Left Case
-        if (balance > 1 && key < node->left->key)
-            return rightRotate(node);
+    // Fill the outbox with download chunks while windows and the outbox allow: each chunk is
+    // read with pread() straight into its frame and encrypted there
+    void pumpDownloads(Session& s) {
+        for (size_t i = 0; i < s.transfers.size(); ++i) {
+            FileTransfer* t = s.transfers[i].get();
+            while (!t->upload && t->offset < t->size && t->offset - t->acked < t->window) {
+                size_t n = size_t(min<uint64_t>(FILE_CHUNK_BYTES, t->size - t->offset));
+                unsigned char* out = s.outbox.beginFrame(MSG_FILE_CHUNK, t->id, FILE_OFFSET_BYTES + n);
+                if (!out) return;
+                if (!preadAll(t->fd, out + FILE_OFFSET_BYTES, n, t->offset)) {
+                    abortTransfer(s, t, "read failed");
+                    --i;
+                    break;
+                }
+                uint64_t start = metricsNow();
+                putFileField(out, t->offset, 8);
+                s.cipher.encrypt(out, FILE_OFFSET_BYTES + n);
+                s.outbox.commitFrame(FILE_OFFSET_BYTES + n);
+                stats.prgaNanos.add(metricsNow() - start);
+                stats.fileBytesOut.add(n);
+                t->offset += n;
+                s.bytesSinceRekey += FILE_OFFSET_BYTES + n;
+                maybeRotate(s); // May queue a REKEY between chunks
+            }
+        }
+    }
+
+    // The outbox has space again: move queued room messages and download chunks into it
+    void refill(Session& s) {
+        if (!s.backlog.empty()) drainBacklog(s);
+        if (!s.transfers.empty()) pumpDownloads(s);
+    }
+
+    // Fan out what other workers posted to this one, and queue the replies for its sessions
+    void deliverPosts() {
+        hub.take(worker, inbound, replies);
+        for (RoomHub::Post& post : inbound) {
+            auto it = members.find(post.room);
+            if (it != members.end()) { // Otherwise everyone here left in the meantime
+                SharedMessage* message = post.message.operator->();
+                for (Session* member : it->second) {
+                    deliver(*member, message->data(), message->length(), message->sequence(), message->packed(),
+                            message->packedLength(), [&]() -> const MessageRef& { return post.message; });
+                }
+            }
+            hub.release(post.room);
+        }
+        inbound.clear();
+        for (RoomHub::Reply& reply : replies) {
+            auto it = sessions.find(reply.fd);
+            if (it == sessions.end() || it->second.serial != reply.session || it->second.closing) continue; // Gone
+            Session& s = it->second;
+            if (reply.message->type() == MSG_HISTORY) { // The replay is over: give back the space it set aside
+                s.replayMessages -= s.replays.front().first;
+                s.replayBytes -= s.replays.front().second;
+                s.replays.pop_front();
+            } else {
+                stats.historyReplayed.add();
+            }
+            s.backlogBytes += reply.message->length();
+            s.backlog.push_back(move(reply.message));
+            markTouched(s);
+        }
+        replies.clear();
+    }
 
-        // Right Right Case
-        if (balance < -1 && key > node->right->key)
-            return leftRotate(node);
+    // Hand the room messages gathered during a batch to their workers (one post per worker)
+    void postOutgoing() {
+        for (size_t w = 0; w < outgoing.size(); ++w) {
+            if (!outgoing[w].empty()) hub.post(w, outgoing[w]);
+        }
+    }
 
-        // Left Right Case
-        if (balance > 1 && key > node->left->key) {
-            node->left = leftRotate(node->left);
-            return rightRotate(node);
+    // End of an event batch: send what room deliveries queued, post to other workers, prepare keys
+    template <typename Flush>
+    void finishBatch(Flush&& flush) {
+        flushing.swap(touched);
+        for (int fd : flushing) {
+            auto it = sessions.find(fd);
+            if (it == sessions.end()) continue; // Closed in the meantime
+            it->second.touched = false;
+            flush(it->second);
         }
+        flushing.clear();
+        postOutgoing();
+        if (log) log->submit(logBatch); // Never blocks; dropped (and counted) if the disk falls far behind
+        prepareQueuedKeys();
+    }
+
+    // Start a session for an accepted socket and queue the frame carrying its key (a WebSocket
+    // client gets it once the handshake is done). A client that opens with MSG_RESUME gets no
+    // key unless its ticket turns out unusable.
+    Session& openSession(int fd, bool webSocket = false) {
+        bool resuming = resumption && !webSocket && resumeWaiting(fd);
+        string key = resuming ? string() : generateSessionKey();
+        uint64_t start = metricsNow();
+        Session& s = sessions.try_emplace(fd, fd, key, pool).first->second; // Runs the key schedule
+        if (!resuming) stats.ksaNanos.add(metricsNow() - start);
+        if (!resuming) s.logStream = newLogStream(); // A resumed session gets its old one back
+        s.serial = ++sessionSerial;
+        stats.connectionsAccepted.add();
+        LOG_INFO("Connection established with a ", webSocket ? "WebSocket" : "TCP", " client! Active sessions: ",
+                 sessions.size());
+        if (webSocket) s.ws.reset(new WebSocketState());
+        else if (!resuming) sendSessionKey(s);
+        return s;
+    }
+
+    // Key a session that was waiting to resume but could not, and send it the key
+    void startFresh(Session& s) {
+        s.key = generateSessionKey();
+        s.logStream = newLogStream();
+        uint64_t start = metricsNow();
+        s.cipher.init(s.key, CipherContext::SERVER);
+        stats.ksaNanos.add(metricsNow() - start);
+        sendSessionKey(s);
+    }
 
-        // Right Left Case
-        if (balance < -1 && key < node->right->key) {
-            node->right = rightRotate(node->right);
-            return leftRotate(node);
+    // Send the encryption key to the client
+    void sendSessionKey(Session& s) {
+        unsigned char* out = s.outbox.beginFrame(MSG_KEY, 0, s.key.size());
+        memcpy(out, s.key.data(), s.key.size());
+        s.outbox.commitFrame(s.key.size());
+    }
+
+    // Queue bytes that must reach a closing client; sent at once if nothing is ahead of them
+    // (a closing io_uring session sends nothing more)
+    void sendFinal(Session& s, const string& bytes) {
+        if (s.outbox.empty() && s.sending.empty() && !s.sendBusy) {
+            ssize_t n = send(s.fd, bytes.data(), bytes.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            (void)n; // Best effort: the connection closes either way
+        } else {
+            s.outbox.append(bytes.data(), bytes.size());
         }
+    }
 
-        return node;
+    // Turn bytes read from a WebSocket client into the frame stream, in place: finish the
+    // handshake, unmask data, answer pings. Returns how many stream bytes start at `data`,
+    // or -1 if the connection is to be closed.
+    long receiveWebSocket(Session& s, unsigned char* data, size_t length) {
+        WebSocketState& ws = *s.ws;
+        if (!ws.open) {
+            ws.request.append(reinterpret_cast<char*>(data), length);
+            string response;
+            size_t consumed;
+            int status = webSocketHandshake(ws.request, response, consumed);
+            if (status == 0) return 0;
+            if (status < 0) {
+                LOG_WARN("Client ", s.fd, " sent an invalid WebSocket upgrade");
+                sendFinal(s, response);
+                return -1;
+            }
+            s.outbox.append(response.data(), response.size());
+            s.outbox.setWebSocket(true);
+            sendSessionKey(s);
+            ws.open = true;
+            length = ws.request.size() - consumed; // Frames sent right behind the request (all from this read)
+            memcpy(data, ws.request.data() + consumed, length);
+            string().swap(ws.request);
+        }
+        long n = ws.decoder.decode(data, length, wsReplies);
+        if (!wsReplies.empty()) {
+            if (!s.outbox.append(wsReplies.data(), wsReplies.size())) {
+                LOG_DEBUG("No room to answer a ping from client ", s.fd);
+            }
+            wsReplies.clear();
+        }
+        if (n < 0) {
+            LOG_DEBUG("WebSocket client ", s.fd, " closing (", ws.decoder.closeStatus(), ")");
+            sendFinal(s, webSocketClose(ws.decoder.closeStatus()));
+        }
+        return n;
     }
 
-    // Search for a key in the AVL tree
-    bool searchKey(AVLNode* node, const string& key) {
-        if (!node) return false;
-        if (node->key == key) return true;
-        if (key < node->key) return searchKey(node->left, key);
-        return searchKey(node->right, key);
+    // Forget a session whose socket has been closed, keeping its state for resumption if it
+    // holds a ticket (not in the middle of a key rotation: its two directions are on different keys)
+    void eraseSession(int fd) {
+        stats.connectionsClosed.add();
+        auto it = sessions.find(fd);
+        Session& s = it->second;
+        int64_t now = resumeWallNow();
+        if (resumption && s.ticketId && s.ticketExpires > now && !s.rekeyPending && !s.key.empty()) {
+            ResumptionCache::Entry entry{s.cipher, s.key, s.logStream, s.compress ? FEATURE_COMPRESSION : 0u, {}, now,
+                                         s.ticketExpires, s.bytesSinceRekey, s.messagesSinceRekey, s.keyStart};
+            for (RoomHub::Room* room : s.rooms) entry.rooms.push_back(room->name);
+            resumption->cache.put(s.ticketId, move(entry));
+        }
+        while (!it->second.rooms.empty()) leaveRoom(it->second, it->second.rooms.back());
+        LOG_INFO("Client disconnected after ", it->second.rotations, " key rotations. Active sessions: ",
+                 sessions.size() - 1, " (slowest rotation ", slowestRotationNanos, " ns of ", rotations, ")");
+        sessions.erase(it);
     }
 
-    // Helper function to destroy the AVL tree
-    void destroyTree(AVLNode* node) {
-        if (node) {
-            destroyTree(node->left);
-            destroyTree(node->right);
-            delete node;
+    // Turn compression on or off for a session, keeping the rooms' counts of compressing members
+    void setCompression(Session& s, bool on) {
+        if (s.compress == on) return;
+        s.compress = on;
+        for (RoomHub::Room* room : s.rooms) {
+            if (on) room->packing.fetch_add(1, memory_order_relaxed);
+            else room->packing.fetch_sub(1, memory_order_relaxed);
         }
     }
 
-public:
-    AVLTree() : root(nullptr) {} // Constructor initializes an empty tree
+    // Answer a client's feature request with the bits this server accepts; false if the outbox
+    // has no room for the answer yet
+    bool handleFeatures(Session& s, const FrameHeader& header, unsigned char* payload) {
+        unsigned char* out = s.outbox.beginFrame(MSG_FEATURES, header.sequence, 4);
+        if (!out) return false;
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += header.length + 4;
+        uint32_t requested = header.length >= 4 ? uint32_t(historyField(payload, 4)) : 0;
+        uint32_t accepted = requested & ((compression ? FEATURE_COMPRESSION : 0) | (resumption && !s.ws ? FEATURE_RESUMPTION : 0));
+        setCompression(s, accepted & FEATURE_COMPRESSION);
+        LOG_DEBUG("Client ", s.fd, " asked for features ", requested, ", accepted ", accepted);
+        unsigned char reply[4] = {uint8_t(accepted >> 24), uint8_t(accepted >> 16), uint8_t(accepted >> 8), uint8_t(accepted)};
+        s.cipher.encrypt(reply, out, 4);
+        s.outbox.commitFrame(4);
+        if ((accepted & FEATURE_RESUMPTION) && !s.ticketId) issueTicket(s);
+        maybeRotate(s);
+        return true;
+    }
 
-    ~AVLTree() { // Destructor clears the tree
-        destroyTree(root);
+    // Hand the client a ticket for resuming this session once it disconnects
+    void issueTicket(Session& s) {
+        TicketBody body;
+        entropy.generate(reinterpret_cast<unsigned char*>(&body.id), sizeof(body.id));
+        body.id |= 1; // 0 means "no ticket"
+        body.issued = resumeWallNow();
+        body.expires = body.issued + resumption->lifetimeNanos;
+        body.logStream = s.logStream;
+        body.features = s.compress ? FEATURE_COMPRESSION : 0;
+        body.secret.resize(TICKET_SECRET_BYTES);
+        entropy.generate(reinterpret_cast<unsigned char*>(&body.secret[0]), body.secret.size());
+        string ticket = resumption->tickets.seal(body, entropy);
+        size_t length = 5 + body.secret.size() + ticket.size();
+        unsigned char* out = s.outbox.beginFrame(MSG_TICKET, 0, length);
+        if (!out) return; // No room: this connection just won't be resumable
+        putField(out, uint64_t(resumption->lifetimeNanos / 1000000000), 4);
+        out[4] = uint8_t(body.secret.size());
+        memcpy(out + 5, body.secret.data(), body.secret.size());
+        memcpy(out + 5 + body.secret.size(), ticket.data(), ticket.size());
+        s.cipher.encrypt(out, length);
+        s.outbox.commitFrame(length);
+        s.bytesSinceRekey += length;
+        s.ticketId = body.id;
+        s.ticketExpires = body.expires;
+        stats.ticketsIssued.add();
     }
 
-    void insert(const string& key) { // Insert a key into the tree
-        root = insertNode(root, key);
+    // A client reconnecting with a ticket: continue its old keystreams if the session is still
+    // cached, else key a new session from the ticket's secret and both sides' nonces, else fall
+    // back to a fresh key. Answered in the clear, then with a new ticket; false if the outbox has
+    // no room for the answer yet.
+    bool handleResume(Session& s, const FrameHeader& header, unsigned char* payload) {
+        if (header.length == 0) { // The client's marker: what follows uses the keys it was answered with
+            s.discarding = false;
+            return true;
+        }
+        unsigned char* out = s.outbox.beginFrame(MSG_RESUME, header.sequence, RESUME_REPLY_SIZE);
+        if (!out) return false;
+        uint64_t start = metricsNow();
+        uint8_t status = RESUME_REJECTED;
+        TicketBody body;
+        ResumptionCache::Entry entry;
+        uint64_t nonce = 0, clientSent = 0, since = 0;
+        unsigned char serverNonce[RESUME_NONCE_BYTES] = {};
+        if (resumption && !s.ws && !s.ticketId && header.length > RESUME_REQUEST_HEADER &&
+            resumption->tickets.open(payload + RESUME_REQUEST_HEADER, header.length - RESUME_REQUEST_HEADER, body) &&
+            body.expires > resumeWallNow()) {
+            nonce = historyField(payload, 8);
+            clientSent = historyField(payload + 8, 8);
+            uint64_t clientReceived = historyField(payload + 16, 8);
+            status = RESUME_TICKET;
+            if (resumption->cache.take(body.id, entry) && clientSent >= entry.cipher.received() &&
+                clientSent - entry.cipher.received() <= RESUME_MAX_SKIP && clientReceived <= entry.cipher.sent() &&
+                entry.cipher.sent() - clientReceived <= RESUME_MAX_SKIP) {
+                status = RESUME_CACHED;
+            }
+        }
+
+        if (status == RESUME_CACHED) { // Pick up where the connection stopped: no key schedule at all
+            uint64_t lost = clientSent - entry.cipher.received(); // Sent by the client, never decrypted here
+            entry.cipher.skipReceived(lost);
+            s.cipher = entry.cipher;
+            s.key = move(entry.key);
+            s.logStream = entry.logStream;
+            s.bytesSinceRekey = entry.bytesSinceRekey + lost;
+            s.messagesSinceRekey = entry.messagesSinceRekey;
+            s.keyStart = entry.keyStart;
+            setCompression(s, compression && (entry.features & FEATURE_COMPRESSION));
+            for (const string& name : entry.rooms) joinRoom(s, name);
+            since = entry.closedAt;
+            stats.resumedCached.add();
+        } else if (status == RESUME_TICKET) { // New keystreams, same log stream and features
+            entropy.generate(serverNonce, sizeof(serverNonce)); // Fresh per answer: a replayed request gets new keys
+            s.key = ticketSessionKey(body.secret, nonce, serverNonce);
+            s.cipher.init(s.key, CipherContext::SERVER);
+            s.logStream = body.logStream;
+            s.bytesSinceRekey = 0;
+            s.messagesSinceRekey = 0;
+            s.keyStart = loopTime;
+            setCompression(s, compression && (body.features & FEATURE_COMPRESSION));
+            since = body.issued;
+            stats.resumedTicket.add();
+        } else {
+            stats.resumeRejected.add();
+        }
+        LOG_DEBUG("Client ", s.fd, " resumed: ", status == RESUME_CACHED ? "cached" : status == RESUME_TICKET ? "ticket" : "rejected");
+
+        uint32_t features = status == RESUME_REJECTED ? 0 : (s.compress ? FEATURE_COMPRESSION : 0) | FEATURE_RESUMPTION;
+        out[0] = status;
+        putField(out + 1, features, 4);
+        putField(out + 5, status == RESUME_CACHED ? s.cipher.sent() : 0, 8);
+        putField(out + 13, since, 8);
+        memcpy(out + 21, serverNonce, RESUME_NONCE_BYTES);
+        s.outbox.commitFrame(RESUME_REPLY_SIZE);
+        if (status != RESUME_CACHED) s.discarding = true; // Anything sent ahead of the answer used keys we don't have
+        if (status == RESUME_REJECTED) {
+            if (s.key.empty()) startFresh(s);
+        } else {
+            issueTicket(s);
+        }
+        stats.resumeNanos.add(metricsNow() - start);
+        return true;
+    }
+
+    // Plaintext of a decrypted MSG_DATA or MSG_ROOM payload: the payload itself, or its expansion
+    // into `inflated` if it arrived compressed; nullptr if a compressed payload is corrupt
+    const unsigned char* unpack(Session& s, const FrameHeader& header, const unsigned char* payload, size_t& length) {
+        length = header.length;
+        if (!(header.flags & FLAG_COMPRESSED)) return payload;
+        uint64_t start = metricsNow();
+        long n = Lz4::decompress(payload, header.length, inflated.data(), header.plainLength);
+        stats.compressNanos.add(metricsNow() - start);
+        if (n != long(header.plainLength)) {
+            LOG_WARN("Client ", s.fd, " sent a corrupt compressed message");
+            return nullptr;
+        }
+        stats.packedPlainBytes.add(n);
+        stats.packedWireBytes.add(header.length);
+        length = n;
+        return inflated.data();
     }
 
-    bool contains(const string& key) { // Check if a key exists in the tree
-        return searchKey(root, key);
+    // Decrypt one frame and queue the encrypted echo; returns false if the outbox has no room yet
+    bool handleFrame(Session& s, const FrameHeader& header, unsigned char* payload) {
+        if (header.type == MSG_RESUME) return handleResume(s, header, payload);
+        if (s.discarding || s.key.empty()) return true; // Encrypted under keys this connection does not have
+        if (header.type == MSG_REKEY_ACK) {
+            completeRekey(s);
+            return true;
+        }
+        if (header.type == MSG_JOIN || header.type == MSG_LEAVE) return handleMembership(s, header, payload);
+        if (header.type == MSG_ROOM) {
+            handleRoomMessage(s, header, payload);
+            return true;
+        }
+        if (header.type == MSG_HISTORY) {
+            handleHistory(s, header, payload);
+            return true;
+        }
+        if (header.type == MSG_FILE_OPEN) return handleFileOpen(s, header, payload);
+        if (header.type == MSG_FILE_CHUNK) return handleFileChunk(s, header, payload);
+        if (header.type == MSG_FILE_ACK) {
+            handleFileAck(s, header, payload);
+            return true;
+        }
+        if (header.type == MSG_FEATURES) return handleFeatures(s, header, payload);
+        if (header.type != MSG_DATA) return true; // Ignore frames this server does not understand
+
+        unsigned char* out = s.outbox.beginFrame(MSG_DATA, header.sequence, header.plainLength); // Fits the echo uncompressed
+        if (!out) return false;
+
+        LOG_DEBUG("Received message ", header.sequence, " from client ", s.fd, ", encrypted: ",
+                  LogBytes(payload, header.length)); // Message contents are logged only at debug level
+
+        // Decrypt the received message in place (and expand it if it came compressed)
+        uint64_t start = metricsNow();
+        s.cipher.decrypt(payload, header.length);
+        s.bytesSinceRekey += header.length;
+        ++s.messagesSinceRekey;
+        size_t length;
+        const unsigned char* plain = unpack(s, header, payload, length);
+        if (!plain) {
+            maybeRotate(s);
+            return true; // Not echoed
+        }
+        LOG_DEBUG("Decrypted message ", header.sequence, " from client ", s.fd, ": ", LogBytes(plain, length));
+        if (log) logBatch.add(s.logStream, wallTime, MSG_DATA, 0, header.sequence, plain, length);
+
+        // Encrypt the response straight into the outbox (echo back the decrypted message), compressed
+        // if the client negotiated it and the message shrinks enough
+        uint64_t packNanos = 0;
+        size_t wire = length;
+        if (s.compress) {
+            uint64_t packStart = metricsNow();
+            size_t packedLength = s.echoPolicy.apply(lz4, plain, length, packed.data());
+            packNanos = metricsNow() - packStart;
+            stats.compressNanos.add(packNanos);
+            if (packedLength) {
+                out = s.outbox.beginFrame(MSG_DATA, header.sequence, packedLength, FLAG_COMPRESSED, length); // Same spot, shorter
+                plain = packed.data();
+                wire = packedLength;
+                stats.packedPlainBytes.add(length);
+                stats.packedWireBytes.add(wire);
+            }
+        }
+        s.cipher.encrypt(plain, out, wire);
+        s.outbox.commitFrame(wire);
+        uint64_t end = metricsNow();
+        stats.prgaNanos.add(end - start - packNanos);
+        stats.cryptoLatency.record(end - start);
+        stats.messagesIn.add();
+        stats.messagesOut.add();
+        if (s.unsentMessages++ == 0) s.unsentSince = start;
+
+        s.bytesSinceRekey += wire;
+        maybeRotate(s);
+        return true;
     }
+
+public:
+    SessionServer(int fd, int wsFd, EntropyPool& pool, KeyRegistry& keys, ThreadMetrics& metrics, RoomHub& rooms,
+                  size_t index, MessageLog* messages, const string& files, bool compress, Resumption* resume)
+        : listenFd(fd), wsListenFd(wsFd), entropy(pool), stats(metrics), registry(keys), lastSweep(chrono::steady_clock::now()),
+          lastAgeCheck(lastSweep), loopTime(lastSweep), rotations(0), slowestRotationNanos(0), hub(rooms), worker(index),
+          outgoing(RoomHub::MAX_WORKERS), sessionSerial(0), log(messages), wallTime(0), fileDir(files), compression(compress),
+          inflated(MAX_FRAME_PAYLOAD), packed(MAX_FRAME_PAYLOAD), resumption(resume) {}
 };
 
-// RC4 Encryption/Decryption class
-class RC4 {
+// Edge-triggered epoll reactor serving its clients from a single thread
+class EpollServer : public SessionServer {
 private:
-    unsigned char S[256]; // Permutation array for RC4
+    int epollFd;                           // epoll instance watching all sockets
 
-    // Key Scheduling Algorithm (KSA) initializes the permutation array
-    void KSA(const string& key) {
-        for (int i = 0; i < 256; ++i) {
-            S[i] = i;
-        }
+    // Accept every pending connection on a listening socket and register it with epoll
+    void acceptClients(int listener) {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Accept failed: ", strerror(errno)); // Error handling if accepting a connection fails
+                }
+                return; // No more pending connections
+            }
+            if (!setNonBlocking(fd)) {
+                LOG_ERROR("fcntl failed: ", strerror(errno));
+                close(fd);
+                continue;
+            }
 
-        int j = 0;
-        for (int i = 0; i < 256; ++i) {
-            j = (j + S[i] + key[i % key.size()]) % 256; // Key-dependent swapping
-            swap(S[i], S[j]);
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // Edge-triggered: one wakeup per state change
+            ev.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                LOG_ERROR("epoll_ctl failed: ", strerror(errno));
+                close(fd);
+                continue;
+            }
+            Session& s = openSession(fd, listener == wsListenFd);
+            if (!flush(s)) {
+                LOG_ERROR("Failed to send key to client ", fd);
+                closeSession(fd);
+            }
         }
     }
 
-    // Pseudo-Random Generation Algorithm (PRGA) generates the keystream
-    string PRGA(const string& data) {
-        string result(data.size(), 0); // Result will have the same size as the input
-        int i = 0, j = 0;
+    // Handle buffered frames and drain readable data; returns false if the session closed
+    bool handleRead(Session& s) {
+        while (true) {
+            // Process every complete frame already buffered (a single read may carry several)
+            FrameHeader header;
+            unsigned char* payload;
+            int status;
+            while ((status = s.reader.peek(header, payload)) > 0) {
+                if (!handleFrame(s, header, payload)) {
+                    if (!flush(s)) return false;
+                    if (!handleFrame(s, header, payload)) {
+                        s.readPaused = true; // Client is not reading its responses; resume on EPOLLOUT
+                        return true;
+                    }
+                }
+                s.reader.consume(header);
+            }
+            if (status < 0) {
+                LOG_WARN("Malformed frame from client ", s.fd);
+                return false;
+            }
+
+            // Read straight into the session's receive block
+            size_t available;
+            unsigned char* space = s.reader.writeSpace(available);
+            uint64_t start = metricsNow();
+            ssize_t bytes_read = read(s.fd, space, available);
+            stats.readNanos.add(metricsNow() - start);
+            stats.readCalls.add();
+            if (bytes_read == 0) {
+                return false; // Client disconnected
+            }
+            if (bytes_read < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    s.reader.recycle(); // Don't hold a block while idle
+                    s.readPaused = false;
+                    return flush(s); // Socket drained; wait for the next edge
+                }
+                return false; // Read error
+            }
+            stats.bytesIn.add(bytes_read);
+            if (s.ws) { // Unwrap WebSocket messages in place
+                long n = receiveWebSocket(s, space, bytes_read);
+                if (n < 0) {
+                    flush(s); // Last chance for the close frame
+                    return false;
+                }
+                bytes_read = n;
+            }
+            s.reader.commit(bytes_read);
+        }
+    }
 
-        for (size_t k = 0; k < data.size(); ++k) {
-            i = (i + 1) % 256;
-            j = (j + S[i]) % 256;
-            swap(S[i], S[j]);
-            unsigned char rnd = S[(S[i] + S[j]) % 256]; // Generate pseudo-random byte
-            result[k] = data[k] ^ rnd; // XOR input data with the generated byte
+    // Send as much of the outbox as the socket accepts; returns false if the session failed
+    bool flush(Session& s) {
+        while (true) {
+            refill(s); // Sent bytes made space for queued room messages and download chunks
+            if (s.outbox.empty()) return true;
+            uint64_t start = metricsNow();
+            ssize_t sent = send(s.fd, s.outbox.data(), s.outbox.size(), MSG_NOSIGNAL);
+            uint64_t end = metricsNow();
+            stats.sendNanos.add(end - start);
+            stats.sendCalls.add();
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true; // Wait for EPOLLOUT
+                LOG_WARN("Failed to send response to client ", s.fd, ": ", strerror(errno));
+                return false;
+            }
+            s.outbox.consume(sent);
+            stats.bytesOut.add(sent);
+            if (s.outbox.empty() && s.unsentMessages) { // Every queued echo is now with the kernel
+                stats.sendLatency.record(end - s.unsentSince, s.unsentMessages);
+                s.unsentMessages = 0;
+            }
         }
+    }
 
-        return result; // Return encrypted/decrypted data
+    // Remove a session from epoll and close its socket
+    void closeSession(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        eraseSession(fd);
     }
 
 public:
-    // Encrypt data using the given key
-    string encrypt(const string& key, const string& data) {
-        KSA(key); // Initialize the permutation array
-        return PRGA(data); // Generate encrypted data
+    EpollServer(int fd, int wsFd, EntropyPool& pool, KeyRegistry& keys, ThreadMetrics& metrics, RoomHub& rooms,
+                size_t index, MessageLog* messages, const string& files, bool compress, Resumption* resume) // Constructor takes bound, listening sockets
+        : SessionServer(fd, wsFd, pool, keys, metrics, rooms, index, messages, files, compress, resume), epollFd(-1) {}
+
+    ~EpollServer() { // Destructor closes every remaining session
+        for (auto& entry : sessions) {
+            close(entry.first);
+        }
+        if (epollFd >= 0) close(epollFd);
     }
 
-    // Decrypt data (same as encrypt for RC4)
-    string decrypt(const string& key, const string& data) {
-        return encrypt(key, data);
+    // Run the event loop forever; returns false if it could not start
+    bool run() {
+        epollFd = epoll_create1(0);
+        if (epollFd < 0) {
+            LOG_ERROR("epoll_create1 failed: ", strerror(errno));
+            return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = listenFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) < 0) {
+            LOG_ERROR("epoll_ctl failed: ", strerror(errno));
+            return false;
+        }
+        ev.data.fd = wsListenFd;
+        if (wsListenFd >= 0 && epoll_ctl(epollFd, EPOLL_CTL_ADD, wsListenFd, &ev) < 0) {
+            LOG_ERROR("epoll_ctl failed: ", strerror(errno));
+            return false;
+        }
+        int wakeFd = hub.wakeFd(worker); // Readable when other workers posted room messages
+        ev.data.fd = wakeFd;
+        if (wakeFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) < 0) {
+            LOG_ERROR("Room inbox unavailable: ", strerror(errno));
+            return false;
+        }
+
+        epoll_event events[MAX_EVENTS];
+        while (!shuttingDown.load(memory_order_relaxed)) {
+            int n = epoll_wait(epollFd, events, MAX_EVENTS, 1000); // Wake at least once a second for housekeeping
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("epoll_wait failed: ", strerror(errno));
+                return false;
+            }
+            beginBatch();
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd || fd == wsListenFd) {
+                    acceptClients(fd);
+                    continue;
+                }
+                if (fd == wakeFd) {
+                    deliverPosts();
+                    continue;
+                }
+
+                auto it = sessions.find(fd);
+                if (it == sessions.end()) continue; // Closed earlier in this batch
+                Session& s = it->second;
+
+                bool alive = !(events[i].events & EPOLLERR);
+                if (alive && (events[i].events & EPOLLOUT)) {
+                    alive = flush(s);
+                    if (alive && s.readPaused) {
+                        alive = handleRead(s); // Outbox has room again; resume the paused client
+                    }
+                }
+                if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                    alive = handleRead(s);
+                }
+                if (!alive) {
+                    closeSession(fd);
+                }
+            }
+            finishBatch([this](Session& s) { if (!flush(s)) closeSession(s.fd); });
+        }
+        return true; // Another worker failed
     }
 };
 
-// Main function starts here
-int main() {
-    RC4 rc4;                        // RC4 encryption/decryption instance
-    string encryption_key;          // Holds the encryption key
-    int server_fd, new_socket;      // Server file descriptor and client socket
-    struct sockaddr_in address;     // Server address structure
-    int addrlen = sizeof(address);  // Length of the address structure
-    char buffer[BUFFER_SIZE] = {0}; // Buffer to hold received data
+// io_uring event loop (--io uring). One multishot accept and one multishot receive per client
+// keep producing completions without being resubmitted. Receives land in buffers the kernel
+// picks from a provided-buffer group, and frames are decrypted right where they landed; only a
+// frame split across two receives is copied (into the session's FrameReader). Echoes are
+// encrypted into pool blocks whose slabs are registered with the ring and sent with
+// WRITE_FIXED, so the kernel skips pinning the pages on every send. Everything queued while a
+// batch of completions is handled reaches the kernel in the next single io_uring_enter().
+class UringServer : public SessionServer {
+private:
+    enum Operation : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_PROVIDE, OP_CANCEL, OP_WAKE }; // Kept in user_data's top half
+
+    static const unsigned RING_ENTRIES = 256;         // Submission slots (flushed early when full)
+    static const unsigned COMPLETION_ENTRIES = 4096;  // Multishot operations post many completions per submission
+    static const unsigned RECV_BUFFERS = 256;         // Provided receive buffers
+    static const unsigned RECV_BUFFER_SIZE = 16 * 1024;
+    static const uint16_t RECV_GROUP = 1;             // Buffer group the receives select from
+    static const unsigned FIXED_SLOTS = 1024;         // Pool slabs that can be registered; later ones use plain sends
+
+    IoUring ring;
+    unique_ptr<unsigned char[]> recvMemory;  // RECV_BUFFERS buffers back to back, indexed by buffer id
+    unsigned fixedSlots;                     // Registered-buffer slots available (0 if registration failed)
+    unsigned registeredSlabs;                // Pool slabs registered so far (slab i is slot i)
+    bool acceptArmed;                        // The multishot accept is active
+    bool wsAcceptArmed;                      // The multishot accept on the WebSocket port is active
+    bool wakeArmed;                          // The multishot poll on the room inbox is active
+    vector<int> rearm;                       // Sessions whose receive stopped; re-armed after the batch
+
+    static uint64_t tag(Operation op, int fd) { return (uint64_t(op) << 32) | uint32_t(fd); }
+
+    unsigned char* recvBuffer(uint16_t id) { return recvMemory.get() + size_t(id) * RECV_BUFFER_SIZE; }
+
+    // Hand receive buffers [first, first + count) (back) to the kernel
+    void provide(uint16_t first, unsigned count = 1) {
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) {
+            LOG_ERROR("io_uring submission queue stuck; receive buffer ", first, " lost");
+            return;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = reinterpret_cast<uint64_t>(recvBuffer(first));
+        sqe->len = RECV_BUFFER_SIZE;
+        sqe->off = first;
+        sqe->buf_group = RECV_GROUP;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS; // Only failures complete
+        sqe->user_data = tag(OP_PROVIDE, 0);
+    }
 
-    // Step 1: Create the server socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket failed"); // Error handling if socket creation fails
-        exit(EXIT_FAILURE);
+    void armAccept(int listener) {
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) return; // Retried after the next batch
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = tag(OP_ACCEPT, listener);
+        (listener == wsListenFd ? wsAcceptArmed : acceptArmed) = true;
     }
-    cout << "Socket created successfully.\n";
 
-    // Step 2: Configure server address and bind it to the socket
-    address.sin_family = AF_INET;           // IPv4
-    address.sin_addr.s_addr = INADDR_ANY;   // Bind to all available interfaces
-    address.sin_port = htons(PORT);         // Use the defined port (8080)
+    void armWake() {
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) return; // Retried after the next batch
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = hub.wakeFd(worker);
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = tag(OP_WAKE, sqe->fd);
+        wakeArmed = true;
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed"); // Error handling if binding fails
-        exit(EXIT_FAILURE);
+    void armRecv(Session& s) {
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) {
+            rearm.push_back(s.fd);
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = s.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT; // len 0: the whole selected buffer
+        sqe->buf_group = RECV_GROUP;
+        sqe->user_data = tag(OP_RECV, s.fd);
+        s.recvArmed = true;
     }
-    cout << "Bind successful. Server is listening...\n";
 
-    // Step 3: Start listening for incoming connections
-    if (listen(server_fd, 3) < 0) { // Allow up to 3 pending connections
-        perror("Listen failed"); // Error handling if listening fails
-        exit(EXIT_FAILURE);
+    void cancelRecv(Session& s) {
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) return; // The receive keeps running; its data is queued until the session resumes
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(OP_RECV, s.fd);
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = tag(OP_CANCEL, s.fd);
     }
-    cout << "Server is listening on port " << PORT << "...\n";
 
-    while (true) {
-        cout << "Waiting for a connection...\n";
+    // Register pool slabs allocated since the last send; a failure leaves later slabs on plain sends
+    void registerNewSlabs() {
+        while (registeredSlabs < pool.slabCount() && registeredSlabs < fixedSlots) {
+            if (!ring.updateBuffer(registeredSlabs, pool.slabData(registeredSlabs), pool.slabBytes())) {
+                LOG_WARN("Could not register send buffer slab ", registeredSlabs, ": ", strerror(errno));
+                fixedSlots = registeredSlabs;
+                return;
+            }
+            ++registeredSlabs;
+        }
+    }
 
-        // Step 4: Accept a client connection
-        new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (new_socket < 0) {
-            perror("Accept failed"); // Error handling if accepting a connection fails
-            continue;
+    // Start sending the outbox unless a send is already in flight (one at a time keeps the byte order)
+    void flush(Session& s) {
+        refill(s); // The outbox may have space for queued room messages and download chunks
+        if (s.sendBusy || s.closing) return;
+        if (s.sending.empty()) {
+            if (s.outbox.empty()) return;
+            s.sending.swap(s.outbox); // New echoes go to a fresh block; this one stays put until sent
+            if (s.unsentMessages) { // Every queued echo is now with the kernel
+                stats.sendLatency.record(metricsNow() - s.unsentSince, s.unsentMessages);
+                s.unsentMessages = 0;
+            }
+        }
+        io_uring_sqe* sqe = ring.getSqe();
+        if (!sqe) {
+            rearm.push_back(s.fd); // Retried after the batch
+            return;
         }
-        cout << "Connection established with a client!\n";
+        registerNewSlabs();
+        unsigned slab = s.sending.slab();
+        sqe->fd = s.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(s.sending.data());
+        sqe->len = s.sending.size();
+        if (slab < registeredSlabs) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->off = uint64_t(-1); // Sockets have no file position
+            sqe->buf_index = slab;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        sqe->user_data = tag(OP_SEND, s.fd);
+        s.sendBusy = true;
+        stats.sendCalls.add();
+    }
+
+    // Stop reading until the outbox drains; data already received stays queued
+    bool pauseReading(Session& s) {
+        s.readPaused = true;
+        if (s.recvArmed) cancelRecv(s);
+        return true;
+    }
+
+    // Run received bytes through the frame parser until they run out or the outbox is full;
+    // returns false on a malformed frame
+    bool processInput(Session& s) {
+        s.readPaused = false;
+        while (true) {
+            // A frame completed from several receives is handled from the reader
+            FrameHeader header;
+            unsigned char* payload;
+            int status = s.reader.peek(header, payload);
+            if (status < 0) return false;
+            if (status > 0) {
+                if (!handleFrame(s, header, payload)) return pauseReading(s);
+                s.reader.consume(header);
+                continue;
+            }
+            if (s.received.empty()) {
+                s.reader.recycle();
+                return true;
+            }
 
-        // Step 5: Generate an encryption key (from an image or fallback)
-        try {
-            encryption_key = "1234567890"; // Placeholder for generated key
-            cout << "Using encryption key: " << encryption_key << endl;
-        } catch (const exception& e) {
-            encryption_key = "1234567890"; // Fallback key if generation fails
-            cout << "Using fallback encryption key: " << encryption_key << endl;
+            RecvChunk& chunk = s.received.front();
+            unsigned char* data = recvBuffer(chunk.id) + chunk.offset;
+            size_t missing = s.reader.missing();
+            if (missing > 0) { // Top up the split frame with just the bytes it lacks
+                size_t available;
+                unsigned char* space = s.reader.writeSpace(available);
+                size_t n = min(min(missing, available), size_t(chunk.length));
+                memcpy(space, data, n);
+                s.reader.commit(n);
+                chunk.offset += n;
+                chunk.length -= n;
+            } else {
+                // Frames wholly inside the buffer are decrypted where the kernel put them
+                while (chunk.length >= FRAME_HEADER_SIZE) {
+                    header = decodeHeader(data);
+                    if (header.length > MAX_FRAME_PAYLOAD) return false;
+                    size_t size = FRAME_HEADER_SIZE + header.length;
+                    if (chunk.length < size) break;
+                    if (!handleFrame(s, header, data + FRAME_HEADER_SIZE)) return pauseReading(s);
+                    data += size;
+                    chunk.offset += size;
+                    chunk.length -= size;
+                }
+                if (chunk.length > 0) { // Start of a frame that continues in the next receive
+                    size_t available;
+                    unsigned char* space = s.reader.writeSpace(available);
+                    memcpy(space, data, chunk.length);
+                    s.reader.commit(chunk.length);
+                    chunk.length = 0;
+                }
+            }
+            if (chunk.length == 0) {
+                provide(chunk.id);
+                s.received.erase(s.received.begin());
+            }
         }
+    }
+
+    // Shut a session down; it is erased once its receive and send have completed
+    void closeSession(Session& s) {
+        if (s.closing) return;
+        s.closing = true;
+        shutdown(s.fd, SHUT_RDWR); // Ends the receive and any send still in flight
+        if (s.recvArmed) cancelRecv(s);
+        for (const RecvChunk& chunk : s.received) provide(chunk.id);
+        s.received.clear();
+        finishClose(s);
+    }
+
+    void finishClose(Session& s) {
+        if (s.recvArmed || s.sendBusy) return; // The fd must stay ours until nothing refers to it
+        close(s.fd);
+        eraseSession(s.fd);
+    }
 
-        // Step 6: Send the encryption key to the client
-        if (send(new_socket, encryption_key.c_str(), encryption_key.length(), 0) < 0) {
-            cerr << "Failed to send key to client" << endl;
-            close(new_socket);
-            continue;
+    void onAccept(int listener, const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) (listener == wsListenFd ? wsAcceptArmed : acceptArmed) = false; // Re-armed after the batch
+        if (cqe.res < 0) {
+            if (cqe.res != -ECANCELED) LOG_ERROR("Accept failed: ", strerror(-cqe.res));
+            return;
         }
+        Session& s = openSession(cqe.res, listener == wsListenFd);
+        armRecv(s);
+        flush(s);
+    }
 
-        // Step 7: Handle client communication in a loop
-        while (true) {
-            // Receive an encrypted message from the client
-            memset(buffer, 0, BUFFER_SIZE); // Clear the buffer
-            ssize_t bytes_read = read(new_socket, buffer, BUFFER_SIZE - 1);
-            if (bytes_read <= 0) {
-                cout << "Client disconnected" << endl; // Exit loop if client disconnects
-                break;
+    void onRecv(Session& s, const io_uring_cqe& cqe) {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) s.recvArmed = false;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            long length = cqe.res;
+            if (length > 0 && !s.closing) {
+                stats.readCalls.add();
+                stats.bytesIn.add(length);
+                if (s.ws) length = receiveWebSocket(s, recvBuffer(id), length); // Unwrapped in the buffer itself
+            }
+            if (length > 0 && !s.closing) {
+                s.received.push_back({id, 0, uint32_t(length)});
+            } else {
+                provide(id);
+            }
+            if (length < 0) {
+                closeSession(s);
+                return;
+            }
+        }
+        if (s.closing) {
+            finishClose(s);
+            return;
+        }
+        if (cqe.res == 0) { // Client disconnected
+            closeSession(s);
+            return;
+        }
+        if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            LOG_WARN("Receive from client ", s.fd, " failed: ", strerror(-cqe.res));
+            closeSession(s);
+            return;
+        }
+        if (!s.readPaused && !processInput(s)) {
+            LOG_WARN("Malformed frame from client ", s.fd);
+            closeSession(s);
+            return;
+        }
+        flush(s);
+        if (!s.recvArmed && !s.readPaused) rearm.push_back(s.fd); // Ran out of buffers or stopped by the kernel
+    }
+
+    void onSend(Session& s, const io_uring_cqe& cqe) {
+        s.sendBusy = false;
+        if (s.closing) {
+            finishClose(s);
+            return;
+        }
+        if (cqe.res < 0) {
+            LOG_WARN("Failed to send response to client ", s.fd, ": ", strerror(-cqe.res));
+            closeSession(s);
+            return;
+        }
+        s.sending.consume(cqe.res); // A short write resends the rest next
+        stats.bytesOut.add(cqe.res);
+        if (s.readPaused) { // Room again: finish the frames that were waiting
+            flush(s);
+            if (!processInput(s)) {
+                LOG_WARN("Malformed frame from client ", s.fd);
+                closeSession(s);
+                return;
+            }
+            if (!s.readPaused && !s.recvArmed) armRecv(s);
+        }
+        flush(s);
+    }
+
+    void dispatch(const io_uring_cqe& cqe) {
+        Operation op = Operation(cqe.user_data >> 32);
+        int fd = int(uint32_t(cqe.user_data));
+        if (op == OP_ACCEPT) {
+            onAccept(fd, cqe);
+            return;
+        }
+        if (op == OP_PROVIDE) {
+            LOG_ERROR("Could not provide receive buffers: ", strerror(-cqe.res));
+            return;
+        }
+        if (op == OP_CANCEL) return; // Nothing to cancel: the receive had already ended
+        if (op == OP_WAKE) {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) wakeArmed = false;
+            if (cqe.res > 0) deliverPosts();
+            return;
+        }
+
+        auto it = sessions.find(fd);
+        if (it == sessions.end()) { // Cannot happen while fds are closed last; keep the buffer anyway
+            if (cqe.flags & IORING_CQE_F_BUFFER) provide(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            return;
+        }
+        if (op == OP_RECV) onRecv(it->second, cqe);
+        else onSend(it->second, cqe);
+    }
+
+public:
+    UringServer(int fd, int wsFd, EntropyPool& pool, KeyRegistry& keys, ThreadMetrics& metrics, RoomHub& rooms,
+                size_t index, MessageLog* messages, const string& files, bool compress, Resumption* resume) // Constructor takes bound, listening sockets
+        : SessionServer(fd, wsFd, pool, keys, metrics, rooms, index, messages, files, compress, resume), fixedSlots(0), registeredSlabs(0),
+          acceptArmed(false), wsAcceptArmed(false), wakeArmed(false) {}
+
+    ~UringServer() { // Destructor closes every remaining session
+        for (auto& entry : sessions) {
+            close(entry.first);
+        }
+    }
+
+    // Set up the ring and receive buffers; false (errno set) if this kernel cannot run the loop
+    bool start() {
+        if (!ring.init(RING_ENTRIES, COMPLETION_ENTRIES)) return false;
+        if (!ring.supports({IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITE_FIXED,
+                            IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD}) ||
+            hub.wakeFd(worker) < 0) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+        fixedSlots = ring.registerSparseBuffers(FIXED_SLOTS) ? FIXED_SLOTS : 0; // Without them every send is a plain SEND
+
+        recvMemory.reset(new unsigned char[size_t(RECV_BUFFERS) * RECV_BUFFER_SIZE]);
+        provide(0, RECV_BUFFERS);
+        if (ring.submit() < 0) return false;
+        int failed = 0;
+        ring.drain([&](const io_uring_cqe& cqe) { failed = cqe.res; }); // Only a failure posts a completion
+        if (failed < 0) {
+            errno = -failed;
+            return false;
+        }
+        return true;
+    }
+
+    // Run the event loop forever; returns false if it stopped on an error
+    bool run() {
+        armAccept(listenFd);
+        if (wsListenFd >= 0) armAccept(wsListenFd);
+        armWake();
+        while (!shuttingDown.load(memory_order_relaxed)) {
+            if (ring.submit(true, 1000) < 0 && errno != EBUSY && errno != EAGAIN) { // Wake at least once a second for housekeeping
+                LOG_ERROR("io_uring_enter failed: ", strerror(errno));
+                return false;
+            }
+            beginBatch();
+
+            ring.drain([this](const io_uring_cqe& cqe) { dispatch(cqe); });
+            vector<int> retry;
+            retry.swap(rearm);
+            for (int fd : retry) {
+                auto it = sessions.find(fd);
+                if (it == sessions.end() || it->second.closing) continue;
+                if (!it->second.recvArmed && !it->second.readPaused) armRecv(it->second);
+                flush(it->second);
+            }
+            if (!acceptArmed) armAccept(listenFd);
+            if (wsListenFd >= 0 && !wsAcceptArmed) armAccept(wsListenFd);
+            if (!wakeArmed) armWake();
+            finishBatch([this](Session& s) { flush(s); });
+        }
+        return true; // Another worker failed
+    }
+};
+
+// Main function starts here
+int main(int argc, char* argv[]) {
+    vector<int> listeners;          // One listening socket per worker
+    vector<int> wsListeners;        // One WebSocket listening socket per worker (if enabled)
+    struct sockaddr_in address;     // Server address structure
+    int port = PORT;                // Listening port (--port overrides the default)
+    int wsPort = WS_PORT;           // WebSocket port (--ws-port 0 disables it)
+    int workers = 1;                // Event-loop threads (--workers 0 = one per core)
+    bool pinWorkers = false;        // Pin worker i to CPU i
+    int statsPort = STATS_PORT;     // Metrics over HTTP on 127.0.0.1 (0 = off)
+    string statsSocket;             // Metrics over HTTP on a Unix socket instead, if set
+    LogLevel logLevel = LogLevel::INFO; // debug also logs every message's ciphertext and plaintext
+    bool useUring = false;          // --io uring: io_uring event loops (epoll if unavailable)
+    MessageLog::Options logOptions; // --log-dir DIR: keep an encrypted message history there
+    string fileDir;                 // --file-dir DIR: accept uploads into and serve downloads from DIR
+    bool compression = true;        // Clients may negotiate compression (--no-compression refuses)
+    bool resumable = true;          // Clients may resume sessions with tickets (--no-resumption refuses)
+    size_t resumeEntries = RESUME_CACHE_ENTRIES; // --resume-cache N: closed sessions kept (0 = tickets only)
+    long ticketLifetime = TICKET_LIFETIME_SECONDS; // --ticket-lifetime SEC
+    long entropyMillis = 1000;      // --entropy-interval MS: how often frame sources are looked at
+
+    // Step 0: Parse command-line options
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--ws-port" && i + 1 < argc) {
+            wsPort = atoi(argv[++i]);
+        } else if (arg == "--stats-port" && i + 1 < argc) {
+            statsPort = atoi(argv[++i]);
+        } else if (arg == "--stats-socket" && i + 1 < argc) {
+            statsSocket = argv[++i];
+        } else if (arg == "--log-level" && i + 1 < argc && Logger::parseLevel(argv[i + 1], logLevel)) {
+            ++i;
+        } else if (arg == "--debug") {
+            logLevel = LogLevel::DEBUG;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--pin") {
+            pinWorkers = true;
+        } else if (arg == "--io" && i + 1 < argc && (string(argv[i + 1]) == "epoll" || string(argv[i + 1]) == "uring")) {
+            useUring = string(argv[++i]) == "uring";
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            logOptions.directory = argv[++i];
+        } else if (arg == "--log-segment-mb" && i + 1 < argc) {
+            logOptions.segmentBytes = size_t(atoi(argv[++i])) << 20;
+        } else if (arg == "--log-retention" && i + 1 < argc) {
+            logOptions.retentionSeconds = atoll(argv[++i]);
+        } else if (arg == "--log-session-retention" && i + 1 < argc) {
+            logOptions.sessionRetentionSeconds = atoll(argv[++i]);
+        } else if (arg == "--log-no-sync") {
+            logOptions.sync = false;
+        } else if (arg == "--file-dir" && i + 1 < argc) {
+            fileDir = argv[++i];
+        } else if (arg == "--no-compression") {
+            compression = false;
+        } else if (arg == "--no-resumption") {
+            resumable = false;
+        } else if (arg == "--resume-cache" && i + 1 < argc) {
+            resumeEntries = size_t(atol(argv[++i]));
+        } else if (arg == "--ticket-lifetime" && i + 1 < argc) {
+            ticketLifetime = max(1L, atol(argv[++i]));
+        } else if (arg == "--entropy-interval" && i + 1 < argc) {
+            entropyMillis = max(1L, atol(argv[++i]));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--port N] [--ws-port N (0 = off)] [--workers N (0 = one per core)] [--pin]\n"
+                 << "       [--io epoll|uring]\n"
+                 << "       [--stats-port N | --stats-socket PATH]\n"
+                 << "       [--log-level debug|info|warn|error] [--debug (same as --log-level debug)]\n"
+                 << "       [--log-dir DIR [--log-segment-mb N] [--log-retention SEC] [--log-session-retention SEC]\n"
+                 << "        [--log-no-sync]]\n"
+                 << "       [--file-dir DIR] [--no-compression]\n"
+                 << "       [--no-resumption | [--resume-cache N (0 = tickets only)] [--ticket-lifetime SEC]]\n"
+                 << "       [--entropy-interval MS (1000; 33 follows open.py --stream at 30 fps)]" << endl;
+            return 1;
+        }
+    }
+
+    if (wsPort == port) {
+        cerr << "--ws-port must differ from --port" << endl;
+        return 1;
+    }
+    Logger::instance().setLevel(logLevel);
+    if (useUring) signal(SIGPIPE, SIG_IGN); // A write to a closed socket must fail, not kill the server
+    int cpus = max(1u, thread::hardware_concurrency());
+    if (workers <= 0) workers = cpus;
+    workers = min<int>(workers, RoomHub::MAX_WORKERS); // Rooms track workers in a 64-bit mask
+
+    // Steps 1-3 run once per worker: with SO_REUSEPORT each worker gets its own listening socket
+    // and accept queue, and the kernel spreads new connections across them
+    for (int w = 0; w < workers; ++w) {
+        for (int which = 0; which < (wsPort > 0 ? 2 : 1); ++which) { // The raw TCP port, then the WebSocket port
+            int p = which ? wsPort : port;
+            // Step 1: Create the server socket
+            int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (server_fd == -1) {
+                perror("Socket failed"); // Error handling if socket creation fails
+                exit(EXIT_FAILURE);
+            }
+            int opt = 1;
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)); // Allow quick restarts on the same port
+            if (workers > 1 && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+                perror("SO_REUSEPORT failed");
+                exit(EXIT_FAILURE);
             }
-            buffer[bytes_read] = '\0'; // Null-terminate the received data
-            string encrypted_msg(buffer); // Store the encrypted message
 
-            // Decrypt the received message
-            string decrypted_msg = rc4.decrypt(encryption_key, encrypted_msg);
-            cout << "\nReceived message from client:" << endl;
-            cout << "Encrypted: " << encrypted_msg << endl;
-            cout << "Decrypted: " << decrypted_msg << endl;
+            // Step 2: Configure server address and bind it to the socket
+            address.sin_family = AF_INET;           // IPv4
+            address.sin_addr.s_addr = INADDR_ANY;   // Bind to all available interfaces
+            address.sin_port = htons(p);            // Use the configured port (8080 by default, WebSocket 8081)
 
-            // Prepare a response (echo back the decrypted message)
-            string response = decrypted_msg; // Use the decrypted message as a response
-            string encrypted_response = rc4.encrypt(encryption_key, response);
+            if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+                perror("Bind failed"); // Error handling if binding fails
+                exit(EXIT_FAILURE);
+            }
 
-            // Send the encrypted response to the client
-            if (send(new_socket, encrypted_response.c_str(), encrypted_response.length(), 0) < 0) {
-                cerr << "Failed to send response" << endl;
-                break;
+            // Step 3: Start listening for incoming connections
+            if (listen(server_fd, SOMAXCONN) < 0 || !setNonBlocking(server_fd)) { // Deep backlog; the event loop accepts in bursts
+                perror("Listen failed"); // Error handling if listening fails
+                exit(EXIT_FAILURE);
             }
+            (which ? wsListeners : listeners).push_back(server_fd);
         }
+    }
+    cout << "Server is listening on port " << port;
+    if (!wsListeners.empty()) cout << " (WebSocket clients on " << wsPort << ")";
+    cout << " with " << workers << " " << (useUring ? "io_uring" : "epoll")
+         << " worker(s)" << (pinWorkers ? " pinned to CPUs" : "") << "...\n";
+
+    // Step 4: Start folding captured lava lamp frames into the entropy pool (stills and the live stream)
+    EntropyPool entropy;
+    entropy.start({"opencv_frame_0.png", "opencv_frame_1.png", "opencv_frame_2.png", "opencv_frame_3.png",
+                   "lava_frame.ppm"},
+                  chrono::milliseconds(entropyMillis));
+    cout << "Entropy pool started; session keys are drawn from captured frames.\n";
+
+    // Step 5: Publish metrics for local scrapers
+    Metrics metrics;
+    StatsEndpoint statsEndpoint(metrics);
+    if (!statsSocket.empty()) {
+        if (statsEndpoint.listenUnix(statsSocket)) cout << "Metrics available on unix:" << statsSocket << "\n";
+        else perror("Stats socket failed"); // Not fatal: the server runs without its endpoint
+    } else if (statsPort > 0) {
+        if (statsEndpoint.listenTcp(statsPort)) cout << "Metrics available at http://127.0.0.1:" << statsPort << "/metrics\n";
+        else perror("Stats port failed");
+    }
+    metrics.addGauge("lava_entropy_frames_folded_total", [&] { return double(entropy.stats().framesFolded); });
+    metrics.addGauge("lava_entropy_frames_unchanged_total", [&] { return double(entropy.stats().framesUnchanged); });
+    metrics.addGauge("lava_entropy_tiles_changed_total", [&] { return double(entropy.stats().tilesChanged); });
+    metrics.addGauge("lava_entropy_bits_total", [&] { return double(entropy.stats().entropyBits); });
+    metrics.addGauge("lava_entropy_recent_bits", [&] { return double(entropy.stats().recentBits); });
+    metrics.addGauge("lava_entropy_low", [&] { return entropy.stats().entropyLow ? 1.0 : 0.0; });
+
+    // Step 6: Open the message log (history replay for rooms; echoed messages kept for a shorter time)
+    MessageLog messageLog;
+    MessageLog* history = nullptr;
+    if (!logOptions.directory.empty()) {
+        logOptions.sessionType = MSG_DATA;
+        logOptions.newKey = entropy.sessionKey(); // Used only if the directory holds no log yet
+        string error;
+        if (!messageLog.open(logOptions, error)) {
+            cerr << "Message log failed: " << error << endl;
+            return EXIT_FAILURE;
+        }
+        history = &messageLog;
+        metrics.addGauge("lava_log_records_total", [&] { return double(messageLog.stats().records); });
+        metrics.addGauge("lava_log_bytes_total", [&] { return double(messageLog.stats().bytes); });
+        metrics.addGauge("lava_log_commits_total", [&] { return double(messageLog.stats().commits); });
+        metrics.addGauge("lava_log_dropped_total", [&] { return double(messageLog.stats().dropped); });
+        metrics.addGauge("lava_log_segments", [&] { return double(messageLog.stats().segments); });
+        cout << "Message log in " << logOptions.directory << (logOptions.sync ? "" : " (not synced)") << "\n";
+    }
 
-        // Step 8: Close the client socket
-        close(new_socket);
+    // Step 7: Prepare the directory file transfers use
+    if (!fileDir.empty()) {
+        struct stat st;
+        if (mkdir(fileDir.c_str(), 0755) < 0 && (stat(fileDir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))) {
+            cerr << "File directory " << fileDir << " unusable: " << strerror(errno) << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "File transfers stored in " << fileDir << "\n";
+    }
+
+    // Step 8: Draw the ticket keys and size the cache of closed sessions for resumption
+    unique_ptr<Resumption> resumption;
+    Resumption* resume = nullptr;
+    if (resumable) {
+        resumption.reset(new Resumption(entropy, resumeEntries, ticketLifetime));
+        resume = resumption.get();
+        metrics.addGauge("lava_resume_cache_entries", [resume] { return double(resume->cache.stats().entries); });
+        metrics.addGauge("lava_resume_cache_hits_total", [resume] { return double(resume->cache.stats().hits); });
+        metrics.addGauge("lava_resume_cache_misses_total", [resume] { return double(resume->cache.stats().misses); });
+        metrics.addGauge("lava_resume_cache_evicted_total", [resume] { return double(resume->cache.stats().evicted); });
+        metrics.addGauge("lava_resume_cache_expired_total", [resume] { return double(resume->cache.stats().expired); });
+        cout << "Session resumption on: tickets last " << ticketLifetime << " s, up to " << resumeEntries
+             << " closed sessions cached.\n";
     }
 
-    // Step 9: Close the server socket when shutting down
-    close(server_fd);
-    return 0;
+    // Step 9: Serve clients; each worker owns its event loop and session table. Workers share
+    // only the entropy pool (per-thread generators), the key registry (touched per session
+    // and per rotation, never per message), the room hub (per join, and once per batch
+    // for room messages that have members on other workers) and the resumption cache (per
+    // close and per resumption).
+    KeyRegistry registry;
+    RoomHub rooms(workers);
+    atomic<bool> failed(false);
+    // A failed worker's listeners are closed at once: SO_REUSEPORT would otherwise keep hashing
+    // a share of new connections into accept queues nobody drains. The rest then shut down.
+    auto workerFailed = [&](int w) {
+        LOG_ERROR("Worker ", w, " failed; shutting down");
+        close(listeners[w]);
+        listeners[w] = -1;
+        if (!wsListeners.empty()) {
+            close(wsListeners[w]);
+            wsListeners[w] = -1;
+        }
+        failed = true;
+        shuttingDown = true;
+    };
+    vector<thread> threads;
+    for (int w = 0; w < workers; ++w) {
+        threads.emplace_back([&, w] {
+            if (pinWorkers && !pinToCpu(w % cpus)) {
+                LOG_WARN("Could not pin worker ", w, " to CPU ", w % cpus);
+            }
+            ThreadMetrics& stats = metrics.registerThread("worker-" + to_string(w));
+            if (useUring) {
+                UringServer server(listeners[w], wsListeners.empty() ? -1 : wsListeners[w], entropy, registry, stats, rooms, w, history, fileDir, compression, resume);
+                if (server.start()) {
+                    if (!server.run()) workerFailed(w);
+                    return;
+                }
+                LOG_WARN("io_uring unavailable (", strerror(errno), "); worker ", w, " falls back to epoll");
+            }
+            EpollServer server(listeners[w], wsListeners.empty() ? -1 : wsListeners[w], entropy, registry, stats, rooms, w, history, fileDir, compression, resume);
+            if (!server.run()) workerFailed(w);
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    // Step 10: Close the server sockets when shutting down (and stop the log's replays before
+    // the room hub they answer through goes away)
+    if (history) history->close();
+    for (int fd : listeners) {
+        if (fd >= 0) close(fd);
+    }
+    for (int fd : wsListeners) {
+        if (fd >= 0) close(fd);
+    }
+    return failed ? EXIT_FAILURE : 0;
 }
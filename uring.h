@@ -0,0 +1,186 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cerrno>         // For errno
+#include <csignal>        // For _NSIG (getevents argument)
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memset()
+#include <ctime>          // For timespec timeouts
+#include <initializer_list> // For opcode lists passed to supports()
+#include <linux/io_uring.h> // For the io_uring ABI
+#include <sys/mman.h>     // For mapping the rings
+#include <sys/syscall.h>  // For the io_uring system call numbers
+#include <sys/uio.h>      // For iovec buffer registration
+#include <unistd.h>       // For syscall()/close()
+
+// Minimal io_uring binding (no liburing dependency): one submission/completion ring pair and
+// sparse registered ("fixed") buffers. Callers fill in the entries from getSqe() themselves.
+// Single-threaded: each event loop owns its ring.
+class IoUring {
+private:
+    int ringFd;
+    io_uring_params params;
+
+    void* sqMap;                    // Submission ring mapping (shared with the CQ ring on modern kernels)
+    size_t sqMapSize;
+    void* cqMap;                    // Completion ring mapping
+    size_t cqMapSize;
+    io_uring_sqe* sqes;             // Submission entries
+    size_t sqesSize;
+
+    unsigned* sqHead;               // Kernel-owned: consumed submissions
+    unsigned* sqTail;               // Ours: published submissions
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned sqLocalTail;           // Submissions prepared, published at submit()
+    unsigned sqSubmitted;           // sqLocalTail at the last submit()
+
+    unsigned* cqHead;               // Ours: completions consumed
+    unsigned* cqTail;               // Kernel-owned: completions posted
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+
+    static int enter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t argSize) {
+        return int(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argSize));
+    }
+
+    int registerOp(unsigned opcode, void* arg, unsigned count) {
+        return int(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+    }
+
+public:
+    IoUring() : ringFd(-1), sqMap(nullptr), sqMapSize(0), cqMap(nullptr), cqMapSize(0), sqes(nullptr), sqesSize(0),
+                sqLocalTail(0), sqSubmitted(0) {}
+
+    ~IoUring() {
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqMap && cqMap != sqMap) munmap(cqMap, cqMapSize);
+        if (sqMap) munmap(sqMap, sqMapSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Create the rings; false (errno set) if io_uring is unavailable or too old for what we use
+    bool init(unsigned entries, unsigned completionEntries) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        params.cq_entries = completionEntries; // Multishot operations post many completions per submission
+        ringFd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (ringFd < 0) return false;
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            errno = ENOSYS;
+            return false;
+        }
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqMapSize = cqMapSize = sqMapSize > cqMapSize ? sqMapSize : cqMapSize; // One mapping serves both rings
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqMap == MAP_FAILED) {
+            sqMap = nullptr;
+            return false;
+        }
+        cqMap = sqMap;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* entriesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (entriesMap == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(entriesMap);
+
+        char* sq = static_cast<char*>(sqMap);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqLocalTail = sqSubmitted = *sqTail;
+
+        char* cq = static_cast<char*>(cqMap);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Check that the kernel implements every opcode in the list
+    bool supports(std::initializer_list<uint8_t> opcodes) {
+        unsigned char storage[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage);
+        if (registerOp(IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        for (uint8_t op : opcodes) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+        }
+        return true;
+    }
+
+    // Next free submission entry (zeroed); submits what is queued first if the ring is full
+    io_uring_sqe* getSqe() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head >= params.sq_entries) {
+            submit();
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (sqLocalTail - head >= params.sq_entries) return nullptr;
+        }
+        unsigned index = sqLocalTail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        ++sqLocalTail;
+        return sqe;
+    }
+
+    // Publish queued submissions and optionally wait for one completion (up to timeoutMs; -1 = forever)
+    int submit(bool wait = false, int timeoutMs = -1) {
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        unsigned pending = sqLocalTail - sqSubmitted;
+        sqSubmitted = sqLocalTail;
+        if (!wait) return pending ? enter(ringFd, pending, 0, 0, nullptr, 0) : 0;
+
+        __kernel_timespec ts;
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+        int r = enter(ringFd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (r < 0 && (errno == ETIME || errno == EINTR)) return 0; // Timed out or interrupted: nothing to do
+        return r;
+    }
+
+    // Visit every posted completion, then hand the slots back to the kernel
+    template <typename Handler>
+    unsigned drain(Handler&& handle) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned seen = 0;
+        for (; head != tail; ++head, ++seen) {
+            handle(cqes[head & cqMask]);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return seen;
+    }
+
+    // Reserve `count` fixed-buffer slots to be filled in later with updateBuffer()
+    bool registerSparseBuffers(unsigned count) {
+        io_uring_rsrc_register reg{};
+        reg.nr = count;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        return registerOp(IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+    }
+
+    // Pin memory as fixed buffer `slot`, so reads and writes from it skip per-I/O page mapping
+    bool updateBuffer(unsigned slot, void* data, size_t length) {
+        iovec iov{data, length};
+        io_uring_rsrc_update2 update{};
+        update.offset = slot;
+        update.data = reinterpret_cast<uint64_t>(&iov);
+        update.nr = 1;
+        return registerOp(IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) >= 0;
+    }
+};
+
+#endif // URING_H
@@ -0,0 +1,362 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <algorithm>      // For std::min
+#include <cstdint>        // For fixed-width integer types
+#include <cstring>        // For memcpy()/memmove()
+#include <string>         // For handshake text and control replies
+#include <strings.h>      // For strncasecmp() on header names
+
+// WebSocket transport (RFC 6455) for browser clients. A WebSocket connection carries the same
+// byte stream as a raw TCP one: the server's frames (header and encrypted payload) travel one per
+// binary message, and whatever binary messages the client sends are joined back into a stream,
+// so the session and cipher code never sees the difference.
+
+// SHA-1, only for the handshake's accept key
+class Sha1 {
+private:
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    size_t used = 0;      // Bytes in block
+    uint64_t total = 0;   // Bytes hashed
+
+    static uint32_t rol(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void compress() {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 | uint32_t(block[4 * i + 2]) << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; ++i) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+public:
+    void update(const void* data, size_t length) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total += length;
+        while (length > 0) {
+            size_t n = std::min(length, sizeof(block) - used);
+            memcpy(block + used, p, n);
+            used += n;
+            p += n;
+            length -= n;
+            if (used == sizeof(block)) {
+                compress();
+                used = 0;
+            }
+        }
+    }
+
+    void finish(unsigned char digest[20]) {
+        uint64_t bits = total * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) update(&pad, 1);
+        unsigned char length[8];
+        for (int i = 0; i < 8; ++i) length[i] = uint8_t(bits >> (56 - 8 * i));
+        update(length, 8);
+        for (int i = 0; i < 20; ++i) digest[i] = uint8_t(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+};
+
+inline std::string base64Encode(const unsigned char* data, size_t length) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16 | (i + 1 < length ? uint32_t(data[i + 1]) << 8 : 0) | (i + 2 < length ? data[i + 2] : 0);
+        out += digits[v >> 18];
+        out += digits[(v >> 12) & 63];
+        out += i + 1 < length ? digits[(v >> 6) & 63] : '=';
+        out += i + 2 < length ? digits[v & 63] : '=';
+    }
+    return out;
+}
+
+// Sec-WebSocket-Accept for a client's Sec-WebSocket-Key
+inline std::string webSocketAccept(const std::string& key) {
+    Sha1 sha;
+    sha.update(key.data(), key.size());
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    sha.update(guid, sizeof(guid) - 1);
+    unsigned char digest[20];
+    sha.finish(digest);
+    return base64Encode(digest, sizeof(digest));
+}
+
+// WebSocket opcodes
+enum WebSocketOpcode : uint8_t {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA,
+};
+
+const size_t WS_MAX_HEADER = 14;       // Largest frame header (64-bit length and mask)
+const size_t WS_MAX_REQUEST = 8192;    // Largest upgrade request accepted
+
+// Bytes of a frame header for a payload of `length` (client -> server frames add a 4-byte mask)
+inline size_t webSocketHeaderSize(size_t length, bool masked = false) {
+    return (length <= 125 ? 2 : length <= 0xffff ? 4 : 10) + (masked ? 4 : 0);
+}
+
+// Write a final frame header, with `mask` if given (client -> server); returns its size
+inline size_t encodeWebSocketHeader(uint8_t opcode, size_t length, unsigned char* out, const unsigned char* mask = nullptr) {
+    size_t at;
+    out[0] = 0x80 | opcode;
+    if (length <= 125) {
+        out[1] = uint8_t(length);
+        at = 2;
+    } else if (length <= 0xffff) {
+        out[1] = 126;
+        out[2] = uint8_t(length >> 8);
+        out[3] = uint8_t(length);
+        at = 4;
+    } else {
+        out[1] = 127;
+        for (int i = 0; i < 8; ++i) out[2 + i] = uint8_t(uint64_t(length) >> (56 - 8 * i));
+        at = 10;
+    }
+    if (!mask) return at;
+    out[1] |= 0x80;
+    memcpy(out + at, mask, 4);
+    return at + 4;
+}
+
+// XOR `length` bytes with a 4-byte mask, starting at mask byte `phase`
+inline void applyWebSocketMask(const unsigned char* in, unsigned char* out, size_t length, const unsigned char mask[4], unsigned phase = 0) {
+    size_t i = 0;
+    if (length >= 8) {
+        unsigned char pattern[8];
+        for (int k = 0; k < 8; ++k) pattern[k] = mask[(phase + k) & 3];
+        uint64_t m;
+        memcpy(&m, pattern, 8);
+        for (; i + 8 <= length; i += 8) { // Reads run ahead of writes, so out <= in may overlap
+            uint64_t word;
+            memcpy(&word, in + i, 8);
+            word ^= m;
+            memcpy(out + i, &word, 8);
+        }
+    }
+    for (; i < length; ++i) out[i] = in[i] ^ mask[(phase + i) & 3];
+}
+
+// A complete control frame; `masked` for one sent by a client (the mask is all zero bytes,
+// which is valid: control payloads here are never attacker-chosen)
+inline std::string webSocketControl(uint8_t opcode, const void* payload, size_t length, bool masked = false) {
+    static const unsigned char zeroMask[4] = {0, 0, 0, 0};
+    unsigned char header[WS_MAX_HEADER];
+    std::string frame(reinterpret_cast<char*>(header), encodeWebSocketHeader(opcode, length, header, masked ? zeroMask : nullptr));
+    return frame.append(static_cast<const char*>(payload), length);
+}
+
+inline std::string webSocketClose(uint16_t code) {
+    unsigned char payload[2] = {uint8_t(code >> 8), uint8_t(code)};
+    return webSocketControl(WS_CLOSE, payload, sizeof(payload));
+}
+
+// Parse an HTTP upgrade request. Returns 1 and the response to send once the request is complete
+// and valid, 0 if more bytes are needed, -1 (with an error response) if it is not a WebSocket
+// upgrade we accept. `consumed` is set to the request's length.
+inline int webSocketHandshake(const std::string& request, std::string& response, size_t& consumed) {
+    size_t end = request.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (request.size() < WS_MAX_REQUEST) return 0;
+        response = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        return -1;
+    }
+    consumed = end + 4;
+    bool upgrade = false, connection = false, version = false;
+    std::string key, protocol;
+    size_t line = request.find("\r\n");
+    bool get = request.compare(0, 4, "GET ") == 0;
+    while (line < end) {
+        size_t next = request.find("\r\n", line + 2);
+        size_t colon = request.find(':', line + 2);
+        if (colon < next) {
+            std::string name = request.substr(line + 2, colon - line - 2);
+            size_t from = request.find_first_not_of(" \t", colon + 1);
+            std::string value = from < next ? request.substr(from, next - from) : "";
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.pop_back();
+            auto is = [&](const char* header) { return strcasecmp(name.c_str(), header) == 0; };
+            auto contains = [&](const char* token) { // Case-insensitive substring (header tokens are ASCII)
+                for (size_t i = 0; i + strlen(token) <= value.size(); ++i) {
+                    if (strncasecmp(value.c_str() + i, token, strlen(token)) == 0) return true;
+                }
+                return false;
+            };
+            if (is("Upgrade")) upgrade = contains("websocket");
+            else if (is("Connection")) connection = contains("upgrade");
+            else if (is("Sec-WebSocket-Version")) version = value == "13";
+            else if (is("Sec-WebSocket-Key")) key = value;
+            else if (is("Sec-WebSocket-Protocol") && contains("lava")) protocol = "lava";
+        }
+        line = next;
+    }
+    if (!get || !upgrade || !connection || key.empty()) {
+        response = "HTTP/1.1 426 Upgrade Required\r\nUpgrade: websocket\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        return -1;
+    }
+    if (!version) {
+        response = "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        return -1;
+    }
+    response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " +
+               webSocketAccept(key) + "\r\n";
+    if (!protocol.empty()) response += "Sec-WebSocket-Protocol: " + protocol + "\r\n";
+    response += "\r\n";
+    return 1;
+}
+
+// Client side of the handshake: the upgrade request for `host`, with a fresh `key` (16 bytes)
+inline std::string webSocketUpgradeRequest(const std::string& host, const unsigned char key[16], std::string& keyText) {
+    keyText = base64Encode(key, 16);
+    return "GET / HTTP/1.1\r\nHost: " + host + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Key: " + keyText + "\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: lava\r\n\r\n";
+}
+
+// True if a complete response header accepts the upgrade requested with `keyText`
+inline bool webSocketUpgradeAccepted(const std::string& response, const std::string& keyText) {
+    return response.compare(0, 12, "HTTP/1.1 101") == 0 &&
+           response.find("Sec-WebSocket-Accept: " + webSocketAccept(keyText) + "\r\n") != std::string::npos;
+}
+
+// Turns the bytes a client sends (masked frames, possibly fragmented, with control frames in
+// between) back into the stream they carry. Works in place: headers are squeezed out and
+// payloads unmasked towards the front of the same buffer, so a read needs no second copy.
+// A client's own decoder (peerIsClient = false) takes the server's unmasked frames instead.
+class WebSocketDecoder {
+private:
+    bool fromClient;                     // Peer is a client: every frame must be masked
+    unsigned char header[WS_MAX_HEADER]; // Header being assembled (may span reads)
+    size_t headerBytes = 0;
+    uint64_t remaining = 0;              // Payload bytes left in the current frame
+    uint8_t opcode = 0;                  // Current frame's opcode (continuations take the message's)
+    uint8_t mask[4];
+    unsigned maskPhase = 0;              // Mask byte for the next payload byte
+    bool inPayload = false;
+    bool inMessage = false;              // A fragmented binary message is in progress
+    std::string control;                 // Control frame payload being collected
+    uint16_t closeCode = 0;
+
+    static size_t headerSize(const unsigned char* h) {
+        size_t length = h[1] & 0x7f;
+        return 2 + (length == 126 ? 2 : length == 127 ? 8 : 0) + ((h[1] & 0x80) ? 4 : 0);
+    }
+
+    // Unmask n payload bytes from `in` to `out` (out <= in)
+    void unmask(const unsigned char* in, unsigned char* out, size_t n) {
+        applyWebSocketMask(in, out, n, mask, maskPhase);
+        maskPhase = (maskPhase + n) & 3;
+    }
+
+    // A complete header: check it and set up the payload; false on a protocol violation
+    bool startFrame() {
+        bool fin = header[0] & 0x80;
+        uint8_t op = header[0] & 0x0f;
+        if ((header[0] & 0x70) || bool(header[1] & 0x80) != fromClient) return fail(1002); // No extensions; only clients mask
+        uint64_t length = header[1] & 0x7f;
+        size_t at = 2;
+        if (length == 126) {
+            length = uint64_t(header[2]) << 8 | header[3];
+            at = 4;
+        } else if (length == 127) {
+            length = 0;
+            for (int i = 0; i < 8; ++i) length = length << 8 | header[2 + i];
+            if (length >> 63) return fail(1002);
+            at = 10;
+        }
+        if (fromClient) memcpy(mask, header + at, 4);
+        else memset(mask, 0, 4);
+        maskPhase = 0;
+        if (op >= WS_CLOSE) { // Control frames are short and never fragmented
+            if (!fin || length > 125 || (op != WS_CLOSE && op != WS_PING && op != WS_PONG)) return fail(1002);
+            control.clear();
+        } else if (op == WS_TEXT) {
+            return fail(1003); // The stream is binary
+        } else if (op == WS_BINARY) {
+            if (inMessage) return fail(1002); // New message inside a fragmented one
+            inMessage = !fin;
+        } else if (op == WS_CONTINUATION) {
+            if (!inMessage) return fail(1002);
+            inMessage = !fin;
+        } else {
+            return fail(1002);
+        }
+        opcode = op;
+        remaining = length;
+        inPayload = true;
+        return true;
+    }
+
+    bool fail(uint16_t code) {
+        closeCode = code;
+        return false;
+    }
+
+    // A complete control frame: queue the reply; false once the connection is closing
+    bool endControl(std::string& replies) {
+        if (opcode == WS_PING) {
+            replies += webSocketControl(WS_PONG, control.data(), control.size(), !fromClient);
+            return true;
+        }
+        if (opcode == WS_CLOSE) {
+            closeCode = control.size() >= 2 ? uint16_t(uint8_t(control[0]) << 8 | uint8_t(control[1])) : 1000;
+            return false;
+        }
+        return true; // Unsolicited pong
+    }
+
+public:
+    explicit WebSocketDecoder(bool peerIsClient = true) : fromClient(peerIsClient) {}
+
+    // Decode `length` received bytes in place. Returns how many stream bytes now start at `data`,
+    // or -1 when the connection should close (see closeStatus()). Pongs for pings are appended
+    // to `replies` for the caller to send.
+    long decode(unsigned char* data, size_t length, std::string& replies) {
+        size_t in = 0, out = 0;
+        while (in < length) {
+            if (!inPayload) {
+                header[headerBytes++] = data[in++];
+                if (headerBytes < 2 || headerBytes < headerSize(header)) continue;
+                headerBytes = 0;
+                if (!startFrame()) return -1;
+                if (remaining > 0) continue;
+            } else {
+                size_t n = size_t(std::min<uint64_t>(remaining, length - in));
+                if (opcode >= WS_CLOSE) {
+                    size_t at = control.size();
+                    control.resize(at + n);
+                    unmask(data + in, reinterpret_cast<unsigned char*>(&control[at]), n);
+                } else {
+                    unmask(data + in, data + out, n);
+                    out += n;
+                }
+                in += n;
+                remaining -= n;
+                if (remaining > 0) continue;
+            }
+            inPayload = false; // Frame complete
+            if (opcode >= WS_CLOSE && !endControl(replies)) return -1;
+        }
+        return long(out);
+    }
+
+    // Close code to answer with: the client's own on a clean close, or ours for a violation
+    uint16_t closeStatus() const { return closeCode ? closeCode : 1000; }
+};
+
+#endif // WEBSOCKET_H